@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "bench_main.h"
+#include "pool.h"
+#include "irc.h"
+
+#define DISPATCH_ROUNDS 20000
+
+enum dispatch {THREAD, POOLED, INLINE};
+
+static sem_t done;
+static double latency;     //!< Sum of the delays between dispatching a command and the start of its function
+static const char request[] = "#foss-teimes\0roll\0" "6";
+
+/** Stands in for a cheap command like !roll. The request is copied like pre_launch_command() does */
+static void command(const char *strings, double dispatched) {
+
+	latency += bench_now() - dispatched;
+	if (strings[strlen(strings) + 1] != 'r')
+		abort();
+}
+
+struct job {
+	double dispatched;
+	char strings[sizeof(request)];
+};
+
+static void pooled_command(void *arg) {
+
+	struct job *job = arg;
+
+	command(job->strings, job->dispatched);
+	free(job);
+	sem_post(&done);
+}
+
+// Previous implementation: a detached thread per command
+static void *thread_command(void *arg) {
+
+	pthread_detach(pthread_self());
+	pooled_command(arg);
+	return NULL;
+}
+
+static void run(const char *name, enum dispatch dispatch, Pool pool) {
+
+	pthread_t tid;
+	struct job *job;
+	char strings[sizeof(request)];
+	double start = bench_now();
+
+	latency = 0;
+	for (int r = 0; r < DISPATCH_ROUNDS; r++) {
+		if (dispatch == INLINE) {
+			double dispatched = bench_now();
+
+			memcpy(strings, request, sizeof(request));
+			command(strings, dispatched);
+			continue;
+		}
+		job = malloc(sizeof(*job));
+		job->dispatched = bench_now();
+		memcpy(job->strings, request, sizeof(request));
+		if (dispatch == THREAD ? pthread_create(&tid, NULL, thread_command, job) : !pool_submit(pool, pooled_command, job))
+			abort();
+
+		// One at a time, so that only the dispatch latency is measured
+		sem_wait(&done);
+	}
+	bench_report(name, DISPATCH_ROUNDS, DISPATCH_ROUNDS * sizeof(request), bench_now() - start);
+	printf("%-28s %10.2f us mean dispatch latency\n", "", latency / DISPATCH_ROUNDS * 1e6);
+}
+
+void bench_dispatch(void) {
+
+	Pool pool = pool_init(4, 32, 512 * 1024);
+
+	sem_init(&done, 0, 0);
+	run("thread per command (legacy)", THREAD, NULL);
+	run("command pool",                POOLED, pool);
+	run("inline command",              INLINE, NULL);
+	pool_destroy(pool);
+	sem_destroy(&done);
+}
@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include <time.h>
+#include "bench_main.h"
+#include "init.h"
+
+int fds[TOTAL];
+
+double bench_now(void) {
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void bench_report(const char *name, size_t items, size_t bytes, double secs) {
+
+	printf("%-28s %10zu items %8.3f s %12.0f items/s %9.1f MB/s\n",
+			name, items, secs, items / secs, bytes / secs / (1024 * 1024));
+}
+
+int main(void) {
+
+	bench_reader();
+	bench_parser();
+	bench_dispatch();
+	bench_spawn();
+	return 0;
+}
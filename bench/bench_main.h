@@ -0,0 +1,22 @@
+#ifndef BENCH_MAIN_H
+#define BENCH_MAIN_H
+
+/**
+ * @file bench_main.h
+ * Micro benchmarks comparing hot paths against the implementations they replaced
+ */
+
+#include <stddef.h>
+
+/** Monotonic time in seconds */
+double bench_now(void);
+
+/** Print throughput for a finished run */
+void bench_report(const char *name, size_t items, size_t bytes, double secs);
+
+void bench_reader(void);
+void bench_parser(void);
+void bench_dispatch(void);
+void bench_spawn(void);
+
+#endif
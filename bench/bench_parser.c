@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench_main.h"
+#include "irc.h"
+#include "tokenizer.h"
+
+#define PARSE_ROUNDS  5000000
+#define TRAFFIC_FILE  "test-files/irc-traffic.txt"
+#define MAXSAMPLES    64
+
+enum parser {LEGACY, PARSER, TOKENIZER};
+
+struct samples {
+	const char *lines[MAXSAMPLES];
+	size_t len[MAXSAMPLES];
+	int count;
+};
+
+// Sink, so that the compiler can't drop the parsing
+static volatile size_t checksum;
+
+// Previous implementation: copy the line out of the socket buffer and split it in place with strtok()
+static void legacy_parse(const char *line, size_t len) {
+
+	char buf[IRCLEN + 1], *sender, *command, *message;
+
+	memcpy(buf, line, len);
+	buf[len] = '\0';
+	sender = strtok(buf + 1, " ");
+	if (!sender)
+		return;
+
+	command = strtok(NULL, " ");
+	if (!command)
+		return;
+
+	message = strtok(NULL, "");
+	if (!message)
+		return;
+
+	checksum += atoi(command) + (message - sender);
+}
+
+// Candidate: every delimiter comes from the tokenizer's bitmaps. Same results as irc_parse_message()
+static bool tokenizer_parse(const char *line, size_t len, struct irc_message *msg) {
+
+	size_t pos = 0, delim, sep, trailing;
+	struct irc_tokens tok;
+
+	msg->tags = msg->prefix = msg->nick = (struct span) {NULL, 0};
+	msg->param_count = 0;
+	if (!irc_tokenize(line, len, &tok))
+		return false;
+
+	if (len && *line == '@') {
+		delim = token_next(&tok, tok.space, 0);
+		if (delim == len)
+			return false;
+
+		msg->tags = (struct span) {line + 1, delim - 1};
+		for (pos = delim; pos < len && line[pos] == ' '; pos++);
+	}
+	if (pos < len && line[pos] == ':') {
+		delim = token_next(&tok, tok.space, pos);
+		if (delim == len)
+			return false;
+
+		msg->prefix = (struct span) {line + pos + 1, delim - pos - 1};
+		for (sep = token_next(&tok, tok.user, pos); sep < delim && line[sep] != '!'; sep = token_next(&tok, tok.user, sep + 1));
+		if (sep < delim)
+			msg->nick = (struct span) {msg->prefix.ptr, sep - pos - 1};
+
+		pos = delim;
+	}
+	while (pos < len && line[pos] == ' ')
+		pos++;
+
+	delim = token_next(&tok, tok.space, pos);
+	msg->command = (struct span) {line + pos, delim - pos};
+	if (!msg->command.len)
+		return false;
+
+	trailing = token_next(&tok, tok.trailing, delim);
+	for (pos = delim; msg->param_count < IRC_MAXPARAMS; pos = delim) {
+		while (pos < len && line[pos] == ' ')
+			pos++;
+
+		if (pos == len)
+			break;
+
+		if (pos == trailing || msg->param_count == IRC_MAXPARAMS - 1) {
+			pos += pos == trailing;
+			msg->params[msg->param_count++] = (struct span) {line + pos, len - pos};
+			break;
+		}
+		delim = token_next(&tok, tok.space, pos);
+		msg->params[msg->param_count++] = (struct span) {line + pos, delim - pos};
+	}
+	return true;
+}
+
+static void run(const char *name, const struct samples *s, enum parser parser) {
+
+	double start;
+	size_t bytes = 0;
+	struct irc_message msg;
+
+	start = bench_now();
+	for (int r = 0; r < PARSE_ROUNDS; r++) {
+		const int i = r % s->count;
+
+		bytes += s->len[i];
+		switch (parser) {
+		case LEGACY:
+			legacy_parse(s->lines[i], s->len[i]);
+			break;
+		case PARSER:
+			if (irc_parse_message(s->lines[i], s->len[i], &msg))
+				checksum += msg.param_count + msg.command.len;
+			break;
+		case TOKENIZER:
+			if (tokenizer_parse(s->lines[i], s->len[i], &msg))
+				checksum += msg.param_count + msg.command.len;
+		}
+	}
+	bench_report(name, PARSE_ROUNDS, bytes, bench_now() - start);
+}
+
+/** Lines captured from a real session, one per line */
+static char *load_samples(struct samples *s) {
+
+	FILE *file;
+	char *buf, *line, *end;
+	size_t n;
+
+	file = fopen(TRAFFIC_FILE, "r");
+	if (!file) {
+		perror(TRAFFIC_FILE);
+		exit(EXIT_FAILURE);
+	}
+	buf = malloc(MAXSAMPLES * (IRCLEN + 1));
+	n = fread(buf, 1, MAXSAMPLES * IRCLEN, file);
+	fclose(file);
+	buf[n] = '\0';
+
+	s->count = 0;
+	for (line = buf; *line && s->count < MAXSAMPLES; line = end + 1) {
+		end = strchr(line, '\n');
+		if (!end)
+			end = line + strlen(line);
+
+		s->lines[s->count] = line;
+		s->len[s->count++] = end - line;
+		if (!*end)
+			break;
+	}
+	return buf;
+}
+
+static void set_lengths(struct samples *s) {
+
+	for (int i = 0; i < s->count; i++)
+		s->len[i] = strlen(s->lines[i]);
+}
+
+void bench_parser(void) {
+
+	char *buf;
+	struct samples captured;
+	struct samples plain = {
+		.lines = {
+			":laxanofido!~laxanofid@snf-23545.vm.okeanos.grnet.gr PRIVMSG #foss-teimes :How YA doing fossbot",
+			":wolfe.freenode.net 353 fossbot = #foss-teimes :fossbot freestyl3r laxanofido charkost @ChanServ",
+			":nick!user@host JOIN #foss-teimes",
+			":freestyl3r!~freestyl@unaffiliated/freestyl3r PRIVMSG #foss-teimes :!github irc-bot 5"
+		},
+		.count = 4
+	};
+	struct samples tagged = {
+		.lines = {
+			"@time=2021-03-01T12:00:00.000Z;account=laxanofido;msgid=zx8Cq4d7 :laxanofido!~laxanofid@snf-23545.vm.okeanos.grnet.gr "
+				"PRIVMSG #foss-teimes :How YA doing fossbot",
+			"@time=2021-03-01T12:00:01.000Z :wolfe.freenode.net 353 fossbot = #foss-teimes :fossbot freestyl3r @ChanServ",
+			"@time=2021-03-01T12:00:02.000Z;batch=yXNAbvnRHTRBv :nick!user@host JOIN #foss-teimes",
+			"@+typing=active;time=2021-03-01T12:00:03.000Z :freestyl3r!~freestyl@unaffiliated/freestyl3r TAGMSG #foss-teimes"
+		},
+		.count = 4
+	};
+
+	set_lengths(&plain);
+	set_lengths(&tagged);
+	buf = load_samples(&captured);
+
+	run("strtok parse (legacy)",       &plain,    LEGACY);
+	run("irc_parse_message",           &plain,    PARSER);
+	run("tokenizer parse",             &plain,    TOKENIZER);
+	run("irc_parse_message tags",      &tagged,   PARSER);
+	run("tokenizer parse tags",        &tagged,   TOKENIZER);
+	run("irc_parse_message captured",  &captured, PARSER);
+	run("tokenizer parse captured",    &captured, TOKENIZER);
+	free(buf);
+}
@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "bench_main.h"
+#include "socket.h"
+#include "irc.h"
+
+#define TRAFFIC_LINES 2000000
+#define WRITE_CHUNK   4096
+
+struct traffic {
+	int fd;
+	char *buf;
+	size_t len;
+};
+
+// Previous implementation: single function-static buffer handed out one byte at a time
+static ssize_t legacy_readbyte(int sock, char *byte) {
+
+	static ssize_t bytes_read;
+	static char buffer[IRCLEN];
+	static char *buf_ptr;
+
+	if (bytes_read <= 0) {
+		bytes_read = sock_read(sock, buffer, IRCLEN);
+		if (bytes_read <= 0)
+			return bytes_read;
+
+		buf_ptr = buffer;
+	}
+	bytes_read--;
+	*byte = *buf_ptr++;
+
+	return 1;
+}
+
+static ssize_t legacy_readline(int sock, char *line_buf, size_t len) {
+
+	ssize_t n;
+	size_t n_read = 0;
+	char byte = '\0';
+
+	while (n_read++ <= len) {
+		n = legacy_readbyte(sock, &byte);
+		if (n <= 0) {
+			*line_buf = '\0';
+			if (n == 0)
+				return n_read - 1;
+
+			return n;
+		}
+		*line_buf++ = byte;
+		if (byte == '\n' && *(line_buf - 2) == '\r')
+			break;
+	}
+	*line_buf = '\0';
+	return n_read;
+}
+
+static char *generate_traffic(size_t *len) {
+
+	char *buf, *ptr;
+	const char *samples[] = {
+		":laxanofido!~laxanofid@snf-23545.vm.okeanos.grnet.gr PRIVMSG #foss-teimes :How YA doing fossbot\r\n",
+		":wolfe.freenode.net 353 fossbot = #foss-teimes :fossbot freestyl3r laxanofido charkost @ChanServ\r\n",
+		"PING :wolfe.freenode.net\r\n",
+		":nick!user@host JOIN #foss-teimes\r\n",
+		":freestyl3r!~freestyl@unaffiliated/freestyl3r PRIVMSG #foss-teimes :!github irc-bot 5 -- and a longer "
+			"message body that is closer to what people actually paste in a busy channel during the day\r\n"
+	};
+	const int count = sizeof(samples) / sizeof(samples[0]);
+
+	buf = ptr = malloc(TRAFFIC_LINES * 256);
+	for (int i = 0; i < TRAFFIC_LINES; i++)
+		ptr = stpcpy(ptr, samples[i % count]);
+
+	*len = ptr - buf;
+	return buf;
+}
+
+static void *write_traffic(void *arg) {
+
+	struct traffic *t = arg;
+
+	for (size_t sent = 0; sent < t->len; sent += WRITE_CHUNK)
+		sock_write(t->fd, t->buf + sent, t->len - sent < WRITE_CHUNK ? t->len - sent : WRITE_CHUNK);
+
+	close(t->fd);
+	return NULL;
+}
+
+static void start_writer(struct traffic *t, pthread_t *tid, int *fd) {
+
+	int pair[RDWR];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) {
+		perror("socketpair");
+		exit(EXIT_FAILURE);
+	}
+	t->fd = pair[WR];
+	*fd = pair[RD];
+	pthread_create(tid, NULL, write_traffic, t);
+}
+
+void bench_reader(void) {
+
+	int fd;
+	ssize_t n;
+	size_t lines;
+	double start;
+	pthread_t tid;
+	Reader reader;
+	struct traffic t;
+	char line[IRCLEN + 1];
+	struct line found[READER_MAXLINES];
+
+	t.buf = generate_traffic(&t.len);
+
+	start_writer(&t, &tid, &fd);
+	start = bench_now();
+	for (lines = 0; legacy_readline(fd, line, IRCLEN) > 0; lines++);
+	bench_report("sock_readline (legacy)", lines, t.len, bench_now() - start);
+	pthread_join(tid, NULL);
+	close(fd);
+
+	start_writer(&t, &tid, &fd);
+	reader = reader_init(fd);
+	start = bench_now();
+	for (lines = 0; (n = reader_readlines(reader, found, READER_MAXLINES)) > 0; lines += n);
+	bench_report("reader_readlines", lines, t.len, bench_now() - start);
+	pthread_join(tid, NULL);
+	reader_destroy(reader);
+	close(fd);
+
+	free(t.buf);
+}
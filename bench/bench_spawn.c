@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "bench_main.h"
+#include "zygote.h"
+#include "common.h"
+
+#define SPAWN_ROUNDS 500
+#define SPAWN_HEAP   (256 * 1024 * 1024) //!< Touched before spawning, like a bot that has been running for a while
+
+enum spawner {FORK, DIRECT, ZYGOTE};
+
+// Previous implementation: fork() the whole process and exec in the child
+static pid_t legacy_spawn(char *argv[], int out_fd) {
+
+	pid_t pid = fork();
+
+	if (pid)
+		return pid;
+
+	dup2(out_fd, STDOUT_FILENO);
+	execvp(argv[0], argv);
+	_exit(EXIT_FAILURE);
+}
+
+static void run(const char *name, enum spawner spawner) {
+
+	int status_fd = -1, fd[2];
+	pid_t pid;
+	double start;
+
+	if (pipe(fd))
+		abort();
+
+	start = bench_now();
+	for (int i = 0; i < SPAWN_ROUNDS; i++) {
+		if (spawner == FORK)
+			pid = legacy_spawn(CMD("true"), fd[1]);
+		else
+			pid = zygote_spawn(CMD("true"), -1, fd[1], NULL, &status_fd);
+
+		if (pid < 0 || zygote_wait(pid, status_fd) < 0)
+			abort();
+	}
+	bench_report(name, SPAWN_ROUNDS, 0, bench_now() - start);
+	close(fd[0]);
+	close(fd[1]);
+}
+
+void bench_spawn(void) {
+
+	char *heap;
+
+	if (!zygote_start())
+		abort();
+
+	heap = malloc(SPAWN_HEAP);
+	memset(heap, 1, SPAWN_HEAP);
+	run("fork & exec (legacy)", FORK);
+	run("spawn server",         ZYGOTE);
+	zygote_stop();
+	run("posix_spawn",          DIRECT); // Without the server
+	free(heap);
+}
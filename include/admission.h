@@ -0,0 +1,47 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+/**
+ * @file admission.h
+ * Admission control for work that holds resources while it runs. Requests are admitted until too many are in flight,
+ * the outbound queue they reply to is backed up or the recent ones took too long, then the rest are shed until that
+ * recovers. Latency is a moving average of the finished requests. It only counts while something is in flight, so an
+ * idle system always admits a request that can refresh it. All functions are thread safe
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ADMISSION_WEIGHT 0.2 //!< Of the newest latency sample in the moving average
+
+typedef struct admission *Admission;
+
+enum admission_verdict {ADMIT, SHED_INFLIGHT, SHED_QUEUE, SHED_LATENCY};
+
+struct admission_stats {
+	int inflight;
+	size_t admitted;
+	size_t shed;
+	double latency_ms; //!< Moving average
+};
+
+/**
+ * @param max_inflight    Requests admitted at the same time
+ * @param max_depth       Queued lines above which requests are shed
+ * @param max_latency_ms  Average above which requests are shed while others are in flight
+ */
+Admission admission_init(int max_inflight, size_t max_depth, long max_latency_ms);
+
+/** Admit a request or tell why not. Admitted ones must call admission_exit() when done
+ *  @param depth  Lines currently waiting in the queue the request would reply to */
+enum admission_verdict admission_enter(Admission a, size_t depth);
+
+/** @param latency_ms  The request's latency as the caller measures it, e.g. its time queued. Negative if it never ran */
+void admission_exit(Admission a, long latency_ms);
+
+/** Copy the counters */
+void admission_stats(Admission a, struct admission_stats *stats);
+
+void admission_destroy(Admission a);
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+/**
+ * @file cache.h
+ * In-memory key / value cache with a time to live per entry. Keys are spread over CACHE_SHARDS shards, each with its
+ * own lock, LRU list & share of the size bound, so threads rarely contend. When a shard is full its least recently
+ * used entries are evicted. All functions are thread safe
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CACHE_SHARDS  16
+#define CACHE_BUCKETS 64 //!< Hash chains per shard
+
+typedef struct cache *Cache;
+
+/** Counters since the cache was created, summed over the shards */
+struct cache_stats {
+	size_t hits;
+	size_t misses;
+	size_t evictions; //!< Entries dropped to make room. Expired ones don't count
+	size_t entries;
+	size_t bytes;     //!< Counting the keys & bookkeeping too
+};
+
+/** @param max_bytes  Size bound of all entries combined. Each shard gets an equal share
+ *  @returns          NULL if max_bytes is 0 */
+Cache cache_init(size_t max_bytes);
+
+/**
+ * Add or replace the value of key
+ *
+ * @param value   Copied into the cache
+ * @param ttl_ms  Milliseconds until it expires
+ * @returns       false if the entry is larger than a shard
+ */
+bool cache_put(Cache cache, const char *key, const void *value, size_t len, long ttl_ms);
+
+/** @param len  Filled with the value's length on a hit
+ *  @returns    A copy of the value that must be freed or NULL if key is missing or expired */
+void *cache_get(Cache cache, const char *key, size_t *len);
+
+/** Copy the counters */
+void cache_stats(Cache cache, struct cache_stats *stats);
+
+void cache_destroy(Cache cache);
+
+#endif
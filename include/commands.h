@@ -14,6 +14,7 @@
  */
 
 #include "irc.h"
+#include "coproc.h"
 
 #define MAXCOMMITS   10
 #define MAXPINGS     10
@@ -21,6 +22,7 @@
 #define QUOTELEN     250
 #define DEFAULT_ROLL 100
 #define MAXROLL      1000000
+#define SCRIPT_TIMEOUT (15 * MILLISECS) //!< Scripts served by workers, they fall back to a one off run after that
 
 // Irc color codes
 #define COLOR   "\x03"
@@ -96,6 +98,9 @@ void bot_tweet(Irc server, struct parsed_data pdata);
 /** Check if freestyler is fit yet */
 void bot_fit(Irc server, struct parsed_data pdata);
 
+/** Weather & population are answered by these long-lived script workers. NULL runs the script for each request */
+void set_script_workers(Coproc cp);
+
 /** Report weather */
 void bot_weather(Irc server, struct parsed_data pdata);
 
@@ -24,6 +24,15 @@
 #define NANOSECS  (1000 * MICROSECS)
 #define SCRIPTDIR "scripts/" //!< default folder to look for scripts like the youtube one
 
+//@{
+/** Limits of the programs started by print_cmd_output() */
+#define CMD_MAXLINES  25
+#define CMD_MAXBYTES  4096
+#define CMD_MAXCPU    20           //!< Seconds of CPU time
+#define CMD_MAXMEMORY (1024 << 20) //!< Bytes of address space
+#define CMD_TERM_WAIT 500          //!< Milliseconds between SIGTERM & SIGKILL
+//@}
+
 //@{
 /** Macros to help reduce boilerplate code */
 #define CMD(...) (char *[]) {__VA_ARGS__, NULL}
@@ -39,6 +48,7 @@
 
 /** Find minimum number. Beware of side effects. */
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 //@{
 /** Wrappers for allocating memory. On failure, print the position and exit. A valid pointer is returned always. */
@@ -68,6 +78,19 @@ bool starts_with(const char *s1, const char *s2);
 /** Case insensitive version */
 bool starts_case_with(const char *s1, const char *s2);
 
+/** @returns  true if the span's content matches str. Case insensitive */
+bool span_case_eq(struct span s, const char *str);
+
+/** @returns  true if the span starts with str */
+bool span_starts_with(struct span s, const char *str);
+
+/** Case insensitive version */
+bool span_starts_case_with(struct span s, const char *str);
+
+/** Copy span to buf and null terminate it. If it doesn't fit, it will be truncated
+ *  @returns  buf */
+char *span_copy(char *buf, size_t size, struct span s);
+
 /** Terminate buffer on the delim character
  *  @returns NULL if something went wrong, or the pointer to the NULL character */
 char *null_terminate(char *buf, char delim);
@@ -104,6 +127,9 @@ void send_all_lines(Irc server, const char *target, FILE *stream);
 
 /**
  * Run the program specified and print the output in target channel / person
+ * Lines are sent as they arrive. The program runs with CMD_MAXCPU & CMD_MAXMEMORY limits. If it prints more than
+ * CMD_MAXLINES or CMD_MAXBYTES or the command's deadline passes, the program and everything it started are stopped.
+ * That includes a program that closed its output but keeps running
  *
  * @param cmd_args  Is an array with it's first member having the actual program name,
  *                  the arguments come after that and the last member should be NULL
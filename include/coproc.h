@@ -0,0 +1,44 @@
+#ifndef COPROC_H
+#define COPROC_H
+
+/**
+ * @file coproc.h
+ * Long-lived script workers that answer requests over a JSON lines protocol, so that an interpreter starts once
+ * instead of once per command and scripts can keep their own caches. Workers are spawned through the zygote on first
+ * use with a socket as their stdin & stdout. Each request is a line like {"cmd": "weather", "arg": "athens"} and gets
+ * a single line back, {"lines": ["...", ...]} or {"error": "..."}. A worker that has been idle for a while must
+ * answer a {"cmd": "ping"} first. Workers that die, time out, reply garbage or served COPROC_MAXREQUESTS are
+ * restarted. All functions are thread safe, but calls block, so they are not for coroutines
+ */
+
+#include <stdbool.h>
+#include <yajl/yajl_tree.h>
+#include "zygote.h"
+
+#define COPROC_LINELEN       8192 //!< Longest request or reply
+#define COPROC_MAXREQUESTS   1000 //!< Served before the worker is replaced, to bound leaks
+#define COPROC_PING_IDLE     60   //!< Seconds of idleness after which a worker is pinged before use
+#define COPROC_PING_TIMEOUT  1000 //!< Milliseconds
+#define COPROC_RESTART_DELAY 1000 //!< Milliseconds before a worker that failed is started again
+
+typedef struct coproc *Coproc;
+
+/**
+ * @param argv     Program & its arguments, copied. It must serve requests from stdin until EOF
+ * @param workers  Started at most. Callers wait for a free one when all are busy
+ * @param limits   Resource limits of each worker or NULL for none
+ */
+Coproc coproc_init(char *argv[], int workers, const struct spawn_limits *limits);
+
+/**
+ * Send cmd & arg to a free worker and wait for its reply, for timeout_ms or the current deadline
+ *
+ * @param arg  NULL to omit it
+ * @returns    The parsed reply, which must be freed with yajl_tree_free(), or NULL on failure
+ */
+yajl_val coproc_call(Coproc cp, const char *cmd, const char *arg, long timeout_ms);
+
+/** Stop the workers. Calls must have returned */
+void coproc_destroy(Coproc cp);
+
+#endif
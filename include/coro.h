@@ -0,0 +1,68 @@
+#ifndef CORO_H
+#define CORO_H
+
+/**
+ * @file coro.h
+ * Stackful coroutines that run on the reactor's thread. A coroutine runs until it awaits a descriptor, a timer or an
+ * HTTP transfer, and the reactor resumes it once that is ready, so commands that spend their time waiting don't hold
+ * a thread. Transfers share a single curl multi handle that is driven by the reactor. Stacks are mmap()ed with a guard
+ * page, so only the pages a coroutine touches use memory. None of the functions are thread safe
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <curl/curl.h>
+#include "event.h"
+
+#define CORO_STACKSIZE (64 * 1024)
+#define CORO_MAXCOROS  256 //!< Coroutines alive at the same time
+#define CORO_MAXSPARE  16  //!< Finished coroutines kept around for their stacks
+
+typedef struct coro *Coro;
+typedef void (*coro_func)(void *arg);
+
+/** Users of coro_local(), each gets a slot of its own */
+enum coro_slot {CORO_CAPTURE, CORO_DEADLINE, CORO_SLOTS};
+
+/** Setup the curl multi handle & its timer on the reactor. Must be called before any other function
+ *  @returns  false on failure */
+bool coro_init(Reactor r);
+
+/** Free the multi handle & the spare stacks. Coroutines still waiting are abandoned */
+void coro_cleanup(void);
+
+/** Run func on a new coroutine until it first awaits. It's freed when func returns
+ *  @returns  false if CORO_MAXCOROS are alive or the stack couldn't be allocated */
+bool coro_start(coro_func func, void *arg);
+
+/** Same as coro_start(), but the coroutine is kept until another coroutine collects it with coro_join()
+ *  @returns  NULL on failure */
+Coro coro_spawn(coro_func func, void *arg);
+
+/** Wait for a coroutine created by coro_spawn() to return and free it. Must be called from a coroutine */
+void coro_join(Coro c);
+
+/** @returns  The running coroutine or NULL when called from outside of one */
+Coro coro_self(void);
+
+/** Per coroutine slot for the caller's data, like __thread is for threads. NULL when the coroutine starts. Must be
+ *  called from a coroutine */
+void **coro_local(enum coro_slot slot);
+
+/** Number of coroutines alive, including those spawned and not joined yet */
+size_t coro_count(void);
+
+/** Wait until fd is ready for events (EPOLLIN, EPOLLOUT...) or timeout_ms pass. The descriptor must not be watched
+ *  by the reactor already
+ *  @returns  false on timeout */
+bool coro_wait_fd(int fd, uint32_t events, long timeout_ms);
+
+/** Let the reactor run for at least ms milliseconds */
+void coro_sleep(long ms);
+
+/** Drop-in replacement for curl_easy_perform(). On a coroutine the transfer runs on the multi handle while the
+ *  coroutine waits, otherwise it blocks as usual. CURLOPT_PRIVATE is used internally */
+CURLcode coro_perform(CURL *curl);
+
+#endif
@@ -7,10 +7,12 @@
  */
 
 #include <stdbool.h>
+#include <curl/curl.h>
 #include <yajl/yajl_tree.h>
 
 #define URLLEN   440
 #define TITLELEN 300
+#define CURL_RESOLVELEN 512
 
 /** HTTP status codes */
 enum http_codes {
@@ -62,6 +64,19 @@ char *fetch_mumble_users(void);
  */
 struct github *fetch_github_commits(yajl_val *root, const char *repo, int *commits);
 
+/**
+ * Set the request's url and resolve its host with resolve(), so that curl uses the cached addresses
+ * instead of doing a blocking lookup of its own. Redirects to other hosts are still resolved by curl
+ *
+ * @param hosts  List passed to CURLOPT_RESOLVE. Must be freed with curl_slist_free_all() after the request
+ * @returns      false if the host doesn't resolve. Urls without a hostname are accepted as is
+ */
+bool curl_set_url(CURL *curl, const char *url, struct curl_slist **hosts);
+
+/** Limit the transfer to timeout_ms or the current deadline, whichever comes first. The deadline is also checked from
+ *  the progress callback, so cancelling it aborts the transfer. Call it from the thread or coroutine that performs it */
+void curl_set_timeout(CURL *curl, long timeout_ms);
+
 /** Callback required by Curl if we want to save the output in a buffer
  *  @param membuf  Mem_buffer type is expected */
 size_t curl_write_memory(char *data, size_t size, size_t elements, void *membuf);
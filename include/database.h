@@ -9,6 +9,9 @@
 #include <stdbool.h>
 
 #define QUOTE_MODIFY_PERIOD 600
+#define DB_BUSY_TIMEOUT     3000 //!< Milliseconds to wait for a locked database, unless the command's deadline is sooner
+#define DB_BUSY_SLEEP       10
+#define DB_PROGRESS_OPS     1000 //!< Virtual machine instructions between deadline checks
 
 /** Open database, create tables, merge config access list and more */
 bool setup_database(void);
@@ -0,0 +1,53 @@
+#ifndef DEADLINE_H
+#define DEADLINE_H
+
+/**
+ * @file deadline.h
+ * Per command deadlines. The command's thread or coroutine installs one before running and everything it calls
+ * checks the current one: curl transfers abort from their progress callback, sqlite statements from its progress
+ * handler, children are killed and socket waits give up. Another thread can also cancel the deadline before it
+ * expires. Without a deadline installed nothing is limited beyond the callers' own timeouts
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+
+struct deadline {
+	struct timespec expires; //!< CLOCK_MONOTONIC
+	volatile sig_atomic_t cancelled;
+};
+
+/** Start a deadline ms milliseconds from now and make it the current one for the calling thread or coroutine.
+ *  d must stay valid until deadline_stop() */
+void deadline_start(struct deadline *d, long ms);
+
+/** Uninstall the current deadline */
+void deadline_stop(void);
+
+/** Make an already started deadline, or none for NULL, the current one
+ *  @returns  The previous one, so that it can be restored */
+struct deadline *deadline_set(struct deadline *d);
+
+/** @returns  The calling thread's or coroutine's deadline or NULL if none is installed */
+struct deadline *deadline_current(void);
+
+/** Make d expire right away. Safe to call from any thread */
+void deadline_cancel(struct deadline *d);
+
+/** @returns  true if d expired or was cancelled. A NULL deadline never expires */
+bool deadline_expired(const struct deadline *d);
+
+/** @returns  Milliseconds left for d, 0 if expired or LONG_MAX if d is NULL */
+long deadline_remaining(const struct deadline *d);
+
+/** @returns  timeout_ms, shortened to what's left of the current deadline */
+long deadline_clamp(long timeout_ms);
+
+/** Wait until fd is ready for events (EPOLLIN, EPOLLOUT...) or the timeout or current deadline pass. Coroutines don't
+ *  block the reactor while waiting
+ *  @returns  false on timeout or error */
+bool deadline_wait_fd(int fd, uint32_t events, long timeout_ms);
+
+#endif
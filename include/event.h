@@ -0,0 +1,64 @@
+#ifndef EVENT_H
+#define EVENT_H
+
+/**
+ * @file event.h
+ * Single threaded reactor built on epoll. Subsystems register file descriptors, timers (timerfd)
+ * and signals (signalfd) along with a handler that is called when they become ready.
+ * Registering and removing events is O(1) and handlers are allowed to remove any event, even
+ * ones that are pending in the same round.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+
+#define REACTOR_MAXEVENTS 32
+
+typedef struct reactor *Reactor;
+typedef struct event *Event;
+
+/** Called when an event is ready. Timer expirations & signals are consumed before the call
+ *  @param events  Bitmask of the epoll events that occurred, e.g. EPOLLIN */
+typedef void (*event_handler)(Reactor r, Event ev, uint32_t events, void *data);
+
+/** @returns  NULL on failure */
+Reactor reactor_init(void);
+
+/** Free all registered events. Timer & signal descriptors are closed, plain fds are left open */
+void reactor_destroy(Reactor r);
+
+/** Dispatch events until reactor_stop() is called
+ *  @returns  0 if stopped or -1 on error */
+int reactor_run(Reactor r);
+
+/** Make reactor_run() return after the current round of handlers */
+void reactor_stop(Reactor r);
+
+/** Watch fd for events (EPOLLIN, EPOLLOUT...). fd is not owned by the reactor
+ *  @returns  NULL on failure */
+Event reactor_add_fd(Reactor r, int fd, uint32_t events, event_handler cb, void *data);
+
+/** Create a monotonic timer. Times are in milliseconds, 0 after_ms creates a disarmed timer
+ *  @param interval_ms  Period after the first expiration or 0 for one-shot
+ *  @returns            NULL on failure */
+Event reactor_add_timer(Reactor r, long after_ms, long interval_ms, event_handler cb, void *data);
+
+/** Receive signum through the reactor instead of asynchronously. The signal gets blocked in the
+ *  calling thread, so it must be called before any other thread is created
+ *  @returns  NULL on failure */
+Event reactor_add_signal(Reactor r, int signum, event_handler cb, void *data);
+
+/** Stop watching and free the event. Safe to call from any handler */
+void reactor_remove(Reactor r, Event ev);
+
+/** Change the events watched for */
+bool event_modify(Reactor r, Event ev, uint32_t events);
+
+/** Rearm a timer created with reactor_add_timer(). 0 after_ms disarms it */
+bool timer_set(Event ev, long after_ms, long interval_ms);
+
+/** @returns  The descriptor being watched */
+int event_fd(Event ev);
+
+#endif
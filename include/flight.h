@@ -0,0 +1,41 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+/**
+ * @file flight.h
+ * Single-flight coalescing of identical requests. The first caller for a key leads: it does the work and lands the
+ * result, while callers for the same key that arrive in the meantime wait for it instead of repeating the work.
+ * Waiters give up after a timeout, so a slow leader can't hold them up for longer. All functions are thread safe and
+ * coroutines wait without blocking the reactor
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct flight *Flight;
+
+enum flight_role {
+	FLIGHT_LEAD,    //!< Do the work, then call flight_land() with the same key
+	FLIGHT_DONE,    //!< The leader's result was copied
+	FLIGHT_FAILED,  //!< The leader had no result to share
+	FLIGHT_TIMEOUT  //!< The leader is still working
+};
+
+Flight flight_init(void);
+
+/**
+ * Lead the request for key or wait for the leader's result
+ *
+ * @param timeout_ms  Longest to wait for the leader
+ * @param result      Filled on FLIGHT_DONE with a copy that must be freed
+ * @param len         Filled on FLIGHT_DONE
+ */
+enum flight_role flight_join(Flight flight, const char *key, long timeout_ms, void **result, size_t *len);
+
+/** Hand result to the waiters of key. A NULL result means failure. Later callers of flight_join() lead a new request */
+void flight_land(Flight flight, const char *key, const void *result, size_t len);
+
+/** No request may be in flight */
+void flight_destroy(Flight flight);
+
+#endif
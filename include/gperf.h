@@ -12,10 +12,22 @@
 
 typedef void (*func_ptr)(Irc, struct parsed_data);
 
+/** Where a command runs. Set in gperf.txt's third column, memoize in the fourth & deadline in the fifth */
+enum exec_class {
+	EXEC_INLINE,   //!< Never blocks. Runs on the reactor thread as soon as it's parsed, without allocating
+	EXEC_ASYNC,    //!< Only waits on transfers & sockets through coro.h. Runs on a coroutine of the reactor thread
+	EXEC_POOLED,   //!< Short local work, like a database query. Runs on the command pool
+	EXEC_BLOCKING, //!< Waits on the network, NickServ or another program. Runs on the blocking pool
+	EXEC_CLASSES
+};
+
 /** Key / value pair */
 typedef const struct command_entry {
-	char *name;        //!< String containing the command
-	func_ptr function; //!< Function pointer to corresponding command
+	char *name;           //!< String containing the command
+	func_ptr function;    //!< Function pointer to corresponding command
+	enum exec_class exec; //!< Inline & async ones run on the reactor thread, so they must never call user_has_access()
+	unsigned memoize;     //!< Seconds to replay the replies for the same arguments instead of running again. 0 to disable
+	unsigned deadline;    //!< Seconds the command may run before its transfers, queries & children are aborted. 0 for none
 } Command;
 
 /**
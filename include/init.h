@@ -8,8 +8,9 @@
 
 #include <stdio.h>
 #include <stdbool.h>
-#include <poll.h>
 #include "irc.h"
+#include "event.h"
+#include "uring.h"
 
 #define DEFAULT_CONFIG_NAME "config.json"
 #define FIFO_PERMISSIONS (S_IRUSR | S_IWUSR | S_IWGRP | S_IWOTH)
@@ -17,11 +18,18 @@
 #define CONFSIZE      4096
 #define PATHLEN       120
 #define MAXACCLIST    10
-#define POLL_TIMEOUT (300 * MILLISECS)
+#define MAXNETWORKS   8
+#define IDLE_TIMEOUT (300 * MILLISECS)
+#define MAXCOMMANDQUEUE 1024
+#define MAXSTACKSIZE    8192 //!< KiB, the usual default of a thread
+#define MAXCACHESIZE    65536 //!< KiB
+#define MAXSCRIPTWORKERS 16
 
-enum fds_array {IRC, MURM_LISTEN, MURM_ACCEPT, MPD, FIFO, TOTAL};
+/** Descriptors that survive an upgrade. Everything else is only registered to the reactor */
+enum fds_array {IRC, MURM_LISTEN, MURM_ACCEPT, TOTAL};
 
-struct config_options {
+/** Connection details of an IRC network. Every network gets its own connection & message queue */
+struct network_options {
 	char *server;
 	char *port;
 	char *nick;
@@ -29,6 +37,12 @@ struct config_options {
 	char *user;
 	char *channels[MAXCHANS];
 	int channels_set;
+	bool tls;
+};
+
+struct config_options {
+	struct network_options networks[MAXNETWORKS]; //!< The first one is described by the top level fields
+	int networks_set;
 	char *bot_version;
 	char *github_repo;
 	char *quit_message;
@@ -44,10 +58,18 @@ struct config_options {
 	char *oauth_token_secret;
 	char *google_shortener_api_key;
 	char *wolframalpha_api_key;
+	char *tls_ca_file;
 	bool twitter_details_set;
 	char *access_list[MAXACCLIST];
 	int access_list_count;
 	bool verbose;
+	bool io_uring;
+	int command_threads;
+	int blocking_threads;
+	int command_queue;
+	int command_stack_size; //!< In KiB
+	int command_cache_size; //!< In KiB
+	int script_workers;
 };
 
 extern struct config_options cfg; //!< global struct with config's values
@@ -59,15 +81,28 @@ extern struct config_options cfg; //!< global struct with config's values
  */
 int initialize(int argc, char *argv[], int *fd);
 
+/**
+ * Connect to a network and queue the registration
+ *
+ * @param net  Network to connect to
+ * @param fd   Connection handed over by a previous image or 0 to connect
+ * @returns    A connected Irc object. exit() is called on failure
+ */
+Irc setup_irc(Reactor r, Uring u, const struct network_options *net, int fd);
+
 //@{
 /** The returned file descriptors are always valid. exit() is called on failure */
-int setup_irc(Irc *server, int *fd_args);
 int setup_mpd(void);
 int setup_fifo(FILE **stream);
 //@}
 
-/** Mumble setup is more special because we have to handle 2 probable file descriptors */
-void setup_mumble(struct pollfd *pfd, int *fd_args);
+/** Mumble setup is more special because we have to handle 2 probable file descriptors.
+ *  fds[MURM_LISTEN] & fds[MURM_ACCEPT] are set if available */
+void setup_mumble(int *fds, int *fd_args);
+
+/** Wait for the commands running on the pools and stop their workers. Must happen before the servers
+ *  they reply to are freed. No commands can be received afterwards */
+void stop_commands(void);
 
 /** Cleanup init's mess */
 void cleanup(void);
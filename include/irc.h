@@ -8,9 +8,16 @@
 
 #include <sys/types.h>
 #include <stdbool.h>
+#include <time.h>
 #include "queue.h"
+#include "tls.h"
+#include "pool.h"
+#include "cache.h"
+#include "ratelimit.h"
+#include "admission.h"
 
 #define IRCLEN   512
+#define IRC_TAGLEN 8191 //!< IRCv3 budget of the tags, including the '@' and the space after them. It's on top of IRCLEN
 #define QUITLEN  160
 #define NICKLEN  20
 #define USERLEN  15
@@ -18,6 +25,30 @@
 #define ADDRLEN  40
 #define PORTLEN  5
 #define MAXCHANS 8
+#define IRC_MAXPARAMS 15
+#define IRC_NUMERICS  1000 //!< Numeric replies are always 3 digits
+#define ACC_TIMEOUT   5000 //!< Milliseconds to wait for NickServ to tell if a user is identified
+#define RECONNECT_BASE_DELAY 1000   //!< Milliseconds before the first reconnect attempt, doubled on every failure
+#define RECONNECT_MAX_DELAY  300000 //!< Upper bound of the backoff
+#define MEMOLEN   4096  //!< Replies of a memoized command that don't fit aren't cached
+#define MEMO_WAIT 10000 //!< Milliseconds to wait for an identical memoized command that's already running
+
+// Bot commands each nick, channel & command name can send at once before being ignored, then how many per second
+#define LIMIT_NICK_BURST    5
+#define LIMIT_NICK_RATE     0.25
+#define LIMIT_CHANNEL_BURST 8
+#define LIMIT_CHANNEL_RATE  0.5
+#define LIMIT_COMMAND_BURST 10
+#define LIMIT_COMMAND_RATE  1.0
+#define LIMIT_MAXKEYS       256
+
+enum limit_kind {LIMIT_NICK, LIMIT_CHANNEL, LIMIT_COMMAND, LIMITS};
+
+// Commands that aren't inline or replayed from the cache are shed past these. See admission.h
+#define ADMIT_MAXINFLIGHT     48
+#define ADMIT_MAXDEPTH        (QUEUE_MAXLINES / 2)
+#define ADMIT_MAXLATENCY      2000 //!< Milliseconds commands waited for a thread. Their runtime doesn't count, it's up to the command
+#define ADMIT_NOTICE_INTERVAL 30   //!< Seconds between notices about shed commands
 
 /** Pointer to the internal irc struct, making it an incomplete type
  *  Use the available functions in this file to change it's attributes */
@@ -29,8 +60,29 @@ struct parsed_data {
 	char *command; //!< The command type. Examples: "PRIVMSG", "MODE", "433"
 	char *target;  //!< The channel (or private) the message is directed at
 	char *message; //!< The actual message
+	char *tags;    //!< IRCv3 tags still escaped, see irc_tag_value(). Empty string if the message had none
+};
+
+/** (pointer, length) view inside a buffer. The bytes referenced are NOT null terminated */
+struct span {
+	const char *ptr;
+	size_t len;
 };
 
+/** Immutable view of a raw IRC line. Every member points inside the line parsed, nothing is copied
+ *  Example: ":laxanofido!~laxanofid@snf-23545.vm.okeanos.grnet.gr PRIVMSG #foss-teimes :How YA doing fossbot" */
+struct irc_message {
+	struct span tags;    //!< IRCv3 tags without the leading '@'. Example: "time=2021-03-01T12:00:00.000Z;account=bob". Empty if none
+	struct span prefix;  //!< Sender without the leading ':'. Example: "laxanofido!~laxanofid@snf-23545.vm.okeanos.grnet.gr"
+	struct span nick;    //!< Prefix up to '!'. Example: "laxanofido". Empty if the sender is a server
+	struct span command; //!< Examples: "PRIVMSG", "MODE", "433"
+	struct span params[IRC_MAXPARAMS]; //!< Examples: "#foss-teimes", "How YA doing fossbot". Trailing one is stored without the ':'
+	int param_count;
+};
+
+/** Handles a command or numeric reply. The message is only valid during the call */
+typedef void (*message_handler)(Irc server, const struct irc_message *msg);
+
 /** IRC server numeric replies. See http://www.ietf.org/rfc/rfc1459.txt for a detailed list */
 enum irc_reply {
 	ENDOFMOTD      = 376, //!< Registration successful, join the channels already set
@@ -45,17 +97,39 @@ enum irc_reply {
  * @param address  hostname / IP
  * @param port     Port in string form
  * @param fd       Use this file descriptor instead of connecting
+ * @param tls      Wrap the connection in TLS. Requires tls_init() and can't be combined with fd
  * @returns        On success: A handler than can be used on every function that requires one or NULL on failure
  */
-Irc irc_connect(const char *address, const char *port, int fd);
+Irc irc_connect(const char *address, const char *port, int fd, bool tls);
 
 /* Extract the socket descriptor from the opaque Irc object
- * @returns  Always a valid descriptor */
+ * @returns  A valid descriptor or -1 while disconnected */
 int get_socket(Irc server);
 
+/** Returns the TLS connection or NULL for plaintext ones */
+Tls get_tls(Irc server);
+
+/** Returns the message queue set with set_mqueue() */
+Mqueue get_mqueue(Irc server);
+
 /** Store message queue pointer */
 void set_mqueue(Irc server, Mqueue mq);
 
+/** Bot commands of all servers run on these pools' workers, depending on their class. Inline ones run on the
+ *  caller's thread. Must be set before any command is received. The first call also sets up admission control */
+void set_command_pools(Pool pooled, Pool blocking);
+
+/** Run stub instead of every bot command, so that a replay measures the bot and not the services the commands
+ *  call out to. Commands still go through admission, the pools & memoization. NULL restores them */
+void set_command_stub(void (*stub)(Irc, struct parsed_data));
+
+/** @returns  Commands admitted that haven't finished yet. Inline ones and cache hits don't count */
+int commands_inflight(void);
+
+/** Replies of memoized commands are kept here, keyed on the command & its arguments. NULL disables memoization.
+ *  Identical memoized commands that run at the same time are coalesced into one */
+void set_command_cache(Cache cache);
+
 /** Returns the first channel set or NULL if there is not one */
 char *default_channel(Irc server);
 
@@ -66,6 +140,9 @@ void set_nick(Irc server, const char *nick);
  *  Can only be set during server connection so it should only be called once */
 void set_user(Irc server, const char *user);
 
+/** Password to identify to NickServ with when asked. It gets wiped after use, so the caller keeps ownership of a writable copy */
+void set_nick_password(Irc server, char *password);
+
 /** Find out if the user is in config access list and has identified to the NickServ
  *  @warning  Calling this function from the main proccess will abort (if debug is on) in order to avoid deadlocking */
 bool user_has_access(Irc server, const char *nick);
@@ -78,23 +155,68 @@ bool user_has_access(Irc server, const char *nick);
  */
 int join_channel(Irc server, const char *channel);
 
-/* Read line from server, split it into Parsed_data structure elements and launch the function associated with the IRC command
- * @returns  On success: line length, -1 on error, -2 if the operation would block or 0 if connection is closed */
+/* Read all available lines from server, split each into an irc_message and launch the function associated with the IRC command
+ * @returns  On success: number of lines parsed, -1 on error, -EAGAIN if the operation would block or 0 if connection is closed */
 ssize_t parse_irc_line(Irc server);
 
+/** Same as parse_irc_line() but the data were already received from the server, e.g. by io_uring
+ *  @returns  Number of lines parsed */
+size_t parse_irc_buffer(Irc server, const char *buf, size_t len);
+
+/**
+ * Split an IRC line into tags, prefix, command and parameters without modifying or copying it.
+ * Reentrant, it can be called from any thread
+ *
+ * @param line  Raw line without the "\r\n" terminators. It doesn't need to be null terminated
+ * @param len   Line's length
+ * @param msg   Filled with spans pointing inside line. They are valid as long as line is
+ * @returns     false if the line doesn't contain a command
+ */
+bool irc_parse_message(const char *line, size_t len, struct irc_message *msg);
+
+/**
+ * Find a tag in the tags of a message. Keys are matched exactly, including any client '+' or vendor prefix
+ *
+ * @param value  Set to the tag's value, still escaped. Empty for tags without a value
+ * @returns      false if the tag is missing
+ */
+bool irc_tag_find(struct span tags, const char *key, struct span *value);
+
+/**
+ * Decode the escapes of a tag's value. Nothing is allocated, the value is decoded only when asked for
+ *
+ * @param buf   Filled with the null terminated value. Longer values are truncated
+ * @returns     Decoded length or 0 if the tag is missing or has no value
+ */
+size_t irc_tag_value(struct span tags, const char *key, char *buf, size_t size);
+
+/** Read the server-time tag. Example: "time=2011-10-19T16:40:51.620Z"
+ *  @returns  false if the tag is missing or malformed */
+bool irc_tag_time(struct span tags, struct timespec *time);
+
 /** Parse channel / private messages and launch the function that matches the BOT command (must begin with '!') or CTCP request.
- *  Info available in pdata: nick, command, message (the rest message after command, including target)*/
-void irc_privmsg(Irc server, struct parsed_data pdata);
+ *  Only the parts of the message the command needs are copied before it's launched in a separate thread */
+void irc_privmsg(Irc server, const struct irc_message *msg);
 
 /** Handle notices. If nick requires identify, the password will be sent and then immediately destroyed */
-void irc_notice(Irc server, struct parsed_data pdata);
+void irc_notice(Irc server, const struct irc_message *msg);
 
 /** Rejoin few secs after being kicked and send message to offender */
-void irc_kick(Irc server, struct parsed_data pdata);
+void irc_kick(Irc server, const struct irc_message *msg);
 
-/* Handle server numeric replies
+/**
+ * Set the handler for a numeric reply, e.g. 352 (WHO) or 353 (NAMES). The table is shared by all servers and it's
+ * not locked, so register handlers at startup, before any server is read
+ *
+ * @param numeric  From 1 to IRC_NUMERICS - 1
+ * @param handler  NULL ignores the reply
+ * @returns        Previous handler, so that the new one can chain to it. NULL if there was none
+ */
+message_handler irc_register_numeric(int numeric, message_handler handler);
+
+/* Handle server numeric replies by calling the registered handler
  * @returns the numeric reply received */
-int numeric_reply(Irc Server, struct parsed_data pdata, int reply);
+int numeric_reply(Irc server, const struct irc_message *msg, int reply);
 
 //@{
 /**
@@ -117,5 +239,21 @@ void _irc_command(Irc server, const char *type, const char *target, const char *
 /** Close socket and free resources */
 void quit_server(Irc server, const char *msg);
 
+/** Drop the connection but keep all state, including the messages queued. No-op if already disconnected */
+void irc_disconnect(Irc server);
+
+/**
+ * Connect again to the same server, with TLS if the original connection used it, and register with the
+ * current nick & user. Channels are joined again after the MOTD and then the messages that were queued during the
+ * outage are released. Blocks until connected, bounded by the resolver's and the handshake's timeouts
+ *
+ * @returns  false if the attempt failed. The object stays disconnected and the caller should retry later
+ */
+bool irc_reconnect(Irc server);
+
+/** Milliseconds to wait before the given reconnect attempt, starting from 0.
+ *  Exponential backoff capped to RECONNECT_MAX_DELAY, of which the second half is random to spread out clients */
+long reconnect_delay(unsigned attempt);
+
 #endif
 
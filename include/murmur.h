@@ -20,6 +20,7 @@
 #define VALIDATE_CONNECTION_PACKET_SIZE 14
 #define READ_BUFFER_SIZE 512
 #define USERLIST_BUFFER_SIZE 4096
+#define MURMUR_TIMEOUT 3000 //!< Milliseconds to wait for a reply
 
 /** Add callbacks */
 bool add_murmur_callbacks(const char *port);
@@ -32,6 +33,10 @@ char *fetch_murmur_users(void);
  *  @return non-blocking socket */
 int accept_murmur_connection(int murm_listenfd);
 
+/** Act on a single callback packet. The packet is modified
+ *  @returns  false if the connection should be closed */
+bool parse_murmur_callback(Irc server, char *packet, size_t len);
+
 /** Listen for callbacks */
 bool listen_murmur_callbacks(Irc server, int murm_acceptfd);
 
@@ -0,0 +1,48 @@
+#ifndef POOL_H
+#define POOL_H
+
+/**
+ * @file pool.h
+ * Fixed set of worker threads that run submitted tasks. Every worker has a deque of its own. Tasks are spread over them
+ * round robin and a worker that runs out of work steals from the others. The total of queued tasks is bounded, so a
+ * burst gets rejected instead of piling up threads or memory. Submission is thread safe
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define POOL_MAXWORKERS 64
+
+typedef struct pool *Pool;
+
+/** Runs on a worker thread. The argument is owned by the task */
+typedef void (*pool_task)(void *arg);
+
+/** Counters since the pool was created */
+struct pool_stats {
+	size_t submitted;
+	size_t rejected; //!< Submissions refused because the pool was saturated
+	size_t stolen;   //!< Tasks run by a worker other than the one they were queued on
+};
+
+/**
+ * Start the workers
+ *
+ * @param workers     Number of threads, up to POOL_MAXWORKERS
+ * @param capacity    Maximum number of tasks waiting for a worker. Running ones don't count
+ * @param stack_size  Stack size of each worker in bytes. Raised to PTHREAD_STACK_MIN if lower, 0 keeps the default
+ * @returns           NULL on failure
+ */
+Pool pool_init(int workers, int capacity, size_t stack_size);
+
+/** Queue a task. Never blocks
+ *  @returns  false if capacity tasks are already waiting. The task is not run and the caller keeps arg */
+bool pool_submit(Pool pool, pool_task task, void *arg);
+
+/** Copy the counters */
+void pool_stats(Pool pool, struct pool_stats *stats);
+
+/** Wait for the queued & running tasks to finish, then stop the workers and free the pool */
+void pool_destroy(Pool pool);
+
+#endif
@@ -7,33 +7,73 @@
  * in order to throttle the sending of messages if needed. That way we avoid getting
  * kicked by the server for flooding. Token bucket algorithm supports bursting before
  * throttling kicks in. If lines arrive while queue is full, they are dropped.
+ * Sending is driven by the reactor: an eventfd wakes it up on new lines, a timer when
+ * the bucket refills and EPOLLOUT when a full socket buffer drains.
  */
 
 #include <stdbool.h>
+#include <sys/uio.h>
+#include "event.h"
+#include "uring.h"
+#include "tls.h"
 
 #define QUEUE_MAXLINES       30
 #define QUEUE_BURST_CAPACITY 6.0
 #define QUEUE_FILL_RATE      1.0
 #define QUEUE_CONSUME_RATE   1.0
+#define QUEUE_RESERVED       5   //!< Slots that only protocol lines can take, so that replies never crowd out a PONG
 
 typedef struct message_queue *Mqueue;
 
-/** Initialize token bucket algorithm and setup queue
- *  @param fd  Store the fd in the Mqueue struct so that mqueue_start() can access it
- *             because pthread_create() accepts a single argument */
-Mqueue mqueue_init(int fd);
+/** Initialize token bucket algorithm, setup queue and register its events to the reactor
+ *  @param fd  Socket that the lines are sent to */
+Mqueue mqueue_init(Reactor r, int fd);
 
-/** Reverse the steps in init */
+/** Send batches as linked io_uring submissions instead of writev() */
+void mqueue_set_uring(Mqueue mq, Uring u);
+
+/** Encrypt batches with tls_writev(). Can't be combined with io_uring */
+void mqueue_set_tls(Mqueue mq, Tls tls);
+
+/** Stop rate limiting, for outputs that aren't an IRC server */
+void mqueue_unthrottle(Mqueue mq);
+
+/** Reverse the steps in init. Any lines still queued are sent without rate limiting, unless disconnected */
 void mqueue_destroy(Mqueue mq);
 
-/** Read's messages from queue and send them to IRC rate limited */
-void *mqueue_start(void *mqueue);
+/**
+ * Stop sending because the connection is lost. Lines not sent yet are kept, including the whole batch that
+ * was interrupted, and new ones keep being queued. The socket is shut down, so the reader notices as well.
+ * The queue does this by itself on a write error
+ */
+void mqueue_disconnect(Mqueue mq);
+
+/** Resume sending to a new connection. The replies kept from the old one are held back until mqueue_release(),
+ *  so that registration goes first. Protocol lines still queued for the old one are dropped. Replaces any mqueue_set_tls() */
+void mqueue_connect(Mqueue mq, int fd, Tls tls);
+
+/** Queue the lines held back by mqueue_connect() after the ones already queued. Lines that don't fit are dropped */
+void mqueue_release(Mqueue mq);
+
+/** Send messages from queue to IRC rate limited. All the lines the token bucket currently
+ *  allows are sent together with a single writev(). Called by the reactor's handlers */
+void mqueue_flush(Mqueue mq);
 
-/** Send messages to the queue. Returns false if queue was full */
+/** Send messages to the queue. Safe to call from any thread. Returns false if queue was full */
 bool mqueue_send(Mqueue mq, const char *line);
 
-/** Receive messages from queue. If queue is empty it will block until a message arrives */
-char *mqueue_recv(Mqueue mq);
+/** Same as mqueue_send(), but leaves the last QUEUE_RESERVED slots free. Meant for replies to users, which are the
+ *  only lines kept when reconnecting */
+bool mqueue_send_reply(Mqueue mq, const char *line);
+
+/** @returns  Lines waiting to be sent */
+size_t mqueue_depth(Mqueue mq);
+
+/** Receive up to max messages from queue without copying them. The lines stay in the queue
+ *  until the next call, so they must be sent before calling again. Doesn't block
+ *  @param iov  Filled with the address and length of each line
+ *  @returns    The number of lines stored in iov */
+size_t mqueue_recv(Mqueue mq, struct iovec *iov, size_t max);
 
 #endif
 
@@ -0,0 +1,52 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+/**
+ * @file ratelimit.h
+ * Token buckets, alone or keyed. Buckets are refilled lazily, when they are checked, so idle ones cost nothing.
+ * A keyed limiter gives every key (nick, channel...) a bucket of its own in a fixed size hash table. When it's full
+ * the least recently used key is evicted, which has usually been idle long enough to be full again anyway. Lookups
+ * never allocate. None of the functions are thread safe
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define RATELIMIT_KEYLEN 40 //!< Longer keys are compared up to this length
+
+struct token_bucket {
+	double tokens;
+	double burst_capacity;
+	double fill_rate;          //!< Tokens per second
+	struct timespec timestamp; //!< Of the last refill
+};
+
+typedef struct ratelimit *Ratelimit;
+
+/** Start full with burst tokens */
+void bucket_init(struct token_bucket *bucket, double burst, double rate);
+
+/** Refill for the time passed since the last call
+ *  @returns  The tokens available */
+double bucket_tokens(struct token_bucket *bucket);
+
+/** @returns  Milliseconds until the bucket holds n tokens. Call bucket_tokens() first */
+long bucket_delay(struct token_bucket *bucket, double n);
+
+/**
+ * Setup a keyed limiter
+ *
+ * @param burst     Requests a key can make at once
+ * @param rate      Requests per second after the burst
+ * @param max_keys  Buckets kept at the same time
+ */
+Ratelimit ratelimit_init(double burst, double rate, int max_keys);
+
+/** Take a token from key's bucket. Keys are case insensitive and don't need to be null terminated
+ *  @returns  false if the bucket is empty */
+bool ratelimit_allow(Ratelimit rl, const char *key, size_t len);
+
+void ratelimit_destroy(Ratelimit rl);
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+/**
+ * @file replay.h
+ * Record the lines an IRC server sends and feed them back later, so that production traffic can be reproduced
+ * offline. Recordings are binary: the REPLAY_MAGIC header and then one record per line, made of the microseconds
+ * passed since the previous line (uint32_t), the line's length (uint16_t) and the line without "\r\n".
+ * Numbers are in host byte order
+ */
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "irc.h"
+#include "event.h"
+
+#define REPLAY_MAGIC    "IRCREC1\n"
+#define REPLAY_MAGICLEN 8
+#define REPLAY_POLL     10 //!< Milliseconds between checks for the commands a replay left running
+#define REPLAY_BATCH    8  //!< Lines fed per reactor round. Well below ADMIT_MAXDEPTH, so that a batch's replies don't shed the next
+
+typedef struct recorder *Recorder;
+typedef struct player *Player;
+
+/**
+ * Create a recording, replacing any previous file
+ * @returns  NULL on failure
+ */
+Recorder recorder_open(const char *path);
+
+/** Append a line, timestamped with the monotonic clock. Lines are cut at READER_LINELEN and gaps over UINT32_MAX
+ *  microseconds (~71 minutes) are stored as that. On a write error, the error is printed once and recording stops */
+void recorder_write(Recorder rec, const char *line, size_t len);
+
+/** Flush and close the file */
+void recorder_close(Recorder rec);
+
+/** Record every line the server reads from now on. NULL stops recording. The recorder is not closed */
+void set_recorder(Irc server, Recorder rec);
+
+/** Called from the reactor once the last line was fed, with the number of lines replayed.
+ *  Replay stops at a truncated or corrupt record */
+typedef void (*replay_done)(void *data, ssize_t lines);
+
+/**
+ * Feed a recording to the server as if it was read from its connection. Lines go through the whole parse & dispatch
+ * path and the replies are queued as usual, so the caller decides where they are written. The lines are fed from the
+ * reactor, REPLAY_BATCH per round, so that the queue's flushes, the timers & the coroutines run in between
+ *
+ * @param realtime  Keep the recorded gaps between lines. Otherwise the lines are fed as fast as possible
+ * @returns         NULL if the file is not a recording
+ */
+Player replay_file(Reactor r, Irc server, const char *path, bool realtime, replay_done done, void *data);
+
+/** Stop feeding lines, if not done yet, and free the player */
+void replay_destroy(Player p);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+/**
+ * @file resolver.h
+ * Shared hostname resolver. Every lookup runs getaddrinfo() in a thread of its own and callers only wait up to
+ * RESOLVER_TIMEOUT for it. Results are cached per host & port, failures included, so that repeated
+ * connections don't pay the DNS latency again. getaddrinfo() doesn't report record TTLs, so fixed ones are used.
+ * All functions are thread safe. Coroutines wait for lookups without blocking the reactor
+ */
+
+#include <netdb.h>
+
+#define RESOLVER_TTL          300  //!< Seconds to keep a successful lookup
+#define RESOLVER_NEGATIVE_TTL 15   //!< Seconds to keep a failed one
+#define RESOLVER_TIMEOUT      5000 //!< Milliseconds to wait for a lookup. It keeps going in the background after that
+#define RESOLVER_MAXENTRIES   64
+
+/**
+ * Resolve a hostname to TCP addresses. Numeric addresses are converted without a lookup
+ * @warning  Returned list is a single allocation and must be freed with free(), not freeaddrinfo()
+ *
+ * @param host  hostname / IP
+ * @param port  Port in string form
+ * @returns     Addresses in the order getaddrinfo() returned them or NULL on failure or timeout
+ */
+struct addrinfo *resolve(const char *host, const char *port);
+
+/** Expire all cached results, so that the next lookups query DNS again */
+void resolver_flush(void);
+
+/** Free the cache. Lookups still in progress are abandoned. No other thread may use the resolver during or after the call */
+void resolver_cleanup(void);
+
+#endif
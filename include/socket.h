@@ -7,6 +7,8 @@
  */
 
 #include <stdbool.h>
+#include <sys/uio.h>
+#include <netdb.h>
 
 #define RD   0
 #define WR   1
@@ -14,16 +16,34 @@
 #define NONBLOCK 1
 #define MAXPORT  65535
 #define LOCALHOST "127.0.0.1"
+#define LOCALHOST_ANY "localhost" //!< Resolves to ::1 and / or 127.0.0.1, for connecting to local services
+#define CONNECT_ATTEMPT_DELAY 250 //!< Milliseconds before starting the next connection attempt in parallel
+#define CONNECT_MAXADDRS 16
+#define CONNECT_TIMEOUT  20000 //!< Milliseconds for all the attempts together
+#define READER_LINELEN  8704  //!< Longest line returned. IRCv3 allows 8191 bytes of tags on top of IRCLEN
+#define READER_BUFSIZE  16384 //!< Must be a power of 2 and larger than READER_LINELEN
+#define READER_MAXLINES 64
 
 /**
- * Open a connection to a remote location
+ * Open a connection to a remote location. All the addresses the hostname resolves to are tried with
+ * Happy Eyeballs (RFC 8305), so that an unreachable IPv6 or IPv4 route doesn't stall the connection
  *
  * @param address  hostname / IP
  * @param port     Port in string form
- * @returns        A valid socket descriptor or -1 on error
+ * @returns        A valid blocking socket descriptor or -1 on error
  */
 int sock_connect(const char *address, const char *port);
 
+/**
+ * Connect to the first address that accepts. Families are interleaved and a new non-blocking attempt starts
+ * every CONNECT_ATTEMPT_DELAY ms or as soon as the previous one fails, while the earlier ones keep going. Gives up
+ * after CONNECT_TIMEOUT or the current deadline. On a coroutine the reactor keeps running while it waits
+ *
+ * @param addr  List as returned by getaddrinfo()
+ * @returns     A valid blocking socket descriptor or -1 if all addresses failed or it timed out
+ */
+int connect_any(struct addrinfo *addr);
+
 /**
  * Start listening for connections
  *
@@ -53,6 +73,21 @@ int sock_accept(int listen_fd, bool non_block);
  */
 ssize_t sock_write(int sock, const void *buffer, size_t len);
 
+/**
+ * Gather write of multiple buffers to socket descriptor with as few syscalls as possible
+ *
+ * @param sock    (Non) blocking socket
+ * @param iov     Buffers to send. On partial writes, iov is updated in place to describe the unsent bytes.
+ *                Fully sent buffers get iov_len = 0, so the same array can be passed again to resume
+ * @param iovcnt  Number of buffers in iov
+ * @returns       blocking: On success: the total amount of bytes written or -1 on error
+ *                non-blocking: Same as blocking, but less bytes than requested may be written due to EAGAIN
+ */
+ssize_t sock_writev(int sock, struct iovec *iov, int iovcnt);
+
+/** Skip the first n bytes of iov, the same way sock_writev() does after a partial write */
+void iov_advance(struct iovec *iov, int iovcnt, size_t n);
+
 /**
  * Read data into buffer
  *
@@ -64,19 +99,47 @@ ssize_t sock_write(int sock, const void *buffer, size_t len);
  */
 ssize_t sock_read(int sock, void *buffer, size_t len);
 
+/** Per-connection line reader. Keeps a ring buffer so that lines split between reads are glued back together.
+ *  Use reader_init() to create one for a socket and reader_destroy() to free it */
+typedef struct line_reader *Reader;
+
+/** A complete line as returned by the reader. Trailing "\r\n" (or plain "\n") is removed and the line is null terminated */
+struct line {
+	char *buf;  //!< Points inside the reader's buffer. Valid till the next reader_readlines() / reader_feed() call
+	size_t len; //!< Length without the terminators
+};
+
+/** Bind a new reader to the socket. The socket is not closed on reader_destroy() */
+Reader reader_init(int sock);
+
+/** Free the reader and any buffered data */
+void reader_destroy(Reader reader);
+
 /**
- * Read a valid IRC line containing "\r\n" at the end and null terminate it
- * Characters after the IRC message terminators are left untouched for the next call
- * In non blocking mode line_buffer will contain the chars read so far even if -EAGAIN is returned
- * The length of the line can be used as an offset for the next call till a positive return value
- * @warning NOT thread safe. Mantains it's own buffer internally to avoid calling single byte read's(). Als
+ * Return every complete line available from a single read() call. Characters after the last line terminator
+ * are kept for the next call. If more than max lines are buffered, the rest are returned on the next call without reading.
+ * Lines longer than READER_LINELEN are cut and the rest of them is discarded, it's never returned as a line of its own.
+ * A line that had to be copied out of the ring ends the batch
  *
- * @param sock         Non blocking socket
- * @param line_buffer  Buffer to store the line
- * @param len          Will fill the buffer up to len bytes
- * @returns            On success: Amount of bytes written in line, -1 on error and -EAGAIN if the operation would block
+ * @param reader  Reader bound to a (non) blocking socket
+ * @param lines   Array to store the lines found
+ * @param max     Maximum number of lines to return
+ * @returns       On success: Number of lines stored, -1 on error, -EAGAIN if the operation would block
+ *                and 0 if connection is closed. Partial lines are discarded on close
  */
-ssize_t sock_readline(int sock, char *line_buffer, size_t len);
+ssize_t reader_readlines(Reader reader, struct line lines[], size_t max);
+
+/**
+ * Append data that was received by other means (e.g. io_uring) instead of reading the socket
+ *
+ * @returns  The amount of bytes consumed. If less than len, the buffer is full and
+ *           reader_getlines() must be called before feeding the rest
+ */
+size_t reader_feed(Reader reader, const char *buf, size_t len);
+
+/** Same as reader_readlines() but only returns lines already buffered, it never reads
+ *  @returns  Number of lines stored */
+size_t reader_getlines(Reader reader, struct line lines[], size_t max);
 
 #endif
 
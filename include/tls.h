@@ -0,0 +1,57 @@
+#ifndef TLS_H
+#define TLS_H
+
+/**
+ * @file tls.h
+ * TLS transport for the IRC connection. Sessions are cached per server, so that reconnecting resumes the
+ * previous session instead of doing a full handshake. The cache survives deploy()'s exec through the environment
+ */
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define TLS_SESSION_ENV       "IRCBOT_TLS_SESSIONS" //!< Carries the cached sessions to the next program image
+#define TLS_MAXSESSIONS       8
+#define TLS_HANDSHAKE_TIMEOUT 10    //!< Seconds
+#define TLS_RECORDLEN         16384 //!< Maximum plaintext in a single record
+
+typedef struct tls_conn *Tls;
+
+/**
+ * Setup the client context and import any sessions left in the environment by a previous image
+ *
+ * @param cafile  Certificates to trust in PEM format. If empty, the system's default store is used
+ * @returns       false on failure
+ */
+bool tls_init(const char *cafile);
+
+/** Free the context and the cached sessions */
+void tls_cleanup(void);
+
+/**
+ * Do the handshake over a connected blocking socket, for at most TLS_HANDSHAKE_TIMEOUT or the current deadline. On a
+ * coroutine the reactor keeps running while it waits. The server's certificate is verified against address
+ *
+ * @param address  Server's hostname / IP. A cached session for address & port is offered for resumption
+ * @returns        NULL on failure. The socket is not closed
+ */
+Tls tls_connect(int sock, const char *address, const char *port);
+
+/** True if the handshake resumed a cached session */
+bool tls_resumed(Tls tls);
+
+/** Same as sock_read(), but decrypts. The socket may be switched to non-blocking mode after tls_connect() */
+ssize_t tls_read(Tls tls, void *buffer, size_t len);
+
+/** Same as sock_writev(). The buffers are coalesced into as few records as possible.
+ *  After a partial write, the unsent bytes must be passed again unaltered */
+ssize_t tls_writev(Tls tls, struct iovec *iov, int iovcnt);
+
+/** Send close_notify and free the connection. The socket is not closed */
+void tls_close(Tls tls);
+
+/** Store the cached sessions in the environment, right before exec */
+void tls_export_sessions(void);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef TOKENIZER_H
+#define TOKENIZER_H
+
+/**
+ * @file tokenizer.h
+ * Single pass classification of the characters that split an IRC line. The line is scanned in SIMD sized
+ * blocks (AVX2 or SSE2 when the compiler targets them, plain C otherwise) and every later stage of parsing
+ * finds its delimiters in the resulting bitmaps, instead of scanning the line again. Classification is done
+ * 64 bytes at a time and only as far as the parser asks, so the trailing parameter is usually never scanned
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TOKEN_MAXLEN 512 //!< Same as IRCLEN. Lines with IRCv3 tags may be longer, they are rejected
+#define TOKEN_WORDS  (TOKEN_MAXLEN / 64)
+
+/** Bit i of each bitmap is set if line[i] belongs to the class. Only the first words are valid */
+struct irc_tokens {
+	const char *line;
+	size_t len;
+	size_t words;                   //!< Number of 64 byte words classified so far
+	uint64_t space[TOKEN_WORDS];    //!< ' '
+	uint64_t trailing[TOKEN_WORDS]; //!< ':' right after a space, starts the trailing parameter when found after the command
+	uint64_t user[TOKEN_WORDS];     //!< '!' & '@' that end the nick in a prefix. Example: "nick!user@host"
+};
+
+/**
+ * Prepare the line for classification. Nothing is scanned yet
+ *
+ * @param line  It doesn't need to be null terminated. Nothing is read past len
+ * @returns     false if len is larger than TOKEN_MAXLEN
+ */
+bool irc_tokenize(const char *line, size_t len, struct irc_tokens *tok);
+
+/**
+ * Find the next character of a class. The line is classified up to the word that contains it
+ *
+ * @param bitmap  One of tok's bitmaps
+ * @returns       Position of the first bit set at or after from or tok->len if there is none
+ */
+size_t token_next(struct irc_tokens *tok, const uint64_t *bitmap, size_t from);
+
+#endif
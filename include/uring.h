@@ -0,0 +1,61 @@
+#ifndef URING_H
+#define URING_H
+
+/**
+ * @file uring.h
+ * Optional io_uring backend, talking to the kernel with raw syscalls. Sockets are read with multishot
+ * receives into a ring of provided buffers, so a single submission keeps delivering data. Batches
+ * of lines are sent as linked submissions with one syscall. Completions are reaped by the reactor,
+ * since the ring's descriptor is registered to it.
+ */
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "event.h"
+
+#define URING_ENTRIES    64
+#define URING_BUFFERS    64   //!< Must be a power of 2
+#define URING_BUFSIZE    4096
+#define URING_BUFGROUP   0
+
+typedef struct uring *Uring;
+typedef struct uring_op *Uring_op;
+
+/** Called for every completion
+ *  @param buf  Received data, only valid during the call. NULL for sends
+ *  @param res  Bytes received / sent, 0 if the peer closed the connection or -errno on error.
+ *              After a result <= 0 the operation is finished and there will be no more calls */
+typedef void (*uring_handler)(void *data, char *buf, ssize_t res);
+
+/** Setup the ring and verify that the kernel supports everything needed, including multishot receives
+ *  @returns  NULL if io_uring is not usable. The caller should fallback to plain reads & writes */
+Uring uring_init(Reactor r);
+
+/** Cancel pending operations and free the ring */
+void uring_destroy(Uring u);
+
+/** Block until at least one operation completes and call the handlers of all completed ones.
+ *  Normally completions are dispatched by the reactor */
+void uring_wait(Uring u);
+
+/** Receive from a socket until it is closed or the operation is cancelled
+ *  @returns  NULL on failure */
+Uring_op uring_recv(Uring u, int sock, uring_handler cb, void *data);
+
+/** Same as uring_recv() but for descriptors that are not sockets, like pipes */
+Uring_op uring_read(Uring u, int fd, uring_handler cb, void *data);
+
+/** Stop a receive. The handler is called a last time with -ECANCELED */
+void uring_cancel(Uring u, Uring_op op);
+
+/**
+ * Send the buffers in order, one linked submission each. The buffers must remain valid until the handler is called.
+ * The handler is called once, with the amount of bytes sent. A short send breaks the chain, so in that case
+ * the bytes reported are all from the start of iov
+ *
+ * @returns  false if the batch couldn't be queued. The handler won't be called
+ */
+bool uring_sendv(Uring u, int sock, const struct iovec *iov, int iovcnt, uring_handler cb, void *data);
+
+#endif
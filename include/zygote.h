@@ -0,0 +1,52 @@
+#ifndef ZYGOTE_H
+#define ZYGOTE_H
+
+/**
+ * @file zygote.h
+ * Spawn server for external programs. A small helper is forked at startup, before the bot grows or starts threads,
+ * and launches the programs with vfork() on the bot's behalf. Requests go over a Unix socket with the argv in the
+ * message and the output descriptor passed with SCM_RIGHTS, so spawning doesn't depend on the bot's size. The helper
+ * reports the exit status of its children but only reaps them once zygote_wait() is done, so until then the pid and
+ * process group can be signalled without hitting a reused one. Without the helper, programs are spawned from the bot
+ * itself. Programs get a process group of their own, default signal handling and optionally resource limits, set
+ * before exec. All functions are thread safe
+ */
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#define ZYGOTE_MSGLEN      4096 //!< Max bytes of a request's arguments, including the null terminators
+#define ZYGOTE_MAXARGS     32
+#define ZYGOTE_MAXCHILDREN 64   //!< Programs the helper runs at the same time
+
+/** RLIM_INFINITY for no limit */
+struct spawn_limits {
+	rlim_t cpu;    //!< Seconds of CPU time, after which the program gets SIGXCPU and a second later SIGKILL
+	rlim_t memory; //!< Bytes of address space
+};
+
+/** Fork the helper. Must be called before any thread is created. Programs get the environment as it is at this point,
+ *  so it must be set up first. The TLS sessions an upgrade exported are dropped from it
+ *  @returns  false on failure, in which case programs are spawned locally */
+bool zygote_start(void);
+
+/** Ask the helper to exit. Programs still running are left alone */
+void zygote_stop(void);
+
+/**
+ * Start a program with its stdout on out_fd
+ *
+ * @param argv       Program name first & NULL last. The PATH is searched like execvp() does
+ * @param in_fd      Becomes its stdin or -1 to keep ours
+ * @param limits     Resource limits or NULL for none
+ * @param status_fd  Set to where zygote_wait() reads the exit status from, or -1 if the program runs as our child
+ * @returns          The program's pid, which is also its process group, or -1 on failure
+ */
+pid_t zygote_spawn(char *argv[], int in_fd, int out_fd, const struct spawn_limits *limits, int *status_fd);
+
+/** Wait for a program started by zygote_spawn() to exit
+ *  @returns  Its status, as returned by waitpid(), or -1 on error */
+int zygote_wait(pid_t pid, int status_fd);
+
+#endif
@@ -1,17 +1,27 @@
 #!/usr/bin/env python3
 import sys
 import json
+import time
+import traceback
 import urllib.request
 
+COUNTRIES_TTL = 24 * 60 * 60
+countries_cache = {'countries': None, 'fetched': 0}
+
 def get_json(url):
     try: return json.loads(urllib.request.urlopen(url, timeout=12).read().decode('utf-8'))
     except urllib.error.HTTPError: return None
     else: return 'Request has timed out.'
 
-def population(query):
-    countries = get_json('http://api.population.io/1.0/countries')['countries']
+def countries():
+    # Served processes live long, so the list is fetched once a day instead of on every request
+    if countries_cache['countries'] is None or time.time() - countries_cache['fetched'] > COUNTRIES_TTL:
+        countries_cache['countries'] = get_json('http://api.population.io/1.0/countries')['countries']
+        countries_cache['fetched'] = time.time()
+    return countries_cache['countries']
 
-    for country in countries:
+def population(query):
+    for country in countries():
         if query.lower() == country.lower():
             query = country.replace(' ', '%20')
             break
@@ -19,8 +29,8 @@ def population(query):
     url = 'http://api.population.io/1.0/population/2016/{}/'.format(query)
     res = get_json(url)
 
-    if res is None: return print('Invalid country. Refer to http://api.population.io/1.0/countries for a list of all countries available.')
-    elif isinstance(res, str) is True: return print(res)
+    if res is None: return ['Invalid country. Refer to http://api.population.io/1.0/countries for a list of all countries available.']
+    elif isinstance(res, str) is True: return [res]
 
     total   = 0
     males   = 0
@@ -31,37 +41,58 @@ def population(query):
         males   += entry['males']
         females += entry['females']
 
-    print('Total population ({}, 2016): {:,} | Males: {:,} ({}%) | Females: {:,} ({}%)'.format(
+    return ['Total population ({}, 2016): {:,} | Males: {:,} ({}%) | Females: {:,} ({}%)'.format(
         query.replace('%20', ' '), total,
         males, round((males * 100)/total, 2),
         females, round((females * 100)/total, 2)
-    ))
+    )]
 
 def weather(api_key, query):
     query = query.replace(' ', '%20')
     url = 'http://api.wunderground.com/api/{}/conditions/q/{}.json'.format(api_key, query)
     res = get_json(url)
 
-    if isinstance(res, str) is True: return print(res)
+    if isinstance(res, str) is True: return [res]
     if 'response' in res:
         ptr = res['response']
-        if 'results' in ptr: return print('Found {} results, please be more specific (i.e. "city country").'.format(len(ptr['results'])))
-        if 'error' in ptr: return print(ptr['error']['description'] + '.')
+        if 'results' in ptr: return ['Found {} results, please be more specific (i.e. "city country").'.format(len(ptr['results']))]
+        if 'error' in ptr: return [ptr['error']['description'] + '.']
 
     result = res['current_observation']
-    print('Weather ({}): {} | Humidity: {} | Wind: {}\nLast updated on {}.'.format(
+    return ['Weather ({}): {} | Humidity: {} | Wind: {}'.format(
         result['display_location']['full'], result['temperature_string'],
         result['relative_humidity'],
-        result['wind_string'],
-        result['observation_time_rfc822']
-    ))
+        result['wind_string']
+    ), 'Last updated on {}.'.format(result['observation_time_rfc822'])]
+
+def handle(request):
+    if request.get('cmd') == 'ping': return []
+    if request.get('cmd') == 'weather': return weather('847c514d3a158eb4', request['arg'])
+    if request.get('cmd') == 'population': return population(request['arg'])
+    raise ValueError('Unknown command')
+
+def serve():
+    # One JSON request per line on stdin, one reply per line on stdout. See include/coproc.h
+    while True:
+        line = sys.stdin.readline()
+        if not line: break
+
+        # Exceptions can carry URLs with the API key, so the details only go to the log
+        try: reply = {'lines': handle(json.loads(line))}
+        except Exception:
+            traceback.print_exc(file=sys.stderr)
+            reply = {'error': 'Request failed.'}
+        sys.stdout.write(json.dumps(reply) + '\n')
+        sys.stdout.flush()
 
 
 if __name__ == '__main__':
-    if len(sys.argv) == 3:
+    if len(sys.argv) == 2 and sys.argv[1] == '--serve':
+        serve()
+    elif len(sys.argv) == 3:
         if sys.argv[1] == '-w':
-            weather('847c514d3a158eb4', sys.argv[2])
+            print('\n'.join(weather('847c514d3a158eb4', sys.argv[2])))
         elif sys.argv[1] == '-p':
-            population(sys.argv[2])
+            print('\n'.join(population(sys.argv[2])))
     else:
         print('No query was given.')
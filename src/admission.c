@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "admission.h"
+#include "common.h"
+
+struct admission {
+	pthread_mutex_t mtx;
+	int max_inflight;
+	size_t max_depth;
+	long max_latency;
+	int inflight;
+	double latency;
+	size_t admitted, shed;
+};
+
+Admission admission_init(int max_inflight, size_t max_depth, long max_latency_ms) {
+
+	Admission a;
+
+	if (max_inflight < 1 || max_latency_ms < 1)
+		return NULL;
+
+	a = calloc_w(sizeof(*a));
+	pthread_mutex_init(&a->mtx, NULL);
+	a->max_inflight = max_inflight;
+	a->max_depth    = max_depth;
+	a->max_latency  = max_latency_ms;
+	return a;
+}
+
+enum admission_verdict admission_enter(Admission a, size_t depth) {
+
+	enum admission_verdict verdict = ADMIT;
+
+	pthread_mutex_lock(&a->mtx);
+	if (a->inflight >= a->max_inflight)
+		verdict = SHED_INFLIGHT;
+	else if (depth > a->max_depth)
+		verdict = SHED_QUEUE;
+	else if (a->inflight && a->latency > a->max_latency)
+		verdict = SHED_LATENCY;
+
+	if (verdict == ADMIT) {
+		a->inflight++;
+		a->admitted++;
+	} else
+		a->shed++;
+
+	pthread_mutex_unlock(&a->mtx);
+	return verdict;
+}
+
+void admission_exit(Admission a, long latency_ms) {
+
+	pthread_mutex_lock(&a->mtx);
+	a->inflight--;
+	if (latency_ms >= 0)
+		a->latency += ADMISSION_WEIGHT * (latency_ms - a->latency);
+
+	pthread_mutex_unlock(&a->mtx);
+}
+
+void admission_stats(Admission a, struct admission_stats *stats) {
+
+	pthread_mutex_lock(&a->mtx);
+	stats->inflight   = a->inflight;
+	stats->admitted   = a->admitted;
+	stats->shed       = a->shed;
+	stats->latency_ms = a->latency;
+	pthread_mutex_unlock(&a->mtx);
+}
+
+void admission_destroy(Admission a) {
+
+	if (!a)
+		return;
+
+	pthread_mutex_destroy(&a->mtx);
+	free(a);
+}
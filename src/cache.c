@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include "cache.h"
+#include "common.h"
+
+struct entry {
+	struct entry *chain;      //!< Next in the same bucket
+	struct entry *newer, *older;
+	uint32_t hash;
+	long long expires;        //!< Monotonic milliseconds
+	size_t size;              //!< What it counts against the bound
+	size_t len;
+	char *value;              //!< Right after the key
+	char key[];
+};
+
+struct shard {
+	pthread_mutex_t mtx;
+	struct entry *buckets[CACHE_BUCKETS];
+	struct entry *newest, *oldest;
+	size_t bytes, entries;
+	size_t hits, misses, evictions;
+};
+
+struct cache {
+	size_t shard_bytes;
+	struct shard shards[CACHE_SHARDS];
+};
+
+/** FNV-1a. The low bits pick the bucket, the high ones the shard */
+static uint32_t hash_key(const char *key) {
+
+	uint32_t hash = 2166136261u;
+
+	while (*key) {
+		hash ^= (unsigned char) *key++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static long long now_ms(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * MILLISECS + ts.tv_nsec / (NANOSECS / MILLISECS);
+}
+
+static struct shard *shard_of(Cache cache, uint32_t hash) {
+
+	return &cache->shards[(hash >> 24) % CACHE_SHARDS];
+}
+
+static void lru_unlink(struct shard *s, struct entry *e) {
+
+	if (e->newer)
+		e->newer->older = e->older;
+	else
+		s->newest = e->older;
+
+	if (e->older)
+		e->older->newer = e->newer;
+	else
+		s->oldest = e->newer;
+}
+
+static void lru_push(struct shard *s, struct entry *e) {
+
+	e->newer = NULL;
+	e->older = s->newest;
+	if (s->newest)
+		s->newest->newer = e;
+	else
+		s->oldest = e;
+
+	s->newest = e;
+}
+
+static struct entry **find(struct shard *s, const char *key, uint32_t hash) {
+
+	struct entry **e = &s->buckets[hash % CACHE_BUCKETS];
+
+	while (*e && ((*e)->hash != hash || strcmp((*e)->key, key)))
+		e = &(*e)->chain;
+
+	return e;
+}
+
+/** Unlink the entry that link points to and free it */
+static void drop(struct shard *s, struct entry **link) {
+
+	struct entry *e = *link;
+
+	*link = e->chain;
+	lru_unlink(s, e);
+	s->bytes -= e->size;
+	s->entries--;
+	free(e);
+}
+
+Cache cache_init(size_t max_bytes) {
+
+	Cache cache;
+
+	if (!max_bytes)
+		return NULL;
+
+	cache = calloc_w(sizeof(*cache));
+	cache->shard_bytes = MAX(max_bytes / CACHE_SHARDS, 1);
+	for (int i = 0; i < CACHE_SHARDS; i++)
+		pthread_mutex_init(&cache->shards[i].mtx, NULL);
+
+	return cache;
+}
+
+bool cache_put(Cache cache, const char *key, const void *value, size_t len, long ttl_ms) {
+
+	struct entry *e, **link;
+	uint32_t hash = hash_key(key);
+	struct shard *s = shard_of(cache, hash);
+	size_t keylen = strlen(key) + 1;
+	size_t size = sizeof(*e) + keylen + len;
+
+	if (size > cache->shard_bytes)
+		return false;
+
+	e = malloc_w(size);
+	e->hash    = hash;
+	e->expires = now_ms() + ttl_ms;
+	e->size    = size;
+	e->len     = len;
+	e->value   = e->key + keylen;
+	memcpy(e->key, key, keylen);
+	memcpy(e->value, value, len);
+
+	pthread_mutex_lock(&s->mtx);
+	link = find(s, key, hash);
+	if (*link)
+		drop(s, link);
+
+	// Oldest first. The entry being evicted might be in any bucket, so look its link up again
+	while (s->bytes + size > cache->shard_bytes) {
+		drop(s, find(s, s->oldest->key, s->oldest->hash));
+		s->evictions++;
+	}
+	e->chain = s->buckets[hash % CACHE_BUCKETS];
+	s->buckets[hash % CACHE_BUCKETS] = e;
+	lru_push(s, e);
+	s->bytes += size;
+	s->entries++;
+	pthread_mutex_unlock(&s->mtx);
+	return true;
+}
+
+void *cache_get(Cache cache, const char *key, size_t *len) {
+
+	struct entry **link;
+	void *value = NULL;
+	uint32_t hash = hash_key(key);
+	struct shard *s = shard_of(cache, hash);
+
+	pthread_mutex_lock(&s->mtx);
+	link = find(s, key, hash);
+	if (*link && (*link)->expires <= now_ms())
+		drop(s, link);
+
+	if (!*link) {
+		s->misses++;
+		goto cleanup;
+	}
+	s->hits++;
+	lru_unlink(s, *link);
+	lru_push(s, *link);
+
+	// Copied under the lock, since another thread may replace the entry as soon as it's released
+	*len  = (*link)->len;
+	value = malloc_w(MAX(*len, 1));
+	memcpy(value, (*link)->value, *len);
+
+cleanup:
+	pthread_mutex_unlock(&s->mtx);
+	return value;
+}
+
+void cache_stats(Cache cache, struct cache_stats *stats) {
+
+	memset(stats, 0, sizeof(*stats));
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		struct shard *s = &cache->shards[i];
+
+		pthread_mutex_lock(&s->mtx);
+		stats->hits      += s->hits;
+		stats->misses    += s->misses;
+		stats->evictions += s->evictions;
+		stats->entries   += s->entries;
+		stats->bytes     += s->bytes;
+		pthread_mutex_unlock(&s->mtx);
+	}
+}
+
+void cache_destroy(Cache cache) {
+
+	struct entry *e, *next;
+
+	if (!cache)
+		return;
+
+	for (int i = 0; i < CACHE_SHARDS; i++) {
+		for (e = cache->shards[i].oldest; e; e = next) {
+			next = e->newer;
+			free(e);
+		}
+		pthread_mutex_destroy(&cache->shards[i].mtx);
+	}
+	free(cache);
+}
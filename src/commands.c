@@ -3,22 +3,25 @@
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
-#include <poll.h>
-#include <pthread.h>
+#include <fcntl.h>
 #include <sqlite3.h>
 #include <yajl/yajl_tree.h>
 #include "init.h"
 #include "commands.h"
 #include "irc.h"
+#include "tls.h"
 #include "curl.h"
 #include "murmur.h"
 #include "twitter.h"
 #include "database.h"
+#include "coro.h"
 #include "common.h"
 
 extern char *program_name_arg;
 extern char *config_file_arg;
-extern struct pollfd pfd[TOTAL];
+extern int fds[TOTAL];
+
+static Coproc script_workers;
 
 void bot_help(Irc server, struct parsed_data pdata) {
 
@@ -29,7 +32,14 @@ void bot_help(Irc server, struct parsed_data pdata) {
 
 static void deploy(char *operation) {
 
-	char fd_args[] = {pfd[IRC].fd, pfd[MURM_LISTEN].fd, pfd[MURM_ACCEPT].fd};
+	char fd_args[] = {fds[IRC], fds[MURM_LISTEN], fds[MURM_ACCEPT]};
+
+	// Sockets are closed on exec, except for the ones handed over
+	for (int i = 0; i < TOTAL; i++)
+		if (fds[i] >= 0)
+			fcntl(fds[i], F_SETFD, 0);
+
+	tls_export_sessions();
 	execv(program_name_arg, CMD(program_name_arg, operation, "-f", fd_args, config_file_arg));
 	perror(__func__);
 }
@@ -152,13 +162,24 @@ void bot_fail_modify(Irc server, struct parsed_data pdata) {
 	}
 }
 
+struct shortening {
+	char *long_url;
+	char *short_url;
+};
+
+static void shorten(void *arg) {
+
+	struct shortening *s = arg;
+
+	s->short_url = shorten_url(s->long_url);
+}
+
 void bot_url(Irc server, struct parsed_data pdata) {
 
 	int argc;
 	char **argv;
-	pthread_t id;
-	bool thread_active = false;
-	char *short_url = NULL;
+	Coro shortener = NULL;
+	struct shortening s = {NULL, NULL};
 	char *url_title = NULL;
 
 	argc = extract_params(pdata.message, &argv);
@@ -169,19 +190,23 @@ void bot_url(Irc server, struct parsed_data pdata) {
 	if (!strchr(argv[0], '.'))
 		goto cleanup;
 
-	if (!pthread_create(&id, NULL, shorten_url, argv[0]))
-		thread_active = true;
+	// Both requests are in flight at the same time when running on a coroutine
+	s.long_url = argv[0];
+	if (coro_self())
+		shortener = coro_spawn(shorten, &s);
+	if (!shortener)
+		shorten(&s);
 
 	url_title = get_url_title(argv[0]);
-	if (thread_active)
-		pthread_join(id, (void *) &short_url);
+	if (shortener)
+		coro_join(shortener);
 
 	// Only print short_url / title if they are not empty (some stdlibs like glibc will print (NULL) but we can't depend on that)
-	send_message(server, pdata.target, "%s -- %s", (short_url ? short_url : ""), (url_title ? url_title : ""));
+	send_message(server, pdata.target, "%s -- %s", (s.short_url ? s.short_url : ""), (url_title ? url_title : ""));
 
 cleanup:
 	free(url_title);
-	free(short_url);
+	free(s.short_url);
 	free(argv);
 }
 
@@ -314,16 +339,13 @@ void bot_uptime(Irc server, struct parsed_data pdata) {
 
 void bot_roll(Irc server, struct parsed_data pdata) {
 
-	char **argv;
-	int argc, r, def_roll = DEFAULT_ROLL;
+	int r, def_roll = DEFAULT_ROLL;
 
-	argc = extract_params(pdata.message, &argv);
-	if (argc >= 1) {
-		def_roll = get_int(argv[0], MAXROLL);
+	// Inline commands must not allocate. strtol() skips the leading blanks & stops at the end of the first parameter
+	if (pdata.message) {
+		def_roll = get_int(pdata.message, MAXROLL);
 		if (def_roll == 1)
 			def_roll = DEFAULT_ROLL;
-
-		free(argv);
 	}
 	r = random() % def_roll + 1;
 	send_message(server, pdata.target, "%s rolls %d", pdata.sender, r);
@@ -375,11 +397,33 @@ void bot_fit(Irc server, struct parsed_data pdata) {
 
 STATIC void weather_and_population(Irc server, struct parsed_data pdata, char *type) {
 
+	const char *cmd = !strcmp(type, "-w") ? "weather" : "population";
+	yajl_val reply, error, lines;
+
 	pdata.message = trim_whitespace(pdata.message);
 	if (!pdata.message)
 		return;
 
-	print_cmd_output(server, pdata.target, CMD(SCRIPTDIR "weather_and_population.py", type, pdata.message));
+	reply = script_workers ? coproc_call(script_workers, cmd, pdata.message, SCRIPT_TIMEOUT) : NULL;
+	if (!reply) {
+		print_cmd_output(server, pdata.target, CMD(SCRIPTDIR "weather_and_population.py", type, pdata.message));
+		return;
+	}
+	error = yajl_tree_get(reply, CFG("error"), yajl_t_string);
+	lines = yajl_tree_get(reply, CFG("lines"), yajl_t_array);
+	if (error)
+		send_message(server, pdata.target, "%s", YAJL_GET_STRING(error));
+	else if (lines)
+		for (size_t i = 0; i < YAJL_GET_ARRAY(lines)->len && i < CMD_MAXLINES; i++)
+			if (YAJL_IS_STRING(YAJL_GET_ARRAY(lines)->values[i]))
+				send_message(server, pdata.target, "%s", YAJL_GET_STRING(YAJL_GET_ARRAY(lines)->values[i]));
+
+	yajl_tree_free(reply);
+}
+
+void set_script_workers(Coproc cp) {
+
+	script_workers = cp;
 }
 
 void bot_weather(Irc server, struct parsed_data pdata) {
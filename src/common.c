@@ -6,10 +6,18 @@
 #include <string.h>
 #include <stdarg.h>
 #include <assert.h>
+#include <signal.h>
+#include <errno.h>
 #include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <limits.h>
+#include <fcntl.h>
 #include "socket.h"
 #include "irc.h"
 #include "common.h"
+#include "deadline.h"
+#include "zygote.h"
 
 #define ALLOC_ERROR(function, file, line) exit_msg("Failed to allocate memory in %s() %s:%d", function, file, line);
 
@@ -46,6 +54,35 @@ bool starts_case_with(const char *s1, const char *s2) {
 	return strncasecmp(s1, s2, strlen(s2)) == 0;
 }
 
+bool span_case_eq(struct span s, const char *str) {
+
+	return strlen(str) == s.len && !strncasecmp(s.ptr, str, s.len);
+}
+
+bool span_starts_with(struct span s, const char *str) {
+
+	size_t len = strlen(str);
+
+	return len <= s.len && !memcmp(s.ptr, str, len);
+}
+
+bool span_starts_case_with(struct span s, const char *str) {
+
+	size_t len = strlen(str);
+
+	return len <= s.len && !strncasecmp(s.ptr, str, len);
+}
+
+char *span_copy(char *buf, size_t size, struct span s) {
+
+	size_t len = MIN(s.len, size - 1);
+
+	assert(size);
+	memcpy(buf, s.ptr, len);
+	buf[len] = '\0';
+	return buf;
+}
+
 void *_malloc_w(size_t size, const char *caller, const char *file, int line) {
 
 	void *buffer;
@@ -172,56 +209,142 @@ void send_all_lines(Irc server, const char *target, FILE *stream) {
 	}
 }
 
-int print_cmd_output(Irc server, const char *target, char *cmd_args[]) {
+/** Output of a program that print_cmd_output() forwards */
+struct cmd_output {
+	Irc server;
+	const char *target;
+	char buf[LINELEN];
+	size_t len;     //!< Of the partial line at the start of buf
+	int lines;
+	size_t bytes;
+	bool truncated; //!< Past CMD_MAXLINES or CMD_MAXBYTES, the rest is dropped
+};
+
+static void send_output_line(struct cmd_output *out, const char *line, size_t len) {
+
+	if (len <= 1 || out->truncated) // Only print if line is not empty. Nothing after the cut, so there are no gaps
+		return;
+
+	if (out->lines >= CMD_MAXLINES || out->bytes + len > CMD_MAXBYTES) {
+		out->truncated = true;
+		return;
+	}
+	out->lines++;
+	out->bytes += len;
+	send_message(out->server, out->target, "%s", line);
+}
 
-	FILE *prog;
-	int status, fd[RDWR];
+/** Send the complete lines that are available. A full buffer without a newline is sent as is
+ *  @returns  false on EOF or error */
+static bool read_output(int fd, struct cmd_output *out) {
 
-	if (pipe(fd)) {
-		perror("pipe");
-		return EXIT_FAILURE;
-	}
-	switch (fork()) {
-	case -1:
-		perror("fork");
-		return EXIT_FAILURE;
-	case 0:
-		close(fd[RD]); // Close reading end of the socket
+	char *line, *newline;
+	ssize_t n;
 
-		// Re-open stdout to point to the writing end of our socket
-		if (dup2(fd[WR], STDOUT_FILENO) != STDOUT_FILENO) {
-			perror("dup2");
-			return EXIT_FAILURE;
-		}
-		close(fd[WR]); // We don't need this anymore
-		execvp(cmd_args[0], cmd_args);
+	do
+		n = read(fd, out->buf + out->len, sizeof(out->buf) - 1 - out->len);
+	while (n < 0 && errno == EINTR);
 
-		perror("exec failed"); // Exec functions return only on error
-		_exit(EXIT_FAILURE);
+	if (n <= 0)
+		return false;
+
+	out->len += n;
+	for (line = out->buf; (newline = memchr(line, '\n', out->buf + out->len - line)); line = newline + 1) {
+		*newline = '\0';
+		send_output_line(out, line, newline - line);
 	}
-	close(fd[WR]); // Close writing end
+	out->len -= line - out->buf;
+	memmove(out->buf, line, out->len);
+	if (out->len == sizeof(out->buf) - 1) {
+		out->buf[out->len] = '\0';
+		send_output_line(out, out->buf, out->len);
+		out->len = 0;
+	}
+	return true;
+}
 
-	// Open socket as FILE stream since we need to print in lines anyway
-	prog = fdopen(fd[RD], "r");
-	if (!prog)
-		return EXIT_FAILURE;
+/** SIGTERM the program & whatever it started. If they don't close the output within CMD_TERM_WAIT, SIGKILL them.
+ *  Nobody reaps the program before zygote_wait(), so its process group can't have been reused yet */
+static void terminate(pid_t pid, int fd, struct cmd_output *out) {
+
+	struct deadline grace, *saved = deadline_current();
+	bool eof = false;
 
-	send_all_lines(server, target, prog);
+	kill(-pid, SIGTERM);
+	deadline_start(&grace, CMD_TERM_WAIT); // The command's own deadline may have passed already
+	while (!eof && deadline_wait_fd(fd, EPOLLIN, LONG_MAX))
+		eof = !read_output(fd, out);
 
-	fclose(prog);
-	wait(&status); // Don't leave zombie
-	return WEXITSTATUS(status);
+	deadline_set(saved);
+	if (!eof)
+		kill(-pid, SIGKILL);
 }
 
-int print_cmd_output_unsafe(Irc server, const char *target, const char *cmd) {
+/** Wait for the program to exit. Closing its output doesn't mean it's done, so it's stopped like terminate() does
+ *  if the command's deadline passes first
+ *  @returns  Its status like zygote_wait() */
+static int reap(pid_t pid, int status_fd, const char *name) {
+
+	struct deadline grace, *saved;
+	int fd = status_fd >= 0 ? status_fd : syscall(SYS_pidfd_open, pid, 0); // Readable once it exits
+
+	if (fd >= 0 && !deadline_wait_fd(fd, EPOLLIN, LONG_MAX)) {
+		fprintf(stderr, "%s: Stopping %s, out of time after closing its output\n", __func__, name);
+		kill(-pid, SIGTERM);
+		saved = deadline_current();
+		deadline_start(&grace, CMD_TERM_WAIT);
+		if (!deadline_wait_fd(fd, EPOLLIN, LONG_MAX))
+			kill(-pid, SIGKILL);
+		deadline_set(saved);
+	}
+	if (fd >= 0 && fd != status_fd)
+		close(fd);
+
+	return zygote_wait(pid, status_fd);
+}
+
+int print_cmd_output(Irc server, const char *target, char *cmd_args[]) {
+
+	struct spawn_limits limits = {CMD_MAXCPU, CMD_MAXMEMORY};
+	struct cmd_output out = {.server = server, .target = target};
+	bool eof = false;
+	pid_t pid;
+	int status, status_fd, fd[RDWR];
 
-	// Open the program with arguments specified
-	FILE *prog = popen(cmd, "r");
-	if (!prog)
+	// Close on exec, so that programs other threads start don't keep the pipe open
+	if (pipe2(fd, O_CLOEXEC)) {
+		perror("pipe2");
+		return EXIT_FAILURE;
+	}
+	// The program gets a process group of its own, so that whatever it starts is stopped along with it
+	pid = zygote_spawn(cmd_args, -1, fd[WR], &limits, &status_fd);
+	close(fd[WR]); // Close writing end
+	if (pid < 0) {
+		close(fd[RD]);
 		return EXIT_FAILURE;
+	}
+	// Lines are queued as they arrive, until the program exits, prints too much or the command's deadline passes
+	while (!eof && !out.truncated && deadline_wait_fd(fd[RD], EPOLLIN, LONG_MAX))
+		eof = !read_output(fd[RD], &out);
+
+	if (!eof) {
+		fprintf(stderr, "%s: Stopping %s, %s\n", __func__, cmd_args[0], out.truncated ? "too much output" : "out of time");
+		terminate(pid, fd[RD], &out);
+	}
+	close(fd[RD]);
+	out.buf[out.len] = '\0';
+	send_output_line(&out, out.buf, out.len);
+	if (out.truncated)
+		send_message(server, target, "%s", "[output truncated]");
+
+	status = reap(pid, status_fd, cmd_args[0]); // Don't leave zombie
+	return status >= 0 && WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+}
+
+int print_cmd_output_unsafe(Irc server, const char *target, const char *cmd) {
 
-	send_all_lines(server, target, prog);
-	return WEXITSTATUS(pclose(prog));
+	// Not popen(), so that the shell is spawned like any other program
+	return print_cmd_output(server, target, CMD("/bin/sh", "-c", (char *) cmd));
 }
 
 char *iso8859_7_to_utf8(const char *iso) {
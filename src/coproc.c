@@ -0,0 +1,336 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "coproc.h"
+#include "deadline.h"
+#include "socket.h"
+#include "common.h"
+
+/** Owned by the caller that marked it busy, so only the busy flag needs the lock */
+struct worker {
+	pid_t pid;      //!< 0 while not running
+	int fd;         //!< Its stdin & stdout
+	int status_fd;
+	bool busy;
+	unsigned requests;
+	long last_used; //!< Monotonic milliseconds
+	long retry_at;  //!< Not started again before this
+	size_t len;     //!< Bytes in buf
+	char buf[COPROC_LINELEN];
+};
+
+struct coproc {
+	pthread_mutex_t mtx;
+	pthread_cond_t idle;
+	char **argv;
+	struct spawn_limits limits;
+	bool limited;
+	int count;
+	struct worker *workers;
+};
+
+static long now_ms(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * MILLISECS + ts.tv_nsec / (NANOSECS / MILLISECS);
+}
+
+/** Format a request line, escaping the strings as JSON requires
+ *  @returns  false if it doesn't fit in size */
+STATIC bool coproc_request(char *buf, size_t size, const char *cmd, const char *arg) {
+
+	const char *keys[] = {"cmd", "arg"}, *values[] = {cmd, arg};
+	size_t len = 0;
+	int n;
+
+	for (int i = 0; i < 2; i++) {
+		if (!values[i])
+			continue;
+
+		n = snprintf(buf + len, size - len, "%s\"%s\": \"", i ? ", " : "{", keys[i]);
+		if (n < 0 || (size_t) n >= size - len)
+			return false;
+
+		len += n;
+		for (const unsigned char *c = (const unsigned char *) values[i]; *c; c++) {
+			if (*c == '"' || *c == '\\')
+				n = snprintf(buf + len, size - len, "\\%c", *c);
+			else if (*c < 0x20)
+				n = snprintf(buf + len, size - len, "\\u%04x", *c);
+			else
+				n = snprintf(buf + len, size - len, "%c", *c);
+
+			if ((size_t) n >= size - len)
+				return false;
+
+			len += n;
+		}
+		if (len + 1 >= size)
+			return false;
+
+		buf[len++] = '"';
+	}
+	n = snprintf(buf + len, size - len, "}\n");
+	return (size_t) n < size - len;
+}
+
+Coproc coproc_init(char *argv[], int workers, const struct spawn_limits *limits) {
+
+	Coproc cp;
+	pthread_condattr_t attr;
+	int argc = 0;
+
+	if (workers < 1 || !argv[0])
+		return NULL;
+
+	while (argv[argc])
+		argc++;
+
+	cp = calloc_w(sizeof(*cp));
+	cp->argv = calloc_w((argc + 1) * sizeof(*cp->argv));
+	for (int i = 0; i < argc; i++)
+		cp->argv[i] = strdup(argv[i]);
+
+	if (limits) {
+		cp->limits  = *limits;
+		cp->limited = true;
+	}
+	cp->count   = workers;
+	cp->workers = calloc_w(workers * sizeof(*cp->workers));
+
+	pthread_mutex_init(&cp->mtx, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cp->idle, &attr);
+	pthread_condattr_destroy(&attr);
+	return cp;
+}
+
+static struct worker *acquire(Coproc cp, long timeout_ms) {
+
+	struct worker *w = NULL;
+	struct timespec until;
+
+	clock_gettime(CLOCK_MONOTONIC, &until);
+	until.tv_sec  += timeout_ms / MILLISECS;
+	until.tv_nsec += timeout_ms % MILLISECS * (NANOSECS / MILLISECS);
+	if (until.tv_nsec >= NANOSECS) {
+		until.tv_sec++;
+		until.tv_nsec -= NANOSECS;
+	}
+	pthread_mutex_lock(&cp->mtx);
+	for (;;) {
+		for (int i = 0; i < cp->count && !w; i++)
+			if (!cp->workers[i].busy)
+				w = &cp->workers[i];
+
+		if (w || pthread_cond_timedwait(&cp->idle, &cp->mtx, &until) == ETIMEDOUT)
+			break;
+	}
+	if (w)
+		w->busy = true;
+
+	pthread_mutex_unlock(&cp->mtx);
+	return w;
+}
+
+static void release(Coproc cp, struct worker *w) {
+
+	pthread_mutex_lock(&cp->mtx);
+	w->busy = false;
+	w->last_used = now_ms();
+	pthread_cond_signal(&cp->idle);
+	pthread_mutex_unlock(&cp->mtx);
+}
+
+static bool start_worker(Coproc cp, struct worker *w) {
+
+	int sv[RDWR];
+	pid_t pid;
+
+	if (now_ms() < w->retry_at)
+		return false;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv)) {
+		perror("socketpair");
+		return false;
+	}
+	pid = zygote_spawn(cp->argv, sv[WR], sv[WR], cp->limited ? &cp->limits : NULL, &w->status_fd);
+	close(sv[WR]);
+	if (pid < 0) {
+		close(sv[RD]);
+		w->retry_at = now_ms() + COPROC_RESTART_DELAY;
+		return false;
+	}
+	w->pid       = pid;
+	w->fd        = sv[RD];
+	w->len       = 0;
+	w->requests  = 0;
+	w->last_used = now_ms();
+	return true;
+}
+
+/** Killed rather than asked to exit, since it might be stuck
+ *  @param failed  Delay the next start, so that a broken script isn't restarted in a loop */
+static void stop_worker(Coproc cp, struct worker *w, const char *reason, bool failed) {
+
+	if (!w->pid)
+		return;
+
+	if (reason)
+		fprintf(stderr, "%s: Stopping %s worker %d, %s\n", __func__, cp->argv[0], w->pid, reason);
+
+	kill(-w->pid, SIGKILL);
+	close(w->fd);
+	zygote_wait(w->pid, w->status_fd);
+	w->pid = 0;
+	if (failed)
+		w->retry_at = now_ms() + COPROC_RESTART_DELAY;
+}
+
+static bool send_all(int fd, const char *buf, size_t len) {
+
+	ssize_t n;
+
+	while (len) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return false;
+
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+/** @returns  The next line without the newline, which must be freed, or NULL on timeout, EOF or a line too long */
+static char *read_reply(struct worker *w, long timeout_ms) {
+
+	long until = now_ms() + timeout_ms;
+	char *newline, *line;
+	size_t len;
+	ssize_t n;
+
+	while (!(newline = memchr(w->buf, '\n', w->len))) {
+		if (w->len == sizeof(w->buf) || !deadline_wait_fd(w->fd, EPOLLIN, until - now_ms()))
+			return NULL;
+
+		n = read(w->fd, w->buf + w->len, sizeof(w->buf) - w->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return NULL;
+
+		w->len += n;
+	}
+	len  = newline - w->buf;
+	line = malloc_w(len + 1);
+	memcpy(line, w->buf, len);
+	line[len] = '\0';
+
+	w->len -= len + 1;
+	memmove(w->buf, newline + 1, w->len);
+	return line;
+}
+
+static yajl_val exchange(struct worker *w, const char *request, long timeout_ms) {
+
+	yajl_val reply;
+	char *line, errbuf[128];
+
+	if (!send_all(w->fd, request, strlen(request)))
+		return NULL;
+
+	line = read_reply(w, timeout_ms);
+	if (!line)
+		return NULL;
+
+	reply = yajl_tree_parse(line, errbuf, sizeof(errbuf));
+	free(line);
+	return reply;
+}
+
+static bool healthy(struct worker *w) {
+
+	struct pollfd pfd = {.fd = w->fd, .events = POLLIN};
+	yajl_val reply;
+	bool ok;
+
+	// Nothing is expected while idle, so anything to read is either EOF or garbage
+	if (poll(&pfd, 1, 0))
+		return false;
+
+	if (now_ms() - w->last_used < COPROC_PING_IDLE * MILLISECS)
+		return true;
+
+	reply = exchange(w, "{\"cmd\": \"ping\"}\n", COPROC_PING_TIMEOUT);
+	ok = reply && !yajl_tree_get(reply, CFG("error"), yajl_t_any);
+	yajl_tree_free(reply);
+	return ok;
+}
+
+yajl_val coproc_call(Coproc cp, const char *cmd, const char *arg, long timeout_ms) {
+
+	struct worker *w;
+	yajl_val reply = NULL;
+	char request[COPROC_LINELEN];
+	long until;
+
+	if (!coproc_request(request, sizeof(request), cmd, arg)) {
+		fprintf(stderr, "%s: Request for %s is too long\n", __func__, cmd);
+		return NULL;
+	}
+	timeout_ms = deadline_clamp(timeout_ms);
+	until = now_ms() + timeout_ms;
+	w = acquire(cp, timeout_ms);
+	if (!w) {
+		fprintf(stderr, "%s: All %d %s workers are busy\n", __func__, cp->count, cp->argv[0]);
+		return NULL;
+	}
+	// A worker that died while idle is started again right away
+	if (w->pid && !healthy(w))
+		stop_worker(cp, w, "failed its health check", false);
+
+	if ((!w->pid && !start_worker(cp, w)) || until <= now_ms())
+		goto cleanup;
+
+	reply = exchange(w, request, until - now_ms());
+	if (!reply)
+		stop_worker(cp, w, "no valid reply", true);
+	else if (++w->requests >= COPROC_MAXREQUESTS)
+		stop_worker(cp, w, NULL, false);
+cleanup:
+	release(cp, w);
+	return reply;
+}
+
+void coproc_destroy(Coproc cp) {
+
+	if (!cp)
+		return;
+
+	for (int i = 0; i < cp->count; i++)
+		stop_worker(cp, &cp->workers[i], NULL, false);
+
+	for (char **arg = cp->argv; *arg; arg++)
+		free(*arg);
+
+	free(cp->argv);
+	free(cp->workers);
+	pthread_cond_destroy(&cp->idle);
+	pthread_mutex_destroy(&cp->mtx);
+	free(cp);
+}
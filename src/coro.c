@@ -0,0 +1,357 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <curl/curl.h>
+#include "coro.h"
+#include "common.h"
+
+struct coro {
+	ucontext_t ctx;
+	ucontext_t caller;  //!< Where to switch back to when the coroutine waits or returns
+	char *stack;        //!< The lowest page is the guard
+	coro_func func;
+	void *arg;
+	bool done;
+	bool joinable;
+	Coro joiner;        //!< Waiting in coro_join()
+	void *local[CORO_SLOTS]; //!< See coro_local()
+	Event fd_event;
+	Event timer;        //!< Created on first use and kept with the stack
+	bool timed_out;
+	CURLcode result;    //!< Of the last transfer
+	Coro next;          //!< Spare list
+};
+
+static Reactor reactor;
+static CURLM *multi;
+static Event multi_timer;
+static __thread Coro current; //!< Worker threads must never see the reactor's coroutine
+static Coro spare;
+static size_t spare_count, alive;
+static long page_size;
+
+static void trampoline(void) {
+
+	Coro c = current;
+
+	c->func(c->arg);
+	c->done = true;
+	setcontext(&c->caller);
+}
+
+static void destroy(Coro c) {
+
+	reactor_remove(reactor, c->timer);
+	munmap(c->stack, CORO_STACKSIZE);
+	free(c);
+}
+
+static Coro create(coro_func func, void *arg) {
+
+	Coro c;
+
+	if (alive == CORO_MAXCOROS)
+		return NULL;
+
+	if (spare) {
+		c = spare;
+		spare = c->next;
+		spare_count--;
+	} else {
+		c = calloc_w(sizeof(*c));
+		c->stack = mmap(NULL, CORO_STACKSIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK | MAP_NORESERVE, -1, 0);
+		if (c->stack == MAP_FAILED || mprotect(c->stack, page_size, PROT_NONE)) {
+			perror(__func__);
+			if (c->stack != MAP_FAILED)
+				munmap(c->stack, CORO_STACKSIZE);
+
+			free(c);
+			return NULL;
+		}
+	}
+	c->func     = func;
+	c->arg      = arg;
+	c->done     = false;
+	c->joinable = false;
+	c->joiner   = NULL;
+	memset(c->local, 0, sizeof(c->local));
+	getcontext(&c->ctx);
+	c->ctx.uc_stack.ss_sp   = c->stack + page_size;
+	c->ctx.uc_stack.ss_size = CORO_STACKSIZE - page_size;
+	c->ctx.uc_link = NULL;
+	makecontext(&c->ctx, trampoline, 0);
+	alive++;
+	return c;
+}
+
+/** Keep a few stacks around, so that bursts of commands don't mmap() each time */
+static void release(Coro c) {
+
+	alive--;
+	if (spare_count == CORO_MAXSPARE) {
+		destroy(c);
+		return;
+	}
+	c->next = spare;
+	spare = c;
+	spare_count++;
+}
+
+static void resume(Coro c) {
+
+	Coro joiner, previous = current;
+
+	current = c;
+	swapcontext(&c->caller, &c->ctx);
+	current = previous;
+	if (!c->done)
+		return;
+
+	joiner = c->joiner;
+	if (!c->joinable)
+		release(c);
+	if (joiner)
+		resume(joiner);
+}
+
+static void yield(void) {
+
+	swapcontext(&current->ctx, &current->caller);
+}
+
+static void wake(Reactor r, Event ev, uint32_t events, void *data) {
+
+	Coro c = data;
+
+	(void) r;
+	(void) events;
+
+	c->timed_out = ev == c->timer;
+	resume(c);
+}
+
+static bool arm_timer(Coro c, long ms) {
+
+	if (c->timer)
+		return timer_set(c->timer, ms, 0);
+
+	c->timer = reactor_add_timer(reactor, ms, 0, wake, c);
+	return c->timer;
+}
+
+/** Resume the coroutines whose transfers are done */
+static void check_transfers(void) {
+
+	int left;
+	Coro c;
+	CURLMsg *msg;
+
+	while ((msg = curl_multi_info_read(multi, &left))) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &c);
+		c->result = msg->data.result;
+		curl_multi_remove_handle(multi, msg->easy_handle);
+		resume(c);
+	}
+}
+
+static void socket_ready(Reactor r, Event ev, uint32_t events, void *data) {
+
+	int running, flags = 0;
+
+	(void) r;
+	(void) data;
+
+	if (events & EPOLLIN)
+		flags |= CURL_CSELECT_IN;
+	if (events & EPOLLOUT)
+		flags |= CURL_CSELECT_OUT;
+	if (events & (EPOLLERR | EPOLLHUP))
+		flags |= CURL_CSELECT_ERR;
+
+	curl_multi_socket_action(multi, event_fd(ev), flags, &running);
+	check_transfers();
+}
+
+static void multi_timeout(Reactor r, Event ev, uint32_t events, void *data) {
+
+	int running;
+
+	(void) r;
+	(void) ev;
+	(void) events;
+	(void) data;
+
+	curl_multi_socket_action(multi, CURL_SOCKET_TIMEOUT, 0, &running);
+	check_transfers();
+}
+
+/** Called by curl to tell us which of its sockets to watch */
+static int socket_cb(CURL *easy, curl_socket_t sock, int what, void *userp, void *sockp) {
+
+	Event ev = sockp;
+	uint32_t events = (what & CURL_POLL_IN ? EPOLLIN : 0) | (what & CURL_POLL_OUT ? EPOLLOUT : 0);
+
+	(void) easy;
+	(void) userp;
+
+	if (what == CURL_POLL_REMOVE) {
+		reactor_remove(reactor, ev);
+		return 0;
+	}
+	if (ev)
+		return event_modify(reactor, ev, events) ? 0 : -1;
+
+	ev = reactor_add_fd(reactor, sock, events, socket_ready, NULL);
+	if (!ev)
+		return -1;
+
+	curl_multi_assign(multi, sock, ev);
+	return 0;
+}
+
+/** Curl must not be called back from here, so a timeout of 0 fires on the next round instead */
+static int timer_cb(CURLM *m, long timeout_ms, void *userp) {
+
+	(void) m;
+	(void) userp;
+
+	return timer_set(multi_timer, timeout_ms < 0 ? 0 : MAX(timeout_ms, 1), 0) ? 0 : -1;
+}
+
+bool coro_init(Reactor r) {
+
+	reactor = r;
+	page_size = sysconf(_SC_PAGESIZE);
+	multi = curl_multi_init();
+	if (!multi)
+		return false;
+
+	multi_timer = reactor_add_timer(r, 0, 0, multi_timeout, NULL);
+	if (!multi_timer) {
+		curl_multi_cleanup(multi);
+		multi = NULL;
+		return false;
+	}
+	curl_multi_setopt(multi, CURLMOPT_SOCKETFUNCTION, socket_cb);
+	curl_multi_setopt(multi, CURLMOPT_TIMERFUNCTION, timer_cb);
+	return true;
+}
+
+void coro_cleanup(void) {
+
+	Coro c;
+
+	curl_multi_cleanup(multi);
+	reactor_remove(reactor, multi_timer);
+	multi = NULL;
+	multi_timer = NULL;
+	while (spare) {
+		c = spare;
+		spare = c->next;
+		destroy(c);
+	}
+	spare_count = 0;
+}
+
+bool coro_start(coro_func func, void *arg) {
+
+	Coro c = create(func, arg);
+
+	if (!c)
+		return false;
+
+	resume(c);
+	return true;
+}
+
+Coro coro_spawn(coro_func func, void *arg) {
+
+	Coro c = create(func, arg);
+
+	if (!c)
+		return NULL;
+
+	c->joinable = true;
+	resume(c);
+	return c;
+}
+
+void coro_join(Coro c) {
+
+	assert(current && c->joinable);
+	if (!c->done) {
+		c->joiner = current;
+		yield();
+	}
+	release(c);
+}
+
+Coro coro_self(void) {
+
+	return current;
+}
+
+void **coro_local(enum coro_slot slot) {
+
+	assert(current);
+	return &current->local[slot];
+}
+
+size_t coro_count(void) {
+
+	return alive;
+}
+
+bool coro_wait_fd(int fd, uint32_t events, long timeout_ms) {
+
+	Coro c = current;
+
+	assert(c && timeout_ms > 0);
+	c->fd_event = reactor_add_fd(reactor, fd, events, wake, c);
+	if (!c->fd_event)
+		return false;
+
+	if (!arm_timer(c, timeout_ms)) {
+		reactor_remove(reactor, c->fd_event);
+		return false;
+	}
+	yield();
+
+	// Whichever didn't fire might be pending in this round. Removing or disarming it makes the reactor skip it
+	reactor_remove(reactor, c->fd_event);
+	c->fd_event = NULL;
+	timer_set(c->timer, 0, 0);
+	return !c->timed_out;
+}
+
+void coro_sleep(long ms) {
+
+	assert(current);
+	if (arm_timer(current, MAX(ms, 1)))
+		yield();
+}
+
+CURLcode coro_perform(CURL *curl) {
+
+	CURLMcode code;
+
+	if (!current)
+		return curl_easy_perform(curl);
+
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, current);
+	code = curl_multi_add_handle(multi, curl);
+	if (code != CURLM_OK) {
+		fprintf(stderr, "%s: %s\n", __func__, curl_multi_strerror(code));
+		return CURLE_FAILED_INIT;
+	}
+	yield();
+	return current->result;
+}
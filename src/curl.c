@@ -9,6 +9,9 @@
 #include "init.h"
 #include "irc.h"
 #include "curl.h"
+#include "resolver.h"
+#include "coro.h"
+#include "deadline.h"
 #include "common.h"
 
 static pthread_mutex_t *openssl_mtx;
@@ -65,13 +68,85 @@ size_t curl_write_memory(char *data, size_t size, size_t elements, void *membuf)
 	return total_size;
 }
 
+/** Coroutines' transfers run from the reactor, so the deadline is passed along instead of looked up */
+static int deadline_progress(void *deadline, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+
+	(void) dltotal;
+	(void) dlnow;
+	(void) ultotal;
+	(void) ulnow;
+
+	return deadline_expired(deadline); // Non zero aborts the transfer
+}
+
+void curl_set_timeout(CURL *curl, long timeout_ms) {
+
+	struct deadline *deadline = deadline_current();
+
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, MAX(deadline_clamp(timeout_ms), 1L)); // 0 would mean no timeout
+	if (!deadline)
+		return;
+
+	curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, deadline_progress);
+	curl_easy_setopt(curl, CURLOPT_XFERINFODATA, deadline);
+	curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+}
+
+bool curl_set_url(CURL *curl, const char *url, struct curl_slist **hosts) {
+
+	CURLU *parts;
+	struct addrinfo *addr = NULL;
+	char *host = NULL, *port = NULL, entry[CURL_RESOLVELEN], ip[INET6_ADDRSTRLEN];
+	int len, n;
+	bool resolved = true;
+
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+
+	// Urls without a hostname (like file://) or literal IPv6 addresses are left to curl
+	parts = curl_url();
+	if (!parts || curl_url_set(parts, CURLUPART_URL, url, CURLU_GUESS_SCHEME)
+			|| curl_url_get(parts, CURLUPART_HOST, &host, 0) || curl_url_get(parts, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT)
+			|| *host == '[')
+		goto cleanup;
+
+	addr = resolve(host, port);
+	if (!addr) {
+		resolved = false;
+		goto cleanup;
+	}
+	// Format is "host:port:addr1,[addr2],..." with IPv6 addresses in brackets
+	len = snprintf(entry, sizeof(entry), "%s:%s:", host, port);
+	if (len >= (int) sizeof(entry))
+		goto cleanup;
+
+	for (struct addrinfo *iterator = addr; iterator; iterator = iterator->ai_next) {
+		if (getnameinfo(iterator->ai_addr, iterator->ai_addrlen, ip, sizeof(ip), NULL, 0, NI_NUMERICHOST))
+			continue;
+
+		n = snprintf(entry + len, sizeof(entry) - len, iterator->ai_family == AF_INET6 ? "%s[%s]" : "%s%s", entry[len - 1] == ':' ? "" : ",", ip);
+		if (n >= (int) sizeof(entry) - len)
+			break; // Keep the addresses that fit
+
+		len += n;
+	}
+	*hosts = curl_slist_append(*hosts, entry);
+	curl_easy_setopt(curl, CURLOPT_RESOLVE, *hosts);
+
+cleanup:
+	free(addr);
+	curl_free(host);
+	curl_free(port);
+	curl_url_cleanup(parts);
+	return resolved;
+}
+
 void *shorten_url(void *long_url_arg) {
 
 	CURL *curl;
 	CURLcode code;
 	char url_formatted[URLLEN], API_URL[URLLEN], *short_url = NULL;
 	struct mem_buffer mem = {NULL, 0};
-	struct curl_slist *headers = NULL;
+	struct curl_slist *headers = NULL, *hosts = NULL;
 	const char *long_url = long_url_arg;
 
 	if (!*cfg.google_shortener_api_key)
@@ -89,14 +164,16 @@ void *shorten_url(void *long_url_arg) {
 	snprintf(API_URL, URLLEN, "https://www.googleapis.com/urlshortener/v1/url?key=%s", cfg.google_shortener_api_key);
 
 #ifdef TEST
-	curl_easy_setopt(curl, CURLOPT_URL, getenv("IRCBOT_TESTFILE"));
+	if (!curl_set_url(curl, getenv("IRCBOT_TESTFILE"), &hosts))
 #else
-	curl_easy_setopt(curl, CURLOPT_URL, API_URL); // Set API url
+	if (!curl_set_url(curl, API_URL, &hosts)) // Set API url
 #endif
+		goto cleanup;
+
 	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, url_formatted); // Send the formatted POST
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L); // Allow redirects
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 3L); // Don't wait for too long
-	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // Required for use with threads. DNS queries will not honor timeout
+	curl_set_timeout(curl, 3 * MILLISECS); // Don't wait for too long
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L); // Required for use with threads. DNS is already resolved with a timeout
 	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers); // Use our modified header
 
 	// By default curl_easy_perform outputs the result in stdout.
@@ -104,7 +181,7 @@ void *shorten_url(void *long_url_arg) {
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_memory);
 	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &mem);
 
-	code = curl_easy_perform(curl); // Do the job!
+	code = coro_perform(curl); // Do the job!
 	if (code != CURLE_OK) {
 		fprintf(stderr, "Error: %s\n", curl_easy_strerror(code));
 		goto cleanup;
@@ -125,6 +202,7 @@ void *shorten_url(void *long_url_arg) {
 cleanup:
 	free(mem.buffer);
 	curl_slist_free_all(headers);
+	curl_slist_free_all(hosts);
 	curl_easy_cleanup(curl);
 	return short_url;
 }
@@ -136,6 +214,7 @@ struct github *fetch_github_commits(yajl_val *root, const char *repo, int *commi
 	yajl_val val;
 	struct github *commits = NULL;
 	struct mem_buffer mem = {NULL, 0};
+	struct curl_slist *hosts = NULL;
 	char API_URL[URLLEN], errbuf[1024];
 
 	// Use per_page field to limit json reply to the amount of commits specified
@@ -147,18 +226,20 @@ struct github *fetch_github_commits(yajl_val *root, const char *repo, int *commi
 		goto cleanup;
 
 #ifdef TEST
-	curl_easy_setopt(curl, CURLOPT_URL, getenv("IRCBOT_TESTFILE"));
+	if (!curl_set_url(curl, getenv("IRCBOT_TESTFILE"), &hosts))
 #else
-	curl_easy_setopt(curl, CURLOPT_URL, API_URL);
+	if (!curl_set_url(curl, API_URL, &hosts))
 #endif
+		goto cleanup;
+
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
 	curl_easy_setopt(curl, CURLOPT_USERAGENT, "irc-bot"); // Github requires a user-agent
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 8L);
+	curl_set_timeout(curl, 8 * MILLISECS);
 	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_memory);
 	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &mem);
 
-	code = curl_easy_perform(curl);
+	code = coro_perform(curl);
 	if (code != CURLE_OK) {
 		fprintf(stderr, "Error: %s\n", curl_easy_strerror(code));
 		goto cleanup;
@@ -197,6 +278,7 @@ struct github *fetch_github_commits(yajl_val *root, const char *repo, int *commi
 	}
 cleanup:
 	free(mem.buffer);
+	curl_slist_free_all(hosts);
 	curl_easy_cleanup(curl);
 	return commits;
 }
@@ -206,6 +288,7 @@ char *get_url_title(const char *url) {
 	CURL *curl;
 	CURLcode code;
 	struct mem_buffer mem = {NULL, 0};
+	struct curl_slist *hosts = NULL;
 	char *temp, *url_title = NULL;
 	bool iso = false;
 
@@ -213,14 +296,16 @@ char *get_url_title(const char *url) {
 	if (!curl)
 		goto cleanup;
 
-	curl_easy_setopt(curl, CURLOPT_URL, url);
+	if (!curl_set_url(curl, url, &hosts))
+		goto cleanup;
+
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 3L);
+	curl_set_timeout(curl, 3 * MILLISECS);
 	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_memory);
 	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &mem);
 
-	code = curl_easy_perform(curl);
+	code = coro_perform(curl);
 	if (code != CURLE_OK) {
 		fprintf(stderr, "Error: %s\n", curl_easy_strerror(code));
 		goto cleanup;
@@ -262,6 +347,7 @@ char *get_url_title(const char *url) {
 
 cleanup:
 	free(mem.buffer);
+	curl_slist_free_all(hosts);
 	curl_easy_cleanup(curl);
 	return url_title;
 }
@@ -271,20 +357,23 @@ bool fit_status(void) {
 	CURL *curl;
 	CURLcode code;
 	struct mem_buffer mem = {NULL, 0};
+	struct curl_slist *hosts = NULL;
 	bool fitness = false;
 
 	curl = curl_easy_init();
 	if (!curl)
 		goto cleanup;
 
-	curl_easy_setopt(curl, CURLOPT_URL, "http://is.freestyler.fit.yet.charkost.gr/");
+	if (!curl_set_url(curl, "http://is.freestyler.fit.yet.charkost.gr/", &hosts))
+		goto cleanup;
+
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 3L);
+	curl_set_timeout(curl, 3 * MILLISECS);
 	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_memory);
 	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &mem);
 
-	code = curl_easy_perform(curl);
+	code = coro_perform(curl);
 	if (code != CURLE_OK) {
 		fprintf(stderr, "Error: %s\n", curl_easy_strerror(code));
 		goto cleanup;
@@ -297,6 +386,7 @@ bool fit_status(void) {
 
 cleanup:
 	free(mem.buffer);
+	curl_slist_free_all(hosts);
 	curl_easy_cleanup(curl);
 	return fitness;
 }
@@ -6,6 +6,7 @@
 #include "init.h"
 #include "common.h"
 #include "database.h"
+#include "deadline.h"
 
 static sqlite3 *db;
 
@@ -202,6 +203,26 @@ int modify_last_quote(const char *quote) {
 	return status;
 }
 
+/** Like sqlite3_busy_timeout(), but gives up early when the command runs out of time */
+static int busy_wait(void *unused, int count) {
+
+	long waited = (long) count * DB_BUSY_SLEEP;
+
+	(void) unused;
+	if (waited >= DB_BUSY_TIMEOUT || deadline_expired(deadline_current()))
+		return 0;
+
+	sqlite3_sleep(MIN(DB_BUSY_SLEEP, deadline_clamp(DB_BUSY_TIMEOUT - waited)));
+	return 1;
+}
+
+/** Non zero interrupts the statement with SQLITE_INTERRUPT */
+static int interrupt_expired(void *unused) {
+
+	(void) unused;
+	return deadline_expired(deadline_current());
+}
+
 bool setup_database(void) {
 
 	db = open_database(cfg.db_name);
@@ -209,7 +230,8 @@ bool setup_database(void) {
 		goto cleanup;
 
 	sqlite3_extended_result_codes(db, 1);
-	sqlite3_busy_timeout(db, 3 * MILLISECS);
+	sqlite3_busy_handler(db, busy_wait, NULL);
+	sqlite3_progress_handler(db, DB_PROGRESS_OPS, interrupt_expired, NULL);
 	sql_exec("PRAGMA foreign_keys=on");
 
 	if (!sql_exec("CREATE TABLE IF NOT EXISTS users(user_id INTEGER PRIMARY KEY, name TEXT NOT NULL UNIQUE)"))
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include "deadline.h"
+#include "coro.h"
+#include "common.h"
+
+static __thread struct deadline *thread_deadline;
+
+/** Coroutines share the reactor's thread, so they get a slot of their own */
+static struct deadline **deadline_slot(void) {
+
+	return coro_self() ? (struct deadline **) coro_local(CORO_DEADLINE) : &thread_deadline;
+}
+
+void deadline_start(struct deadline *d, long ms) {
+
+	clock_gettime(CLOCK_MONOTONIC, &d->expires);
+	d->expires.tv_sec  += ms / MILLISECS;
+	d->expires.tv_nsec += ms % MILLISECS * (NANOSECS / MILLISECS);
+	if (d->expires.tv_nsec >= NANOSECS) {
+		d->expires.tv_sec++;
+		d->expires.tv_nsec -= NANOSECS;
+	}
+	d->cancelled = 0;
+	*deadline_slot() = d;
+}
+
+void deadline_stop(void) {
+
+	*deadline_slot() = NULL;
+}
+
+struct deadline *deadline_set(struct deadline *d) {
+
+	struct deadline **slot = deadline_slot(), *old = *slot;
+
+	*slot = d;
+	return old;
+}
+
+struct deadline *deadline_current(void) {
+
+	return *deadline_slot();
+}
+
+void deadline_cancel(struct deadline *d) {
+
+	d->cancelled = 1;
+}
+
+bool deadline_expired(const struct deadline *d) {
+
+	return d && !deadline_remaining(d);
+}
+
+long deadline_remaining(const struct deadline *d) {
+
+	struct timespec now;
+	long ms;
+
+	if (!d)
+		return LONG_MAX;
+
+	if (d->cancelled)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ms = (d->expires.tv_sec - now.tv_sec) * MILLISECS + (d->expires.tv_nsec - now.tv_nsec) / (NANOSECS / MILLISECS);
+	return ms > 0 ? ms : 0;
+}
+
+long deadline_clamp(long timeout_ms) {
+
+	return MIN(timeout_ms, deadline_remaining(deadline_current()));
+}
+
+bool deadline_wait_fd(int fd, uint32_t events, long timeout_ms) {
+
+	struct pollfd pfd = {.fd = fd, .events = events}; // EPOLLIN, EPOLLOUT... have the same values as their poll() twins
+	int ready;
+
+	timeout_ms = deadline_clamp(timeout_ms);
+	if (timeout_ms <= 0)
+		return false;
+
+	if (coro_self())
+		return coro_wait_fd(fd, events, timeout_ms);
+
+	do
+		ready = poll(&pfd, 1, MIN(timeout_ms, INT_MAX));
+	while (ready < 0 && errno == EINTR);
+
+	if (ready < 0)
+		perror(__func__);
+
+	return ready > 0;
+}
@@ -0,0 +1,264 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include "event.h"
+#include "common.h"
+
+enum event_type {EV_FD, EV_TIMER, EV_SIGNAL};
+
+struct event {
+	int fd;
+	enum event_type type;
+	bool removed;
+	event_handler cb;
+	void *data;
+	struct event *prev, *next; // Registered events
+};
+
+struct reactor {
+	int epfd;
+	bool running;
+	struct event *events;
+	struct event *garbage; // Removed while dispatching, freed at the end of the round
+};
+
+Reactor reactor_init(void) {
+
+	Reactor r = calloc_w(sizeof(*r));
+
+	r->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (r->epfd == -1) {
+		perror(__func__);
+		free(r);
+		return NULL;
+	}
+	return r;
+}
+
+STATIC void free_event(struct event *ev) {
+
+	if (ev->type != EV_FD)
+		close(ev->fd);
+
+	free(ev);
+}
+
+STATIC void collect_garbage(Reactor r) {
+
+	struct event *ev;
+
+	while (r->garbage) {
+		ev = r->garbage;
+		r->garbage = ev->next;
+		free_event(ev);
+	}
+}
+
+void reactor_destroy(Reactor r) {
+
+	struct event *ev;
+
+	if (!r)
+		return;
+
+	collect_garbage(r);
+	while (r->events) {
+		ev = r->events;
+		r->events = ev->next;
+		free_event(ev);
+	}
+	close(r->epfd);
+	free(r);
+}
+
+STATIC Event add_event(Reactor r, int fd, enum event_type type, uint32_t events, event_handler cb, void *data) {
+
+	struct epoll_event epev;
+	struct event *ev = malloc_w(sizeof(*ev));
+
+	ev->fd = fd;
+	ev->type = type;
+	ev->removed = false;
+	ev->cb = cb;
+	ev->data = data;
+
+	epev.events = events;
+	epev.data.ptr = ev;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &epev)) {
+		perror(__func__);
+		free(ev);
+		return NULL;
+	}
+	ev->prev = NULL;
+	ev->next = r->events;
+	if (r->events)
+		r->events->prev = ev;
+
+	r->events = ev;
+	return ev;
+}
+
+Event reactor_add_fd(Reactor r, int fd, uint32_t events, event_handler cb, void *data) {
+
+	return add_event(r, fd, EV_FD, events, cb, data);
+}
+
+static struct timespec ms_to_timespec(long ms) {
+
+	return (struct timespec) {ms / MILLISECS, (ms % MILLISECS) * (NANOSECS / MILLISECS)};
+}
+
+bool timer_set(Event ev, long after_ms, long interval_ms) {
+
+	struct itimerspec its;
+
+	its.it_value    = ms_to_timespec(after_ms);
+	its.it_interval = ms_to_timespec(interval_ms);
+	if (timerfd_settime(ev->fd, 0, &its, NULL)) {
+		perror(__func__);
+		return false;
+	}
+	return true;
+}
+
+Event reactor_add_timer(Reactor r, long after_ms, long interval_ms, event_handler cb, void *data) {
+
+	Event ev;
+	int fd;
+
+	fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd == -1) {
+		perror(__func__);
+		return NULL;
+	}
+	ev = add_event(r, fd, EV_TIMER, EPOLLIN, cb, data);
+	if (!ev) {
+		close(fd);
+		return NULL;
+	}
+	if (!timer_set(ev, after_ms, interval_ms)) {
+		reactor_remove(r, ev);
+		return NULL;
+	}
+	return ev;
+}
+
+Event reactor_add_signal(Reactor r, int signum, event_handler cb, void *data) {
+
+	Event ev;
+	sigset_t mask;
+	int fd;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, signum);
+	if (pthread_sigmask(SIG_BLOCK, &mask, NULL))
+		return NULL;
+
+	fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (fd == -1) {
+		perror(__func__);
+		return NULL;
+	}
+	ev = add_event(r, fd, EV_SIGNAL, EPOLLIN, cb, data);
+	if (!ev)
+		close(fd);
+
+	return ev;
+}
+
+void reactor_remove(Reactor r, Event ev) {
+
+	if (!ev || ev->removed)
+		return;
+
+	if (epoll_ctl(r->epfd, EPOLL_CTL_DEL, ev->fd, NULL))
+		perror(__func__);
+
+	if (ev->prev)
+		ev->prev->next = ev->next;
+	else
+		r->events = ev->next;
+
+	if (ev->next)
+		ev->next->prev = ev->prev;
+
+	// The event might be pending in the current round, so defer freeing
+	ev->removed = true;
+	ev->next = r->garbage;
+	r->garbage = ev;
+}
+
+bool event_modify(Reactor r, Event ev, uint32_t events) {
+
+	struct epoll_event epev;
+
+	epev.events = events;
+	epev.data.ptr = ev;
+	if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, ev->fd, &epev)) {
+		perror(__func__);
+		return false;
+	}
+	return true;
+}
+
+int event_fd(Event ev) {
+
+	return ev->fd;
+}
+
+/** Drain the timer expirations / pending signal so that the event is not reported again */
+STATIC bool consume_event(struct event *ev) {
+
+	uint64_t expirations;
+	struct signalfd_siginfo info;
+
+	switch (ev->type) {
+	case EV_TIMER:
+		return read(ev->fd, &expirations, sizeof(expirations)) == sizeof(expirations);
+	case EV_SIGNAL:
+		return read(ev->fd, &info, sizeof(info)) == sizeof(info);
+	default:
+		return true;
+	}
+}
+
+int reactor_run(Reactor r) {
+
+	int ready;
+	struct event *ev;
+	struct epoll_event events[REACTOR_MAXEVENTS];
+
+	r->running = true;
+	while (r->running) {
+		ready = epoll_wait(r->epfd, events, REACTOR_MAXEVENTS, -1);
+		if (ready == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror(__func__);
+			return -1;
+		}
+		for (int i = 0; i < ready; i++) {
+			ev = events[i].data.ptr;
+			if (ev->removed || !consume_event(ev))
+				continue;
+
+			ev->cb(r, ev, events[i].events, ev->data);
+		}
+		collect_garbage(r);
+	}
+	return 0;
+}
+
+void reactor_stop(Reactor r) {
+
+	r->running = false;
+}
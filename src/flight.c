@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include "flight.h"
+#include "coro.h"
+#include "common.h"
+
+/** A coroutine waiting for a call. Coroutines can't block on the condition variable, the eventfd wakes them instead */
+struct parked {
+	struct parked *next;
+	int fd;
+};
+
+/** A request in flight. Landed ones leave the list but stay around until their last waiter has copied the result */
+struct call {
+	struct call *next;
+	char *key;
+	int waiters;
+	struct parked *parked;
+	bool landed;
+	void *result;
+	size_t len;
+};
+
+struct flight {
+	pthread_mutex_t mtx;
+	pthread_cond_t landed; //!< Shared by all calls, since only a few are in flight at a time
+	struct call *calls;
+};
+
+static struct timespec deadline_after(long ms) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec  += ms / MILLISECS;
+	ts.tv_nsec += ms % MILLISECS * (NANOSECS / MILLISECS);
+	if (ts.tv_nsec >= NANOSECS) {
+		ts.tv_sec++;
+		ts.tv_nsec -= NANOSECS;
+	}
+	return ts;
+}
+
+/** @returns  Milliseconds until the deadline, rounded up */
+static long remaining_ms(const struct timespec *deadline) {
+
+	struct timespec ts;
+	long long nsecs;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	nsecs = (long long) (deadline->tv_sec - ts.tv_sec) * NANOSECS + deadline->tv_nsec - ts.tv_nsec;
+	return nsecs <= 0 ? 0 : (nsecs + NANOSECS / MILLISECS - 1) / (NANOSECS / MILLISECS);
+}
+
+/** Wait on a coroutine until c lands or the deadline passes. Called and returns with the mutex held
+ *  @returns  false on timeout */
+static bool park(Flight flight, struct call *c, const struct timespec *deadline) {
+
+	struct parked p = {c->parked, eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)}, **link;
+	bool woken;
+
+	if (p.fd == -1) {
+		perror(__func__);
+		return false;
+	}
+	c->parked = &p;
+	pthread_mutex_unlock(&flight->mtx);
+	woken = coro_wait_fd(p.fd, EPOLLIN, remaining_ms(deadline));
+	pthread_mutex_lock(&flight->mtx);
+
+	for (link = &c->parked; *link != &p; link = &(*link)->next)
+		;
+	*link = p.next;
+	close(p.fd);
+	return woken;
+}
+
+static void free_call(struct call *c) {
+
+	free(c->key);
+	free(c->result);
+	free(c);
+}
+
+Flight flight_init(void) {
+
+	Flight flight = calloc_w(sizeof(*flight));
+	pthread_condattr_t attr;
+
+	pthread_mutex_init(&flight->mtx, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&flight->landed, &attr);
+	pthread_condattr_destroy(&attr);
+	return flight;
+}
+
+enum flight_role flight_join(Flight flight, const char *key, long timeout_ms, void **result, size_t *len) {
+
+	struct call *c;
+	enum flight_role role;
+	struct timespec deadline = deadline_after(timeout_ms);
+
+	pthread_mutex_lock(&flight->mtx);
+	for (c = flight->calls; c && strcmp(c->key, key); c = c->next)
+		;
+
+	if (!c) {
+		c = calloc_w(sizeof(*c));
+		c->key  = strdup(key);
+		c->next = flight->calls;
+		flight->calls = c;
+		pthread_mutex_unlock(&flight->mtx);
+		return FLIGHT_LEAD;
+	}
+	c->waiters++;
+	while (!c->landed)
+		if (coro_self() ? !park(flight, c, &deadline) : pthread_cond_timedwait(&flight->landed, &flight->mtx, &deadline) == ETIMEDOUT)
+			break;
+
+	if (!c->landed)
+		role = FLIGHT_TIMEOUT;
+	else if (!c->result)
+		role = FLIGHT_FAILED;
+	else {
+		role = FLIGHT_DONE;
+		*len = c->len;
+		*result = malloc_w(MAX(c->len, 1));
+		memcpy(*result, c->result, c->len);
+	}
+	// Whoever leaves a landed call last frees it
+	if (!--c->waiters && c->landed)
+		free_call(c);
+
+	pthread_mutex_unlock(&flight->mtx);
+	return role;
+}
+
+void flight_land(Flight flight, const char *key, const void *result, size_t len) {
+
+	struct call *c, **link;
+
+	pthread_mutex_lock(&flight->mtx);
+	for (link = &flight->calls; *link && strcmp((*link)->key, key); link = &(*link)->next)
+		;
+
+	c = *link;
+	if (!c) {
+		pthread_mutex_unlock(&flight->mtx);
+		return;
+	}
+	*link = c->next;
+	c->landed = true;
+	if (result) {
+		c->result = malloc_w(MAX(len, 1));
+		c->len = len;
+		memcpy(c->result, result, len);
+	}
+	if (c->waiters) {
+		pthread_cond_broadcast(&flight->landed);
+		for (struct parked *p = c->parked; p; p = p->next)
+			if (eventfd_write(p->fd, 1))
+				perror(__func__);
+	} else
+		free_call(c);
+
+	pthread_mutex_unlock(&flight->mtx);
+}
+
+void flight_destroy(Flight flight) {
+
+	if (!flight)
+		return;
+
+	pthread_cond_destroy(&flight->landed);
+	pthread_mutex_destroy(&flight->mtx);
+	free(flight);
+}
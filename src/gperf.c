@@ -36,7 +36,7 @@
 struct command_entry;
 #include <string.h>
 
-#define TOTAL_KEYWORDS 32
+#define TOTAL_KEYWORDS 29
 #define MIN_WORD_LENGTH 3
 #define MAX_WORD_LENGTH 11
 #define MIN_HASH_VALUE 3
@@ -141,70 +141,64 @@ command_lookup (register const char *str, register unsigned int len)
 {
   static const struct command_entry wordlist[] =
     {
-#line 42 "include/gperf.txt"
-      {"fit",          bot_fit},
+#line 39 "include/gperf.txt"
+      {"fit",          bot_fit,         EXEC_ASYNC,    60,   10},
+#line 23 "include/gperf.txt"
+      {"ping",         bot_ping,        EXEC_BLOCKING, 0,    30},
 #line 26 "include/gperf.txt"
-      {"ping",         bot_ping},
-#line 29 "include/gperf.txt"
-      {"uptime",       bot_uptime},
-#line 45 "include/gperf.txt"
-      {"upgrade",      bot_upgrade},
-#line 24 "include/gperf.txt"
-      {"url",          bot_url},
-#line 20 "include/gperf.txt"
-      {"fail",         bot_fail},
-#line 25 "include/gperf.txt"
-      {"github",       bot_github},
-#line 15 "include/gperf.txt"
-      {"PRIVMSG",      irc_privmsg},
+      {"uptime",       bot_uptime,      EXEC_BLOCKING, 0,    5},
+#line 42 "include/gperf.txt"
+      {"upgrade",      bot_upgrade,     EXEC_BLOCKING, 0,    0},
 #line 21 "include/gperf.txt"
-      {"fail_add",     bot_fail_add},
-#line 37 "include/gperf.txt"
-      {"roll",         bot_roll},
-#line 44 "include/gperf.txt"
-      {"population",   bot_population},
+      {"url",          bot_url,         EXEC_ASYNC,    600,  15},
+#line 17 "include/gperf.txt"
+      {"fail",         bot_fail,        EXEC_POOLED,   0,    5},
 #line 22 "include/gperf.txt"
-      {"fail_modify",  bot_fail_modify},
-#line 43 "include/gperf.txt"
-      {"weather",      bot_weather},
-#line 34 "include/gperf.txt"
-      {"next",         bot_next},
-#line 40 "include/gperf.txt"
-      {"tweet",        bot_tweet},
-#line 16 "include/gperf.txt"
-      {"NOTICE",       irc_notice},
-#line 32 "include/gperf.txt"
-      {"history",      bot_history},
-#line 39 "include/gperf.txt"
-      {"announce",     bot_announce},
+      {"github",       bot_github,      EXEC_ASYNC,    300,  30},
 #line 18 "include/gperf.txt"
-      {"help",         bot_help},
-#line 28 "include/gperf.txt"
-      {"traceroute",   bot_traceroute},
-#line 23 "include/gperf.txt"
-      {"mumble",       bot_mumble},
-#line 33 "include/gperf.txt"
-      {"current",      bot_current},
-#line 38 "include/gperf.txt"
-      {"seek",         bot_seek},
+      {"fail_add",     bot_fail_add,    EXEC_BLOCKING, 0,    10},
+#line 34 "include/gperf.txt"
+      {"roll",         bot_roll,        EXEC_INLINE,   0,    0},
 #line 41 "include/gperf.txt"
-      {"marker",       bot_marker},
-#line 36 "include/gperf.txt"
-      {"stop",         bot_stop},
+      {"population",   bot_population,  EXEC_BLOCKING, 3600, 20},
 #line 19 "include/gperf.txt"
-      {"access_add",   bot_access_add},
+      {"fail_modify",  bot_fail_modify, EXEC_BLOCKING, 0,    10},
+#line 40 "include/gperf.txt"
+      {"weather",      bot_weather,     EXEC_BLOCKING, 600,  20},
+#line 31 "include/gperf.txt"
+      {"next",         bot_next,        EXEC_BLOCKING, 0,    10},
+#line 37 "include/gperf.txt"
+      {"tweet",        bot_tweet,       EXEC_BLOCKING, 0,    20},
+#line 29 "include/gperf.txt"
+      {"history",      bot_history,     EXEC_BLOCKING, 0,    10},
+#line 36 "include/gperf.txt"
+      {"announce",     bot_announce,    EXEC_POOLED,   0,    10},
+#line 15 "include/gperf.txt"
+      {"help",         bot_help,        EXEC_INLINE,   0,    0},
+#line 25 "include/gperf.txt"
+      {"traceroute",   bot_traceroute,  EXEC_BLOCKING, 0,    60},
+#line 20 "include/gperf.txt"
+      {"mumble",       bot_mumble,      EXEC_ASYNC,    0,    10},
 #line 30 "include/gperf.txt"
-      {"play",         bot_play},
+      {"current",      bot_current,     EXEC_BLOCKING, 0,    10},
 #line 35 "include/gperf.txt"
-      {"shuffle",      bot_shuffle},
-#line 31 "include/gperf.txt"
-      {"playlist",     bot_playlist},
-#line 17 "include/gperf.txt"
-      {"KICK",         irc_kick},
+      {"seek",         bot_seek,        EXEC_BLOCKING, 0,    10},
+#line 38 "include/gperf.txt"
+      {"marker",       bot_marker,      EXEC_INLINE,   0,    0},
+#line 33 "include/gperf.txt"
+      {"stop",         bot_stop,        EXEC_BLOCKING, 0,    10},
+#line 16 "include/gperf.txt"
+      {"access_add",   bot_access_add,  EXEC_BLOCKING, 0,    10},
 #line 27 "include/gperf.txt"
-      {"dns",          bot_dns},
-#line 46 "include/gperf.txt"
-      {"downgrade",    bot_downgrade}
+      {"play",         bot_play,        EXEC_BLOCKING, 0,    30},
+#line 32 "include/gperf.txt"
+      {"shuffle",      bot_shuffle,     EXEC_BLOCKING, 0,    10},
+#line 28 "include/gperf.txt"
+      {"playlist",     bot_playlist,    EXEC_BLOCKING, 0,    10},
+#line 24 "include/gperf.txt"
+      {"dns",          bot_dns,         EXEC_BLOCKING, 300,  10},
+#line 43 "include/gperf.txt"
+      {"downgrade",    bot_downgrade,   EXEC_BLOCKING, 0,    0}
     };
 
   if (len <= MAX_WORD_LENGTH && len >= MIN_WORD_LENGTH)
@@ -266,178 +260,157 @@ command_lookup (register const char *str, register unsigned int len)
                     goto compare;
                   }
                 break;
-              case 9:
-                if (len == 7)
-                  {
-                    resword = &wordlist[7];
-                    goto compare;
-                  }
-                break;
               case 10:
                 if (len == 8)
                   {
-                    resword = &wordlist[8];
+                    resword = &wordlist[7];
                     goto compare;
                   }
                 break;
               case 11:
                 if (len == 4)
                   {
-                    resword = &wordlist[9];
+                    resword = &wordlist[8];
                     goto compare;
                   }
                 break;
               case 12:
                 if (len == 10)
                   {
-                    resword = &wordlist[10];
+                    resword = &wordlist[9];
                     goto compare;
                   }
                 break;
               case 13:
                 if (len == 11)
                   {
-                    resword = &wordlist[11];
+                    resword = &wordlist[10];
                     goto compare;
                   }
                 break;
               case 14:
                 if (len == 7)
                   {
-                    resword = &wordlist[12];
+                    resword = &wordlist[11];
                     goto compare;
                   }
                 break;
               case 16:
                 if (len == 4)
                   {
-                    resword = &wordlist[13];
+                    resword = &wordlist[12];
                     goto compare;
                   }
                 break;
               case 17:
                 if (len == 5)
                   {
-                    resword = &wordlist[14];
-                    goto compare;
-                  }
-                break;
-              case 18:
-                if (len == 6)
-                  {
-                    resword = &wordlist[15];
+                    resword = &wordlist[13];
                     goto compare;
                   }
                 break;
               case 19:
                 if (len == 7)
                   {
-                    resword = &wordlist[16];
+                    resword = &wordlist[14];
                     goto compare;
                   }
                 break;
               case 20:
                 if (len == 8)
                   {
-                    resword = &wordlist[17];
+                    resword = &wordlist[15];
                     goto compare;
                   }
                 break;
               case 21:
                 if (len == 4)
                   {
-                    resword = &wordlist[18];
+                    resword = &wordlist[16];
                     goto compare;
                   }
                 break;
               case 22:
                 if (len == 10)
                   {
-                    resword = &wordlist[19];
+                    resword = &wordlist[17];
                     goto compare;
                   }
                 break;
               case 23:
                 if (len == 6)
                   {
-                    resword = &wordlist[20];
+                    resword = &wordlist[18];
                     goto compare;
                   }
                 break;
               case 24:
                 if (len == 7)
                   {
-                    resword = &wordlist[21];
+                    resword = &wordlist[19];
                     goto compare;
                   }
                 break;
               case 26:
                 if (len == 4)
                   {
-                    resword = &wordlist[22];
+                    resword = &wordlist[20];
                     goto compare;
                   }
                 break;
               case 28:
                 if (len == 6)
                   {
-                    resword = &wordlist[23];
+                    resword = &wordlist[21];
                     goto compare;
                   }
                 break;
               case 31:
                 if (len == 4)
                   {
-                    resword = &wordlist[24];
+                    resword = &wordlist[22];
                     goto compare;
                   }
                 break;
               case 32:
                 if (len == 10)
                   {
-                    resword = &wordlist[25];
+                    resword = &wordlist[23];
                     goto compare;
                   }
                 break;
               case 36:
                 if (len == 4)
                   {
-                    resword = &wordlist[26];
+                    resword = &wordlist[24];
                     goto compare;
                   }
                 break;
               case 39:
                 if (len == 7)
                   {
-                    resword = &wordlist[27];
+                    resword = &wordlist[25];
                     goto compare;
                   }
                 break;
               case 40:
                 if (len == 8)
                   {
-                    resword = &wordlist[28];
-                    goto compare;
-                  }
-                break;
-              case 41:
-                if (len == 4)
-                  {
-                    resword = &wordlist[29];
+                    resword = &wordlist[26];
                     goto compare;
                   }
                 break;
               case 45:
                 if (len == 3)
                   {
-                    resword = &wordlist[30];
+                    resword = &wordlist[27];
                     goto compare;
                   }
                 break;
               case 46:
                 if (len == 9)
                   {
-                    resword = &wordlist[31];
+                    resword = &wordlist[28];
                     goto compare;
                   }
                 break;
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <stdbool.h>
@@ -17,8 +18,15 @@
 #include "queue.h"
 #include "murmur.h"
 #include "curl.h"
+#include "resolver.h"
+#include "tls.h"
 #include "mpd.h"
 #include "database.h"
+#include "pool.h"
+#include "cache.h"
+#include "zygote.h"
+#include "coproc.h"
+#include "commands.h"
 #include "common.h"
 
 // Reduce boilerplate code
@@ -27,6 +35,8 @@
 STATIC size_t read_file(char **buf, const char *filename);
 STATIC char *get_json_field(yajl_val root, const char *field_name);
 STATIC int get_json_array(yajl_val root, const char *array_name, char **array_to_fill, int max_entries);
+STATIC void parse_network(yajl_val root, struct network_options *net, const struct network_options *defaults);
+STATIC int parse_networks(yajl_val root, struct network_options *networks);
 STATIC void parse_config(const char *config_file);
 
 struct mpd_info *mpd;
@@ -34,13 +44,19 @@ struct config_options cfg;
 pthread_t main_thread_id;
 char *program_name_arg;
 char *config_file_arg;
+char *record_file_arg;
+char *replay_file_arg;
+bool replay_realtime_arg;
+
+static Coproc script_workers;
+static Pool pooled, blocking;
 
 int initialize(int argc, char *argv[], int *fd_args) {
 
 	int opt, operation = 0;
 	char *config = NULL;
 
-	while ((opt = getopt(argc, argv, "udf:")) != -1) {
+	while ((opt = getopt(argc, argv, "udf:r:p:P:")) != -1) {
 		switch (opt) {
 			case 'u':
 				operation = 1;
@@ -53,8 +69,17 @@ int initialize(int argc, char *argv[], int *fd_args) {
 				fd_args[MURM_LISTEN] = optarg[MURM_LISTEN];
 				fd_args[MURM_ACCEPT] = optarg[MURM_ACCEPT];
 				break;
+			case 'r': // Record the first network's traffic
+				record_file_arg = optarg;
+				break;
+			case 'P': // Replay a recording in real time
+				replay_realtime_arg = true;
+				// Fallthrough
+			case 'p': // Replay a recording as fast as possible
+				replay_file_arg = optarg;
+				break;
 			default:
-				exit_msg("Usage: %s [<-u | -d> <-f fd>] [config_file]", argv[0]);
+				exit_msg("Usage: %s [<-u | -d> <-f fd>] [-r recording | <-p | -P> recording] [config_file]", argv[0]);
 		}
 	}
 	if (optind < argc)
@@ -65,7 +90,14 @@ int initialize(int argc, char *argv[], int *fd_args) {
 	srandom(time(NULL));
 	signal(SIGPIPE, SIG_IGN); // Don't exit program when writing to a closed socket
 	setlinebuf(stdout); // Flush on each line
+
 	parse_config(config ? config : DEFAULT_CONFIG_NAME);
+	if (*cfg.wolframalpha_api_key)
+		setenv("WOLFRAMALPHA_API_KEY", cfg.wolframalpha_api_key, true);
+
+	// The spawn server is forked while the bot is still small and single threaded. It keeps the environment it has now
+	if (!zygote_start())
+		fprintf(stderr, "Could not start the spawn server, programs will be spawned directly\n");
 
 	sqlite3_initialize();
 	if (!setup_database())
@@ -76,12 +108,28 @@ int initialize(int argc, char *argv[], int *fd_args) {
 	if (!openssl_crypto_init())
 		exit_msg("Could not initialize openssl locks");
 
+	for (int i = 0; i < cfg.networks_set; i++)
+		if (cfg.networks[i].tls) {
+			if (!tls_init(cfg.tls_ca_file))
+				exit_msg("Could not initialize TLS");
+			break;
+		}
+
 	if (*cfg.oauth_consumer_key && *cfg.oauth_consumer_secret && *cfg.oauth_token && *cfg.oauth_token_secret)
 		cfg.twitter_details_set = true;
 
-	if (*cfg.wolframalpha_api_key)
-		setenv("WOLFRAMALPHA_API_KEY", cfg.wolframalpha_api_key, true);
+	pooled   = pool_init(cfg.command_threads,  cfg.command_queue, cfg.command_stack_size * 1024);
+	blocking = pool_init(cfg.blocking_threads, cfg.command_queue, cfg.command_stack_size * 1024);
+	if (!pooled || !blocking)
+		exit_msg("Could not start the command workers");
+
+	set_command_pools(pooled, blocking);
+	set_command_cache(cache_init(cfg.command_cache_size * 1024));
 
+	// Workers start on first use. Without them every request runs the script again
+	script_workers = coproc_init(CMD(SCRIPTDIR "weather_and_population.py", "--serve"), cfg.script_workers,
+		&(struct spawn_limits) {RLIM_INFINITY, CMD_MAXMEMORY});
+	set_script_workers(script_workers);
 	return operation;
 }
 
@@ -140,6 +188,22 @@ STATIC bool get_json_bool(yajl_val root, const char *field_name) {
 	return YAJL_IS_TRUE(val);
 }
 
+/** Only accept integers between 1 and max. Optional, def is used when the field is missing */
+STATIC int get_json_int(yajl_val root, const char *field_name, int def, int max) {
+
+	yajl_val val = yajl_tree_get(root, CFG(field_name), yajl_t_any);
+	if (!val)
+		return def;
+
+	if (!YAJL_IS_INTEGER(val))
+		exit_msg("%s: wrong type", field_name);
+
+	if (YAJL_GET_INTEGER(val) < 1 || YAJL_GET_INTEGER(val) > max)
+		exit_msg("%s: must be between 1 and %d", field_name, max);
+
+	return YAJL_GET_INTEGER(val);
+}
+
 STATIC int get_json_array(yajl_val root, const char *array_name, char **array_to_fill, int max_entries) {
 
 	int array_size;
@@ -177,6 +241,65 @@ STATIC char *expand_path(char *path) {
 	return expanded_path;
 }
 
+/** Entries of the "networks" array only need server & port. The rest default to the first network's values */
+STATIC void parse_network(yajl_val root, struct network_options *net, const struct network_options *defaults) {
+
+	if (!defaults) {
+		net->server        = get_json_field(root, "server");
+		net->port          = get_json_field(root, "port");
+		net->nick          = get_json_field(root, "nick");
+		net->user          = get_json_field(root, "user");
+		net->nick_password = get_json_field(root, "nick_password");
+		net->channels_set  = get_json_array(root, "channels", net->channels, MAXCHANS);
+		net->tls           = get_json_bool(root, "tls");
+		return;
+	}
+	*net = *defaults;
+	net->server = get_json_field(root, "server");
+	net->port   = get_json_field(root, "port");
+	if (yajl_tree_get(root, CFG("nick"), yajl_t_string))
+		net->nick = get_json_field(root, "nick");
+
+	if (yajl_tree_get(root, CFG("user"), yajl_t_string))
+		net->user = get_json_field(root, "user");
+
+	if (yajl_tree_get(root, CFG("tls"), yajl_t_any))
+		net->tls = get_json_bool(root, "tls");
+
+	if (yajl_tree_get(root, CFG("channels"), yajl_t_array))
+		net->channels_set = get_json_array(root, "channels", net->channels, MAXCHANS);
+
+	// The password gets wiped after use, so every network needs its own copy
+	if (yajl_tree_get(root, CFG("nick_password"), yajl_t_string))
+		net->nick_password = get_json_field(root, "nick_password");
+
+	net->nick_password = strdup(net->nick_password);
+}
+
+/** The top level fields describe the first network, the optional "networks" array any additional ones */
+STATIC int parse_networks(yajl_val root, struct network_options *networks) {
+
+	int count = 1;
+	yajl_val array;
+
+	parse_network(root, &networks[0], NULL);
+	array = yajl_tree_get(root, CFG("networks"), yajl_t_array);
+	if (!array)
+		return count;
+
+	for (size_t i = 0; i < YAJL_GET_ARRAY(array)->len; i++) {
+		if (count == MAXNETWORKS) {
+			fprintf(stderr, "networks limit (%d) reached. Ignoring rest\n", MAXNETWORKS);
+			break;
+		}
+		if (!YAJL_IS_OBJECT(YAJL_GET_ARRAY(array)->values[i]))
+			exit_msg("networks: entry %zu is not an object", i);
+
+		parse_network(YAJL_GET_ARRAY(array)->values[i], &networks[count++], &networks[0]);
+	}
+	return count;
+}
+
 STATIC void parse_config(const char *config_file) {
 
 	yajl_val root;
@@ -192,11 +315,6 @@ STATIC void parse_config(const char *config_file) {
 	// Free original buffer since we have a duplicate in root now
 	free(buf);
 
-	CFG_GET(cfg, root, server);
-	CFG_GET(cfg, root, port);
-	CFG_GET(cfg, root, nick);
-	CFG_GET(cfg, root, user);
-	CFG_GET(cfg, root, nick_password);
 	CFG_GET(cfg, root, bot_version);
 	CFG_GET(cfg, root, quit_message);
 	CFG_GET(cfg, root, github_repo);
@@ -212,60 +330,72 @@ STATIC void parse_config(const char *config_file) {
 	CFG_GET(cfg, root, oauth_token_secret);
 	CFG_GET(cfg, root, google_shortener_api_key);
 	CFG_GET(cfg, root, wolframalpha_api_key);
-
-	cfg.mpd_database      = expand_path(cfg.mpd_database);
-	cfg.mpd_random_state  = expand_path(cfg.mpd_random_state);
-	cfg.fifo_name         = expand_path(cfg.fifo_name);
-	cfg.db_name           = expand_path(cfg.db_name);
-	cfg.channels_set      = get_json_array(root, "channels",    cfg.channels,    MAXCHANS);
-	cfg.access_list_count = get_json_array(root, "access_list", cfg.access_list, MAXACCLIST);
-	cfg.verbose           = get_json_bool(root, "verbose");
+	CFG_GET(cfg, root, tls_ca_file);
+
+	cfg.mpd_database       = expand_path(cfg.mpd_database);
+	cfg.mpd_random_state   = expand_path(cfg.mpd_random_state);
+	cfg.fifo_name          = expand_path(cfg.fifo_name);
+	cfg.db_name            = expand_path(cfg.db_name);
+	cfg.access_list_count  = get_json_array(root, "access_list", cfg.access_list, MAXACCLIST);
+	cfg.verbose            = get_json_bool(root, "verbose");
+	cfg.io_uring           = get_json_bool(root, "io_uring");
+	cfg.command_threads    = get_json_int(root, "command_threads", 2, POOL_MAXWORKERS);
+	cfg.blocking_threads   = get_json_int(root, "blocking_threads", 4, POOL_MAXWORKERS);
+	cfg.command_queue      = get_json_int(root, "command_queue", 32, MAXCOMMANDQUEUE);
+	cfg.command_stack_size = get_json_int(root, "command_stack_size", 512, MAXSTACKSIZE);
+	cfg.command_cache_size = get_json_int(root, "command_cache_size", 1024, MAXCACHESIZE);
+	cfg.script_workers     = get_json_int(root, "script_workers", 2, MAXSCRIPTWORKERS);
+	cfg.networks_set       = parse_networks(root, cfg.networks);
 }
 
-int setup_irc(Irc *server, int *fd_args) {
+Irc setup_irc(Reactor r, Uring u, const struct network_options *net, int fd) {
 
+	Irc server;
 	Mqueue mq;
-	int ircfd;
-	pthread_t tid;
-	pthread_attr_t attr;
 
-	*server = irc_connect(cfg.server, cfg.port, fd_args[IRC]);
-	if (!*server)
-		exit_msg("Irc connection failed");
+	// TLS state can't be handed over on upgrade, reconnect and resume the session instead.
+	// The same goes for an upgrade that happened while reconnecting
+	if (fd < 0)
+		fd = 0;
 
-	ircfd = get_socket(*server);
-	mq = mqueue_init(ircfd);
+	if (net->tls && fd > 0) {
+		close(fd);
+		fd = 0;
+	}
+	server = irc_connect(net->server, net->port, fd, net->tls);
+	if (!server)
+		exit_msg("%s: Irc connection failed", net->server);
+
+	mq = mqueue_init(r, get_socket(server));
 	if (!mq)
 		exit_msg("message queue initialization failed");
 
-	set_mqueue(*server, mq);
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	if (pthread_create(&tid, &attr, mqueue_start, mq))
-		exit_msg("Could not start queue");
+	if (net->tls)
+		mqueue_set_tls(mq, get_tls(server));
+	else if (u)
+		mqueue_set_uring(mq, u);
 
-	pthread_attr_destroy(&attr);
-	set_nick(*server, cfg.nick);
-	set_user(*server, cfg.user);
-	for (int i = 0; i < cfg.channels_set; i++)
-		join_channel(*server, cfg.channels[i]);
+	set_mqueue(server, mq);
+	set_nick_password(server, net->nick_password);
+	set_nick(server, net->nick);
+	set_user(server, net->user);
+	for (int i = 0; i < net->channels_set; i++)
+		join_channel(server, net->channels[i]);
 
-	return ircfd;
+	return server;
 }
 
-void setup_mumble(struct pollfd *pfd, int *fd_args) {
+void setup_mumble(int *fds, int *fd_args) {
 
 	if (fd_args[MURM_LISTEN] <= 0) {
 		if (add_murmur_callbacks(cfg.murmur_port))
-			pfd[MURM_LISTEN].fd = sock_listen(LOCALHOST, CB_LISTEN_PORT_S);
+			fds[MURM_LISTEN] = sock_listen(LOCALHOST, CB_LISTEN_PORT_S);
 		else
 			fprintf(stderr, "Could not connect to Murmur\n");
 	} else {
-		pfd[MURM_LISTEN].fd = fd_args[MURM_LISTEN];
-		if (fd_args[MURM_ACCEPT] > 0) {
-			pfd[MURM_ACCEPT].fd = fd_args[MURM_ACCEPT];
-			pfd[MURM_LISTEN].events = 0;
-		}
+		fds[MURM_LISTEN] = fd_args[MURM_LISTEN];
+		if (fd_args[MURM_ACCEPT] > 0)
+			fds[MURM_ACCEPT] = fd_args[MURM_ACCEPT];
 	}
 }
 
@@ -329,11 +459,24 @@ cleanup:
 	return -1;
 }
 
+void stop_commands(void) {
+
+	pool_destroy(pooled);
+	pool_destroy(blocking);
+	pooled = blocking = NULL;
+	set_command_pools(NULL, NULL);
+}
+
 void cleanup(void) {
 
+	stop_commands(); // Before the script workers, commands may still be calling them
 	free(mpd);
+	coproc_destroy(script_workers);
+	zygote_stop();
 	openssl_crypto_cleanup();
 	curl_global_cleanup();
+	resolver_cleanup();
+	tls_cleanup();
 	close_database();
 	sqlite3_shutdown();
 }
@@ -10,6 +10,7 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
+#include <sys/epoll.h>
 #include "socket.h"
 #include "irc.h"
 #include "gperf.h"
@@ -17,14 +18,20 @@
 #include "init.h"
 #include "database.h"
 #include "queue.h"
+#include "replay.h"
+#include "coro.h"
+#include "flight.h"
+#include "admission.h"
+#include "deadline.h"
 
 struct irc_type {
 	int conn;
+	Tls tls;
 	Mqueue mqueue;
 	pthread_mutex_t *mtx;
 	int pipe[RDWR];
-	char line[IRCLEN + 1];
-	size_t line_offset;
+	Reader reader;
+	struct line line; //!< Line currently being parsed. Points inside reader's buffer
 	char address[ADDRLEN + 1];
 	char port[PORTLEN + 1];
 	char nick[NICKLEN + 1];
@@ -32,22 +39,81 @@ struct irc_type {
 	char channels[MAXCHANS][CHANLEN + 1];
 	int channels_set;
 	bool connected;
+	char *nick_password;
+	bool secure;      //!< Reconnect with TLS
+	bool reconnected; //!< Lines kept from the previous connection are released after registration
+	Recorder recorder; //!< Every line read is appended to it if set
+	Ratelimit limits[LIMITS]; //!< Bot commands are checked against all of them
+	time_t shed_notice;       //!< When a user was last told a command was shed
+	unsigned caps;            //!< Capabilities the server listed so far, indexed as in irc_cap()
 };
 
+/** Parts of a bot command request. They are copied to the stack for inline commands, to a single allocation for the rest */
+struct command_spans {
+	struct span tags;
+	struct span sender;
+	struct span command;
+	struct span target;
+	struct span message; //!< ptr is NULL if there are no arguments
+};
+
+#define COMMAND_STRLEN (IRC_TAGLEN + 2 * IRCLEN + 5) //!< Target might repeat the sender. Plus a null terminator for each span
+
 struct command_info {
 	Irc server;
 	Command *cmd;
-	char *line;
+	struct timespec dispatched;
 	struct parsed_data pdata;
+	char strings[]; //!< pdata's members point here
+};
+
+/** Replies of a memoized command to its target, collected by _irc_command() while it runs */
+struct capture {
+	const char *target;
+	size_t len;
+	bool discard;        //!< Too long or sent elsewhere, so not cached
+	char lines[MEMOLEN]; //!< Null terminated one after the other
 };
 
 #define ctcp_reply(server, target, format, ...) _irc_command(server, "NOTICE",  target, "\x01" format "\x01", __VA_ARGS__)
 
-STATIC void pre_launch_command(Irc server, struct parsed_data pdata, Command *cmd);
-STATIC void *launch_command(void *cmd_info);
-STATIC void ctcp_handle(Irc server, struct parsed_data pdata);
+STATIC void irc_ping(Irc server, const struct irc_message *msg);
+STATIC void irc_cap(Irc server, const struct irc_message *msg);
+STATIC void pre_launch_command(Irc server, struct command_spans *spans, Command *cmd);
+STATIC void launch_command(void *cmd_info);
+STATIC bool memo_key(char *key, size_t size, const char *name, struct span args);
+STATIC void ctcp_handle(Irc server, const struct irc_message *msg);
+static void nickname_in_use(Irc server, const struct irc_message *msg);
+static void end_of_motd(Irc server, const struct irc_message *msg);
+static void banned_from_chan(Irc server, const struct irc_message *msg);
+
+/** IRC commands we act upon. Bot commands are looked up in the gperf table instead */
+static const struct {
+	const char *name;
+	message_handler function;
+} irc_handlers[] = {
+	{"PING",    irc_ping},
+	{"CAP",     irc_cap},
+	{"PRIVMSG", irc_privmsg},
+	{"NOTICE",  irc_notice},
+	{"KICK",    irc_kick}
+};
+
+static Pool command_pools[EXEC_CLASSES]; //!< Indexed by the command's class. Inline commands don't need one
+static Cache command_cache;
+static void (*command_stub)(Irc, struct parsed_data); //!< Runs instead of every command if set
+static Flight command_flights; //!< Memoized commands already running, so that identical ones wait for their replies
+static Admission command_admission;
+static __thread struct capture *thread_capture;
+
+/** Numeric replies are looked up by value. Modules add theirs at startup with irc_register_numeric() */
+static message_handler numeric_handlers[IRC_NUMERICS] = {
+	[NICKNAMEINUSE]  = nickname_in_use,
+	[ENDOFMOTD]      = end_of_motd,
+	[BANNEDFROMCHAN] = banned_from_chan
+};
 
-Irc irc_connect(const char *address, const char *port, int fd) {
+Irc irc_connect(const char *address, const char *port, int fd, bool tls) {
 
 	Irc server;
 
@@ -66,6 +132,15 @@ Irc irc_connect(const char *address, const char *port, int fd) {
 			free(server);
 			return NULL;
 		}
+		// Handshake while the socket is still blocking
+		if (tls) {
+			server->tls = tls_connect(server->conn, address, port);
+			if (!server->tls) {
+				close(server->conn);
+				free(server);
+				return NULL;
+			}
+		}
 		// Set socket to non-blocking mode
 		if (fcntl(server->conn, F_SETFL, O_NONBLOCK))
 			goto cleanup;
@@ -75,16 +150,27 @@ Irc irc_connect(const char *address, const char *port, int fd) {
 	if (pthread_mutex_init(server->mtx, NULL))
 		goto cleanup;
 
-	if (pipe(server->pipe))
+	server->limits[LIMIT_NICK]    = ratelimit_init(LIMIT_NICK_BURST,    LIMIT_NICK_RATE,    LIMIT_MAXKEYS);
+	server->limits[LIMIT_CHANNEL] = ratelimit_init(LIMIT_CHANNEL_BURST, LIMIT_CHANNEL_RATE, LIMIT_MAXKEYS);
+	server->limits[LIMIT_COMMAND] = ratelimit_init(LIMIT_COMMAND_BURST, LIMIT_COMMAND_RATE, LIMIT_MAXKEYS);
+
+	// Non-blocking, so that waiting for NickServ can give up
+	if (pipe2(server->pipe, O_NONBLOCK | O_CLOEXEC))
 		goto cleanup;
 
+	server->reader = reader_init(server->conn);
 	strncpy(server->address, address, ADDRLEN);
 	strncpy(server->port, port, PORTLEN);
+	server->secure = tls;
 
 	return server;
 
 cleanup:
 	perror(__func__);
+	tls_close(server->tls);
+	for (int i = 0; i < LIMITS; i++)
+		ratelimit_destroy(server->limits[i]);
+
 	free(server->mtx);
 	free(server);
 	return NULL;
@@ -95,12 +181,55 @@ int get_socket(Irc server) {
 	return server->conn;
 }
 
+Tls get_tls(Irc server) {
+
+	return server->tls;
+}
+
+Mqueue get_mqueue(Irc server) {
+
+	return server->mqueue;
+}
+
 void set_mqueue(Irc server, Mqueue mq) {
 
 	assert(mq);
 	server->mqueue = mq;
 }
 
+void set_command_pools(Pool pooled, Pool blocking) {
+
+	command_pools[EXEC_POOLED]   = pooled;
+	command_pools[EXEC_BLOCKING] = blocking;
+	if (!command_admission)
+		command_admission = admission_init(ADMIT_MAXINFLIGHT, ADMIT_MAXDEPTH, ADMIT_MAXLATENCY);
+}
+
+void set_command_stub(void (*stub)(Irc, struct parsed_data)) {
+
+	command_stub = stub;
+}
+
+int commands_inflight(void) {
+
+	struct admission_stats stats;
+
+	admission_stats(command_admission, &stats);
+	return stats.inflight;
+}
+
+void set_command_cache(Cache cache) {
+
+	command_cache = cache;
+	if (!command_flights)
+		command_flights = flight_init();
+}
+
+void set_recorder(Irc server, Recorder rec) {
+
+	server->recorder = rec;
+}
+
 char *default_channel(Irc server) {
 
 	if (!server->channels_set)
@@ -109,9 +238,25 @@ char *default_channel(Irc server) {
 	return server->channels[0];
 }
 
+static long elapsed_ms(const struct timespec *since) {
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * MILLISECS + (now.tv_nsec - since->tv_nsec) / (NANOSECS / MILLISECS);
+}
+
+/** NickServ's answer to ACC, passed from the reactor's thread through server->pipe. Small enough to be written atomically */
+struct acc_reply {
+	int level;
+	char nick[NICKLEN + 1];
+};
+
 STATIC bool user_is_identified(Irc server, const char *nick) {
 
-	int auth_level = 0;
+	struct acc_reply reply = {0};
+	struct timespec start;
+	long left;
 
 #ifndef NDEBUG
 	extern pthread_t main_thread_id;
@@ -121,12 +266,25 @@ STATIC bool user_is_identified(Irc server, const char *nick) {
 	assert(!pthread_equal(main_thread_id, pthread_self()));
 
 	pthread_mutex_lock(server->mtx);
+
+	// Answers that came after their caller gave up are dropped, so that they aren't taken for this one
+	while (sock_read(server->pipe[RD], &reply, sizeof(reply)) == sizeof(reply));
+
 	send_message(server, "NickServ", "ACC %s", nick);
-	if (sock_read(server->pipe[RD], &auth_level, 4) != 4)
-		perror(__func__);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	do {
+		reply.level = 0;
+		left = ACC_TIMEOUT - elapsed_ms(&start);
+		if (!deadline_wait_fd(server->pipe[RD], EPOLLIN, left)) {
+			fprintf(stderr, "%s: No answer from NickServ about %s\n", __func__, nick);
+			break;
+		}
+		if (sock_read(server->pipe[RD], &reply, sizeof(reply)) != sizeof(reply))
+			reply.nick[0] = '\0';
+	} while (strcasecmp(reply.nick, nick));
 
 	pthread_mutex_unlock(server->mtx);
-	return auth_level == 3;
+	return reply.level == 3;
 }
 
 bool user_has_access(Irc server, const char *nick) {
@@ -143,17 +301,29 @@ void set_nick(Irc server, const char *nick) {
 		irc_command(server, "NICK", server->nick);
 }
 
-void set_user(Irc server, const char *user) {
+/** Capabilities are negotiated first, the server holds registration until CAP END */
+static void send_user(Irc server) {
 
 	char user_with_flags[USERLEN * 2 + 6];
 
+	server->caps = 0;
+	irc_command(server, "CAP", "LS 302");
+	snprintf(user_with_flags, sizeof(user_with_flags), "%s 0 * :%s", server->user, server->user);
+	irc_command(server, "USER", user_with_flags);
+}
+
+void set_nick_password(Irc server, char *password) {
+
+	server->nick_password = password;
+}
+
+void set_user(Irc server, const char *user) {
+
 	assert(user);
 	strncpy(server->user, user, USERLEN);
 
-	if (!server->connected) {
-		snprintf(user_with_flags, sizeof(user_with_flags), "%s 0 * :%s", server->user, server->user);
-		irc_command(server, "USER", user_with_flags);
-	}
+	if (!server->connected)
+		send_user(server);
 }
 
 int join_channel(Irc server, const char *channel) {
@@ -187,145 +357,612 @@ int join_channel(Irc server, const char *channel) {
 	return 1;
 }
 
-ssize_t parse_irc_line(Irc server) {
+bool irc_parse_message(const char *line, size_t len, struct irc_message *msg) {
 
-	int reply;
-	ssize_t n;
-	Command *cmd;
-	struct parsed_data pdata;
+	const char *ptr = line, *end = line + len, *delim;
+
+	msg->tags = msg->prefix = msg->nick = (struct span) {NULL, 0};
+	msg->param_count = 0;
+
+	// IRCv3 tags are optional and come first. Example: "@time=2011-10-19T16:40:51.620Z;account=bob"
+	if (ptr < end && *ptr == '@') {
+		delim = memchr(ptr, ' ', end - ptr);
+		if (!delim)
+			return false;
+
+		if (delim - ptr + 1 > IRC_TAGLEN)
+			return false;
+
+		msg->tags = (struct span) {ptr + 1, delim - ptr - 1};
+		for (ptr = delim; ptr < end && *ptr == ' '; ptr++);
+	}
+	// The tags have a budget of their own, the rest is held to IRCLEN. Whatever is past it is dropped
+	if (end - ptr > IRCLEN)
+		end = ptr + IRCLEN;
+
+	// Prefix is optional. Examples: "laxanofido!~laxanofid@snf-23545.vm.okeanos.grnet.gr", "wolfe.freenode.net"
+	if (ptr < end && *ptr == ':') {
+		delim = memchr(ptr, ' ', end - ptr);
+		if (!delim)
+			return false;
+
+		msg->prefix = (struct span) {ptr + 1, delim - ptr - 1};
+		ptr = memchr(msg->prefix.ptr, '!', msg->prefix.len);
+		if (ptr)
+			msg->nick = (struct span) {msg->prefix.ptr, ptr - msg->prefix.ptr};
+
+		ptr = delim;
+	}
+	while (ptr < end && *ptr == ' ')
+		ptr++;
 
-	// Read raw line from server. Example: ":laxanofido!~laxanofid@snf-23545.vm.okeanos.grnet.gr PRIVMSG #foss-teimes :How YA doing fossbot"
-	n = sock_readline(server->conn, server->line + server->line_offset, IRCLEN - server->line_offset);
-	if (n <= 0) {
-		if (n != -EAGAIN)
-			exit_msg("IRC connection closed");
+	// Examples: "PRIVMSG", "MODE", "433"
+	delim = memchr(ptr, ' ', end - ptr);
+	if (!delim)
+		delim = end;
 
-		server->line_offset = strlen(server->line);
-		return n;
+	msg->command = (struct span) {ptr, delim - ptr};
+	if (!msg->command.len)
+		return false;
+
+	// Examples: "#foss-teimes", "How YA doing fossbot". The last parameter may contain spaces if it's prefixed with ':'
+	for (ptr = delim; msg->param_count < IRC_MAXPARAMS; ptr = delim) {
+		while (ptr < end && *ptr == ' ')
+			ptr++;
+
+		if (ptr == end)
+			break;
+
+		if (*ptr == ':' || msg->param_count == IRC_MAXPARAMS - 1) {
+			ptr += *ptr == ':';
+			msg->params[msg->param_count++] = (struct span) {ptr, end - ptr};
+			break;
+		}
+		delim = memchr(ptr, ' ', end - ptr);
+		if (!delim)
+			delim = end;
+
+		msg->params[msg->param_count++] = (struct span) {ptr, delim - ptr};
 	}
-	// Clear offset and remove IRC protocol terminators \r\n
-	n += server->line_offset - 2;
-	server->line[n] = '\0';
-	server->line_offset = 0;
+	return true;
+}
+
+STATIC int numeric_value(struct span command) {
 
+	// Numeric replies are always 3 digits
+	if (command.len != 3)
+		return 0;
+
+	for (int i = 0; i < 3; i++)
+		if (command.ptr[i] < '0' || command.ptr[i] > '9')
+			return 0;
+
+	return (command.ptr[0] - '0') * 100 + (command.ptr[1] - '0') * 10 + (command.ptr[2] - '0');
+}
+
+STATIC void parse_line(Irc server, struct line *line) {
+
+	int reply;
+	struct irc_message msg;
+
+	server->line = *line;
 	if (cfg.verbose)
-		puts(server->line);
+		puts(line->buf);
 
-	// Check for server ping request. Example: "PING :wolfe.freenode.net"
-	if (starts_with(server->line, "PING")) {
-		irc_command(server, "PONG", server->line + 5);
-		return n;
+	if (server->recorder)
+		recorder_write(server->recorder, line->buf, line->len);
+
+	if (!irc_parse_message(line->buf, line->len, &msg))
+		return;
+
+	// Numeric replies need a single table lookup
+	reply = numeric_value(msg.command);
+	if (reply) {
+		numeric_reply(server, &msg, reply);
+		return;
 	}
-	// Store the sender of the message / server command without the leading ':'.
-	// Examples: "laxanofido!~laxanofid@snf-23545.vm.okeanos.grnet.gr", "wolfe.freenode.net"
-	pdata.sender = strtok(server->line + 1, " ");
-	if (!pdata.sender)
-		return n;
-
-	// Store the server command. Examples: "PRIVMSG", "MODE", "433"
-	pdata.command = strtok(NULL, " ");
-	if (!pdata.command)
-		return n;
-
-	// Store everything that comes after the server command
-	// Examples: "#foss-teimes :How YA doing fossbot_", "fossbot :How YA doing fossbot"
-	pdata.message = strtok(NULL, "");
-	if (!pdata.message)
-		return n;
-
-	// Initialize the last struct member to silence compiler warnings
-	pdata.target = NULL;
-
-	// Find out if server command is a numeric reply
-	reply = atoi(pdata.command);
-	if (reply)
-		numeric_reply(server, pdata, reply);
-	else {
-		// Find & launch any functions registered to IRC commands
-		cmd = command_lookup(pdata.command, strlen(pdata.command));
-		if (cmd)
-			cmd->function(server, pdata);
+	// Find & launch any functions registered to IRC commands
+	for (size_t i = 0; i < sizeof(irc_handlers) / sizeof(irc_handlers[0]); i++) {
+		if (span_case_eq(msg.command, irc_handlers[i].name)) {
+			irc_handlers[i].function(server, &msg);
+			break;
+		}
 	}
+}
+
+bool irc_tag_find(struct span tags, const char *key, struct span *value) {
+
+	const char *ptr = tags.ptr, *end = tags.ptr + tags.len, *next, *equals;
+	size_t keylen = strlen(key);
+
+	// Example: "time=2011-10-19T16:40:51.620Z;+example.com/flag;msgid=a\\:b"
+	for (; ptr < end; ptr = next + 1) {
+		next = memchr(ptr, ';', end - ptr);
+		if (!next)
+			next = end;
+
+		equals = memchr(ptr, '=', next - ptr);
+		if ((size_t) ((equals ? equals : next) - ptr) != keylen || memcmp(ptr, key, keylen))
+			continue;
+
+		*value = equals ? (struct span) {equals + 1, next - equals - 1} : (struct span) {next, 0};
+		return true;
+	}
+	return false;
+}
+
+size_t irc_tag_value(struct span tags, const char *key, char *buf, size_t size) {
+
+	size_t len = 0;
+	struct span value;
+	const char *ptr, *end;
+
+	assert(size);
+	*buf = '\0';
+	if (!irc_tag_find(tags, key, &value))
+		return 0;
+
+	// "\:" is ';', "\s" is ' ', "\r" & "\n" are CR & LF. Any other escaped char stands for itself
+	// and a trailing lone backslash is dropped
+	end = value.ptr + value.len;
+	for (ptr = value.ptr; ptr < end && len < size - 1; ptr++) {
+		if (*ptr != '\\') {
+			buf[len++] = *ptr;
+			continue;
+		}
+		if (++ptr == end)
+			break;
+
+		switch (*ptr) {
+		case ':': buf[len++] = ';';  break;
+		case 's': buf[len++] = ' ';  break;
+		case 'r': buf[len++] = '\r'; break;
+		case 'n': buf[len++] = '\n'; break;
+		default:  buf[len++] = *ptr;
+		}
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+bool irc_tag_time(struct span tags, struct timespec *time) {
+
+	struct tm tm = {0};
+	char buf[32], *ptr;
+	long nsec = 0, scale = NANOSECS;
+
+	if (!irc_tag_value(tags, "time", buf, sizeof(buf)))
+		return false;
+
+	// Fractional seconds are optional, the 'Z' (UTC) is not
+	ptr = strptime(buf, "%Y-%m-%dT%H:%M:%S", &tm);
+	if (!ptr)
+		return false;
+
+	if (*ptr == '.')
+		for (ptr++; *ptr >= '0' && *ptr <= '9'; ptr++)
+			if (scale /= 10)
+				nsec += (*ptr - '0') * scale;
+
+	if (strcmp(ptr, "Z"))
+		return false;
+
+	time->tv_sec  = timegm(&tm);
+	time->tv_nsec = nsec;
+	return true;
+}
+
+/** Decrypted data may be buffered by openssl without the socket being readable, so read until it would block */
+static ssize_t parse_tls_lines(Irc server) {
+
+	ssize_t n, total = 0;
+	char buf[READER_BUFSIZE];
+
+	while ((n = tls_read(server->tls, buf, sizeof(buf))) > 0)
+		total += parse_irc_buffer(server, buf, n);
+
+	if (n != -EAGAIN)
+		return 0; // Closed, even if some lines arrived with it
+
+	return total ? total : -EAGAIN;
+}
+
+ssize_t parse_irc_line(Irc server) {
+
+	ssize_t n;
+	struct line lines[READER_MAXLINES];
+
+	if (server->tls)
+		return parse_tls_lines(server);
+
+	// Read all complete lines available. Example: ":laxanofido!~laxanofid@snf-23545.vm.okeanos.grnet.gr PRIVMSG #foss-teimes :How YA doing fossbot"
+	n = reader_readlines(server->reader, lines, READER_MAXLINES);
+	if (n <= 0)
+		return n == -EAGAIN ? n : 0;
+
+	for (ssize_t i = 0; i < n; i++)
+		parse_line(server, &lines[i]);
+
 	return n;
 }
 
-void irc_privmsg(Irc server, struct parsed_data pdata) {
+size_t parse_irc_buffer(Irc server, const char *buf, size_t len) {
 
-	Command *cmd;
+	size_t used, n, total = 0;
+	struct line lines[READER_MAXLINES];
+
+	// The buffer might not fit in the reader at once, so parse what is complete and feed the rest
+	while (len) {
+		used = reader_feed(server->reader, buf, len);
+		buf += used;
+		len -= used;
+		while ((n = reader_getlines(server->reader, lines, READER_MAXLINES))) {
+			for (size_t i = 0; i < n; i++)
+				parse_line(server, &lines[i]);
 
-	// Discard hostname from nickname. "laxanofido!~laxanofid@snf-23545.vm.okeanos.grnet.gr" becomes "laxanofido"
-	if (!null_terminate(pdata.sender, '!'))
+			total += n;
+		}
+	}
+	return total;
+}
+
+STATIC void irc_ping(Irc server, const struct irc_message *msg) {
+
+	char reply[IRCLEN];
+
+	// Server ping request. Example: "PING :wolfe.freenode.net"
+	if (!msg->param_count)
 		return;
 
-	// Store message destination. Example channel: "#foss-teimes" or private: "fossbot"
-	pdata.target = strtok(pdata.message, " ");
-	if (!pdata.target)
+	snprintf(reply, sizeof(reply), ":%.*s", (int) msg->params[0].len, msg->params[0].ptr);
+	irc_command(server, "PONG", reply);
+}
+
+/** Whether a space separated list has the capability. LS 302 lists may add values. Example: "sasl=PLAIN server-time" */
+static bool cap_listed(struct span caps, const char *cap) {
+
+	const char *ptr = caps.ptr, *end = caps.ptr + caps.len, *next, *equals;
+	size_t len = strlen(cap);
+
+	for (; ptr < end; ptr = next + 1) {
+		next = memchr(ptr, ' ', end - ptr);
+		if (!next)
+			next = end;
+
+		equals = memchr(ptr, '=', next - ptr);
+		if ((size_t) ((equals ? equals : next) - ptr) == len && !memcmp(ptr, cap, len))
+			return true;
+	}
+	return false;
+}
+
+STATIC void irc_cap(Irc server, const struct irc_message *msg) {
+
+	static const char *wanted[] = {"message-tags", "server-time"};
+	char request[IRCLEN] = "REQ :";
+	size_t len = strlen(request);
+	struct span caps;
+
+	// Examples: "CAP * LS * :multi-prefix sasl", "CAP * LS :server-time", "CAP fossbot ACK :server-time"
+	if (msg->param_count < 3)
 		return;
 
-	// If target is not a channel, reply on private back to sender instead
-	if (!strchr(pdata.target, '#'))
-		pdata.target = pdata.sender;
+	if (span_case_eq(msg->params[1], "ACK") || span_case_eq(msg->params[1], "NAK")) {
+		irc_command(server, "CAP", "END");
+		return;
+	}
+	if (!span_case_eq(msg->params[1], "LS"))
+		return;
+
+	caps = msg->params[msg->param_count - 1];
+	for (size_t i = 0; i < sizeof(wanted) / sizeof(wanted[0]); i++)
+		if (cap_listed(caps, wanted[i]))
+			server->caps |= 1u << i;
+
+	// Long lists span multiple lines, all but the last have a "*" before the list
+	if (msg->param_count > 3 && span_case_eq(msg->params[2], "*"))
+		return;
 
-	// Example commands we might receive: ":!url in.gr", ":\x01VERSION\x01"
-	pdata.command = strtok(NULL, " ");
-	if (!pdata.command)
+	if (!server->caps) {
+		irc_command(server, "CAP", "END");
 		return;
+	}
+	for (size_t i = 0; i < sizeof(wanted) / sizeof(wanted[0]); i++)
+		if (server->caps & 1u << i)
+			len += snprintf(request + len, sizeof(request) - len, "%s ", wanted[i]);
+
+	request[len - 1] = '\0'; // Trailing space
+	irc_command(server, "CAP", request);
+}
+
+/** Floods are ignored before they take up a thread, memory or room in the message queue */
+static bool within_limits(Irc server, const struct command_spans *spans, Command *cmd) {
+
+	if (!ratelimit_allow(server->limits[LIMIT_NICK], spans->sender.ptr, spans->sender.len))
+		return false;
 
-	pdata.command++; // Skip leading ":" character
+	// Private messages are already limited by the nick
+	if (spans->target.ptr != spans->sender.ptr)
+		if (!ratelimit_allow(server->limits[LIMIT_CHANNEL], spans->target.ptr, spans->target.len))
+			return false;
 
-	// Grab the rest arguments if any or set null
-	pdata.message = strtok(NULL, "");
+	return ratelimit_allow(server->limits[LIMIT_COMMAND], cmd->name, strlen(cmd->name));
+}
+
+void irc_privmsg(Irc server, const struct irc_message *msg) {
+
+	Command *cmd;
+	const char *end, *space;
+	struct command_spans spans;
+
+	// Only people send messages. Example: "laxanofido"
+	if (!msg->nick.len || msg->param_count < 2)
+		return;
+
+	// Message destination. Example channel: "#foss-teimes" or private: "fossbot"
+	// If target is not a channel, reply on private back to sender instead
+	spans.tags   = msg->tags;
+	spans.sender = msg->nick;
+	spans.target = msg->params[0];
+	if (!memchr(spans.target.ptr, '#', spans.target.len))
+		spans.target = spans.sender;
+
+	// Example commands we might receive: "!url in.gr", "\x01VERSION\x01"
+	if (!msg->params[1].len)
+		return;
 
+	// CTCP requests must begin with ascii char 1 (SOH - start of heading)
+	if (*msg->params[1].ptr == '\x01') {
+		ctcp_handle(server, msg);
+		return;
+	}
 	// Bot commands must begin with '!'
-	if (*pdata.command == '!') {
-		pdata.command++; // Skip leading '!' before passing the command
+	if (*msg->params[1].ptr != '!')
+		return;
 
-		// Query our hash table for any functions registered to BOT commands
-		cmd = command_lookup(pdata.command, strlen(pdata.command));
-		if (cmd)
-			pre_launch_command(server, pdata, cmd);
+	// Skip leading '!' before passing the command and grab the rest arguments if any
+	end = msg->params[1].ptr + msg->params[1].len;
+	spans.command.ptr = msg->params[1].ptr + 1;
+	space = memchr(spans.command.ptr, ' ', end - spans.command.ptr);
+	if (space) {
+		spans.command.len = space - spans.command.ptr;
+		spans.message = (struct span) {space + 1, end - space - 1};
+	} else {
+		spans.command.len = end - spans.command.ptr;
+		spans.message = (struct span) {NULL, 0};
 	}
-	// CTCP requests must begin with ascii char 1 (SOH - start of heading)
-	else if (*pdata.command == '\x01')
-		ctcp_handle(server, pdata);
+	if (spans.message.ptr && !spans.message.len)
+		spans.message.ptr = NULL;
+
+	// Query our hash table for any functions registered to BOT commands
+	cmd = command_lookup(spans.command.ptr, spans.command.len);
+	if (cmd && within_limits(server, &spans, cmd))
+		pre_launch_command(server, &spans, cmd);
+}
+
+STATIC char *append_span(char **dest, struct span src) {
+
+	char *start = *dest;
+
+	if (src.len)
+		memcpy(start, src.ptr, src.len);
+
+	start[src.len] = '\0';
+	*dest += src.len + 1;
+
+	return start;
+}
+
+/** Null terminated copies of the spans go to strings, which must fit command_strlen() bytes */
+static void copy_spans(struct parsed_data *pdata, char *strings, const struct command_spans *spans) {
+
+	pdata->sender  = append_span(&strings, spans->sender);
+	pdata->command = append_span(&strings, spans->command);
+	pdata->target  = append_span(&strings, spans->target);
+	pdata->message = spans->message.ptr ? append_span(&strings, spans->message) : NULL;
+	pdata->tags    = append_span(&strings, spans->tags);
+}
+
+static size_t command_strlen(const struct command_spans *spans) {
+
+	return spans->tags.len + spans->sender.len + spans->command.len + spans->target.len + spans->message.len + 5;
 }
 
-STATIC void pre_launch_command(Irc server, struct parsed_data pdata, Command *cmd) {
+/** Async commands share the reactor's thread, so they get a slot of their own */
+static struct capture **capture_slot(void) {
 
-	pthread_t id;
+	return coro_self() ? (struct capture **) coro_local(CORO_CAPTURE) : &thread_capture;
+}
+
+/** Same arguments modulo whitespace give the same key. Lookup ignores case, so the name is taken from the table
+ *  @returns  false if they don't fit in size */
+STATIC bool memo_key(char *key, size_t size, const char *name, struct span args) {
+
+	size_t len = strlen(name);
+	bool space = true;
+
+	if (len >= size)
+		return false;
+
+	memcpy(key, name, len);
+	for (size_t i = 0; i < args.len; i++) {
+		if (args.ptr[i] == ' ' || args.ptr[i] == '\t') {
+			space = true;
+			continue;
+		}
+		if (len + space + 1 >= size)
+			return false;
+
+		if (space)
+			key[len++] = ' ';
+
+		key[len++] = args.ptr[i];
+		space = false;
+	}
+	key[len] = '\0';
+	return true;
+}
+
+/** Send the lines a previous run of the command captured */
+static void replay_lines(Irc server, const char *target, const char *lines, size_t len) {
+
+	for (const char *line = lines; line < lines + len; line += strlen(line) + 1)
+		send_message(server, target, "%s", line);
+}
+
+static bool replay_memoized(Irc server, struct span target, const char *key) {
+
+	size_t len;
+	char to[IRCLEN + 1], *lines = cache_get(command_cache, key, &len);
+
+	if (!lines)
+		return false;
+
+	replay_lines(server, span_copy(to, sizeof(to), target), lines, len);
+	free(lines);
+	return true;
+}
+
+static void run_command(Command *cmd, Irc server, struct parsed_data pdata) {
+
+	(command_stub ? command_stub : cmd->function)(server, pdata);
+}
+
+/** Wait for an identical command that's already running, otherwise run it and capture its replies for the others */
+static void run_memoized(struct command_info *cmdi, const char *key) {
+
+	Command *cmd = cmdi->cmd;
+	struct capture capture = {cmdi->pdata.target, 0, false, ""};
+	struct capture **slot;
+	size_t len;
+	char *lines;
+
+	switch (flight_join(command_flights, key, deadline_clamp(MEMO_WAIT), (void **) &lines, &len)) {
+	case FLIGHT_DONE:
+		replay_lines(cmdi->server, cmdi->pdata.target, lines, len);
+		free(lines);
+		return;
+	case FLIGHT_LEAD:
+		break;
+	default: // The leader had nothing to share or is too slow
+		run_command(cmd, cmdi->server, cmdi->pdata);
+		return;
+	}
+	// Another leader might have landed after this command was dispatched
+	lines = cache_get(command_cache, key, &len);
+	if (lines) {
+		replay_lines(cmdi->server, cmdi->pdata.target, lines, len);
+		flight_land(command_flights, key, lines, len);
+		free(lines);
+		return;
+	}
+	slot  = capture_slot();
+	*slot = &capture;
+	run_command(cmd, cmdi->server, cmdi->pdata);
+	*slot = NULL;
+	if (!capture.len || capture.discard) {
+		flight_land(command_flights, key, NULL, 0);
+		return;
+	}
+	cache_put(command_cache, key, capture.lines, capture.len, cmd->memoize * MILLISECS);
+	flight_land(command_flights, key, capture.lines, capture.len);
+}
+
+/** Users get a single short notice per ADMIT_NOTICE_INTERVAL, so that shedding doesn't add to the load */
+static void shed_command(Irc server, const struct command_spans *spans, enum admission_verdict verdict) {
+
+	static const char *reasons[] = {
+		[SHED_INFLIGHT] = "too many commands running",
+		[SHED_QUEUE]    = "too many replies queued",
+		[SHED_LATENCY]  = "commands are slow"
+	};
+	char sender[IRCLEN + 1];
+	time_t now = time(NULL);
+
+	fprintf(stderr, "Overloaded (%s), shedding !%.*s\n", reasons[verdict], (int) spans->command.len, spans->command.ptr);
+	if (now - server->shed_notice < ADMIT_NOTICE_INTERVAL)
+		return;
+
+	server->shed_notice = now;
+	send_notice(server, span_copy(sender, sizeof(sender), spans->sender), "Busy, %s. Try again later", reasons[verdict]);
+}
+
+STATIC void pre_launch_command(Irc server, struct command_spans *spans, Command *cmd) {
+
+	enum admission_verdict verdict;
 	struct command_info *cmdi;
+	struct parsed_data pdata;
+	char strings[COMMAND_STRLEN], key[IRCLEN + 1];
 
-	cmdi = malloc_w(sizeof(*cmdi));
-	cmdi->line = malloc_w(IRCLEN + 1);
-	memcpy(cmdi->line, server->line, IRCLEN + 1);
+	// Cheap commands run right away. The copy is only needed because they expect null terminated, writable strings
+	if (cmd->exec == EXEC_INLINE) {
+		assert(command_strlen(spans) <= sizeof(strings));
+		copy_spans(&pdata, strings, spans);
+		run_command(cmd, server, pdata);
+		return;
+	}
+	// The replies are only queued, so a hit is cheap enough for the reactor's thread
+	if (cmd->memoize && command_cache && memo_key(key, sizeof(key), cmd->name, spans->message))
+		if (replay_memoized(server, spans->target, key))
+			return;
+
+	// Shed when overloaded. Inline commands & cache hits got through above and protocol lines never pass here
+	verdict = admission_enter(command_admission, server->mqueue ? mqueue_depth(server->mqueue) : 0);
+	if (verdict != ADMIT) {
+		shed_command(server, spans, verdict);
+		return;
+	}
+	// The command outlives the reader's buffer so copy just the parts it needs
+	cmdi = malloc_w(sizeof(*cmdi) + command_strlen(spans));
 	cmdi->cmd = cmd;
 	cmdi->server = server;
-	cmdi->pdata.sender  = cmdi->line + (pdata.sender  - server->line);
-	cmdi->pdata.command = cmdi->line + (pdata.command - server->line);
-	cmdi->pdata.target  = cmdi->line + (pdata.target  - server->line);
-	cmdi->pdata.message = pdata.message ? cmdi->line + (pdata.message - server->line) : NULL;
-
-	if (pthread_create(&id, NULL, launch_command, cmdi))
-		perror("Could not launch command");
+	clock_gettime(CLOCK_MONOTONIC, &cmdi->dispatched);
+	copy_spans(&cmdi->pdata, cmdi->strings, spans);
+
+	// Drop the command instead of waiting, the reactor thread must never block
+	assert(cmd->exec == EXEC_ASYNC || command_pools[cmd->exec]);
+	if (cmd->exec == EXEC_ASYNC ? !coro_start(launch_command, cmdi) : !pool_submit(command_pools[cmd->exec], launch_command, cmdi)) {
+		fprintf(stderr, "Command pool saturated, dropping !%s from %s\n", cmdi->pdata.command, cmdi->pdata.sender);
+		admission_exit(command_admission, -1);
+		free(cmdi);
+	}
 }
 
-STATIC void *launch_command(void *cmd_info) {
+STATIC void launch_command(void *cmd_info) {
 
 	struct command_info *cmdi = cmd_info;
-
-	pthread_detach(pthread_self());
-	cmdi->cmd->function(cmdi->server, cmdi->pdata);
-
-	free(cmdi->line);
+	struct deadline deadline;
+	Command *cmd = cmdi->cmd;
+	char *message = cmdi->pdata.message, key[IRCLEN + 1];
+	long queued = elapsed_ms(&cmdi->dispatched);
+
+	// Time spent queued counts too, the user is waiting either way
+	if (cmd->deadline)
+		deadline_start(&deadline, cmd->deadline * MILLISECS - queued);
+
+	// Commands may modify their arguments, so the key is made beforehand
+	if (cmd->memoize && command_cache && memo_key(key, sizeof(key), cmd->name, (struct span) {message, message ? strlen(message) : 0}))
+		run_memoized(cmdi, key);
+	else
+		run_command(cmd, cmdi->server, cmdi->pdata);
+
+	if (cmd->deadline) {
+		if (deadline_expired(&deadline))
+			fprintf(stderr, "!%s from %s hit its %u second deadline\n", cmd->name, cmdi->pdata.sender, cmd->deadline);
+		deadline_stop();
+	}
+	// Only the wait tells about overload. A long traceroute is normal and must not shed the cheap commands
+	admission_exit(command_admission, queued);
 	free(cmdi);
-	return NULL;
 }
 
-STATIC void ctcp_handle(Irc server, struct parsed_data pdata) {
+STATIC void ctcp_handle(Irc server, const struct irc_message *msg) {
 
 	time_t now;
 	struct timeval tm;
-	char *now_str, time_micro_str[64];
+	struct span request, args = {NULL, 0};
+	const char *space;
+	char nick[IRCLEN], *now_str, time_micro_str[64];
 
 	now = time(NULL);
 	now_str = ctime(&now);
@@ -333,128 +970,174 @@ STATIC void ctcp_handle(Irc server, struct parsed_data pdata) {
 	gettimeofday(&tm, NULL);
 	snprintf(time_micro_str, 64, "%ld %ld", tm.tv_sec, tm.tv_usec);
 
-	pdata.command++; // Skip the leading escape char
-	if (starts_case_with(pdata.command, "VERSION"))
-		ctcp_reply(server, pdata.sender, "VERSION %s %s", cfg.bot_version, VERSION);
-	else if (starts_case_with(pdata.command, "TIME"))
-		ctcp_reply(server, pdata.sender, "TIME %s", now_str);
-	else if (starts_case_with(pdata.command, "PING"))
-		ctcp_reply(server, pdata.sender, "PING %s", pdata.message ? pdata.message : time_micro_str);
+	// Skip the leading escape char and drop the trailing one. Example: "\x01PING 123456789\x01"
+	request = (struct span) {msg->params[1].ptr + 1, msg->params[1].len - 1};
+	if (request.len && request.ptr[request.len - 1] == '\x01')
+		request.len--;
+
+	space = memchr(request.ptr, ' ', request.len);
+	if (space)
+		args = (struct span) {space + 1, request.ptr + request.len - space - 1};
+
+	span_copy(nick, sizeof(nick), msg->nick);
+	if (span_starts_case_with(request, "VERSION"))
+		ctcp_reply(server, nick, "VERSION %s %s", cfg.bot_version, VERSION);
+	else if (span_starts_case_with(request, "TIME"))
+		ctcp_reply(server, nick, "TIME %s", now_str);
+	else if (span_starts_case_with(request, "PING")) {
+		if (args.len)
+			ctcp_reply(server, nick, "PING %.*s", (int) args.len, args.ptr);
+		else
+			ctcp_reply(server, nick, "PING %s", time_micro_str);
+	}
 }
 
-int numeric_reply(Irc server, struct parsed_data pdata, int reply) {
+/** Add an extra '_' to our nick */
+static void nickname_in_use(Irc server, const struct irc_message *msg) {
 
-	int i;
 	char newnick[NICKLEN];
 
-	switch (reply) {
-	case NICKNAMEINUSE: // Change our nick
-		i = snprintf(newnick, NICKLEN, "%s_", server->nick);
-		if (i >= NICKLEN)
-			exit_msg("maximum nickname length reached");
+	(void) msg;
+	if (snprintf(newnick, NICKLEN, "%s_", server->nick) >= NICKLEN)
+		exit_msg("maximum nickname length reached");
 
-		set_nick(server, newnick);
-		break;
-	case ENDOFMOTD: // Join all set channels
-		server->connected = true;
-		join_channel(server, NULL);
-		break;
-	case BANNEDFROMCHAN: // Find the channel we got banned and remove it from our list
-		pdata.target = strtok(pdata.message, " ");
-		if (!pdata.target)
-			break;
+	set_nick(server, newnick);
+}
 
-		for (i = 0; i < server->channels_set; i++)
-			if (streq(pdata.target, server->channels[i]))
-				break;
+/** Registration is complete, join all set channels */
+static void end_of_motd(Irc server, const struct irc_message *msg) {
 
-		strncpy(server->channels[i], server->channels[--server->channels_set], CHANLEN);
-		break;
+	(void) msg;
+	server->connected = true;
+	join_channel(server, NULL);
+	if (server->reconnected) {
+		server->reconnected = false;
+		mqueue_release(server->mqueue);
 	}
-	return reply;
 }
 
-void irc_notice(Irc server, struct parsed_data pdata) {
+/** Find the channel we got banned from and remove it from our list. Example: "fossbot #foss-teimes :Cannot join" */
+static void banned_from_chan(Irc server, const struct irc_message *msg) {
 
-	char *test;
-	int auth_level;
+	int i;
+	char channel[CHANLEN + 1];
 
-	// Discard hostname from nickname
-	if (!null_terminate(pdata.sender, '!'))
+	if (msg->param_count < 2)
 		return;
 
-	// Notice destination
-	pdata.target = strtok(pdata.message, " ");
-	if (!pdata.target)
-		return;
+	span_copy(channel, sizeof(channel), msg->params[1]);
+	for (i = 0; i < server->channels_set; i++)
+		if (streq(channel, server->channels[i]))
+			break;
 
-	// Grab the message
-	pdata.message = strtok(NULL, "");
-	if (!pdata.message)
-		return;
+	if (i < server->channels_set)
+		strncpy(server->channels[i], server->channels[--server->channels_set], CHANLEN);
+}
 
-	// Skip leading ':'
-	pdata.message++;
+message_handler irc_register_numeric(int numeric, message_handler handler) {
 
-	if (!streq(pdata.sender, "NickServ"))
-		return;
+	message_handler previous;
 
-	test = strstr(pdata.message, "ACC");
-	if (test) {
-		auth_level = atoi(test + 4);
-		if (sock_write(server->pipe[WR], &auth_level, 4) != 4)
-			perror(__func__);
-	} else if (starts_with(pdata.message, "This nickname is registered") && *cfg.nick_password) {
-		send_message(server, pdata.sender, "identify %s", cfg.nick_password);
-		memset(cfg.nick_password, '\0', strlen(cfg.nick_password));
-	}
+	assert(numeric > 0 && numeric < IRC_NUMERICS);
+	previous = numeric_handlers[numeric];
+	numeric_handlers[numeric] = handler;
+	return previous;
+}
+
+int numeric_reply(Irc server, const struct irc_message *msg, int reply) {
+
+	if (numeric_handlers[reply])
+		numeric_handlers[reply](server, msg);
+
+	return reply;
 }
 
-void irc_kick(Irc server, struct parsed_data pdata) {
+void irc_notice(Irc server, const struct irc_message *msg) {
 
-	char *victim;
+	struct acc_reply reply = {0};
+	struct span text;
+	const char *acc, *end;
+	char sender[NICKLEN + 1];
 
-	// Discard hostname from nickname
-	if (!null_terminate(pdata.sender, '!'))
+	// Notice destination and message. Example: "fossbot :This nickname is registered"
+	if (!msg->nick.len || msg->param_count < 2)
 		return;
 
-	// Which channel did the kick happen
-	pdata.target = strtok(pdata.message, " ");
-	if (!pdata.target)
+	if (!span_case_eq(msg->nick, "NickServ"))
 		return;
 
-	// Who got kicked
-	victim = strtok(NULL, " ");
-	if (!victim)
+	// Example: "freestyl3r ACC 3". The nick tells which question it answers
+	text = msg->params[1];
+	acc = memmem(text.ptr, text.len, " ACC ", 5);
+	if (acc) {
+		span_copy(reply.nick, sizeof(reply.nick), (struct span) {text.ptr, acc - text.ptr});
+		end = text.ptr + text.len;
+		for (acc += 5; acc < end && *acc >= '0' && *acc <= '9'; acc++)
+			reply.level = reply.level * 10 + (*acc - '0');
+
+		if (sock_write(server->pipe[WR], &reply, sizeof(reply)) != sizeof(reply))
+			perror(__func__);
+	} else if (span_starts_with(text, "This nickname is registered") && server->nick_password && *server->nick_password) {
+		send_message(server, span_copy(sender, sizeof(sender), msg->nick), "identify %s", server->nick_password);
+		memset(server->nick_password, '\0', strlen(server->nick_password));
+	}
+}
+
+void irc_kick(Irc server, const struct irc_message *msg) {
+
+	char channel[CHANLEN + 1], kicker[IRCLEN];
+
+	// Which channel did the kick happen and who got kicked. Example: "#foss-teimes fossbot :reason"
+	if (!msg->nick.len || msg->param_count < 2)
 		return;
 
 	// Rejoin and send a message back to the one who kicked us
-	if (streq(victim, server->nick)) {
+	if (msg->params[1].len == strlen(server->nick) && !memcmp(msg->params[1].ptr, server->nick, msg->params[1].len)) {
 #ifndef TEST
 		sleep(5);
 #endif
-		join_channel(server, pdata.target);
-		send_message(server, pdata.target, "magkas %s...", pdata.sender);
+		span_copy(channel, sizeof(channel), msg->params[0]);
+		span_copy(kicker, sizeof(kicker), msg->nick);
+		join_channel(server, channel);
+		send_message(server, channel, "magkas %s...", kicker);
 	}
 }
 
 void _irc_command(Irc server, const char *type, const char *target, const char *format, ...) {
 
 	va_list args;
+	size_t len;
+	struct capture *capture = *capture_slot();
 	char msg[IRCLEN - 50], irc_msg[IRCLEN];
 
 	if (format) {
 		va_start(args, format);
-		vsnprintf(msg, sizeof(msg), format, args);
+		len = vsnprintf(msg, sizeof(msg), format, args);
 		snprintf(irc_msg, IRCLEN, "%s %s :%s\r\n", type, target, msg);
 		va_end(args);
+
+		// Only the replies to the requester can be replayed, a different target means a side effect
+		if (capture && !strcmp(type, "PRIVMSG") && !strcmp(target, capture->target)) {
+			len = MIN(len, sizeof(msg) - 1);
+			if (capture->len + len + 1 > sizeof(capture->lines))
+				capture->discard = true;
+			else {
+				memcpy(capture->lines + capture->len, msg, len + 1);
+				capture->len += len + 1;
+			}
+		} else if (capture)
+			capture->discard = true;
 	} else
 		snprintf(irc_msg, IRCLEN, "%s %s\r\n", type, target);
 
 #ifdef TEST
 	sock_write(server->conn, irc_msg, strlen(irc_msg));
 #else
-	mqueue_send(server->mqueue, irc_msg);
+	// Replies can't take the slots reserved for protocol lines
+	if (format && (!strcmp(type, "PRIVMSG") || !strcmp(type, "NOTICE")))
+		mqueue_send_reply(server->mqueue, irc_msg);
+	else
+		mqueue_send(server->mqueue, irc_msg);
 #endif
 }
 
@@ -465,14 +1148,84 @@ void quit_server(Irc server, const char *msg) {
 	assert(msg);
 	strncat(buf, msg, QUITLEN - 1);
 	irc_command(server, "QUIT", buf);
+	mqueue_destroy(server->mqueue); // Flushes QUIT
+	tls_close(server->tls);
 
-	if (close(server->conn))
+	if (server->conn != -1 && close(server->conn))
 		perror(__func__);
 
+	reader_destroy(server->reader);
 	if (pthread_mutex_destroy(server->mtx))
 		perror(__func__);
 
-	mqueue_destroy(server->mqueue);
+	for (int i = 0; i < LIMITS; i++)
+		ratelimit_destroy(server->limits[i]);
+
 	free(server->mtx);
 	free(server);
 }
+
+void irc_disconnect(Irc server) {
+
+	if (server->conn == -1)
+		return;
+
+	mqueue_disconnect(server->mqueue);
+	tls_close(server->tls);
+	server->tls = NULL;
+	if (close(server->conn))
+		perror(__func__);
+
+	server->conn = -1;
+	server->connected = false;
+}
+
+bool irc_reconnect(Irc server) {
+
+	int sock;
+	Tls tls = NULL;
+
+	irc_disconnect(server);
+	sock = sock_connect(server->address, server->port);
+	if (sock < 0)
+		return false;
+
+	if (server->secure) {
+		tls = tls_connect(sock, server->address, server->port);
+		if (!tls) {
+			close(sock);
+			return false;
+		}
+	}
+	if (fcntl(sock, F_SETFL, O_NONBLOCK)) {
+		perror(__func__);
+		tls_close(tls);
+		close(sock);
+		return false;
+	}
+	server->conn = sock;
+	server->tls  = tls;
+	reader_destroy(server->reader);
+	server->reader = reader_init(sock);
+	mqueue_connect(server->mqueue, sock, tls);
+
+	// Register again. Channels are joined on ENDOFMOTD and then the kept lines are sent
+	server->reconnected = true;
+	irc_command(server, "NICK", server->nick);
+	send_user(server);
+
+	return true;
+}
+
+long reconnect_delay(unsigned attempt) {
+
+	long delay = RECONNECT_BASE_DELAY;
+
+	// Exponential growth with "equal jitter": half of the delay is fixed and the other half random
+	while (attempt-- && delay < RECONNECT_MAX_DELAY)
+		delay *= 2;
+
+	delay = MIN(delay, RECONNECT_MAX_DELAY);
+
+	return delay / 2 + random() % (delay / 2 + 1);
+}
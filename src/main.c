@@ -1,64 +1,432 @@
 #include <stdio.h>
-#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
 #include "init.h"
 #include "irc.h"
+#include "event.h"
+#include "uring.h"
+#include "socket.h"
 #include "murmur.h"
 #include "mpd.h"
+#include "replay.h"
+#include "coro.h"
 #include "common.h"
 
-struct pollfd pfd[TOTAL];
+extern char *record_file_arg;
+extern char *replay_file_arg;
+extern bool replay_realtime_arg;
 
-int main(int argc, char *argv[]) {
+int fds[TOTAL] = {-1, -1, -1};
 
+/** Per connection state. Everything else, from the database to the HTTP stack, is shared by all networks */
+struct network {
 	Irc server;
-	FILE *fifo;
-	int fd_args[3] = {0};
-	int ready, operation;
+	Reactor r;
+	Event event;           //!< Readable connection when read with epoll
+	Uring_op op;           //!< Multishot receive when read with io_uring
+	Event idle_timer;
+	Event reconnect_timer;
+	unsigned reconnect_attempts;
+};
+
+static struct network networks[MAXNETWORKS];
+static Irc server; //!< MPD, Murmur & FIFO announcements go to the first network
+static FILE *fifo;
+static Reader fifo_reader;
+static Uring uring;
+static Uring_op murm_op;
+static Event murm_listen;
+static int exit_status = EXIT_FAILURE;
+
+static void disconnect(struct network *net);
+
+static void irc_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	ssize_t n;
+	struct network *net = data;
+
+	(void) r;
+	(void) ev;
+	(void) events;
+
+	// Read & parse all available lines and act on any registered actions found
+	while ((n = parse_irc_line(net->server)) > 0);
+	if (!n) {
+		disconnect(net);
+		return;
+	}
+	timer_set(net->idle_timer, IDLE_TIMEOUT, 0);
+}
+
+static void irc_recv_handler(void *data, char *buf, ssize_t res) {
+
+	struct network *net = data;
 
-	for (int i = 0; i < TOTAL; i++) {
-		pfd[i].fd = -1;
-		pfd[i].events = POLLIN;
+	if (res == -ECANCELED) // Dropped by disconnect()
+		return;
+
+	if (res <= 0) {
+		net->op = NULL; // Already finished, don't cancel it
+		disconnect(net);
+		return;
 	}
-	operation    = initialize(argc, argv, fd_args);
-	pfd[IRC].fd  = setup_irc(&server, fd_args);
-	pfd[MPD].fd  = setup_mpd();
-	pfd[FIFO].fd = setup_fifo(&fifo);
-	setup_mumble(pfd, fd_args);
+	parse_irc_buffer(net->server, buf, res);
+	timer_set(net->idle_timer, IDLE_TIMEOUT, 0);
+}
 
-	if (operation)
-		send_message(server, default_channel(server), "%s to version %s", operation > 0 ? "upgraded" : "downgraded", VERSION);
+static void watch_irc(struct network *net) {
+
+	int fd = get_socket(net->server);
+
+	// The first network's connection survives upgrades
+	if (net == networks)
+		fds[IRC] = fd;
+
+	// Encrypted data has to go through openssl, so TLS connections are always read with epoll
+	if (uring && !get_tls(net->server)) {
+		net->op = uring_recv(uring, fd, irc_recv_handler, net);
+		if (!net->op)
+			exit_msg("io_uring submission failed");
+	} else
+		net->event = reactor_add_fd(net->r, fd, EPOLLIN, irc_handler, net);
+}
+
+/** Stop watching the connection, drop it and schedule the next attempt to reconnect */
+static void disconnect(struct network *net) {
+
+	long delay;
+
+	if (net->event)
+		reactor_remove(net->r, net->event);
+	if (net->op)
+		uring_cancel(uring, net->op);
+
+	net->event = NULL;
+	net->op    = NULL;
+	irc_disconnect(net->server);
+	if (net == networks)
+		fds[IRC] = -1;
+
+	delay = reconnect_delay(net->reconnect_attempts++);
+	fprintf(stderr, "IRC connection to %s lost, reconnecting in %ld ms...\n", cfg.networks[net - networks].server, delay);
+	timer_set(net->idle_timer, 0, 0);
+	timer_set(net->reconnect_timer, delay, 0);
+}
+
+static void reconnect(void *data) {
+
+	struct network *net = data;
+
+	if (!irc_reconnect(net->server)) {
+		disconnect(net);
+		return;
+	}
+	net->reconnect_attempts = 0;
+	watch_irc(net);
+	timer_set(net->idle_timer, IDLE_TIMEOUT, 0);
+}
 
-	while ((ready = poll(pfd, TOTAL, POLL_TIMEOUT)) > 0) {
-		// Read & parse all available lines and act on any registered actions found
-		if (pfd[IRC].revents & POLLIN)
-			while (parse_irc_line(server) > 0);
-
-		if (pfd[MURM_LISTEN].revents & POLLIN) {
-			pfd[MURM_ACCEPT].fd = accept_murmur_connection(pfd[MURM_LISTEN].fd);
-			if (pfd[MURM_ACCEPT].fd > 0)
-				pfd[MURM_LISTEN].events = 0; // Stop listening for connections
-		}
-		if (pfd[MURM_ACCEPT].revents & POLLIN) {
-			if (!listen_murmur_callbacks(server, pfd[MURM_ACCEPT].fd)) {
-				pfd[MURM_ACCEPT].fd = -1;
-				pfd[MURM_LISTEN].events = POLLIN; // Start listening again for Murmur connections
-			}
-		}
-		if (pfd[MPD].revents & POLLIN)
-			if (!print_song(server, default_channel(server)))
-				pfd[MPD].fd = mpd_connect(cfg.mpd_port);
-
-		if (pfd[FIFO].revents & POLLIN)
-			send_all_lines(server, default_channel(server), fifo);
+static void reconnect_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	(void) r;
+	(void) ev;
+	(void) events;
+
+	// Resolving, connecting & the handshake wait on a coroutine, so that a dead network doesn't hold up the rest
+	if (!coro_start(reconnect, data))
+		disconnect(data);
+}
+
+static void idle_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	(void) r;
+	(void) ev;
+	(void) events;
+
+	// Server stopped responding without closing the connection
+	fprintf(stderr, "%d minutes passed without getting a message\n", IDLE_TIMEOUT / MILLISECS / 60);
+	disconnect(data);
+}
+
+static void signal_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	(void) ev;
+	(void) events;
+	(void) data;
+
+	fprintf(stderr, "Terminated by signal, exiting...\n");
+	exit_status = EXIT_SUCCESS;
+	reactor_stop(r);
+}
+
+static void murmur_accept_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	(void) events;
+	(void) data;
+
+	if (!listen_murmur_callbacks(server, fds[MURM_ACCEPT])) {
+		reactor_remove(r, ev);
+		fds[MURM_ACCEPT] = -1;
+		event_modify(r, murm_listen, EPOLLIN); // Start listening again for Murmur connections
 	}
-	// If we reach here, it means we got disconnected from server. Exit with error (1)
-	if (ready == -1)
-		perror("poll");
+}
+
+static void murmur_recv_handler(void *data, char *buf, ssize_t res) {
+
+	Reactor r = data;
+
+	if (res == -ECANCELED || (res > 0 && parse_murmur_callback(server, buf, res)))
+		return;
+
+	// Stop receiving before closing, since the pending receive keeps the socket alive
+	if (res > 0)
+		uring_cancel(uring, murm_op);
+
+	close(fds[MURM_ACCEPT]);
+	fds[MURM_ACCEPT] = -1;
+	event_modify(r, murm_listen, EPOLLIN); // Start listening again for Murmur connections
+}
+
+static void watch_murmur(Reactor r, int fd) {
+
+	if (uring)
+		murm_op = uring_recv(uring, fd, murmur_recv_handler, r);
 	else
-		fprintf(stderr, "%d minutes passed without getting a message, exiting...\n", POLL_TIMEOUT / MILLISECS / 60);
+		reactor_add_fd(r, fd, EPOLLIN, murmur_accept_handler, NULL);
+}
+
+static void murmur_listen_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	(void) events;
+	(void) data;
+
+	fds[MURM_ACCEPT] = accept_murmur_connection(fds[MURM_LISTEN]);
+	if (fds[MURM_ACCEPT] > 0) {
+		watch_murmur(r, fds[MURM_ACCEPT]);
+		event_modify(r, ev, 0); // Stop listening for connections
+	}
+}
+
+static void mpd_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	int fd;
 
+	(void) events;
+	(void) data;
+
+	if (!print_song(server, default_channel(server))) {
+		reactor_remove(r, ev);
+		fd = mpd_connect(cfg.mpd_port);
+		if (fd >= 0)
+			reactor_add_fd(r, fd, EPOLLIN, mpd_handler, NULL);
+	}
+}
+
+static void fifo_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	(void) r;
+	(void) ev;
+	(void) events;
+	(void) data;
+
+	send_all_lines(server, default_channel(server), fifo);
+}
+
+static void fifo_recv_handler(void *data, char *buf, ssize_t res) {
+
+	size_t used, n;
+	struct line lines[READER_MAXLINES];
+
+	(void) data;
+
+	// The last writer closed it. Others may open it later, so keep reading
+	if (!res) {
+		if (!uring_read(uring, fileno(fifo), fifo_recv_handler, NULL))
+			exit_msg("io_uring submission failed");
+		return;
+	}
+	if (res < 0) {
+		if (res != -ECANCELED)
+			fprintf(stderr, "FIFO read failed: %s\n", strerror(-res));
+		return;
+	}
+	while (res) {
+		used = reader_feed(fifo_reader, buf, res);
+		buf += used;
+		res -= used;
+		while ((n = reader_getlines(fifo_reader, lines, READER_MAXLINES)))
+			for (size_t i = 0; i < n; i++)
+				if (lines[i].len > 1) // Only print if line is not empty
+					send_message(server, default_channel(server), "%s", lines[i].buf);
+	}
+}
+
+/** Stands in for every command during a replay. The reply still takes the usual path */
+static void replay_command(Irc server, struct parsed_data pdata) {
+
+	send_message(server, pdata.target, "!%s", pdata.command);
+}
+
+static bool replay_finished;
+static ssize_t replayed;
+
+static void replay_done_handler(void *data, ssize_t lines) {
+
+	(void) data;
+
+	replayed = lines;
+	replay_finished = true;
+}
+
+/** Stop once the recording is over and the commands it started are done, so that the server outlives them */
+static void replay_drain_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	(void) ev;
+	(void) events;
+	(void) data;
+
+	if (replay_finished && !commands_inflight())
+		reactor_stop(r);
+}
+
+/** Feed a recording to the first network and report the throughput. Its replies are written to /dev/null */
+static int replay(Reactor r) {
+
+	int fd, status = EXIT_SUCCESS;
+	Player player;
+	Event drain;
+	double secs;
+	bool interrupted;
+	struct timespec start, end;
+	struct network_options net = cfg.networks[0];
+
+	fd = open("/dev/null", O_WRONLY);
+	if (fd < 0)
+		exit_msg("/dev/null: %s", strerror(errno));
+
+	net.tls = false; // There is no one to do the handshake with
+	server = setup_irc(r, NULL, &net, fd);
+	mqueue_unthrottle(get_mqueue(server));
+	set_command_stub(replay_command);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	player = replay_file(r, server, replay_file_arg, replay_realtime_arg, replay_done_handler, NULL);
+	if (!player) {
+		quit_server(server, cfg.quit_message);
+		return EXIT_FAILURE;
+	}
+	drain = reactor_add_timer(r, REPLAY_POLL, REPLAY_POLL, replay_drain_handler, NULL);
+	if (!drain)
+		exit_msg("replay: timer creation failed");
+
+	if (reactor_run(r))
+		status = EXIT_FAILURE;
+
+	// A signal stops feeding, but the commands already running still need their server
+	interrupted = !replay_finished;
+	replay_finished = true;
+	replay_destroy(player);
+	while (commands_inflight())
+		reactor_run(r);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	reactor_remove(r, drain);
+	stop_commands();
 	quit_server(server, cfg.quit_message);
+	if (interrupted || status == EXIT_FAILURE)
+		return status;
+
+	secs = end.tv_sec - start.tv_sec + (double) (end.tv_nsec - start.tv_nsec) / NANOSECS;
+	fprintf(stderr, "Replayed %zd lines in %.3f s, %.0f lines/s\n", replayed, secs, replayed / secs);
+	return status;
+}
+
+int main(int argc, char *argv[]) {
+
+	Reactor r;
+	Recorder recorder = NULL;
+	int fd_args[3] = {0};
+	int mpdfd, operation;
+
+	r = reactor_init();
+	if (!r)
+		exit_msg("reactor initialization failed");
+
+	// Must happen before any thread is created, so that all of them block the signals
+	reactor_add_signal(r, SIGINT,  signal_handler, NULL);
+	reactor_add_signal(r, SIGTERM, signal_handler, NULL);
+
+	operation = initialize(argc, argv, fd_args);
+	if (!coro_init(r))
+		exit_msg("coroutine initialization failed");
+
+	if (replay_file_arg) {
+		exit_status = replay(r);
+		coro_cleanup();
+		reactor_destroy(r);
+		cleanup();
+		return exit_status;
+	}
+	if (cfg.io_uring) {
+		uring = uring_init(r);
+		if (!uring)
+			fprintf(stderr, "io_uring is not supported, falling back to epoll\n");
+	}
+	for (int i = 0; i < cfg.networks_set; i++) {
+		networks[i].r = r;
+		networks[i].server = setup_irc(r, uring, &cfg.networks[i], i ? 0 : fd_args[IRC]);
+		networks[i].idle_timer      = reactor_add_timer(r, IDLE_TIMEOUT, 0, idle_handler, &networks[i]);
+		networks[i].reconnect_timer = reactor_add_timer(r, 0, 0, reconnect_handler, &networks[i]);
+		watch_irc(&networks[i]);
+	}
+	server = networks[0].server;
+	if (record_file_arg) {
+		recorder = recorder_open(record_file_arg);
+		if (!recorder)
+			exit_msg("%s: recording failed", record_file_arg);
+
+		set_recorder(server, recorder);
+	}
+	mpdfd  = setup_mpd();
+	setup_mumble(fds, fd_args);
+	setup_fifo(&fifo);
+
+	if (uring) {
+		fifo_reader = reader_init(fileno(fifo));
+		if (!uring_read(uring, fileno(fifo), fifo_recv_handler, NULL))
+			exit_msg("io_uring submission failed");
+	} else
+		reactor_add_fd(r, fileno(fifo), EPOLLIN, fifo_handler, NULL);
+	if (mpdfd >= 0)
+		reactor_add_fd(r, mpdfd, EPOLLIN, mpd_handler, NULL);
+
+	if (fds[MURM_LISTEN] >= 0)
+		murm_listen = reactor_add_fd(r, fds[MURM_LISTEN], fds[MURM_ACCEPT] > 0 ? 0 : EPOLLIN, murmur_listen_handler, NULL);
+
+	if (fds[MURM_ACCEPT] > 0)
+		watch_murmur(r, fds[MURM_ACCEPT]);
+
+	if (operation)
+		send_message(server, default_channel(server), "%s to version %s", operation > 0 ? "upgraded" : "downgraded", VERSION);
+
+	if (reactor_run(r))
+		exit_status = EXIT_FAILURE;
+
+	stop_commands();
+	for (int i = 0; i < cfg.networks_set; i++)
+		quit_server(networks[i].server, cfg.quit_message);
+
+	recorder_close(recorder);
+
 	fclose(fifo);
+	reader_destroy(fifo_reader);
+	uring_destroy(uring);
+	coro_cleanup();
+	reactor_destroy(r);
 	cleanup();
-	return 1;
+	return exit_status;
 }
@@ -162,7 +162,7 @@ int mpd_connect(const char *port) {
 	char buf[64];
 	bool status;
 
-	mpd->fd = sock_connect(LOCALHOST, port);
+	mpd->fd = sock_connect(LOCALHOST_ANY, port);
 	if (mpd->fd < 0)
 		return -1;
 
@@ -4,12 +4,24 @@
 #include <stdint.h>
 #include <netinet/in.h>
 #include <errno.h>
+#include <sys/epoll.h>
 #include "socket.h"
 #include "irc.h"
 #include "murmur.h"
+#include "deadline.h"
 #include "common.h"
 #include "init.h"
 
+/** A blocking read would stall the reactor when called from a coroutine and could outlive the command's deadline,
+ *  so wait for the reply first */
+static ssize_t murmur_read(int murmfd, void *buffer, size_t len) {
+
+	if (!deadline_wait_fd(murmfd, EPOLLIN, MURMUR_TIMEOUT))
+		return -1;
+
+	return sock_read(murmfd, buffer, len);
+}
+
 STATIC int murmur_connect(const char *port) {
 
 	int murmfd;
@@ -21,11 +33,11 @@ STATIC int murmur_connect(const char *port) {
 		0x41, 0x01, 0x00, 0x15, 0x00, 0x00, 0x00, 0x01, 0x00, 0x0e, 0x3a, 0x3a, 0x4d, 0x75, 0x72, 0x6d,
 		0x75, 0x72, 0x3a, 0x3a, 0x4d, 0x65, 0x74, 0x61
 	};
-	murmfd = sock_connect(LOCALHOST, port);
+	murmfd = sock_connect(LOCALHOST_ANY, port);
 	if (murmfd < 0)
 		return -1;
 
-	if (sock_read(murmfd, read_buffer, READ_BUFFER_SIZE) != VALIDATE_CONNECTION_PACKET_SIZE) {
+	if (murmur_read(murmfd, read_buffer, READ_BUFFER_SIZE) != VALIDATE_CONNECTION_PACKET_SIZE) {
 		fprintf(stderr, "Error: Failed to receive validate_packet\n");
 		goto cleanup;
 	}
@@ -33,7 +45,7 @@ STATIC int murmur_connect(const char *port) {
 		fprintf(stderr, "Error: Failed to send ice_isA_packet\n");
 		goto cleanup;
 	}
-	if (sock_read(murmfd, read_buffer, READ_BUFFER_SIZE) != ICE_ISA_REPLY_PACKET_SIZE) {
+	if (murmur_read(murmfd, read_buffer, READ_BUFFER_SIZE) != ICE_ISA_REPLY_PACKET_SIZE) {
 		fprintf(stderr, "Error: Failed to receive ice_isA_packet success reply\n");
 		goto cleanup;
 	}
@@ -101,7 +113,7 @@ char *fetch_murmur_users(void) {
 		close(murmfd);
 		return NULL;
 	}
-	if (sock_read(murmfd, read_buffer, USERLIST_BUFFER_SIZE) < 0) {
+	if (murmur_read(murmfd, read_buffer, USERLIST_BUFFER_SIZE) < 0) {
 		fprintf(stderr, "Error: Failed to receive getUsers_packet reply\n");
 		close(murmfd);
 		return NULL;
@@ -153,23 +165,37 @@ int accept_murmur_connection(int murm_listenfd) {
 	return murm_acceptfd;
 }
 
-bool listen_murmur_callbacks(Irc server, int murm_acceptfd) {
+bool parse_murmur_callback(Irc server, char *packet, size_t len) {
 
-	char *username, read_buffer[READ_BUFFER_SIZE];
+	char *username;
+	size_t username_len;
 
-	errno = 0;
-	while (sock_read(murm_acceptfd, read_buffer, sizeof(read_buffer)) > 0) {
-		/* Close connection when related packet received */
-		if (read_buffer[8] == 0x4)
-			break;
+	/* Close connection when related packet received */
+	if (len > 8 && packet[8] == 0x4)
+		return false;
 
-		/* Determine if received packet represents userConnected callback */
-		if (read_buffer[62] == 'C') {
-			username = read_buffer + 99;
-			username[(unsigned char) *(username - 1)] = '\0';
+	/* Determine if received packet represents userConnected callback */
+	if (len > 99 && packet[62] == 'C') {
+		username = packet + 99;
+		username_len = (unsigned char) *(username - 1);
+		if (99 + username_len < len) { // Terminate it in place, the packet continues after the name
+			username[username_len] = '\0';
 			send_message(server, default_channel(server), "Mumble: %s connected", username);
 		}
 	}
+	return true;
+}
+
+bool listen_murmur_callbacks(Irc server, int murm_acceptfd) {
+
+	ssize_t n;
+	char read_buffer[READ_BUFFER_SIZE];
+
+	errno = 0;
+	while ((n = sock_read(murm_acceptfd, read_buffer, sizeof(read_buffer))) > 0)
+		if (!parse_murmur_callback(server, read_buffer, n))
+			break;
+
 	if (errno == EAGAIN)
 		return true;
 
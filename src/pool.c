@@ -0,0 +1,223 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <pthread.h>
+#include "pool.h"
+#include "common.h"
+
+struct task {
+	pool_task function;
+	void *arg;
+};
+
+/** Ring of tasks. The owner takes the oldest from the head, thieves take the newest from the tail */
+struct deque {
+	pthread_mutex_t mtx;
+	struct task *tasks;
+	int head;
+	int count;
+};
+
+struct worker {
+	Pool pool;
+	int id;
+	pthread_t tid;
+	struct deque deque;
+};
+
+/** Submitting & taking tasks only lock the deque involved, the mutex is for workers going to sleep or waking them */
+struct pool {
+	pthread_mutex_t mtx;
+	pthread_cond_t work;
+	int ready;           //!< Atomic. Tasks in the deques, or about to be. Workers sleep while it's 0
+	int sleeping;        //!< Atomic. Workers waiting on the condition, or about to
+	int capacity;
+	bool stop;           //!< Protected by mtx
+	unsigned next;       //!< Atomic. Worker to queue the next task on
+	int started;         //!< Threads to join on destroy
+	size_t submitted, rejected, stolen; //!< Atomic
+	int workers;
+	struct worker worker[];
+};
+
+static bool push(struct deque *d, int capacity, struct task task) {
+
+	bool pushed = false;
+
+	pthread_mutex_lock(&d->mtx);
+	if (d->count < capacity) {
+		d->tasks[(d->head + d->count++) % capacity] = task;
+		pushed = true;
+	}
+	pthread_mutex_unlock(&d->mtx);
+	return pushed;
+}
+
+static bool pop(struct deque *d, int capacity, bool oldest, struct task *task) {
+
+	bool popped = false;
+
+	pthread_mutex_lock(&d->mtx);
+	if (d->count) {
+		if (oldest) {
+			*task = d->tasks[d->head];
+			d->head = (d->head + 1) % capacity;
+		} else
+			*task = d->tasks[(d->head + d->count - 1) % capacity];
+
+		d->count--;
+		popped = true;
+	}
+	pthread_mutex_unlock(&d->mtx);
+	return popped;
+}
+
+/** Take from our own deque first, then try the other workers' in turn */
+static bool take(struct worker *w, struct task *task) {
+
+	Pool pool = w->pool;
+	bool stolen = false;
+
+	if (!pop(&w->deque, pool->capacity, true, task)) {
+		for (int i = 1; i < pool->workers && !stolen; i++)
+			stolen = pop(&pool->worker[(w->id + i) % pool->workers].deque, pool->capacity, false, task);
+
+		if (!stolen)
+			return false;
+	}
+	__atomic_sub_fetch(&pool->ready, 1, __ATOMIC_SEQ_CST);
+	if (stolen)
+		__atomic_add_fetch(&pool->stolen, 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+static void *work(void *arg) {
+
+	struct worker *w = arg;
+	Pool pool = w->pool;
+	struct task task;
+
+	for (;;) {
+		if (take(w, &task)) {
+			task.function(task.arg);
+			continue;
+		}
+		// A submitter may be between counting a task and pushing it, or another worker between taking one and
+		// uncounting it, in that case we just retry. Announcing ourselves before checking ready pairs with
+		// pool_submit() counting the task before checking sleeping, so one of us sees the other
+		pthread_mutex_lock(&pool->mtx);
+		__atomic_add_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+		while (!__atomic_load_n(&pool->ready, __ATOMIC_SEQ_CST) && !pool->stop)
+			pthread_cond_wait(&pool->work, &pool->mtx);
+
+		__atomic_sub_fetch(&pool->sleeping, 1, __ATOMIC_SEQ_CST);
+		if (!__atomic_load_n(&pool->ready, __ATOMIC_SEQ_CST) && pool->stop) {
+			pthread_mutex_unlock(&pool->mtx);
+			return NULL;
+		}
+		pthread_mutex_unlock(&pool->mtx);
+	}
+}
+
+Pool pool_init(int workers, int capacity, size_t stack_size) {
+
+	Pool pool;
+	pthread_attr_t attr;
+	int error = 0;
+
+	if (workers < 1 || workers > POOL_MAXWORKERS || capacity < 1)
+		return NULL;
+
+	pool = calloc_w(sizeof(*pool) + workers * sizeof(*pool->worker));
+	pthread_mutex_init(&pool->mtx, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pool->capacity = capacity;
+	pool->workers  = workers;
+
+	// Any deque might end up holding every queued task
+	for (int i = 0; i < workers; i++) {
+		pool->worker[i].pool = pool;
+		pool->worker[i].id   = i;
+		pthread_mutex_init(&pool->worker[i].deque.mtx, NULL);
+		pool->worker[i].deque.tasks = malloc_w(capacity * sizeof(struct task));
+	}
+	pthread_attr_init(&attr);
+	if (stack_size)
+		error = pthread_attr_setstacksize(&attr, MAX(stack_size, (size_t) PTHREAD_STACK_MIN));
+
+	while (!error && pool->started < workers) {
+		error = pthread_create(&pool->worker[pool->started].tid, &attr, work, &pool->worker[pool->started]);
+		if (!error)
+			pool->started++;
+	}
+
+	if (error)
+		goto cleanup;
+
+	pthread_attr_destroy(&attr);
+	return pool;
+
+cleanup:
+	fprintf(stderr, "%s: %s\n", __func__, strerror(error));
+	pthread_attr_destroy(&attr);
+	pool_destroy(pool);
+	return NULL;
+}
+
+bool pool_submit(Pool pool, pool_task task, void *arg) {
+
+	struct worker *w;
+	int ready = __atomic_load_n(&pool->ready, __ATOMIC_SEQ_CST);
+
+	// Claim a place first, so that the pushes below always fit since ready counts the tasks of all deques
+	do
+		if (ready == pool->capacity) {
+			__atomic_add_fetch(&pool->rejected, 1, __ATOMIC_RELAXED);
+			return false;
+		}
+	while (!__atomic_compare_exchange_n(&pool->ready, &ready, ready + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+
+	w = &pool->worker[__atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED) % pool->workers];
+	push(&w->deque, pool->capacity, (struct task) {task, arg});
+	__atomic_add_fetch(&pool->submitted, 1, __ATOMIC_RELAXED);
+
+	// Taking the mutex means the worker is either not asleep yet & will see ready, or already waiting
+	if (__atomic_load_n(&pool->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pool->mtx);
+		pthread_cond_signal(&pool->work);
+		pthread_mutex_unlock(&pool->mtx);
+	}
+	return true;
+}
+
+void pool_stats(Pool pool, struct pool_stats *stats) {
+
+	stats->submitted = __atomic_load_n(&pool->submitted, __ATOMIC_RELAXED);
+	stats->rejected  = __atomic_load_n(&pool->rejected, __ATOMIC_RELAXED);
+	stats->stolen    = __atomic_load_n(&pool->stolen, __ATOMIC_RELAXED);
+}
+
+void pool_destroy(Pool pool) {
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->mtx);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->mtx);
+
+	for (int i = 0; i < pool->started; i++)
+		pthread_join(pool->worker[i].tid, NULL);
+
+	for (int i = 0; i < pool->workers; i++) {
+		pthread_mutex_destroy(&pool->worker[i].deque.mtx);
+		free(pool->worker[i].deque.tasks);
+	}
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->mtx);
+	free(pool);
+}
@@ -2,10 +2,19 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
 #include <time.h>
-#include <pthread.h>
 #include <assert.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
 #include "queue.h"
+#include "ratelimit.h"
+#include "event.h"
+#include "uring.h"
+#include "tls.h"
 #include "socket.h"
 #include "irc.h"
 #include "common.h"
@@ -13,172 +22,385 @@
 struct fifo_queue {
 	int head;
 	int tail;
+	size_t len[QUEUE_MAXLINES];
+	bool reply[QUEUE_MAXLINES]; // Sent with mqueue_send_reply(). Only these outlive their connection
 	char lines[QUEUE_MAXLINES][IRCLEN + 1];
 };
 
-struct token_bucket {
-	double tokens;
-	double burst_capacity;
-	double fill_rate;
-	struct timespec timestamp;
-	struct timespec sleep_time;
-};
-
 struct message_queue {
-	int ircfd;
+	int ircfd; // -1 while disconnected
+	int outfd; // Duplicate of ircfd, so that it can be watched for EPOLLOUT separately from the reader
 	pthread_mutex_t *mtx;
-	pthread_cond_t *cond;
 	size_t numlines;
+	size_t inflight; // Lines handed to the sender that still occupy their queue slots
 	struct fifo_queue *queue;
-	struct token_bucket *bucket;
+	struct fifo_queue *held; // Lines kept from the previous connection
+	size_t numheld;
+	struct token_bucket bucket;
+	Reactor reactor;
+	Event wakeup;   // eventfd signaled by mqueue_send()
+	Event refill;   // Fires when the bucket has enough tokens for the next line
+	Event writable; // Registered only while a batch is blocked on a full socket buffer
+	Uring uring;    // If set, batches are sent through io_uring instead of writev()
+	Tls tls;        // If set, batches are encrypted
+	bool sending;   // An io_uring send is in flight
+	bool stale;     // The send in flight was to a previous connection
+	bool unthrottled;
+	struct iovec iov[QUEUE_MAXLINES];
+	int iovcnt;
+	ssize_t pending; // Bytes of the current batch not yet written
 };
 
-STATIC struct token_bucket *bucket_init(double burst, double rate) {
+static bool enqueue(Mqueue mq, const char *line, size_t limit, bool reply) {
+
+	size_t len;
+	uint64_t one = 1;
+
+	if (!line)
+		return false;
+
+	len = MIN(strlen(line), IRCLEN);
+	pthread_mutex_lock(mq->mtx);
+	if (mq->numlines >= limit) {
+		pthread_mutex_unlock(mq->mtx);
+		return false;
+	}
+	memcpy(mq->queue->lines[mq->queue->tail], line, len);
+	mq->queue->lines[mq->queue->tail][len] = '\0';
+	mq->queue->len[mq->queue->tail] = len;
+	mq->queue->reply[mq->queue->tail] = reply;
+	mq->queue->tail = (mq->queue->tail + 1) % QUEUE_MAXLINES;
+	mq->numlines++;
+
+	pthread_mutex_unlock(mq->mtx);
+	if (write(event_fd(mq->wakeup), &one, sizeof(one)) != sizeof(one))
+		perror(__func__);
+
+	return true;
+}
+
+bool mqueue_send(Mqueue mq, const char *line) {
+
+	return enqueue(mq, line, QUEUE_MAXLINES, false);
+}
+
+bool mqueue_send_reply(Mqueue mq, const char *line) {
+
+	return enqueue(mq, line, QUEUE_MAXLINES - QUEUE_RESERVED, true);
+}
+
+size_t mqueue_depth(Mqueue mq) {
+
+	size_t depth;
+
+	pthread_mutex_lock(mq->mtx);
+	depth = mq->numlines;
+	pthread_mutex_unlock(mq->mtx);
+	return depth;
+}
+
+size_t mqueue_recv(Mqueue mq, struct iovec *iov, size_t max) {
 
-	int rate_integer;
-	double rate_decimal;
-	struct token_bucket *bucket;
+	size_t count;
+	int slot;
+
+	pthread_mutex_lock(mq->mtx);
+
+	// Lines from the previous call have been sent, free their slots
+	mq->queue->head = (mq->queue->head + mq->inflight) % QUEUE_MAXLINES;
+	mq->numlines -= mq->inflight;
+
+	count = MIN(mq->numlines, max);
+	for (size_t i = 0; i < count; i++) {
+		slot = (mq->queue->head + i) % QUEUE_MAXLINES;
+		iov[i].iov_base = mq->queue->lines[slot];
+		iov[i].iov_len  = mq->queue->len[slot];
+	}
+	mq->inflight = count;
+
+	pthread_mutex_unlock(mq->mtx);
+	return count;
+}
 
-	bucket = malloc_w(sizeof(*bucket));
-	bucket->burst_capacity = burst;
-	bucket->tokens = burst;
-	bucket->fill_rate = rate;
+static ssize_t write_batch(Mqueue mq) {
 
-	rate = 1 / rate;
-	rate_integer = rate;
-	rate_decimal = rate - rate_integer;
-	bucket->sleep_time.tv_sec = rate_integer;
-	bucket->sleep_time.tv_nsec = rate_decimal * NANOSECS;
+	if (mq->tls)
+		return tls_writev(mq->tls, mq->iov, mq->iovcnt);
 
-	return bucket;
+	return sock_writev(mq->ircfd, mq->iov, mq->iovcnt);
 }
 
-STATIC double timediff(struct timespec now, struct timespec old) {
+/** Resume the current batch. Returns false if the socket buffer is still full */
+STATIC bool write_pending(Mqueue mq) {
 
-	struct timespec diff;
+	ssize_t sent;
 
-	diff.tv_sec  = now.tv_sec  - old.tv_sec;
-	diff.tv_nsec = now.tv_nsec - old.tv_nsec;
-	if (diff.tv_nsec < 0) {
-		diff.tv_sec--;
-		diff.tv_nsec += NANOSECS;
+	sent = write_batch(mq);
+	if (sent == -1) {
+		mqueue_disconnect(mq);
+		return false;
 	}
-	return diff.tv_sec + ((double) diff.tv_nsec / NANOSECS);
+	mq->pending -= sent;
+	return !mq->pending;
+}
+
+static void flush_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	(void) r;
+	(void) ev;
+	(void) events;
+	mqueue_flush(data);
+}
+
+static void wakeup_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	uint64_t count;
+
+	(void) r;
+	(void) events;
+	if (read(event_fd(ev), &count, sizeof(count)) == sizeof(count))
+		mqueue_flush(data);
 }
 
-STATIC double get_tokens(struct token_bucket *bucket) {
+static void send_handler(void *data, char *buf, ssize_t res) {
 
-	double new_tokens;
-	struct timespec now;
+	Mqueue mq = data;
 
-	clock_gettime(CLOCK_MONOTONIC, &now);
-	if (bucket->tokens < bucket->burst_capacity) {
-		new_tokens = bucket->fill_rate * timediff(now, bucket->timestamp);
-		bucket->tokens = MIN(bucket->burst_capacity, bucket->tokens + new_tokens);
+	(void) buf;
+	mq->sending = false;
+	if (mq->stale) { // Completion of a send to the old connection
+		mq->stale = false;
+		mqueue_flush(mq);
+		return;
 	}
-	bucket->timestamp = now;
-	return bucket->tokens;
+
+	if (res < 0) {
+		fprintf(stderr, "%s: %s\n", __func__, strerror(-res));
+		mqueue_disconnect(mq);
+		return;
+	}
+	// Resend whatever is left after a short send, then go on with the next batch
+	mq->pending -= res;
+	iov_advance(mq->iov, mq->iovcnt, res);
+	mqueue_flush(mq);
 }
 
-STATIC bool consume_tokens(struct token_bucket *bucket, double tokens) {
+void mqueue_flush(Mqueue mq) {
+
+	double tokens;
+
+	for (;;) {
+		if (mq->sending || mq->ircfd == -1) // The completion or the reconnect will resume flushing
+			return;
+
+		if (mq->pending && mq->uring) {
+			// Handled like a failed write, the reconnect recovers from it
+			mq->sending = uring_sendv(mq->uring, mq->ircfd, mq->iov, mq->iovcnt, send_handler, mq);
+			if (!mq->sending) {
+				fprintf(stderr, "%s: io_uring submission failed\n", __func__);
+				mqueue_disconnect(mq);
+			}
+			return;
+		}
+		if (mq->pending && !write_pending(mq)) {
+			if (!mq->writable && mq->ircfd != -1)
+				mq->writable = reactor_add_fd(mq->reactor, mq->outfd, EPOLLOUT, flush_handler, mq);
+			return;
+		}
+		if (mq->writable) {
+			reactor_remove(mq->reactor, mq->writable);
+			mq->writable = NULL;
+		}
+		if (mq->unthrottled)
+			mq->bucket.tokens = QUEUE_MAXLINES * QUEUE_CONSUME_RATE;
+		tokens = bucket_tokens(&mq->bucket);
+		if (tokens < QUEUE_CONSUME_RATE) {
+			timer_set(mq->refill, bucket_delay(&mq->bucket, QUEUE_CONSUME_RATE), 0);
+			return;
+		}
+		mq->iovcnt = mqueue_recv(mq, mq->iov, MIN((size_t) (tokens / QUEUE_CONSUME_RATE), QUEUE_MAXLINES));
+		if (!mq->iovcnt)
+			return;
 
-	if (tokens <= get_tokens(bucket)) {
-		bucket->tokens -= tokens;
-		return true;
+		mq->bucket.tokens -= mq->iovcnt * QUEUE_CONSUME_RATE;
+		for (int i = 0; i < mq->iovcnt; i++)
+			mq->pending += mq->iov[i].iov_len;
 	}
-	return false;
 }
 
-Mqueue mqueue_init(int fd) {
+Mqueue mqueue_init(Reactor r, int fd) {
 
-	Mqueue mq  = malloc_w(sizeof(*mq));
+	int efd;
+	Mqueue mq  = calloc_w(sizeof(*mq));
 	mq->mtx    = malloc_w(sizeof(*mq->mtx));
-	mq->cond   = malloc_w(sizeof(*mq->cond));
 	mq->queue  = calloc_w(sizeof(*mq->queue));
-	mq->bucket = bucket_init(QUEUE_BURST_CAPACITY, QUEUE_FILL_RATE);
 
+	bucket_init(&mq->bucket, QUEUE_BURST_CAPACITY, QUEUE_FILL_RATE);
+	mq->reactor = r;
 	mq->ircfd = fd;
-	mq->numlines = 0;
-	if (!pthread_mutex_init(mq->mtx, NULL) && !pthread_cond_init(mq->cond, NULL))
+	mq->outfd = dup(fd);
+	efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (mq->outfd == -1 || efd == -1 || pthread_mutex_init(mq->mtx, NULL))
+		goto cleanup;
+
+	mq->wakeup = reactor_add_fd(r, efd, EPOLLIN, wakeup_handler, mq);
+	if (!mq->wakeup)
+		goto cleanup;
+
+	mq->refill = reactor_add_timer(r, 0, 0, flush_handler, mq);
+	if (mq->refill)
 		return mq;
 
+cleanup:
 	perror(__func__);
+	reactor_remove(r, mq->wakeup);
+	if (efd != -1)
+		close(efd);
+	if (mq->outfd != -1)
+		close(mq->outfd);
+
 	free(mq->mtx);
-	free(mq->cond);
 	free(mq->queue);
-	free(mq->bucket);
 	free(mq);
 	return NULL;
 }
 
+void mqueue_set_uring(Mqueue mq, Uring u) {
+
+	assert(!mq->tls);
+	mq->uring = u;
+}
+
+void mqueue_unthrottle(Mqueue mq) {
+
+	mq->unthrottled = true;
+}
+
+void mqueue_set_tls(Mqueue mq, Tls tls) {
+
+	assert(!mq->uring);
+	mq->tls = tls;
+}
+
 void mqueue_destroy(Mqueue mq) {
 
 	if (!mq)
 		return;
 
+	// Last chance for lines like QUIT, ignore the rate limit
+	mq->bucket.tokens = QUEUE_MAXLINES * QUEUE_CONSUME_RATE;
+	while (mq->sending)
+		uring_wait(mq->uring);
+
+	if (mq->ircfd != -1 && (!mq->pending || write_pending(mq)))
+		if ((mq->iovcnt = mqueue_recv(mq, mq->iov, QUEUE_MAXLINES)))
+			write_batch(mq);
+
+	reactor_remove(mq->reactor, mq->writable);
+	reactor_remove(mq->reactor, mq->refill);
+	reactor_remove(mq->reactor, mq->wakeup);
+	close(event_fd(mq->wakeup));
+	if (mq->outfd != -1)
+		close(mq->outfd);
+
 	pthread_mutex_destroy(mq->mtx);
-	pthread_cond_destroy(mq->cond);
 	free(mq->mtx);
-	free(mq->cond);
+	free(mq->held);
 	free(mq->queue);
-	free(mq->bucket);
 	free(mq);
 }
 
-bool mqueue_send(Mqueue mq, const char *line) {
+void mqueue_disconnect(Mqueue mq) {
 
-	if (!line)
-		return false;
+	int fd;
 
-	pthread_mutex_lock(mq->mtx);
-	if (mq->numlines == QUEUE_MAXLINES) {
-		pthread_mutex_unlock(mq->mtx);
-		return false;
-	}
-	strncpy(mq->queue->lines[mq->queue->tail], line, IRCLEN);
-	mq->queue->tail = (mq->queue->tail + 1) % QUEUE_MAXLINES;
-	mq->numlines++;
+	if (!mq || mq->ircfd == -1)
+		return;
 
+	// Make sends still in flight fail right away, even if the peer stopped responding
+	fd = mq->ircfd;
+	mq->ircfd = -1;
+	if (shutdown(fd, SHUT_RDWR))
+		perror(__func__);
+
+	// Can't wait for the completion here, this may run inside a completion handler
+	mq->stale = mq->sending;
+	reactor_remove(mq->reactor, mq->writable);
+	mq->writable = NULL;
+	close(mq->outfd);
+	mq->outfd = -1;
+	mq->tls = NULL;
+
+	// The interrupted batch is sent again in full, so its lines stay queued
+	pthread_mutex_lock(mq->mtx);
+	mq->inflight = 0;
+	mq->pending  = 0;
+	mq->iovcnt   = 0;
 	pthread_mutex_unlock(mq->mtx);
-	pthread_cond_signal(mq->cond);
+}
 
+/** Append a line to a fifo that isn't shared with other threads. Returns false if it was full */
+static bool fifo_push(struct fifo_queue *fifo, size_t *numlines, const char *line, size_t len) {
+
+	if (*numlines == QUEUE_MAXLINES)
+		return false;
+
+	memcpy(fifo->lines[fifo->tail], line, len + 1);
+	fifo->len[fifo->tail] = len;
+	fifo->reply[fifo->tail] = true;
+	fifo->tail = (fifo->tail + 1) % QUEUE_MAXLINES;
+	(*numlines)++;
 	return true;
 }
 
-char *mqueue_recv(Mqueue mq) {
+void mqueue_connect(Mqueue mq, int fd, Tls tls) {
 
-	char *line;
+	int slot;
 
-	pthread_mutex_lock(mq->mtx);
-	while (!mq->numlines)
-		pthread_cond_wait(mq->cond, mq->mtx);
+	if (!mq)
+		return;
+
+	mqueue_disconnect(mq);
+	mq->outfd = dup(fd);
+	if (mq->outfd == -1)
+		perror(__func__);
 
-	line = mq->queue->lines[mq->queue->head];
-	mq->queue->head = (mq->queue->head + 1) % QUEUE_MAXLINES;
-	mq->numlines--;
+	// Lines held from an earlier reconnect that never completed stay in front. Protocol lines belong to the
+	// connection they were meant for, like a PONG or the registration of an attempt that failed, so they're dropped
+	pthread_mutex_lock(mq->mtx);
+	if (!mq->held)
+		mq->held = calloc_w(sizeof(*mq->held));
 
+	for (size_t i = 0; i < mq->numlines; i++) {
+		slot = (mq->queue->head + i) % QUEUE_MAXLINES;
+		if (mq->queue->reply[slot] && !fifo_push(mq->held, &mq->numheld, mq->queue->lines[slot], mq->queue->len[slot]))
+			break;
+	}
+	mq->queue->head = mq->queue->tail = 0;
+	mq->numlines = 0;
 	pthread_mutex_unlock(mq->mtx);
-	return line;
+
+	mq->tls   = tls;
+	mq->ircfd = fd;
 }
 
-void *mqueue_start(void *mqueue) {
+void mqueue_release(Mqueue mq) {
 
-	int len;
-	char *line;
-	Mqueue mq = mqueue;
+	size_t count;
+	struct fifo_queue *held;
 
-	for (;;) {
-		if (!consume_tokens(mq->bucket, QUEUE_CONSUME_RATE)) {
-			nanosleep(&mq->bucket->sleep_time, NULL);
-			mq->bucket->tokens -= QUEUE_CONSUME_RATE;
-		}
-		line = mqueue_recv(mq);
-		assert(line);
-		len = strlen(line);
+	if (!mq || !mq->held)
+		return;
 
-		if (sock_write(mq->ircfd, line, len) != len)
-			exit_msg("error while sending to irc");
-	}
-	// NOT REACHED
-	return NULL;
+	pthread_mutex_lock(mq->mtx);
+	held  = mq->held;
+	count = mq->numheld;
+	mq->held    = NULL;
+	mq->numheld = 0;
+	pthread_mutex_unlock(mq->mtx);
+
+	for (size_t i = 0; i < count; i++)
+		enqueue(mq, held->lines[(held->head + i) % QUEUE_MAXLINES], QUEUE_MAXLINES, true);
+
+	free(held);
 }
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include "ratelimit.h"
+#include "common.h"
+
+#define NONE -1
+
+/** Entries are linked by index, so the table is a single allocation */
+struct key_bucket {
+	int chain;       //!< Next in the same hash slot
+	int newer, older;
+	uint32_t hash;
+	size_t keylen;
+	char key[RATELIMIT_KEYLEN];
+	struct token_bucket bucket;
+};
+
+struct ratelimit {
+	double burst;
+	double rate;
+	int max_keys;
+	int used;        //!< Entries handed out. Once all are, the oldest is reused
+	int newest, oldest;
+	int slot_count;  //!< Power of 2
+	int *slots;
+	struct key_bucket *entries;
+};
+
+STATIC double timediff(struct timespec now, struct timespec old) {
+
+	struct timespec diff;
+
+	diff.tv_sec  = now.tv_sec  - old.tv_sec;
+	diff.tv_nsec = now.tv_nsec - old.tv_nsec;
+	if (diff.tv_nsec < 0) {
+		diff.tv_sec--;
+		diff.tv_nsec += NANOSECS;
+	}
+	return diff.tv_sec + ((double) diff.tv_nsec / NANOSECS);
+}
+
+void bucket_init(struct token_bucket *bucket, double burst, double rate) {
+
+	bucket->burst_capacity = burst;
+	bucket->tokens = burst;
+	bucket->fill_rate = rate;
+	clock_gettime(CLOCK_MONOTONIC, &bucket->timestamp);
+}
+
+double bucket_tokens(struct token_bucket *bucket) {
+
+	double new_tokens;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (bucket->tokens < bucket->burst_capacity) {
+		new_tokens = bucket->fill_rate * timediff(now, bucket->timestamp);
+		bucket->tokens = MIN(bucket->burst_capacity, bucket->tokens + new_tokens);
+	}
+	bucket->timestamp = now;
+	return bucket->tokens;
+}
+
+long bucket_delay(struct token_bucket *bucket, double n) {
+
+	double missing = n - bucket->tokens;
+
+	return missing / bucket->fill_rate * MILLISECS + 1;
+}
+
+/** FNV-1a over the lowercase key */
+static uint32_t hash_key(const char *key, size_t len) {
+
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char) tolower((unsigned char) key[i]);
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void lru_unlink(Ratelimit rl, int i) {
+
+	struct key_bucket *e = &rl->entries[i];
+
+	if (e->newer != NONE)
+		rl->entries[e->newer].older = e->older;
+	else
+		rl->newest = e->older;
+
+	if (e->older != NONE)
+		rl->entries[e->older].newer = e->newer;
+	else
+		rl->oldest = e->newer;
+}
+
+static void lru_push(Ratelimit rl, int i) {
+
+	struct key_bucket *e = &rl->entries[i];
+
+	e->newer = NONE;
+	e->older = rl->newest;
+	if (rl->newest != NONE)
+		rl->entries[rl->newest].newer = i;
+	else
+		rl->oldest = i;
+
+	rl->newest = i;
+}
+
+/** Remove the least recently used key from its hash chain. Its slot in the LRU list is reused by the caller */
+static int evict_oldest(Ratelimit rl) {
+
+	int victim = rl->oldest, *link;
+	struct key_bucket *e = &rl->entries[victim];
+
+	for (link = &rl->slots[e->hash & (rl->slot_count - 1)]; *link != victim; link = &rl->entries[*link].chain)
+		;
+
+	*link = e->chain;
+	lru_unlink(rl, victim);
+	return victim;
+}
+
+Ratelimit ratelimit_init(double burst, double rate, int max_keys) {
+
+	Ratelimit rl;
+
+	if (burst < 1 || rate <= 0 || max_keys < 1)
+		return NULL;
+
+	rl = calloc_w(sizeof(*rl));
+	rl->burst    = burst;
+	rl->rate     = rate;
+	rl->max_keys = max_keys;
+	rl->newest   = NONE;
+	rl->oldest   = NONE;
+
+	// Twice as many slots as keys keeps the chains short
+	rl->slot_count = 1;
+	while (rl->slot_count < 2 * max_keys)
+		rl->slot_count *= 2;
+
+	rl->slots   = malloc_w(rl->slot_count * sizeof(*rl->slots));
+	rl->entries = malloc_w(max_keys * sizeof(*rl->entries));
+	for (int i = 0; i < rl->slot_count; i++)
+		rl->slots[i] = NONE;
+
+	return rl;
+}
+
+bool ratelimit_allow(Ratelimit rl, const char *key, size_t len) {
+
+	int i;
+	uint32_t hash;
+	struct key_bucket *e;
+
+	len  = MIN(len, RATELIMIT_KEYLEN);
+	hash = hash_key(key, len);
+	for (i = rl->slots[hash & (rl->slot_count - 1)]; i != NONE; i = rl->entries[i].chain) {
+		e = &rl->entries[i];
+		if (e->hash == hash && e->keylen == len && !strncasecmp(e->key, key, len))
+			break;
+	}
+	if (i != NONE)
+		lru_unlink(rl, i);
+	else {
+		i = rl->used < rl->max_keys ? rl->used++ : evict_oldest(rl);
+		e = &rl->entries[i];
+		e->hash   = hash;
+		e->keylen = len;
+		memcpy(e->key, key, len);
+		bucket_init(&e->bucket, rl->burst, rl->rate);
+		e->chain = rl->slots[hash & (rl->slot_count - 1)];
+		rl->slots[hash & (rl->slot_count - 1)] = i;
+	}
+	lru_push(rl, i);
+
+	e = &rl->entries[i];
+	if (bucket_tokens(&e->bucket) < 1)
+		return false;
+
+	e->bucket.tokens--;
+	return true;
+}
+
+void ratelimit_destroy(Ratelimit rl) {
+
+	if (!rl)
+		return;
+
+	free(rl->slots);
+	free(rl->entries);
+	free(rl);
+}
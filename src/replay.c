@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "replay.h"
+#include "irc.h"
+#include "socket.h"
+#include "common.h"
+
+struct recorder {
+	FILE *file;
+	struct timespec last; //!< When the previous line was written
+};
+
+/** Microseconds from old to now, saturated to fit a record */
+static uint32_t elapsed(struct timespec now, struct timespec old) {
+
+	int64_t usecs = (int64_t) (now.tv_sec - old.tv_sec) * MICROSECS + (now.tv_nsec - old.tv_nsec) / MILLISECS;
+
+	return usecs < 0 ? 0 : MIN(usecs, UINT32_MAX);
+}
+
+Recorder recorder_open(const char *path) {
+
+	Recorder rec;
+	FILE *file = fopen(path, "wb");
+
+	if (!file || fwrite(REPLAY_MAGIC, REPLAY_MAGICLEN, 1, file) != 1) {
+		perror(__func__);
+		if (file)
+			fclose(file);
+		return NULL;
+	}
+	rec = malloc_w(sizeof(*rec));
+	rec->file = file;
+	clock_gettime(CLOCK_MONOTONIC, &rec->last);
+	return rec;
+}
+
+void recorder_write(Recorder rec, const char *line, size_t len) {
+
+	struct timespec now;
+	uint32_t delay;
+	uint16_t len16 = MIN(len, READER_LINELEN);
+	char record[sizeof(delay) + sizeof(len16) + READER_LINELEN];
+
+	if (!rec->file)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	delay = elapsed(now, rec->last);
+	rec->last = now;
+
+	// Each record is written out right away, so that a crash or an upgrade doesn't lose the lines leading to it
+	memcpy(record, &delay, sizeof(delay));
+	memcpy(record + sizeof(delay), &len16, sizeof(len16));
+	memcpy(record + sizeof(delay) + sizeof(len16), line, len16);
+	if (fwrite(record, sizeof(delay) + sizeof(len16) + len16, 1, rec->file) != 1 || fflush(rec->file)) {
+		perror(__func__);
+		fclose(rec->file);
+		rec->file = NULL;
+	}
+}
+
+void recorder_close(Recorder rec) {
+
+	if (!rec)
+		return;
+
+	if (rec->file && fclose(rec->file))
+		perror(__func__);
+
+	free(rec);
+}
+
+struct player {
+	Reactor r;
+	Irc server;
+	FILE *file;
+	bool realtime;
+	bool buffered;         //!< The line read last is waiting for its time
+	ssize_t count;
+	Event ready;           //!< eventfd that is never read, so that it stays readable while lines are due
+	Event timer;           //!< Wakes a realtime replay up once the next line is due
+	struct timespec due;   //!< When the buffered line is due
+	replay_done done;
+	void *data;
+	uint16_t len;
+	char line[READER_LINELEN + 2];
+};
+
+/** Move the deadline forward by usecs */
+static void add_usecs(struct timespec *deadline, uint32_t usecs) {
+
+	deadline->tv_sec  += usecs / MICROSECS;
+	deadline->tv_nsec += usecs % MICROSECS * MILLISECS;
+	if (deadline->tv_nsec >= NANOSECS) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= NANOSECS;
+	}
+}
+
+/** @returns  Milliseconds until the deadline, rounded up */
+static long remaining_ms(const struct timespec *deadline) {
+
+	struct timespec now;
+	int64_t nsecs;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	nsecs = (int64_t) (deadline->tv_sec - now.tv_sec) * NANOSECS + deadline->tv_nsec - now.tv_nsec;
+	return nsecs <= 0 ? 0 : (nsecs + NANOSECS / MILLISECS - 1) / (NANOSECS / MILLISECS);
+}
+
+/** @returns  False at the end of the file or at a truncated or corrupt record */
+static bool read_record(struct player *p) {
+
+	uint32_t delay;
+
+	if (fread(&delay, sizeof(delay), 1, p->file) != 1 || fread(&p->len, sizeof(p->len), 1, p->file) != 1
+			|| p->len > READER_LINELEN || fread(p->line, 1, p->len, p->file) != p->len)
+		return false;
+
+	add_usecs(&p->due, delay);
+	return true;
+}
+
+/** Stop feeding lines. Safe to call more than once */
+static void stop(struct player *p) {
+
+	if (!p->ready)
+		return;
+
+	reactor_remove(p->r, p->ready);
+	reactor_remove(p->r, p->timer);
+	close(event_fd(p->ready));
+	p->ready = p->timer = NULL;
+}
+
+static void feed_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	struct player *p = data;
+	long wait;
+
+	(void) ev;
+	(void) events;
+
+	// A batch per round, so that the queue, the timers & the coroutines get their turn in between like on a live connection
+	for (int i = 0; i < REPLAY_BATCH; i++) {
+		if (!p->buffered && !(p->buffered = read_record(p))) {
+			stop(p);
+			p->done(p->data, p->count);
+			return;
+		}
+		if (p->realtime && (wait = remaining_ms(&p->due))) {
+			event_modify(r, p->ready, 0);
+			timer_set(p->timer, wait, 0);
+			return;
+		}
+		// Restore the line ending, so that the reader splits the lines exactly like it did when they were recorded
+		memcpy(p->line + p->len, "\r\n", 2);
+		parse_irc_buffer(p->server, p->line, p->len + 2);
+		p->buffered = false;
+		p->count++;
+	}
+}
+
+static void due_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	struct player *p = data;
+
+	(void) ev;
+	(void) events;
+
+	event_modify(r, p->ready, EPOLLIN);
+}
+
+Player replay_file(Reactor r, Irc server, const char *path, bool realtime, replay_done done, void *data) {
+
+	Player p;
+	int efd;
+	FILE *file;
+	char magic[REPLAY_MAGICLEN];
+
+	file = fopen(path, "rb");
+	if (!file) {
+		perror(__func__);
+		return NULL;
+	}
+	if (fread(magic, REPLAY_MAGICLEN, 1, file) != 1 || memcmp(magic, REPLAY_MAGIC, REPLAY_MAGICLEN)) {
+		fprintf(stderr, "%s: %s is not a recording\n", __func__, path);
+		fclose(file);
+		return NULL;
+	}
+	p = calloc_w(sizeof(*p));
+	p->r        = r;
+	p->server   = server;
+	p->file     = file;
+	p->realtime = realtime;
+	p->done     = done;
+	p->data     = data;
+	clock_gettime(CLOCK_MONOTONIC, &p->due);
+
+	// Written once, never read
+	efd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (efd == -1)
+		goto cleanup;
+
+	p->ready = reactor_add_fd(r, efd, EPOLLIN, feed_handler, p);
+	if (!p->ready)
+		goto cleanup;
+
+	p->timer = reactor_add_timer(r, 0, 0, due_handler, p);
+	if (p->timer)
+		return p;
+
+cleanup:
+	perror(__func__);
+	reactor_remove(r, p->ready);
+	if (efd != -1)
+		close(efd);
+
+	fclose(file);
+	free(p);
+	return NULL;
+}
+
+void replay_destroy(Player p) {
+
+	if (!p)
+		return;
+
+	stop(p);
+	fclose(p->file);
+	free(p);
+}
@@ -0,0 +1,324 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include "resolver.h"
+#include "coro.h"
+#include "deadline.h"
+#include "common.h"
+
+/** A coroutine waiting for a lookup. The lookup thread wakes it through its eventfd */
+struct sleeper {
+	struct sleeper *next;
+	int fd;
+};
+
+struct entry {
+	char *host;
+	char *port;
+	struct addrinfo *addr;  //!< Result of the last successful lookup, NULL if it failed
+	int error;              //!< EAI_* code of the last lookup
+	bool pending;           //!< A lookup thread is running. The entry can't be freed until it's done
+	bool orphan;            //!< Removed from the cache while in use, the last one to use it frees it
+	unsigned waiters;       //!< Callers waiting on the lookup. The entry can't be freed until they are done with it
+	struct sleeper *sleepers;
+	time_t expires;
+	struct entry *next;
+};
+
+static pthread_mutex_t cache_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lookup_done;
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static struct entry *cache;
+static size_t cache_size;
+
+static time_t now(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/** Lookup threads don't exist in a forked child, so it must not wait for them */
+static void reset_after_fork(void) {
+
+	pthread_mutex_init(&cache_mtx, NULL);
+	for (struct entry *e = cache; e; e = e->next)
+		if (e->pending) {
+			e->pending = false;
+			e->expires = 0;
+		}
+	for (struct entry *e = cache; e; e = e->next) {
+		e->waiters  = 0;
+		e->sleepers = NULL;
+	}
+}
+
+/** @returns  Milliseconds left until the deadline, rounded up */
+static long remaining_ms(const struct timespec *deadline) {
+
+	struct timespec ts;
+	long long nsecs;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	nsecs = (long long) (deadline->tv_sec - ts.tv_sec) * NANOSECS + deadline->tv_nsec - ts.tv_nsec;
+	return nsecs <= 0 ? 0 : (nsecs + NANOSECS / MILLISECS - 1) / (NANOSECS / MILLISECS);
+}
+
+static void resolver_init(void) {
+
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&lookup_done, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_atfork(NULL, NULL, reset_after_fork);
+}
+
+/** Copy the list to a single allocation, so that callers keep it even if the entry gets refreshed */
+static struct addrinfo *copy_addresses(const struct addrinfo *addr) {
+
+	size_t i, count = 0;
+	struct addrinfo *copy;
+	struct sockaddr_storage *storage;
+
+	for (const struct addrinfo *iterator = addr; iterator; iterator = iterator->ai_next)
+		count++;
+
+	if (!count)
+		return NULL;
+
+	copy = malloc_w(count * (sizeof(*copy) + sizeof(*storage)));
+	storage = (struct sockaddr_storage *) (copy + count);
+	for (i = 0; i < count; i++, addr = addr->ai_next) {
+		copy[i] = *addr;
+		memcpy(&storage[i], addr->ai_addr, addr->ai_addrlen);
+		copy[i].ai_addr      = (struct sockaddr *) &storage[i];
+		copy[i].ai_canonname = NULL;
+		copy[i].ai_next      = i + 1 < count ? &copy[i + 1] : NULL;
+	}
+	return copy;
+}
+
+static bool in_use(const struct entry *e) {
+
+	return e->pending || e->waiters;
+}
+
+static void free_entry(struct entry *e) {
+
+	if (e->addr)
+		freeaddrinfo(e->addr);
+
+	free(e->host);
+	free(e->port);
+	free(e);
+}
+
+/** Evict the entry closest to expiring. Entries in use are skipped, so the cache may grow past the limit for a while */
+static void evict_entry(void) {
+
+	struct entry **victim = NULL;
+
+	for (struct entry **e = &cache; *e; e = &(*e)->next)
+		if (!in_use(*e) && (!victim || (*e)->expires < (*victim)->expires))
+			victim = e;
+
+	if (victim) {
+		struct entry *e = *victim;
+		*victim = e->next;
+		free_entry(e);
+		cache_size--;
+	}
+}
+
+STATIC struct entry *cache_find(const char *host, const char *port) {
+
+	for (struct entry *e = cache; e; e = e->next)
+		if (!strcasecmp(e->host, host) && !strcmp(e->port, port))
+			return e;
+
+	return NULL;
+}
+
+static struct entry *cache_add(const char *host, const char *port) {
+
+	struct entry *e = calloc_w(sizeof(*e));
+
+	if (cache_size >= RESOLVER_MAXENTRIES)
+		evict_entry();
+
+	e->host = strdup(host);
+	e->port = strdup(port);
+	e->next = cache;
+	cache   = e;
+	cache_size++;
+	return e;
+}
+
+/** Blocking getaddrinfo() runs in its own thread, so that callers can give up waiting for it */
+static void *lookup_thread(void *arg) {
+
+	int error;
+	struct entry *e = arg;
+	struct addrinfo *addr = NULL;
+
+	struct addrinfo hints = {
+		.ai_family   = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags    = AI_NUMERICSERV
+	};
+	error = getaddrinfo(e->host, e->port, &hints, &addr);
+
+	pthread_mutex_lock(&cache_mtx);
+	if (e->addr)
+		freeaddrinfo(e->addr);
+
+	e->pending = false;
+	e->error   = error;
+	e->addr    = error ? NULL : addr;
+	e->expires = now() + (error ? RESOLVER_NEGATIVE_TTL : RESOLVER_TTL);
+	for (struct sleeper *z = e->sleepers; z; z = z->next)
+		if (eventfd_write(z->fd, 1))
+			perror(__func__);
+
+	if (e->orphan && !in_use(e))
+		free_entry(e);
+
+	pthread_cond_broadcast(&lookup_done);
+	pthread_mutex_unlock(&cache_mtx);
+	return NULL;
+}
+
+static void start_lookup(struct entry *e) {
+
+	pthread_t tid;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	e->pending = !pthread_create(&tid, &attr, lookup_thread, e);
+	pthread_attr_destroy(&attr);
+	if (!e->pending) {
+		e->error   = EAI_SYSTEM;
+		e->expires = now() + RESOLVER_NEGATIVE_TTL;
+	}
+}
+
+/** The coroutine's share of the wait: the reactor keeps going until the lookup thread writes to the eventfd.
+ *  Called and returns with cache_mtx held
+ *  @returns  false on timeout */
+static bool sleep_on(struct entry *e, const struct timespec *deadline) {
+
+	struct sleeper z = {e->sleepers, eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)}, **link;
+	bool woken;
+
+	if (z.fd == -1) {
+		perror(__func__);
+		return false;
+	}
+	e->sleepers = &z;
+	pthread_mutex_unlock(&cache_mtx);
+	woken = coro_wait_fd(z.fd, EPOLLIN, remaining_ms(deadline));
+	pthread_mutex_lock(&cache_mtx);
+
+	for (link = &e->sleepers; *link != &z; link = &(*link)->next)
+		;
+	*link = z.next;
+	close(z.fd);
+	return woken;
+}
+
+struct addrinfo *resolve(const char *host, const char *port) {
+
+	struct entry *e;
+	struct addrinfo *addr = NULL;
+	struct timespec deadline;
+	long timeout;
+
+	// Numeric addresses don't need a lookup or caching
+	struct addrinfo hints = {
+		.ai_family   = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags    = AI_NUMERICSERV | AI_NUMERICHOST
+	};
+	if (!getaddrinfo(host, port, &hints, &addr)) {
+		struct addrinfo *copy = copy_addresses(addr);
+		freeaddrinfo(addr);
+		return copy;
+	}
+	pthread_once(&once, resolver_init);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	timeout = deadline_clamp(RESOLVER_TIMEOUT); // The command's deadline might be sooner
+	deadline.tv_sec  += timeout / MILLISECS;
+	deadline.tv_nsec += timeout % MILLISECS * (NANOSECS / MILLISECS);
+	if (deadline.tv_nsec >= NANOSECS) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= NANOSECS;
+	}
+	pthread_mutex_lock(&cache_mtx);
+	e = cache_find(host, port);
+	if (!e)
+		e = cache_add(host, port);
+
+	if (!e->pending && now() >= e->expires)
+		start_lookup(e);
+
+	// Waiters pin the entry, a lookup that finishes doesn't let others evict it before it's read
+	e->waiters++;
+	while (e->pending)
+		if (coro_self() ? !sleep_on(e, &deadline) : pthread_cond_timedwait(&lookup_done, &cache_mtx, &deadline) == ETIMEDOUT)
+			break;
+
+	if (e->pending)
+		fprintf(stderr, "%s: Lookup for %s timed out\n", __func__, host);
+	else if (e->error)
+		fprintf(stderr, "%s: %s: %s\n", __func__, host, gai_strerror(e->error));
+	else
+		addr = copy_addresses(e->addr);
+
+	e->waiters--;
+	if (e->orphan && !in_use(e))
+		free_entry(e);
+
+	pthread_mutex_unlock(&cache_mtx);
+	return addr;
+}
+
+void resolver_flush(void) {
+
+	pthread_mutex_lock(&cache_mtx);
+	for (struct entry *e = cache; e; e = e->next)
+		e->expires = 0;
+
+	pthread_mutex_unlock(&cache_mtx);
+}
+
+void resolver_cleanup(void) {
+
+	struct entry *e;
+
+	pthread_mutex_lock(&cache_mtx);
+	while (cache) {
+		e = cache;
+		cache = e->next;
+
+		// getaddrinfo() can't be interrupted, leave the entry to its thread or waiters
+		if (in_use(e))
+			e->orphan = true;
+		else
+			free_entry(e);
+	}
+	cache_size = 0;
+	pthread_mutex_unlock(&cache_mtx);
+}
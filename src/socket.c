@@ -6,46 +6,177 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <string.h>
 #include <assert.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "socket.h"
+#include "resolver.h"
+#include "deadline.h"
+#include "coro.h"
 #include "irc.h"
 #include "common.h"
 
-int sock_connect(const char *address, const char *port) {
+/** Order addresses so that families alternate, starting with the one getaddrinfo() preferred (RFC 8305 section 4) */
+STATIC size_t interleave_families(struct addrinfo *addr, struct addrinfo **ordered, size_t max) {
 
-	int retval, sock = -1;
-	struct addrinfo *addr, *iterator;
+	size_t count = 0;
+	struct addrinfo *first = addr, *other = addr;
+	int family = addr ? addr->ai_family : AF_UNSPEC;
 
-	// Set hints for getaddrinfo()
-	struct addrinfo hints = {
-		.ai_family   = AF_UNSPEC,      // IPv4 or IPv6
-		.ai_socktype = SOCK_STREAM,    // Stream socket / TCP protocol
-		.ai_flags    = AI_NUMERICSERV  // Don't resolve service -> port, since we already provide it in numeric form
-	};
-	assert(atoi(port) > 0 && atoi(port) <= MAXPORT);
+	while (count < max && (first || other)) {
+		while (first && first->ai_family != family)
+			first = first->ai_next;
+		while (other && other->ai_family == family)
+			other = other->ai_next;
 
-	// Return addresses according to the hints specified
-	retval = getaddrinfo(address, port, &hints, &addr);
-	if (retval) {
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(retval));
+		if (first) {
+			ordered[count++] = first;
+			first = first->ai_next;
+		}
+		if (other && count < max) {
+			ordered[count++] = other;
+			other = other->ai_next;
+		}
+	}
+	return count;
+}
+
+/** Start a non-blocking connect. Returns the socket or -1 if it failed right away */
+STATIC int start_connect(struct addrinfo *addr) {
+
+	int sock;
+
+	// Close on exec, an upgrade hands over the descriptors it needs explicitly
+	sock = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr->ai_protocol);
+	if (sock < 0) {
+		perror(__func__);
 		return -1;
 	}
-	for (iterator = addr; iterator; iterator = iterator->ai_next) {
+	if (!connect(sock, addr->ai_addr, addr->ai_addrlen) || errno == EINPROGRESS)
+		return sock;
+
+	perror(__func__);
+	close(sock);
+	return -1;
+}
+
+static long now_ms(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * MILLISECS + ts.tv_nsec / (NANOSECS / MILLISECS);
+}
+
+/** Like poll(). On a coroutine the attempts are gathered in an epoll instance of their own, readable as soon as any
+ *  of them is, and the reactor waits on that */
+static int poll_any(struct pollfd *pfd, nfds_t nfds, long timeout_ms) {
+
+	int epfd, ready = -1;
+
+	if (!coro_self())
+		return poll(pfd, nfds, timeout_ms);
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd == -1)
+		return -1;
+
+	for (nfds_t i = 0; i < nfds; i++)
+		if (pfd[i].fd != -1 && epoll_ctl(epfd, EPOLL_CTL_ADD, pfd[i].fd, &(struct epoll_event) {.events = EPOLLOUT}))
+			goto cleanup;
+
+	ready = coro_wait_fd(epfd, EPOLLIN, timeout_ms) ? poll(pfd, nfds, 0) : 0;
+
+cleanup:
+	close(epfd);
+	return ready;
+}
+
+int connect_any(struct addrinfo *addr) {
+
+	int sock = -1, err, ready, pending = 0;
+	size_t count, next = 0;
+	long until = now_ms() + deadline_clamp(CONNECT_TIMEOUT), left;
+	struct addrinfo *ordered[CONNECT_MAXADDRS];
+	struct pollfd pfd[CONNECT_MAXADDRS];
+
+	count = interleave_families(addr, ordered, CONNECT_MAXADDRS);
+	while (sock == -1 && (next < count || pending)) {
+		left = until - now_ms();
+		if (left <= 0) {
+			fprintf(stderr, "%s: Timed out\n", __func__);
+			break;
+		}
+		// Start the next attempt. Previous ones keep running in parallel
+		if (next < count) {
+			pfd[next].fd = start_connect(ordered[next]);
+			pfd[next].events = POLLOUT;
+			if (pfd[next++].fd == -1) // Failed immediately, don't wait before trying the next one
+				continue;
+
+			pending++;
+		}
+		// Wait for any attempt to finish, but not longer than the delay if more addresses remain
+		ready = poll_any(pfd, next, next < count ? MIN(CONNECT_ATTEMPT_DELAY, left) : left);
+		if (ready == -1) {
+			if (errno == EINTR)
+				continue;
 
-		sock = socket(iterator->ai_family, iterator->ai_socktype, iterator->ai_protocol);
-		if (sock < 0) {
 			perror(__func__);
-			continue; // Failed, try next address
+			break;
 		}
-		if (!connect(sock, iterator->ai_addr, iterator->ai_addrlen))
-			break; // Success
+		for (size_t i = 0; i < next && ready; i++) {
+			if (pfd[i].fd == -1 || !pfd[i].revents)
+				continue;
 
-		// Cleanup and try next address
+			ready--;
+			getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &(socklen_t) {sizeof(err)});
+			if (!err && sock == -1) {
+				sock = pfd[i].fd; // First one to succeed wins
+				pfd[i].fd = -1;
+				continue;
+			}
+			if (err)
+				fprintf(stderr, "%s: %s\n", __func__, strerror(err));
+
+			close(pfd[i].fd);
+			pfd[i].fd = -1;
+			pending--;
+		}
+	}
+	// Abandon the rest
+	for (size_t i = 0; i < next; i++)
+		if (pfd[i].fd != -1)
+			close(pfd[i].fd);
+
+	// Callers expect a blocking socket, like a plain connect() would return
+	if (sock != -1 && fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK)) {
 		perror(__func__);
 		close(sock);
 		sock = -1;
 	}
-	freeaddrinfo(addr);
+	return sock;
+}
+
+int sock_connect(const char *address, const char *port) {
+
+	int sock;
+	struct addrinfo *addr;
+
+	assert(atoi(port) > 0 && atoi(port) <= MAXPORT);
+
+	addr = resolve(address, port);
+	if (!addr)
+		return -1;
+
+	sock = connect_any(addr);
+	free(addr);
 	return sock;
 }
 
@@ -68,7 +199,7 @@ int sock_listen(const char *address, const char *port) {
 	}
 	for (iterator = addr; iterator; iterator = iterator->ai_next) {
 
-		sock = socket(iterator->ai_family, iterator->ai_socktype, iterator->ai_protocol);
+		sock = socket(iterator->ai_family, iterator->ai_socktype | SOCK_CLOEXEC, iterator->ai_protocol);
 		if (sock < 0) {
 			perror(__func__);
 			continue;
@@ -90,7 +221,7 @@ int sock_accept(int listen_fd, bool non_block) {
 
 	int accept_fd;
 
-	accept_fd = accept(listen_fd, NULL, NULL);
+	accept_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
 	if (accept_fd < 0) {
 		perror(__func__);
 		return -1;
@@ -127,6 +258,47 @@ ssize_t sock_write(int sock, const void *buffer, size_t len) {
 	return len;
 }
 
+void iov_advance(struct iovec *iov, int iovcnt, size_t n) {
+
+	for (int i = 0; i < iovcnt && n > 0; i++) {
+		if (n >= iov[i].iov_len) {
+			n -= iov[i].iov_len;
+			iov[i].iov_len = 0;
+		} else {
+			iov[i].iov_base = (char *) iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+			n = 0;
+		}
+	}
+}
+
+ssize_t sock_writev(int sock, struct iovec *iov, int iovcnt) {
+
+	ssize_t n_sent;
+	size_t n_left = 0, len;
+
+	for (int i = 0; i < iovcnt; i++)
+		n_left += iov[i].iov_len;
+
+	len = n_left;
+	while (n_left > 0) {
+		n_sent = writev(sock, iov, iovcnt);
+		if (n_sent == -1) {
+			if (errno == EINTR) // Interrupted by signal, retry
+				continue;
+
+			if (errno == EAGAIN) // Operation would block, return bytes written so far
+				return len - n_left;
+
+			perror(__func__);
+			return -1;
+		}
+		n_left -= n_sent;
+		iov_advance(iov, iovcnt, n_sent); // Skip the bytes already sent
+	}
+	return len;
+}
+
 ssize_t sock_read(int sock, void *buffer, size_t len) {
 
 	ssize_t n;
@@ -147,46 +319,217 @@ ssize_t sock_read(int sock, void *buffer, size_t len) {
 	}
 }
 
-STATIC ssize_t sock_readbyte(int sock, char *byte) {
+struct line_reader {
+	int sock;
+	size_t head; //!< Start of unconsumed data
+	size_t scan; //!< Data before this position is already searched for a terminator
+	size_t tail; //!< End of data. All positions grow forever and are masked on access
+	bool discard; //!< The line at head was cut, drop everything up to its terminator
+	char spill[READER_LINELEN + 1]; //!< Lines that wrap around the end of the ring are copied here
+	char buffer[READER_BUFSIZE + 1]; //!< Extra byte allows null terminating a line that ends on the ring's edge
+};
+
+#define RING_MASK (READER_BUFSIZE - 1)
+
+Reader reader_init(int sock) {
+
+	Reader reader;
+
+	assert(!(READER_BUFSIZE & RING_MASK) && READER_BUFSIZE > READER_LINELEN);
+	reader = malloc_w(sizeof(*reader));
+	reader->sock = sock;
+	reader->head = reader->scan = reader->tail = 0;
+	reader->discard = false;
+
+	return reader;
+}
+
+void reader_destroy(Reader reader) {
+
+	free(reader);
+}
+
+STATIC const char *find_newline(const char *buf, size_t len) {
 
-	static ssize_t bytes_read;
-	static char buffer[IRCLEN];
-	static char *buf_ptr;
+	const char *end = buf + len;
+
+#ifdef __SSE2__
+	int mask;
+	__m128i chunk, newline = _mm_set1_epi8('\n');
+
+	// Compare 16 bytes at a time and use the resulting bitmask to locate the first match
+	for (; buf + 16 <= end; buf += 16) {
+		chunk = _mm_loadu_si128((const __m128i *) buf);
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+		if (mask)
+			return buf + __builtin_ctz(mask);
+	}
+#endif
+	return memchr(buf, '\n', end - buf);
+}
 
-	// Stores the character in byte. Returns 1 on success, -1 on error,
-	// -EAGAIN if the operation would block and 0 if connection is closed
-	if (bytes_read <= 0) {
-		bytes_read = sock_read(sock, buffer, IRCLEN);
-		if (bytes_read <= 0)
-			return bytes_read;
+STATIC ssize_t reader_fill(Reader reader) {
 
-		buf_ptr = buffer;
+	ssize_t n;
+	int iovcnt = 1;
+	struct iovec iov[2];
+	size_t head, tail;
+
+	// Rewind when empty so the whole buffer is available as a single chunk
+	if (reader->head == reader->tail)
+		reader->head = reader->scan = reader->tail = 0;
+
+	head = reader->head & RING_MASK;
+	tail = reader->tail & RING_MASK;
+	assert(reader->tail - reader->head < READER_BUFSIZE);
+
+	// Free space is either [tail, head) or [tail, end) + [0, head) if it wraps around
+	iov[0].iov_base = reader->buffer + tail;
+	if (tail < head)
+		iov[0].iov_len = head - tail;
+	else {
+		iov[0].iov_len = READER_BUFSIZE - tail;
+		iov[1].iov_base = reader->buffer;
+		iov[1].iov_len = head;
+		if (head)
+			iovcnt = 2;
 	}
-	bytes_read--;
-	*byte = *buf_ptr++;
+	for (;;) {
+		n = readv(reader->sock, iov, iovcnt);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
 
-	return 1;
+			if (errno == EAGAIN)
+				return -EAGAIN;
+
+			perror(__func__);
+		}
+		if (n > 0)
+			reader->tail += n;
+
+		return n;
+	}
+}
+
+STATIC const char *reader_find_terminator(Reader reader) {
+
+	size_t start, len;
+	const char *found;
+
+	// Search the data not scanned yet. It's split in 2 segments if it wraps around the ring
+	while (reader->scan < reader->tail) {
+		start = reader->scan & RING_MASK;
+		len = MIN(reader->tail - reader->scan, READER_BUFSIZE - start);
+		found = find_newline(reader->buffer + start, len);
+		if (found)
+			return found;
+
+		reader->scan += len;
+	}
+	return NULL;
 }
 
-ssize_t sock_readline(int sock, char *line_buf, size_t len) {
+STATIC char *reader_extract(Reader reader, size_t len, size_t skip) {
+
+	char *line;
+	size_t start, first;
+
+	// Make the line contiguous and null terminate it. Only a line crossing the ring's edge needs copying
+	start = reader->head & RING_MASK;
+	if (start + len <= READER_BUFSIZE && skip) {
+		line = reader->buffer + start;
+	} else {
+		first = MIN(len, READER_BUFSIZE - start);
+		memcpy(reader->spill, reader->buffer + start, first);
+		memcpy(reader->spill + first, reader->buffer, len - first);
+		line = reader->spill;
+	}
+	line[len] = '\0'; // In place, this overwrites the terminator
+	reader->head += len + skip;
+	reader->scan = reader->head;
+
+	return line;
+}
+
+size_t reader_getlines(Reader reader, struct line lines[], size_t max) {
+
+	size_t count = 0, len, skip;
+	const char *newline;
+
+	while (count < max) {
+		newline = reader_find_terminator(reader);
+		// Absolute position of the newline, translated back from the segment it was found in
+		if (newline)
+			len = reader->scan + (newline - (reader->buffer + (reader->scan & RING_MASK))) - reader->head;
+
+		// The rest of a line that was cut. Returning it would let its tail pass for a line of its own
+		if (reader->discard) {
+			reader->head = reader->scan = newline ? reader->head + len + 1 : reader->tail;
+			reader->discard = !newline;
+			if (newline)
+				continue;
+
+			break;
+		}
+		if (newline) {
+			skip = 1;
+			if (len && reader->buffer[(reader->head + len - 1) & RING_MASK] == '\r') {
+				len--;
+				skip++;
+			}
+		} else if (reader->tail - reader->head >= READER_LINELEN)
+			len = READER_LINELEN + 1;
+		else
+			break;
+
+		// Line too long, cut it and drop the rest
+		if (len > READER_LINELEN) {
+			len = READER_LINELEN;
+			skip = 0;
+			reader->discard = true;
+		}
+		lines[count].len = len;
+		lines[count].buf = reader_extract(reader, len, skip);
+		// The spill buffer holds a single line, the next one copied would overwrite it
+		if (lines[count++].buf == reader->spill)
+			break;
+	}
+	return count;
+}
+
+ssize_t reader_readlines(Reader reader, struct line lines[], size_t max) {
 
 	ssize_t n;
-	size_t n_read = 0;
-	char byte = '\0';
+	size_t count;
 
-	while (n_read++ <= len) {
-		n = sock_readbyte(sock, &byte);
-		if (n <= 0) {
-			*line_buf = '\0';
-			if (n == 0) // connection closed. Return bytes read so far
-				return n_read - 1;
+	assert(max > 0);
+	for (;;) {
+		// Return lines left over from a previous read before reading again
+		count = reader_getlines(reader, lines, max);
+		if (count)
+			return count;
 
+		n = reader_fill(reader);
+		if (n <= 0)
 			return n;
-		}
-		*line_buf++ = byte;
-		if (byte == '\n' && *(line_buf - 2) == '\r')
-			break; // Message complete, we found irc protocol terminators
 	}
-	*line_buf = '\0';
-	return n_read;
+}
+
+size_t reader_feed(Reader reader, const char *buf, size_t len) {
+
+	size_t tail, first;
+
+	if (reader->head == reader->tail)
+		reader->head = reader->scan = reader->tail = 0;
+
+	// Copy as much as fits, wrapping around the ring's edge if needed
+	len = MIN(len, READER_BUFSIZE - (reader->tail - reader->head));
+	tail = reader->tail & RING_MASK;
+	first = MIN(len, READER_BUFSIZE - tail);
+	memcpy(reader->buffer + tail, buf, first);
+	memcpy(reader->buffer, buf + first, len - first);
+	reader->tail += len;
+
+	return len;
 }
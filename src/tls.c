@@ -0,0 +1,381 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <arpa/inet.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include "tls.h"
+#include "socket.h"
+#include "irc.h"
+#include "deadline.h"
+#include "common.h"
+
+#define KEYLEN (ADDRLEN + PORTLEN + 2)
+
+struct tls_conn {
+	SSL *ssl;
+	char key[KEYLEN]; //!< "address:port", identifies the cached session
+	char record[TLS_RECORDLEN];
+};
+
+static SSL_CTX *ctx;
+static pthread_mutex_t sessions_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	char key[KEYLEN];
+	SSL_SESSION *session;
+} sessions[TLS_MAXSESSIONS];
+static int next_slot; //!< Slot to overwrite when the table is full
+
+static void print_errors(const char *func) {
+
+	unsigned long error;
+
+	while ((error = ERR_get_error()))
+		fprintf(stderr, "%s: %s\n", func, ERR_error_string(error, NULL));
+}
+
+/** Replace the key's session or take a free slot. When full, the oldest one is evicted. Takes ownership of session */
+static void store_session(const char *key, SSL_SESSION *session) {
+
+	int slot = -1;
+
+	pthread_mutex_lock(&sessions_mtx);
+	for (int i = 0; i < TLS_MAXSESSIONS && slot == -1; i++)
+		if (!strcmp(sessions[i].key, key))
+			slot = i;
+
+	for (int i = 0; i < TLS_MAXSESSIONS && slot == -1; i++)
+		if (!sessions[i].session)
+			slot = i;
+
+	if (slot == -1) {
+		slot = next_slot;
+		next_slot = (next_slot + 1) % TLS_MAXSESSIONS;
+	}
+	SSL_SESSION_free(sessions[slot].session);
+	strcpy(sessions[slot].key, key);
+	sessions[slot].session = session;
+	pthread_mutex_unlock(&sessions_mtx);
+}
+
+/** Returns a new reference or NULL */
+static SSL_SESSION *find_session(const char *key) {
+
+	SSL_SESSION *session = NULL;
+
+	pthread_mutex_lock(&sessions_mtx);
+	for (int i = 0; i < TLS_MAXSESSIONS; i++)
+		if (sessions[i].session && !strcmp(sessions[i].key, key)) {
+			session = sessions[i].session;
+			SSL_SESSION_up_ref(session);
+			break;
+		}
+
+	pthread_mutex_unlock(&sessions_mtx);
+	return session;
+}
+
+/** Called by openssl when the server sends a ticket. With TLS 1.3 they arrive after the handshake */
+static int new_session_cb(SSL *ssl, SSL_SESSION *session) {
+
+	Tls tls = SSL_get_app_data(ssl);
+
+	if (!SSL_SESSION_is_resumable(session))
+		return 0;
+
+	store_session(tls->key, session);
+	return 1; // We keep the reference
+}
+
+/** Format is "key=base64;key=base64..." */
+STATIC void import_sessions(const char *env) {
+
+	char key[KEYLEN];
+	unsigned char *der;
+	const unsigned char *p;
+	const char *end;
+	SSL_SESSION *session;
+	size_t keylen, len;
+
+	for (; *env; env = *end ? end + 1 : end) {
+		end = strchrnul(env, ';');
+		keylen = strcspn(env, "=");
+		if (env + keylen >= end || keylen >= KEYLEN)
+			continue;
+
+		memcpy(key, env, keylen);
+		key[keylen] = '\0';
+		len = end - env - keylen - 1;
+		der = malloc_w(len / 4 * 3 + 3);
+		p = der;
+		if (len % 4 == 0 && EVP_DecodeBlock(der, (const unsigned char *) env + keylen + 1, len) > 0) {
+			session = d2i_SSL_SESSION(NULL, &p, len / 4 * 3);
+			if (session)
+				store_session(key, session);
+		}
+		free(der);
+	}
+}
+
+bool tls_init(const char *cafile) {
+
+	char *env;
+
+	ctx = SSL_CTX_new(TLS_client_method());
+	if (!ctx)
+		goto cleanup;
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF); // Servers often close without close_notify after QUIT
+#endif
+
+	// Sessions are kept in our own table, so that they can be exported on exec
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, new_session_cb);
+
+	if (!(*cafile ? SSL_CTX_load_verify_locations(ctx, cafile, NULL) : SSL_CTX_set_default_verify_paths(ctx)))
+		goto cleanup;
+
+	// Don't leak the sessions to children
+	env = getenv(TLS_SESSION_ENV);
+	if (env) {
+		import_sessions(env);
+		unsetenv(TLS_SESSION_ENV);
+	}
+	return true;
+
+cleanup:
+	print_errors(__func__);
+	SSL_CTX_free(ctx);
+	ctx = NULL;
+	return false;
+}
+
+void tls_cleanup(void) {
+
+	pthread_mutex_lock(&sessions_mtx);
+	for (int i = 0; i < TLS_MAXSESSIONS; i++) {
+		SSL_SESSION_free(sessions[i].session);
+		sessions[i].session = NULL;
+		sessions[i].key[0]  = '\0';
+	}
+	next_slot = 0;
+	pthread_mutex_unlock(&sessions_mtx);
+
+	SSL_CTX_free(ctx);
+	ctx = NULL;
+}
+
+static long now_ms(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * MILLISECS + ts.tv_nsec / (NANOSECS / MILLISECS);
+}
+
+/** Runs non-blocking, so that on a coroutine the reactor keeps going while it waits. The socket's mode is restored */
+static bool handshake(SSL *ssl, int sock) {
+
+	int flags, n;
+	uint32_t events;
+	bool ok = false;
+	long until = now_ms() + TLS_HANDSHAKE_TIMEOUT * MILLISECS;
+
+	flags = fcntl(sock, F_GETFL);
+	if (flags < 0 || fcntl(sock, F_SETFL, flags | O_NONBLOCK))
+		return false;
+
+	for (;;) {
+		ERR_clear_error();
+		n = SSL_connect(ssl);
+		if (n == 1) {
+			ok = true;
+			break;
+		}
+		switch (SSL_get_error(ssl, n)) {
+		case SSL_ERROR_WANT_READ:
+			events = EPOLLIN;
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			events = EPOLLOUT;
+			break;
+		default:
+			goto cleanup;
+		}
+		if (!deadline_wait_fd(sock, events, until - now_ms())) {
+			fprintf(stderr, "%s: Timed out\n", __func__);
+			break;
+		}
+	}
+cleanup:
+	fcntl(sock, F_SETFL, flags);
+	return ok;
+}
+
+Tls tls_connect(int sock, const char *address, const char *port) {
+
+	Tls tls;
+	SSL_SESSION *session;
+	unsigned char ip[sizeof(struct in6_addr)];
+	bool literal;
+
+	if (!ctx)
+		return NULL;
+
+	tls = calloc_w(sizeof(*tls));
+	snprintf(tls->key, KEYLEN, "%s:%s", address, port);
+	tls->ssl = SSL_new(ctx);
+	if (!tls->ssl || !SSL_set_fd(tls->ssl, sock))
+		goto cleanup;
+
+	SSL_set_app_data(tls->ssl, tls);
+
+	// SNI is only sent for hostnames. IP addresses are verified against the certificate's IP entries instead
+	literal = inet_pton(AF_INET, address, ip) == 1 || inet_pton(AF_INET6, address, ip) == 1;
+	if (literal ? !X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(tls->ssl), address)
+			: !SSL_set_tlsext_host_name(tls->ssl, address) || !SSL_set1_host(tls->ssl, address))
+		goto cleanup;
+
+	session = find_session(tls->key);
+	if (session) {
+		SSL_set_session(tls->ssl, session);
+		SSL_SESSION_free(session);
+	}
+	if (!handshake(tls->ssl, sock))
+		goto cleanup;
+
+	return tls;
+
+cleanup:
+	print_errors(__func__);
+	SSL_free(tls->ssl);
+	free(tls);
+	return NULL;
+}
+
+bool tls_resumed(Tls tls) {
+
+	return SSL_session_reused(tls->ssl);
+}
+
+ssize_t tls_read(Tls tls, void *buffer, size_t len) {
+
+	int n;
+
+	ERR_clear_error();
+	n = SSL_read(tls->ssl, buffer, MIN(len, INT_MAX));
+	if (n > 0)
+		return n;
+
+	switch (SSL_get_error(tls->ssl, n)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		return -EAGAIN;
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	case SSL_ERROR_SYSCALL:
+		if (errno == EAGAIN)
+			return -EAGAIN;
+
+		perror(__func__);
+		return -1;
+	default:
+		print_errors(__func__);
+		return -1;
+	}
+}
+
+ssize_t tls_writev(Tls tls, struct iovec *iov, int iovcnt) {
+
+	int n;
+	size_t len, chunk;
+	ssize_t total = 0;
+
+	for (;;) {
+		// Copy as many buffers as fit in a record. A retry after WANT_WRITE produces the same record
+		len = 0;
+		for (int i = 0; i < iovcnt && len < TLS_RECORDLEN; i++) {
+			chunk = MIN(iov[i].iov_len, TLS_RECORDLEN - len);
+			memcpy(tls->record + len, iov[i].iov_base, chunk);
+			len += chunk;
+		}
+		if (!len)
+			return total;
+
+		ERR_clear_error();
+		n = SSL_write(tls->ssl, tls->record, len);
+		if (n <= 0) {
+			switch (SSL_get_error(tls->ssl, n)) {
+			case SSL_ERROR_WANT_READ:
+			case SSL_ERROR_WANT_WRITE:
+				return total; // Would block, return bytes written so far
+			case SSL_ERROR_SYSCALL:
+				perror(__func__);
+				return -1;
+			default:
+				print_errors(__func__);
+				return -1;
+			}
+		}
+		total += n;
+		iov_advance(iov, iovcnt, n);
+	}
+}
+
+void tls_close(Tls tls) {
+
+	if (!tls)
+		return;
+
+	SSL_shutdown(tls->ssl);
+	SSL_free(tls->ssl);
+	free(tls);
+}
+
+void tls_export_sessions(void) {
+
+	int len;
+	char *env = NULL;
+	size_t size = 1, used = 0;
+	unsigned char *der, *p;
+
+	pthread_mutex_lock(&sessions_mtx);
+	for (int i = 0; i < TLS_MAXSESSIONS; i++) {
+		if (!sessions[i].session)
+			continue;
+
+		len = i2d_SSL_SESSION(sessions[i].session, NULL);
+		if (len <= 0)
+			continue;
+
+		der = p = malloc_w(len);
+		i2d_SSL_SESSION(sessions[i].session, &p);
+
+		// key + '=' + base64 + ';'
+		size += strlen(sessions[i].key) + 1 + (len + 2) / 3 * 4 + 1;
+		env = realloc_w(env, size);
+		used += sprintf(env + used, "%s%s=", used ? ";" : "", sessions[i].key);
+		used += EVP_EncodeBlock((unsigned char *) env + used, der, len);
+		free(der);
+	}
+	pthread_mutex_unlock(&sessions_mtx);
+
+	if (env && setenv(TLS_SESSION_ENV, env, true))
+		perror(__func__);
+
+	free(env);
+}
@@ -0,0 +1,131 @@
+#include <string.h>
+#include "tokenizer.h"
+#include "common.h"
+
+#if defined __AVX2__
+#include <immintrin.h>
+#define BLOCK 32
+#elif defined __SSE2__
+#include <emmintrin.h>
+#define BLOCK 16
+#else
+#define BLOCK 8
+#endif
+
+struct masks {
+	uint64_t space, colon, user;
+};
+
+#if defined __AVX2__
+static struct masks classify(const char *block) {
+
+	__m256i chars = _mm256_loadu_si256((const __m256i *) block);
+	__m256i excl  = _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('!'));
+	__m256i at    = _mm256_cmpeq_epi8(chars, _mm256_set1_epi8('@'));
+
+	return (struct masks) {
+		(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8(' '))),
+		(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chars, _mm256_set1_epi8(':'))),
+		(uint32_t) _mm256_movemask_epi8(_mm256_or_si256(excl, at))
+	};
+}
+#elif defined __SSE2__
+static struct masks classify(const char *block) {
+
+	__m128i chars = _mm_loadu_si128((const __m128i *) block);
+	__m128i excl  = _mm_cmpeq_epi8(chars, _mm_set1_epi8('!'));
+	__m128i at    = _mm_cmpeq_epi8(chars, _mm_set1_epi8('@'));
+
+	return (struct masks) {
+		(uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(chars, _mm_set1_epi8(' '))),
+		(uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(chars, _mm_set1_epi8(':'))),
+		(uint32_t) _mm_movemask_epi8(_mm_or_si128(excl, at))
+	};
+}
+#else
+static struct masks classify(const char *block) {
+
+	struct masks m = {0, 0, 0};
+
+	for (int i = 0; i < BLOCK; i++) {
+		m.space |= (uint64_t) (block[i] == ' ') << i;
+		m.colon |= (uint64_t) (block[i] == ':') << i;
+		m.user  |= (uint64_t) (block[i] == '!' || block[i] == '@') << i;
+	}
+	return m;
+}
+#endif
+
+/** Classify the last bytes of the line, starting at pos. If the line is long enough, the block is loaded so that
+ *  it ends at the line's end and the bytes already classified are shifted out. Short lines are done in plain C */
+static struct masks classify_tail(const char *line, size_t pos, size_t len) {
+
+	struct masks m = {0, 0, 0};
+
+	if (len >= BLOCK) {
+		m = classify(line + len - BLOCK);
+		m.space >>= BLOCK - (len - pos);
+		m.colon >>= BLOCK - (len - pos);
+		m.user  >>= BLOCK - (len - pos);
+		return m;
+	}
+	for (size_t i = pos; i < len; i++) {
+		m.space |= (uint64_t) (line[i] == ' ') << (i - pos);
+		m.colon |= (uint64_t) (line[i] == ':') << (i - pos);
+		m.user  |= (uint64_t) (line[i] == '!' || line[i] == '@') << (i - pos);
+	}
+	return m;
+}
+
+/** Classify the next 64 characters. The last space of the previous word marks a colon at the start of this one */
+static void classify_word(struct irc_tokens *tok) {
+
+	uint64_t space = 0, colon = 0, user = 0, carry;
+	size_t pos, word = tok->words, end = MIN(tok->len, word * 64 + 64);
+	struct masks m;
+
+	for (pos = word * 64; pos < end; pos += BLOCK) {
+		m = end - pos < BLOCK ? classify_tail(tok->line, pos, tok->len) : classify(tok->line + pos);
+		space |= m.space << pos % 64;
+		colon |= m.colon << pos % 64;
+		user  |= m.user  << pos % 64;
+	}
+	carry = word ? tok->space[word - 1] >> 63 : 0;
+	tok->space[word]    = space;
+	tok->trailing[word] = colon & (space << 1 | carry);
+	tok->user[word]     = user;
+	tok->words++;
+}
+
+bool irc_tokenize(const char *line, size_t len, struct irc_tokens *tok) {
+
+	if (len > TOKEN_MAXLEN)
+		return false;
+
+	tok->line  = line;
+	tok->len   = len;
+	tok->words = 0;
+	return true;
+}
+
+size_t token_next(struct irc_tokens *tok, const uint64_t *bitmap, size_t from) {
+
+	uint64_t bits;
+	size_t word = from / 64;
+
+	if (from >= tok->len)
+		return tok->len;
+
+	while (tok->words <= word)
+		classify_word(tok);
+
+	// Clear the bits before from, then look for the first word with any bit set
+	for (bits = bitmap[word] & ~(uint64_t) 0 << from % 64; !bits; bits = bitmap[word]) {
+		if (++word * 64 >= tok->len)
+			return tok->len;
+
+		if (tok->words == word)
+			classify_word(tok);
+	}
+	return word * 64 + __builtin_ctzll(bits);
+}
@@ -8,6 +8,7 @@
 #include <openssl/evp.h>
 #include "twitter.h"
 #include "curl.h"
+#include "coro.h"
 #include "common.h"
 #include "init.h"
 
@@ -157,7 +158,7 @@ STATIC struct curl_slist *prepare_http_post_request(CURL *curl, char **status_ms
 	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, *status_msg);
 	curl_easy_setopt(curl, CURLOPT_URL, TWTAPI);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+	curl_set_timeout(curl, 10 * MILLISECS);
 	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_memory);
 
@@ -171,7 +172,7 @@ long send_tweet(char *status_msg, char *tweet_url) {
 	struct mem_buffer mem = {NULL, 0};
 	yajl_val val, root = NULL;
 	char errbuf[1024];
-	struct curl_slist *request = NULL;
+	struct curl_slist *request = NULL, *hosts = NULL;
 	char *parameter_string;
 	char *signature_base_string;
 	char *oauth_signature = NULL;
@@ -194,8 +195,10 @@ long send_tweet(char *status_msg, char *tweet_url) {
 	oauth_signature = generate_oauth_signature(curl, signature_base_string);
 	request = prepare_http_post_request(curl, &status_msg, oauth_signature, oauth_nonce, timestamp);
 	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &mem);
+	if (!curl_set_url(curl, TWTAPI, &hosts))
+		goto cleanup;
 
-	code = curl_easy_perform(curl);
+	code = coro_perform(curl);
 	if (code != CURLE_OK) {
 		fprintf(stderr, "Error: %s\n", curl_easy_strerror(code));
 		goto cleanup;
@@ -235,6 +238,7 @@ cleanup:
 	curl_free(resource_url);
 	curl_free(parameter_string);
 	curl_slist_free_all(request);
+	curl_slist_free_all(hosts);
 	curl_easy_cleanup(curl);
 	return http_status;
 }
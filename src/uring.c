@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "uring.h"
+#include "event.h"
+#include "socket.h"
+#include "common.h"
+
+enum op_type {OP_RECV, OP_READ, OP_SEND};
+
+struct uring_op {
+	enum op_type type;
+	int fd;
+	uring_handler cb;
+	void *data;
+	bool cancelled;
+	int remaining; //!< Sends: completions left in the chain
+	ssize_t sent;
+	int error;
+	struct uring_op *prev, *next;
+};
+
+struct uring {
+	int fd;
+	Reactor reactor;
+	Event event;
+	struct uring_op *ops; //!< Pending operations, freed on destroy
+	void *ring;
+	size_t ring_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+	unsigned *sq_head, *sq_tail, *sq_array, sq_mask, sq_entries;
+	unsigned sq_local_tail; //!< Entries prepared but not yet made visible to the kernel
+	unsigned *cq_head, *cq_tail, cq_mask;
+	struct io_uring_cqe *cqes;
+	struct io_uring_buf_ring *buf_ring;
+	size_t buf_ring_len;
+	char *buffers;
+	unsigned short buf_tail;
+};
+
+#define OFFSET(ptr, off) ((void *) ((char *) (ptr) + (off)))
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/** Hand buffer bid back to the kernel so that it can be used for future receives */
+STATIC void recycle_buffer(Uring u, unsigned short bid) {
+
+	struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (URING_BUFFERS - 1)];
+
+	buf->addr = (uintptr_t) (u->buffers + bid * URING_BUFSIZE);
+	buf->len = URING_BUFSIZE;
+	buf->bid = bid;
+	__atomic_store_n(&u->buf_ring->tail, ++u->buf_tail, __ATOMIC_RELEASE);
+}
+
+STATIC bool submit(Uring u) {
+
+	int ret;
+	unsigned to_submit;
+
+	__atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+	to_submit = u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+	while (to_submit) {
+		ret = io_uring_enter(u->fd, to_submit, 0, 0);
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+
+			perror(__func__);
+			return false;
+		}
+		to_submit -= ret;
+	}
+	return true;
+}
+
+STATIC struct io_uring_sqe *get_sqe(Uring u) {
+
+	unsigned idx;
+	struct io_uring_sqe *sqe;
+
+	// Submission queue full, let the kernel consume what we have so far
+	if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries)
+		if (!submit(u))
+			return NULL;
+
+	idx = u->sq_local_tail++ & u->sq_mask;
+	sqe = &u->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[idx] = idx;
+
+	return sqe;
+}
+
+STATIC Uring_op new_op(Uring u, enum op_type type, int fd, uring_handler cb, void *data) {
+
+	Uring_op op = calloc_w(sizeof(*op));
+
+	op->type = type;
+	op->fd = fd;
+	op->cb = cb;
+	op->data = data;
+	op->next = u->ops;
+	if (u->ops)
+		u->ops->prev = op;
+
+	u->ops = op;
+	return op;
+}
+
+STATIC void free_op(Uring u, Uring_op op) {
+
+	if (op->prev)
+		op->prev->next = op->next;
+	else
+		u->ops = op->next;
+
+	if (op->next)
+		op->next->prev = op->prev;
+
+	free(op);
+}
+
+/** Queue a receive for op. Sockets use multishot receives, other descriptors a single read each time */
+STATIC bool prepare_recv(Uring u, Uring_op op) {
+
+	struct io_uring_sqe *sqe = get_sqe(u);
+
+	if (!sqe)
+		return false;
+
+	if (op->type == OP_RECV) {
+		sqe->opcode = IORING_OP_RECV;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+	} else {
+		sqe->opcode = IORING_OP_READ;
+		sqe->off = -1; // Current file position
+		sqe->len = URING_BUFSIZE;
+	}
+	sqe->fd = op->fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUFGROUP;
+	sqe->user_data = (uintptr_t) op;
+
+	return true;
+}
+
+STATIC void handle_recv(Uring u, Uring_op op, struct io_uring_cqe *cqe) {
+
+	unsigned short bid;
+	int res = cqe->res;
+
+	if (res > 0) {
+		bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		op->cb(op->data, u->buffers + bid * URING_BUFSIZE, res);
+		recycle_buffer(u, bid);
+		if (cqe->flags & IORING_CQE_F_MORE)
+			return;
+	}
+	// The kernel ran out of provided buffers or the multishot receive stopped. Keep receiving
+	if (!op->cancelled && (res > 0 || res == -ENOBUFS)) {
+		if (prepare_recv(u, op) && submit(u))
+			return;
+
+		res = -EIO;
+	}
+	op->cb(op->data, NULL, op->cancelled ? -ECANCELED : res);
+	free_op(u, op);
+}
+
+STATIC void handle_send(Uring u, Uring_op op, struct io_uring_cqe *cqe) {
+
+	if (cqe->res > 0 && !op->error)
+		op->sent += cqe->res;
+	else if (cqe->res < 0 && !op->error)
+		op->error = cqe->res;
+
+	if (--op->remaining)
+		return;
+
+	op->cb(op->data, NULL, op->sent || !op->error ? op->sent : op->error);
+	free_op(u, op);
+}
+
+/** Dispatch all available completions */
+STATIC void reap(Uring u) {
+
+	Uring_op op;
+	struct io_uring_cqe cqe;
+	unsigned head = *u->cq_head;
+
+	while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+		// Copy it and free the slot right away, handlers may submit more requests
+		cqe = u->cqes[head & u->cq_mask];
+		__atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+		op = (Uring_op) (uintptr_t) cqe.user_data;
+		if (!op) // Completion of a cancel request
+			continue;
+
+		if (op->type == OP_SEND)
+			handle_send(u, op, &cqe);
+		else
+			handle_recv(u, op, &cqe);
+	}
+}
+
+static void ring_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	(void) r;
+	(void) ev;
+	(void) events;
+
+	reap(data);
+}
+
+static void probe_handler(void *data, char *buf, ssize_t res) {
+
+	int *state = data;
+
+	// Expect the byte sent and then the end of stream
+	if (res == 1 && buf && *buf == 'x' && !*state)
+		*state = 1;
+	else
+		*state = res || *state != 1 ? -1 : 2;
+}
+
+/** Use the ring on a socketpair, in the same way that bot's sockets are used. Kernels without multishot receives fail here */
+STATIC bool probe(Uring u) {
+
+	int sv[RDWR], state = 0, tries = 10;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+		return false;
+
+	fcntl(sv[RD], F_SETFL, O_NONBLOCK);
+	if (!uring_recv(u, sv[RD], probe_handler, &state))
+		goto cleanup;
+
+	if (write(sv[WR], "x", 1) != 1)
+		goto cleanup;
+
+	close(sv[WR]);
+	sv[WR] = -1;
+	while (state >= 0 && state != 2 && tries--) {
+		if (io_uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR)
+			break;
+
+		reap(u);
+	}
+cleanup:
+	close(sv[RD]);
+	if (sv[WR] != -1)
+		close(sv[WR]);
+
+	return state == 2;
+}
+
+STATIC bool setup_buffers(Uring u) {
+
+	struct io_uring_buf_reg reg;
+
+	u->buf_ring_len = URING_BUFFERS * sizeof(struct io_uring_buf);
+	u->buf_ring = mmap(NULL, u->buf_ring_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (u->buf_ring == MAP_FAILED) {
+		u->buf_ring = NULL;
+		return false;
+	}
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t) u->buf_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BUFGROUP;
+	if (io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+		return false;
+
+	u->buffers = malloc_w(URING_BUFFERS * URING_BUFSIZE);
+	for (unsigned short i = 0; i < URING_BUFFERS; i++)
+		recycle_buffer(u, i);
+
+	return true;
+}
+
+Uring uring_init(Reactor r) {
+
+	struct io_uring_params p;
+	Uring u = calloc_w(sizeof(*u));
+
+	memset(&p, 0, sizeof(p));
+	u->reactor = r;
+	u->fd = io_uring_setup(URING_ENTRIES, &p);
+	if (u->fd == -1) {
+		free(u);
+		return NULL;
+	}
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+		goto cleanup;
+
+	// Submission & completion rings share a single mapping
+	u->ring_len = MAX(p.sq_off.array + p.sq_entries * sizeof(unsigned), p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe));
+	u->ring = mmap(NULL, u->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+	if (u->ring == MAP_FAILED) {
+		u->ring = NULL;
+		goto cleanup;
+	}
+	u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED) {
+		u->sqes = NULL;
+		goto cleanup;
+	}
+	u->sq_head    = OFFSET(u->ring, p.sq_off.head);
+	u->sq_tail    = OFFSET(u->ring, p.sq_off.tail);
+	u->sq_array   = OFFSET(u->ring, p.sq_off.array);
+	u->sq_mask    = *(unsigned *) OFFSET(u->ring, p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_local_tail = *u->sq_tail;
+	u->cq_head    = OFFSET(u->ring, p.cq_off.head);
+	u->cq_tail    = OFFSET(u->ring, p.cq_off.tail);
+	u->cq_mask    = *(unsigned *) OFFSET(u->ring, p.cq_off.ring_mask);
+	u->cqes       = OFFSET(u->ring, p.cq_off.cqes);
+
+	if (!setup_buffers(u) || !probe(u))
+		goto cleanup;
+
+	u->event = reactor_add_fd(r, u->fd, EPOLLIN, ring_handler, u);
+	if (u->event)
+		return u;
+
+cleanup:
+	uring_destroy(u);
+	return NULL;
+}
+
+void uring_destroy(Uring u) {
+
+	if (!u)
+		return;
+
+	reactor_remove(u->reactor, u->event);
+	close(u->fd); // Pending requests get cancelled by the kernel
+	while (u->ops)
+		free_op(u, u->ops);
+
+	if (u->ring)
+		munmap(u->ring, u->ring_len);
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_len);
+	if (u->buf_ring)
+		munmap(u->buf_ring, u->buf_ring_len);
+
+	free(u->buffers);
+	free(u);
+}
+
+void uring_wait(Uring u) {
+
+	if (io_uring_enter(u->fd, 0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR)
+		perror(__func__);
+
+	reap(u);
+}
+
+STATIC Uring_op start_recv(Uring u, enum op_type type, int fd, uring_handler cb, void *data) {
+
+	Uring_op op = new_op(u, type, fd, cb, data);
+
+	if (prepare_recv(u, op) && submit(u))
+		return op;
+
+	free_op(u, op);
+	return NULL;
+}
+
+Uring_op uring_recv(Uring u, int sock, uring_handler cb, void *data) {
+
+	return start_recv(u, OP_RECV, sock, cb, data);
+}
+
+Uring_op uring_read(Uring u, int fd, uring_handler cb, void *data) {
+
+	return start_recv(u, OP_READ, fd, cb, data);
+}
+
+void uring_cancel(Uring u, Uring_op op) {
+
+	struct io_uring_sqe *sqe;
+
+	if (!op || op->cancelled)
+		return;
+
+	op->cancelled = true;
+	sqe = get_sqe(u);
+	if (!sqe)
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t) op;
+	sqe->user_data = 0;
+	submit(u);
+}
+
+bool uring_sendv(Uring u, int sock, const struct iovec *iov, int iovcnt, uring_handler cb, void *data) {
+
+	Uring_op op;
+	struct io_uring_sqe *sqe;
+
+	if (iovcnt <= 0 || iovcnt > URING_ENTRIES)
+		return false;
+
+	// The whole chain must fit in the submission queue, otherwise a partial chain would be submitted
+	if (u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) + iovcnt > u->sq_entries && !submit(u))
+		return false;
+
+	op = new_op(u, OP_SEND, sock, cb, data);
+	op->remaining = iovcnt;
+	for (int i = 0; i < iovcnt; i++) {
+		sqe = get_sqe(u);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = sock;
+		sqe->addr = (uintptr_t) iov[i].iov_base;
+		sqe->len = iov[i].iov_len;
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+		sqe->user_data = (uintptr_t) op;
+		if (i < iovcnt - 1)
+			sqe->flags = IOSQE_IO_LINK; // Keep them in order. A failed or short send cancels the rest
+	}
+	// If this fails, the chain stays queued and goes in with the next submission
+	submit(u);
+	return true;
+}
@@ -0,0 +1,384 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+#include "zygote.h"
+#include "socket.h"
+#include "tls.h"
+#include "common.h"
+
+enum {OUT, STATUS, IN, FDS}; //!< Descriptors passed with a request. IN is optional
+
+/** A program the helper runs. The slot is free when pid is 0 */
+struct child {
+	pid_t pid;
+	int status_fd;
+	bool exited; //!< Status reported, the zombie waits for the bot to close status_fd
+};
+
+// Written before any thread exists, so the others only ever read them
+static int zygote_sock = -1;
+static pid_t zygote_pid;
+
+/** Only ever lowers the limits, raising the hard one would need privileges */
+static bool lower_limit(int resource, rlim_t soft, rlim_t hard) {
+
+	struct rlimit old, new;
+
+	if (soft == RLIM_INFINITY)
+		return true;
+	if (getrlimit(resource, &old))
+		return false;
+
+	new.rlim_max = MIN(hard, old.rlim_max);
+	new.rlim_cur = MIN(soft, new.rlim_max);
+	return !setrlimit(resource, &new);
+}
+
+/** Called in the child before exec, so that loading the program counts against the limits too */
+static bool set_limits(const struct spawn_limits *limits) {
+
+	// SIGXCPU at the soft limit gives it a chance to exit cleanly
+	return lower_limit(RLIMIT_CPU, limits->cpu, limits->cpu + 1) && lower_limit(RLIMIT_AS, limits->memory, limits->memory);
+}
+
+/** Runs in the helper as well as the bot. vfork() doesn't copy the page tables like fork() would, and unlike
+ *  posix_spawn() it lets the child set its resource limits before exec */
+static pid_t spawn(char *argv[], int in_fd, int out_fd, const struct spawn_limits *limits) {
+
+	volatile int err = 0; // The child borrows our memory until it execs or exits
+	sigset_t none;
+	pid_t pid;
+
+	sigemptyset(&none);
+	pid = vfork();
+	if (!pid) {
+		// Only plain system calls from here on. The bot blocks the signals handled by the reactor & ignores SIGPIPE,
+		// programs should get them normally
+		if (dup2(out_fd, STDOUT_FILENO) < 0 || (in_fd >= 0 && dup2(in_fd, STDIN_FILENO) < 0) || setpgid(0, 0)
+		    || (limits && !set_limits(limits)) || signal(SIGPIPE, SIG_DFL) == SIG_ERR
+		    || sigprocmask(SIG_SETMASK, &none, NULL))
+			err = errno;
+		else {
+			execvp(argv[0], argv);
+			err = errno;
+		}
+		_exit(127);
+	}
+	if (pid < 0) {
+		perror("vfork");
+		return -1;
+	}
+	if (err) {
+		waitpid(pid, NULL, 0);
+		fprintf(stderr, "%s: %s: %s\n", __func__, argv[0], strerror(err));
+		return -1;
+	}
+	return pid;
+}
+
+static bool read_int(int fd, int *value) {
+
+	ssize_t n;
+
+	do
+		n = read(fd, value, sizeof(*value));
+	while (n < 0 && errno == EINTR);
+
+	return n == sizeof(*value);
+}
+
+/** The reader might be gone already, there's nothing to do about it */
+static void write_int(int fd, int value) {
+
+	if (write(fd, &value, sizeof(value)) != sizeof(value))
+		return;
+}
+
+/** The helper must not keep the bot's sockets open */
+static void close_inherited(int keep) {
+
+	DIR *dir = opendir("/proc/self/fd");
+	struct dirent *entry;
+	int fd;
+
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		fd = atoi(entry->d_name);
+		if (fd > STDERR_FILENO && fd != keep && fd != dirfd(dir))
+			close(fd);
+	}
+	closedir(dir);
+}
+
+/** Spawn the requested program and report its pid on the status descriptor, or -1 on failure
+ *  @returns  false once the bot has closed its end */
+static bool serve_request(int sock, struct child *children) {
+
+	struct spawn_limits limits;
+	char buf[ZYGOTE_MSGLEN], *argv[ZYGOTE_MAXARGS + 1];
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(FDS * sizeof(int))];
+	} control;
+	struct iovec iov[] = {{&limits, sizeof(limits)}, {buf, sizeof(buf)}};
+	struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2, .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+	struct cmsghdr *cmsg;
+	struct child *slot = NULL;
+	int fds[FDS] = {-1, -1, -1}, argc = 0;
+	size_t nfds;
+	pid_t pid = -1;
+	ssize_t n;
+
+	n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	if (n < 0 && errno == EINTR)
+		return true;
+	if (n <= 0)
+		return false;
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	nfds = cmsg ? (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int) : 0;
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || nfds < IN || nfds > FDS) {
+		fprintf(stderr, "%s: Request without descriptors\n", __func__);
+		return true;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+
+	// The limits are followed by the arguments, as null terminated strings one after the other
+	n -= sizeof(limits);
+	if (n > 0 && buf[n - 1] == '\0')
+		for (char *arg = buf; arg < buf + n && argc < ZYGOTE_MAXARGS; arg += strlen(arg) + 1)
+			argv[argc++] = arg;
+
+	argv[argc] = NULL;
+	for (int i = 0; i < ZYGOTE_MAXCHILDREN && !slot; i++)
+		if (!children[i].pid)
+			slot = &children[i];
+
+	if (!slot)
+		fprintf(stderr, "%s: Already running %d programs\n", __func__, ZYGOTE_MAXCHILDREN);
+	else if (argc)
+		pid = spawn(argv, fds[IN], fds[OUT], &limits);
+
+	close(fds[OUT]);
+	if (fds[IN] >= 0)
+		close(fds[IN]);
+
+	write_int(fds[STATUS], pid);
+	if (pid < 0) {
+		close(fds[STATUS]);
+		return true;
+	}
+	slot->pid       = pid;
+	slot->status_fd = fds[STATUS];
+	return true;
+}
+
+/** Same encoding as waitpid() */
+static int wait_status(const siginfo_t *info) {
+
+	switch (info->si_code) {
+	case CLD_EXITED:
+		return (info->si_status & 0xff) << 8;
+	case CLD_DUMPED:
+		return info->si_status | 0x80;
+	default:
+		return info->si_status;
+	}
+}
+
+/** Report the exits but leave the zombies. As long as one isn't reaped, its pid & process group can't be reused, so
+ *  the bot can signal them safely until it's done with the status */
+static void report_exits(struct child *children) {
+
+	siginfo_t info;
+
+	for (int i = 0; i < ZYGOTE_MAXCHILDREN; i++) {
+		if (!children[i].pid || children[i].exited)
+			continue;
+
+		info.si_pid = 0;
+		if (waitid(P_PID, children[i].pid, &info, WEXITED | WNOHANG | WNOWAIT) || !info.si_pid)
+			continue;
+
+		write_int(children[i].status_fd, wait_status(&info));
+		children[i].exited = true;
+	}
+}
+
+static void release(struct child *child) {
+
+	waitpid(child->pid, NULL, 0);
+	close(child->status_fd);
+	*child = (struct child) {0, 0, false};
+}
+
+static void zygote_main(int sock) {
+
+	struct child children[ZYGOTE_MAXCHILDREN] = {{0, 0, false}};
+	struct signalfd_siginfo info;
+	struct pollfd pfd[2 + ZYGOTE_MAXCHILDREN];
+	int slot[2 + ZYGOTE_MAXCHILDREN];
+	nfds_t nfds;
+	sigset_t chld;
+
+	close_inherited(sock);
+	unsetenv(TLS_SESSION_ENV); // Only the bot imports them, programs must never see the secrets
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, NULL);
+
+	pfd[0] = (struct pollfd) {.fd = sock, .events = POLLIN};
+	pfd[1] = (struct pollfd) {.fd = signalfd(-1, &chld, SFD_NONBLOCK | SFD_CLOEXEC), .events = POLLIN};
+	if (pfd[1].fd < 0) {
+		perror("signalfd");
+		_exit(EXIT_FAILURE);
+	}
+	for (;;) {
+		// Closing the read end of a status pipe raises POLLERR on ours, even without asking for any events
+		nfds = 2;
+		for (int i = 0; i < ZYGOTE_MAXCHILDREN; i++)
+			if (children[i].exited) {
+				pfd[nfds]    = (struct pollfd) {.fd = children[i].status_fd};
+				slot[nfds++] = i;
+			}
+		if (poll(pfd, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+
+			perror("poll");
+			break;
+		}
+		if (pfd[1].revents) {
+			while (read(pfd[1].fd, &info, sizeof(info)) > 0)
+				;
+			report_exits(children);
+		}
+		for (nfds_t i = 2; i < nfds; i++)
+			if (pfd[i].revents)
+				release(&children[slot[i]]);
+		if (pfd[0].revents && !serve_request(sock, children))
+			break;
+	}
+	_exit(EXIT_SUCCESS); // Skip the bot's atexit handlers
+}
+
+bool zygote_start(void) {
+
+	int sv[RDWR];
+
+	// Close on exec, so that the helper exits when the bot is replaced by an upgrade
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+		perror("socketpair");
+		return false;
+	}
+	fflush(stdout); // The helper would flush it again otherwise
+	fflush(stderr);
+	zygote_pid = fork();
+	switch (zygote_pid) {
+	case -1:
+		perror("fork");
+		close(sv[RD]);
+		close(sv[WR]);
+		return false;
+	case 0:
+		close(sv[RD]);
+		zygote_main(sv[WR]);
+	}
+	close(sv[WR]);
+	zygote_sock = sv[RD];
+	return true;
+}
+
+void zygote_stop(void) {
+
+	if (zygote_sock < 0)
+		return;
+
+	close(zygote_sock);
+	zygote_sock = -1;
+	waitpid(zygote_pid, NULL, 0);
+}
+
+pid_t zygote_spawn(char *argv[], int in_fd, int out_fd, const struct spawn_limits *limits, int *status_fd) {
+
+	struct spawn_limits none = {RLIM_INFINITY, RLIM_INFINITY};
+	char buf[ZYGOTE_MSGLEN];
+	union {
+		struct cmsghdr hdr;
+		char buf[CMSG_SPACE(FDS * sizeof(int))];
+	} control;
+	struct iovec iov[] = {{limits ? (void *) limits : &none, sizeof(none)}, {buf, 0}};
+	struct msghdr msg = {.msg_iov = iov, .msg_iovlen = 2, .msg_control = control.buf, .msg_controllen = sizeof(control.buf)};
+	struct cmsghdr *cmsg;
+	size_t len, nfds;
+	int fds[FDS], status[RDWR];
+	pid_t pid;
+
+	*status_fd = -1;
+	if (zygote_sock < 0)
+		return spawn(argv, in_fd, out_fd, limits);
+
+	for (int i = 0; argv[i]; i++) {
+		len = strlen(argv[i]) + 1;
+		if (i == ZYGOTE_MAXARGS || iov[1].iov_len + len > sizeof(buf)) {
+			fprintf(stderr, "%s: Too many arguments for %s\n", __func__, argv[0]);
+			return -1;
+		}
+		memcpy(buf + iov[1].iov_len, argv[i], len);
+		iov[1].iov_len += len;
+	}
+	if (pipe2(status, O_CLOEXEC)) {
+		perror("pipe2");
+		return -1;
+	}
+	fds[OUT]    = out_fd;
+	fds[STATUS] = status[WR];
+	fds[IN]     = in_fd;
+	nfds = in_fd >= 0 ? FDS : IN;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+
+	// Messages are sent whole, so threads can share the socket. Only the helper keeps the status pipe open now
+	if (sendmsg(zygote_sock, &msg, MSG_NOSIGNAL) < 0) {
+		perror(__func__);
+		close(status[RD]);
+		close(status[WR]);
+		return spawn(argv, in_fd, out_fd, limits); // The helper is gone
+	}
+	close(status[WR]);
+	if (!read_int(status[RD], &pid) || pid < 0) {
+		close(status[RD]);
+		return -1;
+	}
+	*status_fd = status[RD];
+	return pid;
+}
+
+int zygote_wait(pid_t pid, int status_fd) {
+
+	int status;
+	bool ok;
+
+	if (status_fd < 0)
+		return waitpid(pid, &status, 0) == pid ? status : -1;
+
+	ok = read_int(status_fd, &status);
+	close(status_fd);
+	return ok ? status : -1;
+}
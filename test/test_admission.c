@@ -0,0 +1,68 @@
+#include <check.h>
+#include "test_main.h"
+#include "admission.h"
+
+START_TEST(admission_limits) {
+
+	Admission a = admission_init(2, 10, 1000);
+	struct admission_stats stats;
+
+	ck_assert_int_eq(admission_enter(a, 0), ADMIT);
+	ck_assert_int_eq(admission_enter(a, 10), ADMIT);
+	ck_assert_int_eq(admission_enter(a, 0), SHED_INFLIGHT);
+
+	// A request that never ran doesn't count towards latency
+	admission_exit(a, -1);
+	ck_assert_int_eq(admission_enter(a, 11), SHED_QUEUE);
+
+	admission_stats(a, &stats);
+	ck_assert_int_eq(stats.inflight, 1);
+	ck_assert_uint_eq(stats.admitted, 2);
+	ck_assert_uint_eq(stats.shed, 2);
+	ck_assert(stats.latency_ms == 0);
+	admission_exit(a, 0);
+
+	ck_assert_ptr_eq(admission_init(0, 10, 1000), NULL);
+	admission_destroy(a);
+
+} END_TEST
+
+START_TEST(admission_latency) {
+
+	Admission a = admission_init(8, 10, 1000);
+	struct admission_stats stats;
+
+	// Slow requests push the average over the limit
+	for (int i = 0; i < 10; i++) {
+		ck_assert_int_eq(admission_enter(a, 0), ADMIT);
+		admission_exit(a, 5000);
+	}
+	admission_stats(a, &stats);
+	ck_assert(stats.latency_ms > 1000);
+
+	// Nothing in flight, so one is let through to measure again
+	ck_assert_int_eq(admission_enter(a, 0), ADMIT);
+	ck_assert_int_eq(admission_enter(a, 0), SHED_LATENCY);
+
+	// Fast ones bring it back down, one probe at a time
+	for (int i = 0; i < 20; i++) {
+		admission_exit(a, 10);
+		ck_assert_int_eq(admission_enter(a, 0), ADMIT);
+	}
+
+	ck_assert_int_eq(admission_enter(a, 0), ADMIT);
+	admission_destroy(a);
+
+} END_TEST
+
+Suite *admission_suite(void) {
+
+	Suite *suite = suite_create("admission");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_test(core, admission_limits);
+	tcase_add_test(core, admission_latency);
+
+	return suite;
+}
@@ -0,0 +1,108 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "test_main.h"
+#include "cache.h"
+
+static Cache cache;
+
+static void cache_start(void) {
+
+	cache = cache_init(CACHE_SHARDS * 1024);
+	ck_assert_ptr_ne(cache, NULL);
+}
+
+static void cache_stop(void) {
+
+	cache_destroy(cache);
+}
+
+START_TEST(cache_hit_miss) {
+
+	size_t len;
+	char *value;
+	struct cache_stats stats;
+
+	ck_assert_ptr_eq(cache_get(cache, "weather patras", &len), NULL);
+	ck_assert(cache_put(cache, "weather patras", "sunny", 6, 1000));
+	value = cache_get(cache, "weather patras", &len);
+	ck_assert_str_eq(value, "sunny");
+	ck_assert_uint_eq(len, 6);
+	free(value);
+
+	// Replaced, not added
+	ck_assert(cache_put(cache, "weather patras", "rain", 5, 1000));
+	value = cache_get(cache, "weather patras", &len);
+	ck_assert_str_eq(value, "rain");
+	free(value);
+
+	cache_stats(cache, &stats);
+	ck_assert_uint_eq(stats.hits, 2);
+	ck_assert_uint_eq(stats.misses, 1);
+	ck_assert_uint_eq(stats.entries, 1);
+
+	// Larger than a shard
+	ck_assert(!cache_put(cache, "big", "", 1024, 1000));
+	ck_assert_ptr_eq(cache_init(0), NULL);
+
+} END_TEST
+
+START_TEST(cache_ttl) {
+
+	size_t len;
+	struct cache_stats stats;
+
+	ck_assert(cache_put(cache, "fit", "yes", 4, 10));
+	usleep(20 * 1000);
+	ck_assert_ptr_eq(cache_get(cache, "fit", &len), NULL);
+
+	cache_stats(cache, &stats);
+	ck_assert_uint_eq(stats.entries, 0);
+	ck_assert_uint_eq(stats.bytes, 0);
+	ck_assert_uint_eq(stats.evictions, 0);
+
+} END_TEST
+
+START_TEST(cache_lru) {
+
+	size_t len;
+	char key[16], *value;
+	struct cache_stats stats;
+
+	// 300 byte values fill the 1 KiB shards after 3, so each shard keeps its last 2 or 3 entries
+	for (int i = 0; i < 200; i++) {
+		snprintf(key, sizeof(key), "dns %d", i);
+		ck_assert(cache_put(cache, key, "", 300, 1000));
+
+		// Keep the first one fresh, so that it's never the least recently used
+		value = cache_get(cache, "dns 0", &len);
+		ck_assert_ptr_ne(value, NULL);
+		free(value);
+	}
+	cache_stats(cache, &stats);
+	ck_assert_uint_gt(stats.evictions, 0);
+	ck_assert_uint_le(stats.bytes, CACHE_SHARDS * 1024);
+	ck_assert_uint_eq(stats.entries + stats.evictions, 200);
+
+	value = cache_get(cache, "dns 199", &len);
+	ck_assert_ptr_ne(value, NULL);
+	free(value);
+	ck_assert_ptr_eq(cache_get(cache, "dns 1", &len), NULL);
+
+} END_TEST
+
+Suite *cache_suite(void) {
+
+	Suite *suite = suite_create("cache");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_checked_fixture(core, cache_start, cache_stop);
+	tcase_add_test(core, cache_hit_miss);
+	tcase_add_test(core, cache_ttl);
+	tcase_add_test(core, cache_lru);
+
+	return suite;
+}
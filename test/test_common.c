@@ -1,10 +1,12 @@
 #include <check.h>
 #include <string.h>
 #include <unistd.h>
+#include <time.h>
 #include "test_main.h"
 #include "common.h"
 #include "irc.h"
 #include "socket.h"
+#include "deadline.h"
 
 ssize_t n;
 
@@ -48,6 +50,24 @@ START_TEST(strings_compare) {
 
 } END_TEST
 
+START_TEST(span_helpers) {
+
+	struct span s = {"PRIVMSG #foss", 7};
+	char buf[5];
+
+	if (!span_case_eq(s, "privmsg") || span_case_eq(s, "PRIVMSG #"))
+		ck_abort_msg("span_case_eq");
+
+	if (!span_starts_with(s, "PRIV") || span_starts_with(s, "PRIVMSG #"))
+		ck_abort_msg("span_starts_with");
+
+	if (!span_starts_case_with(s, "priv"))
+		ck_abort_msg("span_starts_case_with");
+
+	ck_assert_str_eq(span_copy(buf, sizeof(buf), s), "PRIV");
+
+} END_TEST
+
 START_TEST(nullterminate) {
 
 	strcpy(test_buffer, "|free|");
@@ -117,6 +137,67 @@ START_TEST(cmd_output) {
 
 } END_TEST
 
+START_TEST(cmd_output_limits) {
+
+	char buf[2048];
+	size_t len = 0;
+	int lines = 0;
+
+	// Single digit lines would count as empty
+	print_cmd_output_unsafe(server, "#test", "seq 10 1000");
+	do {
+		n = read(mock[RD], buf + len, sizeof(buf) - 1 - len);
+		ck_assert_int_gt(n, 0);
+		len += n;
+		buf[len] = '\0';
+	} while (!strstr(buf, "[output truncated]\r\n"));
+
+	for (char *line = strstr(buf, "PRIVMSG #test :"); line; line = strstr(line + 1, "PRIVMSG #test :"))
+		lines++;
+
+	ck_assert_int_eq(lines, CMD_MAXLINES + 1);
+	ck_assert(strstr(buf, "PRIVMSG #test :10\r\n"));
+
+} END_TEST
+
+START_TEST(cmd_output_cut) {
+
+	char buf[8192];
+	size_t len = 0;
+	int lines = 0;
+
+	// The line that doesn't fit is the last one sent, shorter ones after it would leave a gap. All of it is written at once
+	print_cmd_output_unsafe(server, "#test", "x=$(for i in $(seq 14); do printf '%0300d\\n' 0; done; echo short); echo \"$x\"");
+	do {
+		n = read(mock[RD], buf + len, sizeof(buf) - 1 - len);
+		ck_assert_int_gt(n, 0);
+		len += n;
+		buf[len] = '\0';
+	} while (!strstr(buf, "[output truncated]\r\n"));
+
+	for (char *line = strstr(buf, "PRIVMSG #test :"); line; line = strstr(line + 1, "PRIVMSG #test :"))
+		lines++;
+
+	ck_assert_int_eq(lines, CMD_MAXBYTES / 300 + 1);
+	ck_assert(!strstr(buf, "short"));
+
+} END_TEST
+
+START_TEST(cmd_output_closed) {
+
+	struct deadline d;
+	struct timespec start, end;
+
+	// Closing the output early doesn't get it past the deadline
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	deadline_start(&d, 300);
+	ck_assert_int_ne(print_cmd_output_unsafe(server, "#test", "exec >&-; sleep 10"), 0);
+	deadline_stop();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ck_assert_int_lt(end.tv_sec - start.tv_sec, 3);
+
+} END_TEST
+
 Suite *common_suite(void) {
 
 	Suite *suite  = suite_create("common");
@@ -127,6 +208,7 @@ Suite *common_suite(void) {
 	tcase_add_test(core, getint);
 	tcase_add_test(core, parameter_extraction);
 	tcase_add_test(core, strings_compare);
+	tcase_add_test(core, span_helpers);
 	tcase_add_test(core, nullterminate);
 	tcase_add_test(core, trim_trailing);
 	tcase_add_test(core, iso8859_7_to_utf8_test);
@@ -136,6 +218,9 @@ Suite *common_suite(void) {
 	tcase_add_unchecked_fixture(output, mock_irc_write, mock_stop);
 	tcase_add_test(output, cmd_output_unsafe);
 	tcase_add_test(output, cmd_output);
+	tcase_add_test(output, cmd_output_limits);
+	tcase_add_test(output, cmd_output_cut);
+	tcase_add_test(output, cmd_output_closed);
 
 	return suite;
 }
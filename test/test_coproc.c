@@ -0,0 +1,81 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include "test_main.h"
+#include "coproc.h"
+#include "common.h"
+
+bool coproc_request(char *buf, size_t size, const char *cmd, const char *arg);
+
+// Replies with its pid, exits on "die" & prints garbage on "junk"
+#define WORKER "while read -r line; do case \"$line\" in " \
+	"*die*) exit 1;; *junk*) echo junk;; *) echo \"{\\\"lines\\\": [\\\"$$\\\"]}\";; esac; done"
+
+START_TEST(coproc_request_escape) {
+
+	char buf[64];
+
+	ck_assert(coproc_request(buf, sizeof(buf), "ping", NULL));
+	ck_assert_str_eq(buf, "{\"cmd\": \"ping\"}\n");
+
+	ck_assert(coproc_request(buf, sizeof(buf), "weather", "a \"b\"\\\n"));
+	ck_assert_str_eq(buf, "{\"cmd\": \"weather\", \"arg\": \"a \\\"b\\\"\\\\\\u000a\"}\n");
+
+	ck_assert(!coproc_request(buf, 16, "weather", "athens"));
+
+} END_TEST
+
+/** @returns  The pid the worker replied with */
+static char *call(Coproc cp, const char *cmd, char *pid) {
+
+	yajl_val reply = coproc_call(cp, cmd, "x", 1000), lines;
+
+	ck_assert_ptr_ne(reply, NULL);
+	lines = yajl_tree_get(reply, CFG("lines"), yajl_t_array);
+	ck_assert_ptr_ne(lines, NULL);
+	ck_assert_int_eq(YAJL_GET_ARRAY(lines)->len, 1);
+	ck_assert(YAJL_IS_STRING(YAJL_GET_ARRAY(lines)->values[0]));
+	snprintf(pid, 16, "%s", YAJL_GET_STRING(YAJL_GET_ARRAY(lines)->values[0]));
+	yajl_tree_free(reply);
+	return pid;
+}
+
+START_TEST(coproc_restart) {
+
+	Coproc cp = coproc_init(CMD("sh", "-c", WORKER), 1, NULL);
+	char first[16], second[16];
+
+	// The same worker answers again
+	ck_assert_str_eq(call(cp, "a", first), call(cp, "b", second));
+
+	// Ones that die while idle are replaced right away
+	kill(atoi(first), SIGKILL);
+	usleep(100 * 1000);
+	ck_assert_str_ne(call(cp, "a", second), first);
+
+	// Ones that fail a request only after a delay, so a broken script isn't restarted in a loop
+	ck_assert_ptr_eq(coproc_call(cp, "junk", NULL, 1000), NULL);
+	ck_assert_ptr_eq(coproc_call(cp, "a", NULL, 1000), NULL);
+	usleep((COPROC_RESTART_DELAY + 100) * 1000);
+	ck_assert_str_ne(call(cp, "a", first), second);
+
+	ck_assert_ptr_eq(coproc_call(cp, "die", NULL, 1000), NULL);
+	coproc_destroy(cp);
+	ck_assert_ptr_eq(coproc_init(CMD("sh"), 0, NULL), NULL);
+
+} END_TEST
+
+Suite *coproc_suite(void) {
+
+	Suite *suite = suite_create("coproc");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_test(core, coproc_request_escape);
+	tcase_add_test(core, coproc_restart);
+
+	return suite;
+}
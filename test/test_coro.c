@@ -0,0 +1,175 @@
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include "test_main.h"
+#include "coro.h"
+#include "curl.h"
+#include "event.h"
+#include "common.h"
+
+static Reactor loop;
+static int order[4], finished;
+
+static void coro_start_fixture(void) {
+
+	loop = reactor_init();
+	ck_assert_ptr_ne(loop, NULL);
+	ck_assert(coro_init(loop));
+	memset(order, 0, sizeof(order));
+	finished = 0;
+}
+
+static void coro_stop_fixture(void) {
+
+	coro_cleanup();
+	reactor_destroy(loop);
+}
+
+/** The last coroutine to finish stops the reactor */
+static void finish(int n) {
+
+	order[finished++] = n;
+	if (finished == 2)
+		reactor_stop(loop);
+}
+
+static void sleeper(void *arg) {
+
+	int ms = *(int *) arg;
+
+	coro_sleep(ms);
+	finish(ms);
+}
+
+START_TEST(coro_sleep_order) {
+
+	int slow = 40, fast = 10;
+
+	ck_assert_ptr_eq(coro_self(), NULL);
+	ck_assert(coro_start(sleeper, &slow));
+	ck_assert(coro_start(sleeper, &fast));
+	ck_assert_uint_eq(coro_count(), 2);
+	ck_assert_int_eq(finished, 0);
+
+	ck_assert_int_eq(reactor_run(loop), 0);
+	ck_assert_int_eq(order[0], fast);
+	ck_assert_int_eq(order[1], slow);
+	ck_assert_uint_eq(coro_count(), 0);
+
+} END_TEST
+
+static int pair[RDWR];
+
+static void reader(void *arg) {
+
+	bool *ready = arg;
+
+	*ready = coro_wait_fd(pair[RD], EPOLLIN, 1000);
+	finish(1);
+}
+
+static void writer(void *arg) {
+
+	(void) arg;
+	coro_sleep(10);
+	write(pair[WR], "hey", 3);
+	finish(2);
+}
+
+START_TEST(coro_wait) {
+
+	bool ready = false, idle = true;
+
+	ck_assert_int_eq(socketpair(AF_UNIX, SOCK_STREAM, 0, pair), 0);
+	ck_assert(coro_start(reader, &ready));
+	ck_assert(coro_start(writer, NULL));
+	ck_assert_int_eq(reactor_run(loop), 0);
+	ck_assert(ready);
+	ck_assert_int_eq(order[0], 2);
+
+	// Nothing left to read, so it times out. The socket can be waited on again after the first wait
+	read(pair[RD], test_buffer, IRCLEN);
+	finished = 1;
+	ck_assert(coro_start(reader, &idle));
+	ck_assert_int_eq(reactor_run(loop), 0);
+	ck_assert(!idle);
+	close(pair[RD]);
+	close(pair[WR]);
+
+} END_TEST
+
+static char url[PATH_MAX + 64];
+
+static void fetch_title(void *arg) {
+
+	char **title = arg;
+
+	*title = get_url_title(url);
+	finish(1);
+}
+
+START_TEST(coro_transfers) {
+
+	char cwd[PATH_MAX], *titles[2] = {NULL};
+
+	getcwd(cwd, PATH_MAX);
+	snprintf(url, sizeof(url), "file://%s/test-files/url-title.txt", cwd);
+
+	// Both transfers run on the multi handle while the reactor waits
+	ck_assert(coro_start(fetch_title, &titles[0]));
+	ck_assert(coro_start(fetch_title, &titles[1]));
+	ck_assert_int_eq(reactor_run(loop), 0);
+	for (int i = 0; i < 2; i++) {
+		ck_assert_str_eq(titles[i], "ΕΘΝΙΚΟ ΜΕΤΣΟΒΙΟ ΠΟΛΥΤΕΧΝΕΙΟ");
+		free(titles[i]);
+	}
+} END_TEST
+
+static void child(void *arg) {
+
+	coro_sleep(5);
+	(*(int *) arg)++;
+}
+
+static void parent(void *arg) {
+
+	int *n = arg;
+	Coro c = coro_spawn(child, n);
+
+	ck_assert_ptr_ne(c, NULL);
+	ck_assert_int_eq(*n, 0);
+	coro_join(c);
+	ck_assert_int_eq(*n, 1);
+	finish(1);
+	finish(1);
+}
+
+START_TEST(coro_spawn_join) {
+
+	int n = 0;
+
+	ck_assert(coro_start(parent, &n));
+	ck_assert_uint_eq(coro_count(), 2);
+	ck_assert_int_eq(reactor_run(loop), 0);
+	ck_assert_int_eq(n, 1);
+	ck_assert_uint_eq(coro_count(), 0);
+
+} END_TEST
+
+Suite *coro_suite(void) {
+
+	Suite *suite = suite_create("coro");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_checked_fixture(core, coro_start_fixture, coro_stop_fixture);
+	tcase_add_test(core, coro_sleep_order);
+	tcase_add_test(core, coro_wait);
+	tcase_add_test(core, coro_transfers);
+	tcase_add_test(core, coro_spawn_join);
+
+	return suite;
+}
@@ -7,6 +7,7 @@
 #include <yajl/yajl_tree.h>
 #include "curl.h"
 #include "init.h"
+#include "common.h"
 
 char path[PATH_MAX];
 char testfile[PATH_MAX];
@@ -67,6 +68,34 @@ START_TEST(github_commits) {
 
 } END_TEST
 
+START_TEST(curl_resolve) {
+
+	CURL *curl = curl_easy_init();
+	struct curl_slist *hosts = NULL;
+
+	// The cached addresses are handed to curl
+	ck_assert(curl_set_url(curl, "http://localhost:8080/index.html", &hosts));
+	ck_assert_ptr_ne(hosts, NULL);
+	ck_assert(starts_with(hosts->data, "localhost:8080:"));
+	ck_assert_ptr_ne(strstr(hosts->data, "127.0.0.1"), NULL);
+	curl_slist_free_all(hosts);
+	hosts = NULL;
+
+	ck_assert(curl_set_url(curl, "localhost/index.html", &hosts));
+	ck_assert(starts_with(hosts->data, "localhost:80:"));
+	curl_slist_free_all(hosts);
+	hosts = NULL;
+
+	// Nothing to resolve
+	ck_assert(curl_set_url(curl, "file:///dev/null", &hosts));
+	ck_assert_ptr_eq(hosts, NULL);
+
+	ck_assert(!curl_set_url(curl, "https://irc.invalid/", &hosts));
+	ck_assert_ptr_eq(hosts, NULL);
+	curl_easy_cleanup(curl);
+
+} END_TEST
+
 Suite *curl_suite(void) {
 
 	Suite *suite = suite_create("curl");
@@ -78,6 +107,7 @@ Suite *curl_suite(void) {
 	tcase_add_test(core, url_shortener_test);
 	tcase_add_test(core, titleurl);
 	tcase_add_test(core, github_commits);
+	tcase_add_test(core, curl_resolve);
 
 	return suite;
 }
@@ -0,0 +1,85 @@
+#include <check.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include "test_main.h"
+#include "deadline.h"
+#include "common.h"
+
+static long now_ms(void) {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * MILLISECS + ts.tv_nsec / (NANOSECS / MILLISECS);
+}
+
+START_TEST(deadline_basics) {
+
+	struct deadline d;
+
+	ck_assert_ptr_eq(deadline_current(), NULL);
+	ck_assert(!deadline_expired(NULL));
+	ck_assert_int_eq(deadline_clamp(1000), 1000);
+
+	deadline_start(&d, 50);
+	ck_assert_ptr_eq(deadline_current(), &d);
+	ck_assert_int_le(deadline_clamp(1000), 50);
+	ck_assert(!deadline_expired(&d));
+
+	deadline_cancel(&d);
+	ck_assert(deadline_expired(&d));
+	ck_assert_int_eq(deadline_remaining(&d), 0);
+
+	deadline_stop();
+	ck_assert_ptr_eq(deadline_current(), NULL);
+	ck_assert_int_eq(deadline_remaining(NULL), LONG_MAX);
+
+} END_TEST
+
+START_TEST(deadline_wait) {
+
+	struct deadline d;
+	int fd[2];
+	long start = now_ms();
+
+	ck_assert_int_eq(pipe(fd), 0);
+	deadline_start(&d, 50);
+	ck_assert(!deadline_wait_fd(fd[0], EPOLLIN, 5000));
+	ck_assert_int_lt(now_ms() - start, 1000);
+	deadline_stop();
+
+	ck_assert_int_eq(write(fd[1], "x", 1), 1);
+	ck_assert(deadline_wait_fd(fd[0], EPOLLIN, 5000));
+	close(fd[0]);
+	close(fd[1]);
+
+} END_TEST
+
+START_TEST(deadline_child) {
+
+	struct deadline d;
+	long start = now_ms();
+
+	// The shell & its sleep are both killed, otherwise the pipe would stay open
+	deadline_start(&d, 100);
+	ck_assert_int_ne(print_cmd_output_unsafe(NULL, "#test", "sleep 5; echo late"), EXIT_SUCCESS);
+	ck_assert_int_lt(now_ms() - start, 2000);
+	deadline_stop();
+
+} END_TEST
+
+Suite *deadline_suite(void) {
+
+	Suite *suite = suite_create("deadline");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_test(core, deadline_basics);
+	tcase_add_test(core, deadline_wait);
+	tcase_add_test(core, deadline_child);
+
+	return suite;
+}
@@ -0,0 +1,228 @@
+#include <check.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include "test_main.h"
+#include "event.h"
+#include "queue.h"
+#include "common.h"
+
+Reactor reactor;
+int calls;
+
+static void reactor_start(void) {
+
+	mock_start();
+	reactor = reactor_init();
+	ck_assert_ptr_ne(reactor, NULL);
+	calls = 0;
+}
+
+static void reactor_stop_fixture(void) {
+
+	reactor_destroy(reactor);
+	mock_stop();
+}
+
+static void stop_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	(void) ev;
+	(void) events;
+	(void) data;
+
+	calls++;
+	reactor_stop(r);
+}
+
+static void read_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	ck_assert(events & EPOLLIN);
+	ck_assert_int_eq(read(event_fd(ev), test_buffer, IRCLEN), 3);
+	stop_handler(r, ev, events, data);
+}
+
+static void remove_handler(Reactor r, Event ev, uint32_t events, void *data) {
+
+	(void) ev;
+	(void) events;
+
+	// Whichever handler runs first removes the other one
+	calls++;
+	reactor_remove(r, *(Event *) data);
+	reactor_stop(r);
+}
+
+START_TEST(event_fd_ready) {
+
+	ck_assert_ptr_ne(reactor_add_fd(reactor, mock[RD], EPOLLIN, read_handler, NULL), NULL);
+	write(mock[WR], "hey", 3);
+	ck_assert_int_eq(reactor_run(reactor), 0);
+	ck_assert_int_eq(calls, 1);
+
+	ck_assert_ptr_eq(reactor_add_fd(reactor, -1, EPOLLIN, read_handler, NULL), NULL);
+
+} END_TEST
+
+START_TEST(event_timer) {
+
+	struct timespec start, end;
+	Event ev;
+
+	ev = reactor_add_timer(reactor, 0, 0, stop_handler, NULL);
+	ck_assert_ptr_ne(ev, NULL);
+	ck_assert(timer_set(ev, 50, 0));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ck_assert_int_eq(reactor_run(reactor), 0);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ck_assert_int_eq(calls, 1);
+	ck_assert_int_ge((end.tv_sec - start.tv_sec) * MILLISECS + (end.tv_nsec - start.tv_nsec) / (NANOSECS / MILLISECS), 49);
+
+	// Periodic
+	timer_set(ev, 1, 1);
+	reactor_run(reactor);
+	reactor_run(reactor);
+	ck_assert_int_eq(calls, 3);
+
+} END_TEST
+
+START_TEST(event_signal) {
+
+	ck_assert_ptr_ne(reactor_add_signal(reactor, SIGUSR1, stop_handler, NULL), NULL);
+	raise(SIGUSR1);
+	ck_assert_int_eq(reactor_run(reactor), 0);
+	ck_assert_int_eq(calls, 1);
+
+} END_TEST
+
+START_TEST(event_remove_pending) {
+
+	Event ev1, ev2;
+	int fd = dup(mock[RD]);
+
+	ev1 = reactor_add_fd(reactor, mock[RD], EPOLLIN, remove_handler, &ev2);
+	ev2 = reactor_add_fd(reactor, fd, EPOLLIN, remove_handler, &ev1);
+	write(mock[WR], "hey", 3);
+
+	// Both are ready in the same round but only one handler may run
+	ck_assert_int_eq(reactor_run(reactor), 0);
+	ck_assert_int_eq(calls, 1);
+	close(fd);
+
+} END_TEST
+
+START_TEST(queue_burst) {
+
+	Mqueue mq;
+	ssize_t n;
+	char line[16];
+
+	fcntl(mock[RD], F_SETFL, O_NONBLOCK);
+	mq = mqueue_init(reactor, mock[WR]);
+	ck_assert_ptr_ne(mq, NULL);
+	for (int i = 0; i < 8; i++) {
+		sprintf(line, "line %d\r\n", i);
+		ck_assert(mqueue_send(mq, line));
+	}
+	// A burst is sent as soon as the queue is flushed, the rest has to wait for the bucket to refill
+	mqueue_flush(mq);
+	n = read(mock[RD], test_buffer, IRCLEN);
+	ck_assert_int_eq(n, 6 * 8);
+	test_buffer[n] = '\0';
+	ck_assert(starts_with(test_buffer, "line 0\r\nline 1\r\n"));
+	ck_assert_int_eq(read(mock[RD], test_buffer, IRCLEN), -1);
+
+	reactor_add_timer(reactor, 1100, 0, stop_handler, NULL);
+	reactor_run(reactor);
+	n = read(mock[RD], test_buffer, IRCLEN);
+	test_buffer[n] = '\0';
+	ck_assert_str_eq(test_buffer, "line 6\r\n");
+
+	// The rest is sent on destroy
+	mqueue_destroy(mq);
+	n = read(mock[RD], test_buffer, IRCLEN);
+	test_buffer[n] = '\0';
+	ck_assert_str_eq(test_buffer, "line 7\r\n");
+
+} END_TEST
+
+START_TEST(queue_reserved) {
+
+	Mqueue mq;
+	int replies = 0;
+
+	mq = mqueue_init(reactor, mock[WR]);
+	ck_assert_ptr_ne(mq, NULL);
+	while (mqueue_send_reply(mq, "PRIVMSG #chan :hey\r\n"))
+		replies++;
+
+	// Protocol lines still fit after replies are refused
+	ck_assert_int_eq(replies, QUEUE_MAXLINES - QUEUE_RESERVED);
+	ck_assert_uint_eq(mqueue_depth(mq), replies);
+	ck_assert(mqueue_send(mq, "PONG :srv\r\n"));
+	mqueue_destroy(mq);
+
+} END_TEST
+
+START_TEST(queue_reconnect) {
+
+	Mqueue mq;
+	ssize_t n;
+	int pair[2];
+
+	mq = mqueue_init(reactor, mock[WR]);
+	ck_assert_ptr_ne(mq, NULL);
+	ck_assert(mqueue_send_reply(mq, "kept 0\r\n"));
+	ck_assert(mqueue_send(mq, "PONG :old\r\n"));
+	mqueue_disconnect(mq);
+	ck_assert_int_eq(read(mock[RD], test_buffer, IRCLEN), 0);
+
+	// Lines keep being queued while disconnected, but only replies outlive the connection
+	ck_assert(mqueue_send_reply(mq, "kept 1\r\n"));
+	ck_assert(mqueue_send(mq, "NICK bot_\r\n"));
+	mqueue_flush(mq);
+
+	// Registration goes first on the new connection
+	ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+	fcntl(pair[RD], F_SETFL, O_NONBLOCK);
+	mqueue_connect(mq, pair[WR], NULL);
+	ck_assert(mqueue_send(mq, "NICK bot\r\n"));
+	mqueue_flush(mq);
+	n = read(pair[RD], test_buffer, IRCLEN);
+	ck_assert_int_eq(n, 10);
+	test_buffer[n] = '\0';
+	ck_assert_str_eq(test_buffer, "NICK bot\r\n");
+
+	mqueue_release(mq);
+	mqueue_flush(mq);
+	n = read(pair[RD], test_buffer, IRCLEN);
+	ck_assert_int_eq(n, 16);
+	test_buffer[n] = '\0';
+	ck_assert_str_eq(test_buffer, "kept 0\r\nkept 1\r\n");
+
+	mqueue_destroy(mq);
+	close(pair[RD]);
+	close(pair[WR]);
+
+} END_TEST
+
+Suite *event_suite(void) {
+
+	Suite *suite = suite_create("event");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_checked_fixture(core, reactor_start, reactor_stop_fixture);
+	tcase_add_test(core, event_fd_ready);
+	tcase_add_test(core, event_timer);
+	tcase_add_test(core, event_signal);
+	tcase_add_test(core, event_remove_pending);
+	tcase_add_test(core, queue_burst);
+	tcase_add_test(core, queue_reserved);
+	tcase_add_test(core, queue_reconnect);
+
+	return suite;
+}
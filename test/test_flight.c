@@ -0,0 +1,153 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "test_main.h"
+#include "flight.h"
+#include "coro.h"
+#include "event.h"
+
+static Flight flight;
+static Reactor loop;
+
+struct waiter {
+	enum flight_role role;
+	char *result;
+	size_t len;
+};
+
+static void flight_start(void) {
+
+	flight = flight_init();
+	ck_assert_ptr_ne(flight, NULL);
+}
+
+static void flight_stop(void) {
+
+	flight_destroy(flight);
+}
+
+static void wait_key(void *arg) {
+
+	struct waiter *w = arg;
+
+	w->role = flight_join(flight, "github irc-bot", 1000, (void **) &w->result, &w->len);
+}
+
+static void *wait_thread(void *arg) {
+
+	wait_key(arg);
+	return NULL;
+}
+
+START_TEST(flight_coalesce) {
+
+	pthread_t tid[2];
+	struct waiter w[2] = {{0}};
+
+	ck_assert_int_eq(flight_join(flight, "github irc-bot", 1000, NULL, NULL), FLIGHT_LEAD);
+	for (int i = 0; i < 2; i++)
+		pthread_create(&tid[i], NULL, wait_thread, &w[i]);
+
+	usleep(50 * 1000);
+	flight_land(flight, "github irc-bot", "commits", 8);
+	for (int i = 0; i < 2; i++) {
+		pthread_join(tid[i], NULL);
+		ck_assert_int_eq(w[i].role, FLIGHT_DONE);
+		ck_assert_str_eq(w[i].result, "commits");
+		ck_assert_uint_eq(w[i].len, 8);
+		free(w[i].result);
+	}
+	// Landed, so the next caller leads a new request
+	ck_assert_int_eq(flight_join(flight, "github irc-bot", 1000, NULL, NULL), FLIGHT_LEAD);
+	flight_land(flight, "github irc-bot", NULL, 0);
+
+} END_TEST
+
+START_TEST(flight_timeout_failure) {
+
+	pthread_t tid;
+	struct waiter w = {0};
+
+	// Keys are independent
+	ck_assert_int_eq(flight_join(flight, "github irc-bot", 1000, NULL, NULL), FLIGHT_LEAD);
+	ck_assert_int_eq(flight_join(flight, "dns a.gr", 1000, NULL, NULL), FLIGHT_LEAD);
+	ck_assert_int_eq(flight_join(flight, "dns a.gr", 10, NULL, NULL), FLIGHT_TIMEOUT);
+
+	pthread_create(&tid, NULL, wait_thread, &w);
+	usleep(50 * 1000);
+	flight_land(flight, "github irc-bot", NULL, 0);
+	pthread_join(tid, NULL);
+	ck_assert_int_eq(w.role, FLIGHT_FAILED);
+	flight_land(flight, "dns a.gr", NULL, 0);
+
+} END_TEST
+
+static void *land_later(void *arg) {
+
+	(void) arg;
+	usleep(30 * 1000);
+	flight_land(flight, "github irc-bot", "commits", 8);
+	return NULL;
+}
+
+static int waiting;
+
+static void wait_and_stop(void *arg) {
+
+	wait_key(arg);
+	if (!--waiting)
+		reactor_stop(loop);
+}
+
+static void timeout_and_stop(void *arg) {
+
+	struct waiter *w = arg;
+
+	w->role = flight_join(flight, "github irc-bot", 10, NULL, NULL);
+	if (!--waiting)
+		reactor_stop(loop);
+}
+
+START_TEST(flight_coroutine) {
+
+	pthread_t tid;
+	struct waiter w[3] = {{0}};
+
+	// The coroutines are parked while the reactor keeps running, one of them gives up first
+	loop = reactor_init();
+	ck_assert(coro_init(loop));
+	ck_assert_int_eq(flight_join(flight, "github irc-bot", 1000, NULL, NULL), FLIGHT_LEAD);
+	waiting = 3;
+	ck_assert(coro_start(wait_and_stop, &w[0]));
+	ck_assert(coro_start(timeout_and_stop, &w[1]));
+	ck_assert(coro_start(wait_and_stop, &w[2]));
+	pthread_create(&tid, NULL, land_later, NULL);
+	ck_assert_int_eq(reactor_run(loop), 0);
+	pthread_join(tid, NULL);
+
+	ck_assert_int_eq(w[1].role, FLIGHT_TIMEOUT);
+	for (int i = 0; i < 3; i += 2) {
+		ck_assert_int_eq(w[i].role, FLIGHT_DONE);
+		ck_assert_str_eq(w[i].result, "commits");
+		free(w[i].result);
+	}
+	coro_cleanup();
+	reactor_destroy(loop);
+
+} END_TEST
+
+Suite *flight_suite(void) {
+
+	Suite *suite = suite_create("flight");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_checked_fixture(core, flight_start, flight_stop);
+	tcase_add_test(core, flight_coalesce);
+	tcase_add_test(core, flight_timeout_failure);
+	tcase_add_test(core, flight_coroutine);
+
+	return suite;
+}
@@ -0,0 +1,74 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <yajl/yajl_tree.h>
+#include "test_main.h"
+#include "init.h"
+
+int parse_networks(yajl_val root, struct network_options *networks);
+int get_json_int(yajl_val root, const char *field_name, int def, int max);
+
+START_TEST(init_get_json_int) {
+
+	yajl_val root;
+	char config[] = "{ \"command_threads\": 8 }";
+
+	root = yajl_tree_parse(config, test_buffer, IRCLEN);
+	ck_assert_ptr_ne(root, NULL);
+	ck_assert_int_eq(get_json_int(root, "command_threads", 2, 64), 8);
+
+	// Keys older configs lack get the default
+	ck_assert_int_eq(get_json_int(root, "script_workers", 2, 16), 2);
+	yajl_tree_free(root);
+
+} END_TEST
+
+START_TEST(init_parse_networks) {
+
+	yajl_val root;
+	struct network_options networks[MAXNETWORKS];
+	char config[] = "{ \"server\": \"chat.freenode.net\", \"port\": \"6667\", \"nick\": \"fossbot\", \"user\": \"bot\","
+			"\"nick_password\": \"secret\", \"tls\": false, \"channels\": [ \"#foss-teimes\" ],"
+			"\"networks\": [ { \"server\": \"irc.libera.chat\", \"port\": \"6697\", \"tls\": true, \"nick\": \"fossbot2\" },"
+			"{ \"server\": \"irc.oftc.net\", \"port\": \"6667\", \"channels\": [ \"#a\", \"#b\" ] } ] }";
+
+	root = yajl_tree_parse(config, test_buffer, IRCLEN);
+	ck_assert_ptr_ne(root, NULL);
+	ck_assert_int_eq(parse_networks(root, networks), 3);
+
+	ck_assert_str_eq(networks[0].server, "chat.freenode.net");
+	ck_assert(!networks[0].tls);
+
+	// Fields not set are taken from the first network
+	ck_assert_str_eq(networks[1].server, "irc.libera.chat");
+	ck_assert_str_eq(networks[1].port, "6697");
+	ck_assert_str_eq(networks[1].nick, "fossbot2");
+	ck_assert_str_eq(networks[1].user, "bot");
+	ck_assert(networks[1].tls);
+	ck_assert_int_eq(networks[1].channels_set, 1);
+	ck_assert_str_eq(networks[1].channels[0], "#foss-teimes");
+
+	ck_assert_str_eq(networks[2].nick, "fossbot");
+	ck_assert_int_eq(networks[2].channels_set, 2);
+	ck_assert_str_eq(networks[2].channels[1], "#b");
+
+	// Each network wipes its own copy of the password
+	ck_assert_str_eq(networks[2].nick_password, "secret");
+	ck_assert_ptr_ne(networks[2].nick_password, networks[1].nick_password);
+	free(networks[1].nick_password);
+	free(networks[2].nick_password);
+	yajl_tree_free(root);
+
+} END_TEST
+
+Suite *init_suite(void) {
+
+	Suite *suite = suite_create("init");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_test(core, init_get_json_int);
+	tcase_add_test(core, init_parse_networks);
+
+	return suite;
+}
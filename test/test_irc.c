@@ -4,15 +4,30 @@
 #include <stdbool.h>
 #include <string.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <errno.h>
+#include <pthread.h>
 #include "test_main.h"
 #include "socket.h"
 #include "irc.h"
 #include "init.h"
+#include "common.h"
+#include "deadline.h"
 
-void ctcp_handle(Irc server, struct parsed_data pdata);
+void ctcp_handle(Irc server, const struct irc_message *msg);
+void irc_cap(Irc server, const struct irc_message *msg);
+int numeric_value(struct span command);
+bool memo_key(char *key, size_t size, const char *name, struct span args);
+bool user_is_identified(Irc server, const char *nick);
 
 ssize_t n;
+struct irc_message msg;
+static int names_received;
+
+static void parse_message(const char *line) {
+
+	ck_assert(irc_parse_message(line, strlen(line), &msg));
+}
 
 START_TEST(irc_get_socket) {
 
@@ -20,6 +35,35 @@ START_TEST(irc_get_socket) {
 
 } END_TEST
 
+static void count_names(Irc server, const struct irc_message *msg) {
+
+	(void) server;
+	names_received += msg->param_count;
+}
+
+START_TEST(irc_numeric_register) {
+
+	ck_assert_int_eq(numeric_value((struct span) {"353", 3}), 353);
+	ck_assert_int_eq(numeric_value((struct span) {"35a", 3}), 0);
+	ck_assert_int_eq(numeric_value((struct span) {"3530", 4}), 0);
+	ck_assert_int_eq(numeric_value((struct span) {"PRIVMSG", 7}), 0);
+
+	// Unregistered numerics are ignored
+	parse_message(":wolfe.freenode.net 353 fossbot = #foss-teimes :fossbot freestyl3r @ChanServ");
+	numeric_reply(server, &msg, 353);
+	ck_assert_int_eq(names_received, 0);
+
+	ck_assert(irc_register_numeric(353, count_names) == NULL);
+	numeric_reply(server, &msg, 353);
+	ck_assert_int_eq(names_received, 4);
+
+	// The previous handler is returned so that it can be chained or restored
+	ck_assert(irc_register_numeric(353, NULL) == count_names);
+	numeric_reply(server, &msg, 353);
+	ck_assert_int_eq(names_received, 4);
+
+} END_TEST
+
 START_TEST(irc_set_nick) {
 
 	set_nick(server, "trololol");
@@ -33,7 +77,8 @@ START_TEST(irc_set_nick) {
 START_TEST(irc_numeric_NICKNAMEINUSE) {
 
 	set_nick(server, "trololol");
-	numeric_reply(server, pdata, NICKNAMEINUSE);
+	parse_message(":wolfe.freenode.net 433 * trololol :Nickname is already in use");
+	numeric_reply(server, &msg, NICKNAMEINUSE);
 	if (server->nick[strlen(server->nick) - 1] != '_')
 		ck_abort_msg("nick rename failed");
 
@@ -43,7 +88,8 @@ START_TEST(irc_numeric_ENDOFMOTD) {
 
 	join_channel(server, "#eleos");
 	join_channel(server, "#eleos2");
-	numeric_reply(server, pdata, ENDOFMOTD);
+	parse_message(":wolfe.freenode.net 376 fossbot :End of /MOTD command.");
+	numeric_reply(server, &msg, ENDOFMOTD);
 	read(mock[RD], test_buffer, IRCLEN);
 	ck_assert_str_eq(test_buffer, "JOIN #eleos\r\nJOIN #eleos2\r\n");
 
@@ -51,18 +97,20 @@ START_TEST(irc_numeric_ENDOFMOTD) {
 
 START_TEST(irc_numeric_BANNEDFROMCHAN) {
 
-	char msg[] = "#trololol re";
-	pdata.message = msg;
-
 	server->connected = true;
 	join_channel(server, "#trololol");
 	join_channel(server, "#trololol2");
 	ck_assert_str_eq(server->channels[0], "#trololol");
-	numeric_reply(server, pdata, BANNEDFROMCHAN);
+	parse_message(":wolfe.freenode.net 474 fossbot #trololol :Cannot join channel (+b)");
+	numeric_reply(server, &msg, BANNEDFROMCHAN);
 	ck_assert_int_eq(server->channels_set, 1);
 	ck_assert_str_eq(server->channels[0], "#trololol2");
 
-	numeric_reply(server, pdata, BANNEDFROMCHAN);
+	numeric_reply(server, &msg, BANNEDFROMCHAN);
+	ck_assert_int_eq(server->channels_set, 1);
+
+	parse_message(":wolfe.freenode.net 474 fossbot #trololol2 :Cannot join channel (+b)");
+	numeric_reply(server, &msg, BANNEDFROMCHAN);
 	ck_assert_int_eq(server->channels_set, 0);
 
 } END_TEST
@@ -73,7 +121,30 @@ START_TEST(irc_set_user) {
 	ck_assert_str_eq(server->user, "trololol");
 
 	read(mock[RD], test_buffer, IRCLEN);
-	ck_assert_str_eq(test_buffer, "USER trololol 0 * :trololol\r\n");
+	ck_assert_str_eq(test_buffer, "CAP LS 302\r\nUSER trololol 0 * :trololol\r\n");
+
+} END_TEST
+
+START_TEST(irc_cap_negotiation) {
+
+	// Only the capabilities listed are requested, once the last line of the list arrives
+	parse_message(":wolfe.freenode.net CAP * LS * :multi-prefix server-time");
+	irc_cap(server, &msg);
+	parse_message(":wolfe.freenode.net CAP * LS :sasl=PLAIN,EXTERNAL message-tags");
+	irc_cap(server, &msg);
+	test_buffer[read(mock[RD], test_buffer, IRCLEN)] = '\0';
+	ck_assert_str_eq(test_buffer, "CAP REQ :message-tags server-time\r\n");
+
+	parse_message(":wolfe.freenode.net CAP fossbot ACK :message-tags server-time");
+	irc_cap(server, &msg);
+	test_buffer[read(mock[RD], test_buffer, IRCLEN)] = '\0';
+	ck_assert_str_eq(test_buffer, "CAP END\r\n");
+
+	server->caps = 0;
+	parse_message(":wolfe.freenode.net CAP * LS :multi-prefix message-tagsx");
+	irc_cap(server, &msg);
+	test_buffer[read(mock[RD], test_buffer, IRCLEN)] = '\0';
+	ck_assert_str_eq(test_buffer, "CAP END\r\n");
 
 } END_TEST
 
@@ -135,10 +206,8 @@ START_TEST(irc_quit_server) {
 
 START_TEST(irc_ctcp_time) {
 
-	pdata.sender = "mitsos";
-	pdata.command = "\x01TIME";
-
-	ctcp_handle(server, pdata);
+	parse_message(":mitsos!~a@b.c PRIVMSG fossbot :\x01TIME\x01");
+	ctcp_handle(server, &msg);
 	n = read(mock[RD], test_buffer, IRCLEN);
 	ck_assert(test_buffer[n - 4] != '\n');
 
@@ -146,30 +215,129 @@ START_TEST(irc_ctcp_time) {
 
 START_TEST(irc_ctcp_ping) {
 
-	pdata.sender = "mitsos";
-	pdata.command = "\x01ping";
-	pdata.message = NULL;
-
-	ctcp_handle(server, pdata);
+	parse_message(":mitsos!~a@b.c PRIVMSG fossbot :\x01ping\x01");
+	ctcp_handle(server, &msg);
 	read(mock[RD], test_buffer, IRCLEN);
 	char *temp = strpbrk(test_buffer, "1234567890");
 	ck_assert_ptr_ne(temp, NULL);
 	ck_assert_int_gt(strlen(temp), 18);
 
-	pdata.message = "123456789 1234";
-	ctcp_handle(server, pdata);
+	parse_message(":mitsos!~a@b.c PRIVMSG fossbot :\x01PING 123456789 1234\x01");
+	ctcp_handle(server, &msg);
 	n = read(mock[RD], test_buffer, IRCLEN);
 	test_buffer[n] = '\0';
 	ck_assert_str_eq(test_buffer, "NOTICE mitsos :\x01PING 123456789 1234\x01\r\n");
 
 } END_TEST
 
+START_TEST(irc_parse_message_spans) {
+
+	const char *line = ":laxanofido!~laxanofid@snf-23545.vm.okeanos.grnet.gr PRIVMSG #foss-teimes :How YA doing fossbot";
+
+	ck_assert(irc_parse_message(line, strlen(line), &msg));
+	ck_assert_int_eq(msg.prefix.len, 51);
+	ck_assert(!memcmp(msg.prefix.ptr, "laxanofido!~laxanofid@snf-23545.vm.okeanos.grnet.gr", msg.prefix.len));
+	ck_assert_int_eq(msg.nick.len, 10);
+	ck_assert(!memcmp(msg.nick.ptr, "laxanofido", msg.nick.len));
+	ck_assert_int_eq(msg.command.len, 7);
+	ck_assert(!memcmp(msg.command.ptr, "PRIVMSG", msg.command.len));
+	ck_assert_int_eq(msg.param_count, 2);
+	ck_assert_int_eq(msg.params[0].len, 12);
+	ck_assert(!memcmp(msg.params[0].ptr, "#foss-teimes", msg.params[0].len));
+	ck_assert_int_eq(msg.params[1].len, 20);
+	ck_assert(!memcmp(msg.params[1].ptr, "How YA doing fossbot", msg.params[1].len));
+
+	// Line is left untouched
+	ck_assert_str_eq(line, ":laxanofido!~laxanofid@snf-23545.vm.okeanos.grnet.gr PRIVMSG #foss-teimes :How YA doing fossbot");
+
+	line = "PING :wolfe.freenode.net";
+	ck_assert(irc_parse_message(line, strlen(line), &msg));
+	ck_assert_ptr_eq(msg.prefix.ptr, NULL);
+	ck_assert_int_eq(msg.nick.len, 0);
+	ck_assert_int_eq(msg.param_count, 1);
+	ck_assert(!memcmp(msg.params[0].ptr, "wolfe.freenode.net", msg.params[0].len));
+
+	line = ":wolfe.freenode.net 005 fossbot CHANTYPES=# EXCEPTS :are supported by this server";
+	ck_assert(irc_parse_message(line, 51, &msg));
+	ck_assert_int_eq(msg.nick.len, 0);
+	ck_assert_int_eq(msg.param_count, 3);
+	ck_assert(!memcmp(msg.params[2].ptr, "EXCEPTS", msg.params[2].len));
+
+	ck_assert(!irc_parse_message(":lonely.prefix", 14, &msg));
+	ck_assert(!irc_parse_message("", 0, &msg));
+
+} END_TEST
+
+START_TEST(irc_parse_message_tags) {
+
+	const char *line = "@time=2011-10-19T16:40:51.620Z;account=bob :bob!~b@c.d PRIVMSG #foss-teimes :hi";
+	char longer[IRCLEN + 100];
+
+	ck_assert(irc_parse_message(line, strlen(line), &msg));
+	ck_assert_int_eq(msg.tags.len, 41);
+	ck_assert(!memcmp(msg.tags.ptr, "time=", 5));
+	ck_assert(!memcmp(msg.nick.ptr, "bob", msg.nick.len));
+	ck_assert(!memcmp(msg.command.ptr, "PRIVMSG", msg.command.len));
+	ck_assert_int_eq(msg.param_count, 2);
+
+	// Server messages may have tags without a prefix
+	line = "@msgid=63E1033A051D4B41B1AB1FA3CF4B243E PING :wolfe.freenode.net";
+	ck_assert(irc_parse_message(line, strlen(line), &msg));
+	ck_assert_int_eq(msg.prefix.len, 0);
+	ck_assert(!memcmp(msg.command.ptr, "PING", msg.command.len));
+
+	line = "hm";
+	ck_assert(irc_parse_message(line, strlen(line), &msg));
+	ck_assert_ptr_eq(msg.tags.ptr, NULL);
+	ck_assert(!irc_parse_message("@lonely=tags", 12, &msg));
+
+	// Tags don't count towards IRCLEN, but the rest of the line is cut there
+	memset(longer, 'a', sizeof(longer));
+	memcpy(longer, "@a=b :n!u@h PRIVMSG #c :", 24);
+	ck_assert(irc_parse_message(longer, sizeof(longer), &msg));
+	ck_assert_uint_eq(msg.params[1].len, IRCLEN - 19);
+	ck_assert(irc_parse_message(longer + 5, sizeof(longer) - 5, &msg));
+	ck_assert_uint_eq(msg.params[1].len, IRCLEN - 19);
+
+} END_TEST
+
+START_TEST(irc_tags_access) {
+
+	struct timespec ts;
+	struct span value, tags;
+	const char *line = "+example.com/flag;account=bob;msgid=a\\:b\\sc\\\\d\\;time=2011-10-19T16:40:51.620Z";
+
+	tags = (struct span) {line, strlen(line)};
+	ck_assert(irc_tag_find(tags, "+example.com/flag", &value));
+	ck_assert_int_eq(value.len, 0);
+	ck_assert(!irc_tag_find(tags, "acc", &value));
+	ck_assert(!irc_tag_find(tags, "example.com/flag", &value));
+
+	ck_assert_int_eq(irc_tag_value(tags, "account", test_buffer, IRCLEN), 3);
+	ck_assert_str_eq(test_buffer, "bob");
+
+	// Escapes are decoded only on access and a trailing backslash is dropped
+	ck_assert_int_eq(irc_tag_value(tags, "msgid", test_buffer, IRCLEN), 7);
+	ck_assert_str_eq(test_buffer, "a;b c\\d");
+	ck_assert_int_eq(irc_tag_value(tags, "msgid", test_buffer, 3), 2);
+	ck_assert_str_eq(test_buffer, "a;");
+	ck_assert_int_eq(irc_tag_value(tags, "batch", test_buffer, IRCLEN), 0);
+
+	ck_assert(irc_tag_time(tags, &ts));
+	ck_assert_int_eq(ts.tv_sec, 1319042451);
+	ck_assert_int_eq(ts.tv_nsec, 620000000);
+	tags = (struct span) {"time=2011-10-19", 15};
+	ck_assert(!irc_tag_time(tags, &ts));
+
+} END_TEST
+
 START_TEST(irc_parse_line_ping) {
 
 	const char *msg = "hm\r\n";
 
 	write(mock[WR], msg, strlen(msg));
-	ck_assert_int_eq(parse_irc_line(server), strlen(msg) - 2);
+	ck_assert_int_eq(parse_irc_line(server), 1);
+	ck_assert_uint_eq(server->line.len, strlen(msg) - 2);
 
 	msg = "PING :wolfe.freenode.net\r\n";
 	write(mock[WR], msg, strlen(msg));
@@ -185,10 +353,11 @@ START_TEST(irc_parse_line_tokens) {
 
 	int len = strlen(msg);
 	write(mock[WR], msg, len);
-	ck_assert_int_eq(parse_irc_line(server), len - 2);
+	ck_assert_int_eq(parse_irc_line(server), 1);
+	ck_assert_uint_eq(server->line.len, len - 2);
 
-	msg = ":laxanofido!~laxanofid@snf-23545.vm.okeanos.grnet.gr\0PRIVMSG1\0#foss-teimes :How YA doing fossbot";
-	if (memcmp(server->line, msg, len - 2))
+	// Parsing doesn't modify the line
+	if (memcmp(server->line.buf, msg, len - 2))
 		ck_abort();
 
 } END_TEST
@@ -205,55 +374,51 @@ START_TEST(irc_parse_line_offset) {
 	msg = "life\r\n";
 	write(mock[WR], msg, 6);
 	n = parse_irc_line(server);
-	ck_assert_int_eq(n, 8);
-	ck_assert_str_eq(server->line, "halflife");
+	ck_assert_int_eq(n, 1);
+	ck_assert_uint_eq(server->line.len, 8);
+	ck_assert_str_eq(server->line.buf, "halflife");
 
 } END_TEST
 
 START_TEST(irc_parse_line_length) {
 
-	char buf1[300] = {'a'};
-	char buf2[250] = {'b'};
+	char buf[READER_LINELEN + 100];
+	const char *tail = "PRIVMSG #foss-teimes :!fail\r\n", *next = "hm\r\n";
 
-	memset(buf1, 'a', sizeof(buf1));
-	memset(buf2, 'b', sizeof(buf2));
-	buf2[248] = '\r';
-	buf2[249] = '\n';
+	memset(buf, 'a', sizeof(buf));
+	memcpy(buf + sizeof(buf) - strlen(tail), tail, strlen(tail));
 
 	fcntl(mock[RD], F_SETFL, O_NONBLOCK);
-	write(mock[WR], buf1, strlen(buf1));
-	n = parse_irc_line(server);
-	ck_assert_int_eq(n, -EAGAIN);
+	write(mock[WR], buf, sizeof(buf));
+	write(mock[WR], next, strlen(next));
 
-	write(mock[WR], buf2, strlen(buf2));
-	n = parse_irc_line(server);
-	ck_assert_int_eq(n, 512);
+	// The line is cut and its tail is dropped, it's never parsed as a line of its own
+	ck_assert_int_eq(parse_irc_line(server), 1);
+	ck_assert_uint_eq(server->line.len, READER_LINELEN);
+	ck_assert_int_eq(parse_irc_line(server), 1);
+	ck_assert_str_eq(server->line.buf, "hm");
+	ck_assert_int_eq(parse_irc_line(server), -EAGAIN);
 
 } END_TEST
 
 START_TEST(irc_privemsg) {
 
-	char msg[] = "freestyl3r!~laxanofid@snf-23545.vm.okeanos.grnet.gr\0PRIVMSG\0freestylerbot :!bot lol re";
-
-	pdata.sender  = &msg[0];
-	pdata.command = &msg[52];
-	pdata.message = &msg[60];
+	// Unknown bot commands and plain messages are ignored
+	parse_message(":freestyl3r!~laxanofid@snf-23545.vm.okeanos.grnet.gr PRIVMSG freestylerbot :!bot lol re");
+	irc_privmsg(server, &msg);
+	parse_message(":freestyl3r!~laxanofid@snf-23545.vm.okeanos.grnet.gr PRIVMSG #foss-teimes :hey");
+	irc_privmsg(server, &msg);
 
-	irc_privmsg(server, pdata);
-	ck_assert_str_eq(pdata.sender, "freestyl3r");
-	ck_assert_str_eq(pdata.message, "freestylerbot");
+	struct pollfd pfd = { .fd = mock[WR], .events = POLLIN };
+	ck_assert_int_eq(poll(&pfd, 1, 0), 0);
 
 } END_TEST
 
 START_TEST(irc_ctcp_version) {
 
-	char sender[] = "bot!~a@b.c";
-	char message[] = "bot :\x01VERSION\x01";
 	cfg.bot_version = "irC bot";
-	pdata.sender = sender;
-	pdata.message = message;
-
-	irc_privmsg(server, pdata);
+	parse_message(":bot!~a@b.c PRIVMSG fossbot :\x01VERSION\x01");
+	irc_privmsg(server, &msg);
 	n = read(mock[WR], test_buffer, IRCLEN);
 	test_buffer[n - 2] = '\0';
 
@@ -265,58 +430,226 @@ START_TEST(irc_ctcp_version) {
 
 START_TEST(irc_privemsg_command) {
 
-	memcpy(server->line, "bot!~a@b.c\0bot :!marker", IRCLEN);
+	Pool pooled = pool_init(1, 1, 0), blocking = pool_init(1, 1, 0);
+	struct pool_stats stats;
+	struct pollfd pfd = { .fd = mock[WR], .events = POLLIN };
 	char *reply = "PRIVMSG bot :tweet max length. URL's not accounted for:  -  -  -  -  -  60"
 			"  -  -  -  -  -  80  -  -  -  -  -  -  100  -  -  -  -  -  120  -  -  -  -  -  140";
 
-	pdata.sender  = &server->line[0];
-	pdata.message = &server->line[11];
-	pdata.target  = pdata.sender;
-
-	irc_privmsg(server, pdata);
+	// Inline commands have replied by the time irc_privmsg() returns
+	set_command_pools(pooled, blocking);
+	parse_message(":bot!~a@b.c PRIVMSG fossbot :!marker");
+	irc_privmsg(server, &msg);
+	ck_assert_int_eq(poll(&pfd, 1, 0), 1);
 	n = read(mock[WR], test_buffer, IRCLEN);
 	test_buffer[n - 2] = '\0';
 	ck_assert_str_eq(test_buffer, reply);
 
+	// The rest go to the pool of their class. Without arguments, announce does nothing
+	parse_message(":bot!~a@b.c PRIVMSG fossbot :!announce");
+	irc_privmsg(server, &msg);
+	pool_stats(pooled, &stats);
+	ck_assert_uint_eq(stats.submitted, 1);
+	pool_stats(blocking, &stats);
+	ck_assert_uint_eq(stats.submitted, 0);
+	pool_destroy(pooled);
+	pool_destroy(blocking);
+
+} END_TEST
+
+START_TEST(irc_privmsg_flood) {
+
+	struct pollfd pfd = { .fd = mock[WR], .events = POLLIN };
+
+	// Inline commands reply right away, so the ignored ones are the ones missing
+	for (int i = 0; i < LIMIT_NICK_BURST + 2; i++) {
+		parse_message(":flood!~a@b.c PRIVMSG #chan :!marker");
+		irc_privmsg(server, &msg);
+		ck_assert_int_eq(poll(&pfd, 1, 0), i < LIMIT_NICK_BURST);
+		if (i < LIMIT_NICK_BURST)
+			read(mock[WR], test_buffer, IRCLEN);
+	}
+	// Others in the same channel are still served
+	parse_message(":other!~a@b.c PRIVMSG #chan :!marker");
+	irc_privmsg(server, &msg);
+	ck_assert_int_eq(poll(&pfd, 1, 0), 1);
+	read(mock[WR], test_buffer, IRCLEN);
+
+} END_TEST
+
+START_TEST(irc_memo_key) {
+
+	char key[17];
+	const char *args = " irc-bot\t  5 ";
+
+	ck_assert(memo_key(key, sizeof(key), "github", (struct span) {args, strlen(args)}));
+	ck_assert_str_eq(key, "github irc-bot 5");
+	ck_assert(memo_key(key, sizeof(key), "fit", (struct span) {NULL, 0}));
+	ck_assert_str_eq(key, "fit");
+
+	// Needs one more byte
+	args = "irc-bot 50";
+	ck_assert(!memo_key(key, sizeof(key), "github", (struct span) {args, strlen(args)}));
+
+} END_TEST
+
+START_TEST(irc_privmsg_memoized) {
+
+	Pool pooled = pool_init(1, 1, 0), blocking = pool_init(1, 1, 0);
+	Cache cache = cache_init(64 * 1024);
+	struct pool_stats stats;
+	const char lines[] = "Server: 1.1.1.1\0Address: 93.184.216.34";
+
+	// A hit is replayed to the new target without running the command. Case & whitespace don't matter
+	set_command_pools(pooled, blocking);
+	set_command_cache(cache);
+	ck_assert(cache_put(cache, "dns example.org", lines, sizeof(lines), 60 * MILLISECS));
+	parse_message(":bot!~a@b.c PRIVMSG #chan :!DNS   example.org");
+	irc_privmsg(server, &msg);
+	n = read(mock[WR], test_buffer, IRCLEN);
+	test_buffer[n] = '\0';
+	ck_assert_str_eq(test_buffer, "PRIVMSG #chan :Server: 1.1.1.1\r\nPRIVMSG #chan :Address: 93.184.216.34\r\n");
+	pool_stats(blocking, &stats);
+	ck_assert_uint_eq(stats.submitted, 0);
+
+	// Different arguments miss. Without a dot, dns does nothing
+	parse_message(":bot!~a@b.c PRIVMSG #chan :!dns example");
+	irc_privmsg(server, &msg);
+	pool_stats(blocking, &stats);
+	ck_assert_uint_eq(stats.submitted, 1);
+
+	set_command_cache(NULL);
+	pool_destroy(pooled);
+	pool_destroy(blocking);
+	cache_destroy(cache);
+
 } END_TEST
 
 START_TEST(irc_notice_identify) {
 
-	char sender[] = "NickServ!~a@b.c";
-	char message[] = "bot :This nickname is registeredTRAILING";
 	char password[] = "lololol";
-	cfg.nick_password = password;
-	pdata.sender = sender;
-	pdata.message = message;
+	set_nick_password(server, password);
 
-	irc_notice(server, pdata);
+	parse_message(":NickServ!~a@b.c NOTICE bot :This nickname is registeredTRAILING");
+	irc_notice(server, &msg);
 	n = read(mock[WR], test_buffer, IRCLEN);
 	test_buffer[n - 2] = '\0';
 	ck_assert_str_eq(test_buffer, "PRIVMSG NickServ :identify lololol");
-	ck_assert_str_eq(cfg.nick_password, "");
+	ck_assert_str_eq(password, "");
+
+} END_TEST
+
+static void *answer_acc(void *arg) {
+
+	struct irc_message answer;
+	const char *lines[] = {":NickServ!~a@b.c NOTICE bot :alice ACC 3", ":NickServ!~a@b.c NOTICE bot :bob ACC 1"};
+
+	(void) arg;
+
+	usleep(50 * 1000);
+	for (int i = 0; i < 2; i++) {
+		ck_assert(irc_parse_message(lines[i], strlen(lines[i]), &answer));
+		irc_notice(server, &answer);
+	}
+	return NULL;
+}
+
+START_TEST(irc_user_identified) {
+
+	struct deadline d;
+	pthread_t tid;
+
+	// An answer nobody waited for is dropped & a silent NickServ is given up on
+	parse_message(":NickServ!~a@b.c NOTICE bot :bob ACC 3");
+	irc_notice(server, &msg);
+	deadline_start(&d, 200);
+	ck_assert(!user_is_identified(server, "bob"));
+	deadline_stop();
+	n = read(mock[RD], test_buffer, IRCLEN);
+	test_buffer[n] = '\0';
+	ck_assert_str_eq(test_buffer, "PRIVMSG NickServ :ACC bob\r\n");
+
+	// Answers about other nicks are skipped
+	ck_assert_int_eq(pthread_create(&tid, NULL, answer_acc, NULL), 0);
+	ck_assert(!user_is_identified(server, "bob"));
+	pthread_join(tid, NULL);
 
 } END_TEST
 
 START_TEST(irc_kick_test) {
 
-	char sender[] = "noob!~a@b.c";
-	char message[] = "#hey bot";
 	strcpy(server->nick, "bot");
-	pdata.sender = sender;
-	pdata.message = message;
-
-	irc_kick(server, pdata);
+	parse_message(":noob!~a@b.c KICK #hey bot :bye");
+	irc_kick(server, &msg);
 	n = read(mock[WR], test_buffer, IRCLEN);
 	test_buffer[n - 2] = '\0';
 	ck_assert_str_eq(test_buffer, "PRIVMSG #hey :magkas noob...");
 
 } END_TEST
 
+START_TEST(irc_reconnect_delay) {
+
+	long delay;
+
+	// Half of the delay is fixed and the other half random
+	for (unsigned attempt = 0; attempt < 40; attempt++) {
+		delay = reconnect_delay(attempt);
+		if (attempt < 8) {
+			ck_assert_int_ge(delay, (RECONNECT_BASE_DELAY << attempt) / 2);
+			ck_assert_int_le(delay, RECONNECT_BASE_DELAY << attempt);
+		} else {
+			ck_assert_int_ge(delay, RECONNECT_MAX_DELAY / 2);
+			ck_assert_int_le(delay, RECONNECT_MAX_DELAY);
+		}
+	}
+} END_TEST
+
+START_TEST(irc_reconnect_test) {
+
+	Irc irc;
+	int listener, peer, total = 0;
+	const char *registration = "NICK bot\r\nCAP LS 302\r\nUSER bot 0 * :bot\r\n";
+
+	listener = sock_listen("127.0.0.1", "16671");
+	ck_assert_int_ge(listener, 0);
+	irc = irc_connect("127.0.0.1", "16671", 0, false);
+	ck_assert_ptr_ne(irc, NULL);
+	strcpy(irc->nick, "bot");
+	strcpy(irc->user, "bot");
+	irc->connected = true;
+	peer = sock_accept(listener, false);
+
+	irc_disconnect(irc);
+	ck_assert_int_eq(get_socket(irc), -1);
+	ck_assert(!irc->connected);
+	ck_assert_int_eq(read(peer, test_buffer, IRCLEN), 0);
+	close(peer);
+
+	// Registers again on the new connection
+	ck_assert(irc_reconnect(irc));
+	ck_assert(irc->reconnected);
+	peer = sock_accept(listener, false);
+	while (total < (int) strlen(registration) && (n = read(peer, test_buffer + total, IRCLEN - total)) > 0)
+		total += n;
+
+	test_buffer[total] = '\0';
+	ck_assert_str_eq(test_buffer, registration);
+	close(peer);
+
+	// Nobody listening anymore, the caller has to retry later
+	close(listener);
+	ck_assert(!irc_reconnect(irc));
+	ck_assert_int_eq(get_socket(irc), -1);
+	quit_server(irc, "bye");
+
+} END_TEST
+
 Suite *irc_suite(void) {
 
-	Suite *suite = suite_create("irc");
-	TCase *core  = tcase_create("core");
-	TCase *parse = tcase_create("parse");
+	Suite *suite     = suite_create("irc");
+	TCase *core      = tcase_create("core");
+	TCase *parse     = tcase_create("parse");
+	TCase *reconnect = tcase_create("reconnect");
 
 	suite_add_tcase(suite, core);
 	tcase_add_unchecked_fixture(core, connect_irc, disconnect_irc);
@@ -325,15 +658,22 @@ Suite *irc_suite(void) {
 	tcase_add_test(core, irc_numeric_NICKNAMEINUSE);
 	tcase_add_test(core, irc_numeric_ENDOFMOTD);
 	tcase_add_test(core, irc_numeric_BANNEDFROMCHAN);
+	tcase_add_test(core, irc_numeric_register);
 	tcase_add_test(core, irc_set_nick);
 	tcase_add_test(core, irc_set_user);
+	tcase_add_test(core, irc_cap_negotiation);
 	tcase_add_test(core, irc_join_channel);
 	tcase_add_test(core, irc_join_channels);
 	tcase_add_test(core, irc_default_channel);
 	tcase_add_test(core, irc_command_test);
+	tcase_add_test(core, irc_memo_key);
 	tcase_add_test(core, irc_quit_server);
 	tcase_add_test(core, irc_ctcp_ping);
 	tcase_add_test(core, irc_ctcp_time);
+	tcase_add_test(core, irc_parse_message_spans);
+	tcase_add_test(core, irc_parse_message_tags);
+	tcase_add_test(core, irc_tags_access);
+	tcase_add_test(core, irc_user_identified);
 
 	suite_add_tcase(suite, parse);
 	tcase_add_unchecked_fixture(parse, connect_irc, disconnect_irc);
@@ -345,9 +685,15 @@ Suite *irc_suite(void) {
 	tcase_add_test(parse, irc_privemsg);
 	tcase_add_test(parse, irc_ctcp_version);
 	tcase_add_test(parse, irc_privemsg_command);
+	tcase_add_test(parse, irc_privmsg_memoized);
+	tcase_add_test(parse, irc_privmsg_flood);
 	tcase_add_test(parse, irc_notice_identify);
 	tcase_add_test(parse, irc_kick_test);
 
+	suite_add_tcase(suite, reconnect);
+	tcase_add_test(reconnect, irc_reconnect_delay);
+	tcase_add_test(reconnect, irc_reconnect_test);
+
 	return suite;
 }
 
@@ -8,11 +8,11 @@ Irc server;
 int mock[RDWR];
 struct parsed_data pdata;
 char test_buffer[IRCLEN + 1];
-struct pollfd pfd[TOTAL];
+int fds[TOTAL];
 
 void connect_irc(void) {
 
-	server = irc_connect("www.google.com", "80", 0);
+	server = irc_connect("www.google.com", "80", 0, false);
 	ck_assert_ptr_ne(server, NULL);
 }
 
@@ -31,6 +31,8 @@ void mock_irc_read(void) {
 
 	mock_start();
 	server->conn = mock[RD];
+	reader_destroy(server->reader);
+	server->reader = reader_init(server->conn);
 }
 
 void mock_irc_write(void) {
@@ -53,6 +55,22 @@ int main(void) {
 	srunner_add_suite(sr, irc_suite());
 	srunner_add_suite(sr, curl_suite());
 	srunner_add_suite(sr, common_suite());
+	srunner_add_suite(sr, event_suite());
+	srunner_add_suite(sr, uring_suite());
+	srunner_add_suite(sr, resolver_suite());
+	srunner_add_suite(sr, tls_suite());
+	srunner_add_suite(sr, init_suite());
+	srunner_add_suite(sr, tokenizer_suite());
+	srunner_add_suite(sr, replay_suite());
+	srunner_add_suite(sr, pool_suite());
+	srunner_add_suite(sr, coro_suite());
+	srunner_add_suite(sr, cache_suite());
+	srunner_add_suite(sr, flight_suite());
+	srunner_add_suite(sr, ratelimit_suite());
+	srunner_add_suite(sr, admission_suite());
+	srunner_add_suite(sr, deadline_suite());
+	srunner_add_suite(sr, zygote_suite());
+	srunner_add_suite(sr, coproc_suite());
 
 	srunner_run_all(sr, CK_ENV);
 	tests_failed = srunner_ntests_failed(sr);
@@ -8,14 +8,16 @@
 #include "irc.h"
 #include "init.h"
 #include "queue.h"
+#include "replay.h"
 
 struct irc_type {
 	int conn;
+	Tls tls;
 	Mqueue mqueue;
 	pthread_mutex_t *mtx;
 	int pipe[RDWR];
-	char line[IRCLEN + 1];
-	size_t line_offset;
+	Reader reader;
+	struct line line;
 	char address[ADDRLEN + 1];
 	char port[PORTLEN + 1];
 	char nick[NICKLEN + 1];
@@ -23,13 +25,20 @@ struct irc_type {
 	char channels[MAXCHANS][CHANLEN + 1];
 	int channels_set;
 	bool connected;
+	char *nick_password;
+	bool secure;
+	bool reconnected;
+	Recorder recorder;
+	Ratelimit limits[LIMITS];
+	time_t shed_notice;
+	unsigned caps;
 };
 
 extern Irc server;
 extern int mock[RDWR];
 extern struct parsed_data pdata;
 extern char test_buffer[IRCLEN + 1];
-extern struct pollfd pfd[TOTAL];
+extern int fds[TOTAL];
 
 void connect_irc(void);
 void disconnect_irc(void);
@@ -42,6 +51,22 @@ Suite *socket_suite(void);
 Suite *irc_suite(void);
 Suite *curl_suite(void);
 Suite *common_suite(void);
+Suite *event_suite(void);
+Suite *uring_suite(void);
+Suite *resolver_suite(void);
+Suite *tls_suite(void);
+Suite *init_suite(void);
+Suite *tokenizer_suite(void);
+Suite *replay_suite(void);
+Suite *pool_suite(void);
+Suite *coro_suite(void);
+Suite *cache_suite(void);
+Suite *flight_suite(void);
+Suite *ratelimit_suite(void);
+Suite *admission_suite(void);
+Suite *deadline_suite(void);
+Suite *zygote_suite(void);
+Suite *coproc_suite(void);
 
 #endif
 
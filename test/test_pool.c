@@ -0,0 +1,125 @@
+#include <check.h>
+#include <semaphore.h>
+#include "test_main.h"
+#include "pool.h"
+
+static Pool pool;
+static sem_t started, release, done;
+
+static void pool_start(void) {
+
+	sem_init(&started, 0, 0);
+	sem_init(&release, 0, 0);
+	sem_init(&done, 0, 0);
+	pool = pool_init(2, 4, 64 * 1024);
+	ck_assert_ptr_ne(pool, NULL);
+}
+
+static void pool_stop(void) {
+
+	pool_destroy(pool);
+	sem_destroy(&started);
+	sem_destroy(&release);
+	sem_destroy(&done);
+}
+
+/** Keep a worker busy until released */
+static void blocker(void *arg) {
+
+	(void) arg;
+	sem_post(&started);
+	sem_wait(&release);
+}
+
+static void quick(void *arg) {
+
+	(*(int *) arg)++;
+	sem_post(&done);
+}
+
+START_TEST(pool_run) {
+
+	int counters[8] = {0};
+	struct pool_stats stats;
+
+	for (int i = 0; i < 8; i++) {
+		ck_assert(pool_submit(pool, quick, &counters[i]));
+		sem_wait(&done);
+	}
+	for (int i = 0; i < 8; i++)
+		ck_assert_int_eq(counters[i], 1);
+
+	pool_stats(pool, &stats);
+	ck_assert_uint_eq(stats.submitted, 8);
+	ck_assert_uint_eq(stats.rejected, 0);
+
+	// Bad arguments
+	ck_assert_ptr_eq(pool_init(0, 4, 0), NULL);
+	ck_assert_ptr_eq(pool_init(POOL_MAXWORKERS + 1, 4, 0), NULL);
+	ck_assert_ptr_eq(pool_init(2, 0, 0), NULL);
+
+} END_TEST
+
+START_TEST(pool_steal) {
+
+	int counters[4] = {0};
+	struct pool_stats stats;
+
+	// Half of the tasks are queued on the blocked worker, the other one has to steal them
+	ck_assert(pool_submit(pool, blocker, NULL));
+	sem_wait(&started);
+	for (int i = 0; i < 4; i++)
+		ck_assert(pool_submit(pool, quick, &counters[i]));
+
+	for (int i = 0; i < 4; i++)
+		sem_wait(&done);
+
+	pool_stats(pool, &stats);
+	ck_assert_uint_ge(stats.stolen, 2);
+	sem_post(&release);
+
+} END_TEST
+
+START_TEST(pool_saturated) {
+
+	int counters[5] = {0};
+	struct pool_stats stats;
+
+	ck_assert(pool_submit(pool, blocker, NULL));
+	ck_assert(pool_submit(pool, blocker, NULL));
+	sem_wait(&started);
+	sem_wait(&started);
+
+	// Both workers are busy, so the queue fills up
+	for (int i = 0; i < 4; i++)
+		ck_assert(pool_submit(pool, quick, &counters[i]));
+
+	ck_assert(!pool_submit(pool, quick, &counters[4]));
+	pool_stats(pool, &stats);
+	ck_assert_uint_eq(stats.submitted, 6);
+	ck_assert_uint_eq(stats.rejected, 1);
+
+	// Queued tasks still run
+	sem_post(&release);
+	sem_post(&release);
+	for (int i = 0; i < 4; i++)
+		sem_wait(&done);
+
+	ck_assert_int_eq(counters[3], 1);
+	ck_assert_int_eq(counters[4], 0);
+
+} END_TEST
+
+Suite *pool_suite(void) {
+
+	Suite *suite = suite_create("pool");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_checked_fixture(core, pool_start, pool_stop);
+	tcase_add_test(core, pool_run);
+	tcase_add_test(core, pool_steal);
+	tcase_add_test(core, pool_saturated);
+
+	return suite;
+}
@@ -0,0 +1,74 @@
+#include <check.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "test_main.h"
+#include "ratelimit.h"
+
+START_TEST(ratelimit_bucket) {
+
+	struct token_bucket bucket;
+
+	bucket_init(&bucket, 2, 100);
+	ck_assert(bucket_tokens(&bucket) == 2);
+	bucket.tokens = 0;
+	ck_assert_int_le(bucket_delay(&bucket, 1), 11);
+
+	// Refilled lazily, up to the burst capacity
+	usleep(15 * 1000);
+	ck_assert(bucket_tokens(&bucket) >= 1);
+	usleep(30 * 1000);
+	ck_assert(bucket_tokens(&bucket) == 2);
+
+} END_TEST
+
+START_TEST(ratelimit_keys) {
+
+	Ratelimit rl = ratelimit_init(3, 0.001, 8);
+
+	for (int i = 0; i < 3; i++)
+		ck_assert(ratelimit_allow(rl, "laxanofido", 10));
+
+	// Nicks are case insensitive, others have buckets of their own
+	ck_assert(!ratelimit_allow(rl, "LaxanoFido", 10));
+	ck_assert(ratelimit_allow(rl, "freestyl3r", 10));
+	ck_assert(ratelimit_allow(rl, "laxanofido!~a@b.c", 17));
+	ck_assert(!ratelimit_allow(rl, "laxanofido", 10));
+
+	ck_assert_ptr_eq(ratelimit_init(0, 1, 8), NULL);
+	ck_assert_ptr_eq(ratelimit_init(1, 0, 8), NULL);
+	ratelimit_destroy(rl);
+
+} END_TEST
+
+START_TEST(ratelimit_eviction) {
+
+	char key[8];
+	Ratelimit rl = ratelimit_init(1, 0.001, 4);
+
+	ck_assert(ratelimit_allow(rl, "nick0", 5));
+	ck_assert(!ratelimit_allow(rl, "nick0", 5));
+
+	// Only 4 fit, so the least recently used one starts over
+	for (int i = 1; i <= 4; i++) {
+		snprintf(key, sizeof(key), "nick%d", i);
+		ck_assert(ratelimit_allow(rl, key, strlen(key)));
+	}
+	ck_assert(ratelimit_allow(rl, "nick0", 5));
+	ck_assert(!ratelimit_allow(rl, "nick4", 5));
+	ratelimit_destroy(rl);
+
+} END_TEST
+
+Suite *ratelimit_suite(void) {
+
+	Suite *suite = suite_create("ratelimit");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_test(core, ratelimit_bucket);
+	tcase_add_test(core, ratelimit_keys);
+	tcase_add_test(core, ratelimit_eviction);
+
+	return suite;
+}
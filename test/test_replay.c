@@ -0,0 +1,176 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "test_main.h"
+#include "replay.h"
+
+static Irc replay_server;
+static char path[] = "/tmp/irc-bot-replay-XXXXXX";
+
+static void replay_setup(void) {
+
+	int fd = mkstemp(path);
+
+	ck_assert_int_ge(fd, 0);
+	close(fd);
+	mock_start();
+	replay_server = irc_connect("irc.example.org", "6667", mock[WR], false);
+	ck_assert_ptr_ne(replay_server, NULL);
+}
+
+static void replay_teardown(void) {
+
+	quit_server(replay_server, "bye"); // Closes mock[WR]
+	close(mock[RD]);
+	unlink(path);
+	strcpy(path, "/tmp/irc-bot-replay-XXXXXX");
+}
+
+/** Read all the replies sent so far */
+static void read_replies(void) {
+
+	ssize_t n = read(mock[RD], test_buffer, IRCLEN);
+
+	ck_assert_int_gt(n, 0);
+	test_buffer[n] = '\0';
+}
+
+struct replay_result {
+	Reactor r;
+	ssize_t lines;
+};
+
+static void replay_done_handler(void *data, ssize_t lines) {
+
+	struct replay_result *result = data;
+
+	result->lines = lines;
+	reactor_stop(result->r);
+}
+
+/** Run a reactor until the whole recording is fed
+ *  @returns  The lines replayed or -1 if it's not a recording */
+static ssize_t replay(const char *file, bool realtime) {
+
+	struct replay_result result = {reactor_init(), -1};
+	Player p;
+
+	ck_assert_ptr_ne(result.r, NULL);
+	p = replay_file(result.r, replay_server, file, realtime, replay_done_handler, &result);
+	if (p)
+		ck_assert_int_eq(reactor_run(result.r), 0);
+
+	replay_destroy(p);
+	reactor_destroy(result.r);
+	return result.lines;
+}
+
+static void record(const char *lines) {
+
+	Recorder rec = recorder_open(path);
+
+	ck_assert_ptr_ne(rec, NULL);
+	set_recorder(replay_server, rec);
+	parse_irc_buffer(replay_server, lines, strlen(lines));
+	set_recorder(replay_server, NULL);
+	recorder_close(rec);
+}
+
+START_TEST(replay_record) {
+
+	FILE *file;
+	long size;
+
+	record("PING :a\r\n:nick!user@host PRIVMSG #foss-teimes :hi\r\n");
+	read_replies();
+	ck_assert_str_eq(test_buffer, "PONG :a\r\n");
+
+	// Header, then delay, length & the line without "\r\n"
+	file = fopen(path, "rb");
+	ck_assert_ptr_ne(file, NULL);
+	fseek(file, 0, SEEK_END);
+	size = ftell(file);
+	fclose(file);
+	ck_assert_int_eq(size, REPLAY_MAGICLEN + 6 + 7 + 6 + 40);
+
+	// Replies go through the usual path again
+	ck_assert_int_eq(replay(path, false), 2);
+	read_replies();
+	ck_assert_str_eq(test_buffer, "PONG :a\r\n");
+
+} END_TEST
+
+START_TEST(replay_realtime) {
+
+	Recorder rec = recorder_open(path);
+	struct timespec start, end;
+	double secs;
+
+	ck_assert_ptr_ne(rec, NULL);
+	recorder_write(rec, "PING :a", 7);
+	usleep(100 * 1000);
+	recorder_write(rec, "PING :b", 7);
+	recorder_close(rec);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ck_assert_int_eq(replay(path, true), 2);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	ck_assert(secs >= 0.1);
+
+	// Maximum speed ignores the delays
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ck_assert_int_eq(replay(path, false), 2);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+	ck_assert(secs < 0.1);
+
+} END_TEST
+
+START_TEST(replay_batches) {
+
+	char lines[(REPLAY_BATCH * 3 + 1) * 9 + 1] = "";
+
+	// Spans several rounds of the reactor, the last one partial
+	for (int i = 0; i < REPLAY_BATCH * 3 + 1; i++)
+		strcat(lines, "PING :a\r\n");
+	record(lines);
+	ck_assert_int_eq(replay(path, false), REPLAY_BATCH * 3 + 1);
+
+} END_TEST
+
+START_TEST(replay_corrupt) {
+
+	FILE *file;
+
+	// A crash may leave the last record truncated
+	record("PING :a\r\nPING :b\r\n");
+	ck_assert(!truncate(path, REPLAY_MAGICLEN + 6 + 7 + 6 + 3));
+	ck_assert_int_eq(replay(path, false), 1);
+
+	file = fopen(path, "wb");
+	ck_assert_ptr_ne(file, NULL);
+	fputs("PING :a\r\n", file);
+	fclose(file);
+	ck_assert_int_eq(replay(path, false), -1);
+	ck_assert_int_eq(replay("/nonexistent/recording", false), -1);
+
+} END_TEST
+
+Suite *replay_suite(void) {
+
+	Suite *suite = suite_create("replay");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_checked_fixture(core, replay_setup, replay_teardown);
+	tcase_add_test(core, replay_record);
+	tcase_add_test(core, replay_realtime);
+	tcase_add_test(core, replay_batches);
+	tcase_add_test(core, replay_corrupt);
+
+	return suite;
+}
@@ -0,0 +1,115 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "test_main.h"
+#include "resolver.h"
+#include "coro.h"
+#include "event.h"
+
+struct entry *cache_find(const char *host, const char *port);
+
+static void resolver_stop(void) {
+
+	resolver_cleanup();
+}
+
+START_TEST(resolve_numeric) {
+
+	struct addrinfo *addr = resolve("127.0.0.1", "6667");
+	struct sockaddr_in *sin;
+
+	ck_assert_ptr_ne(addr, NULL);
+	ck_assert_ptr_eq(addr->ai_next, NULL);
+	ck_assert_int_eq(addr->ai_family, AF_INET);
+	sin = (struct sockaddr_in *) addr->ai_addr;
+	ck_assert_int_eq(ntohs(sin->sin_port), 6667);
+	ck_assert_int_eq(sin->sin_addr.s_addr, htonl(INADDR_LOOPBACK));
+	free(addr);
+
+	// Not worth caching
+	ck_assert_ptr_eq(cache_find("127.0.0.1", "6667"), NULL);
+
+} END_TEST
+
+START_TEST(resolve_cached) {
+
+	struct addrinfo *first, *second;
+
+	first = resolve("localhost", "6667");
+	ck_assert_ptr_ne(first, NULL);
+	ck_assert_ptr_ne(cache_find("LOCALHOST", "6667"), NULL);
+	ck_assert_ptr_eq(cache_find("localhost", "80"), NULL);
+
+	// Every caller gets its own copy of the cached addresses
+	second = resolve("localhost", "6667");
+	ck_assert_ptr_ne(second, NULL);
+	ck_assert_ptr_ne(first, second);
+	ck_assert_int_eq(first->ai_addrlen, second->ai_addrlen);
+	ck_assert(!memcmp(first->ai_addr, second->ai_addr, first->ai_addrlen));
+	free(first);
+
+	resolver_flush();
+	first = resolve("localhost", "6667");
+	ck_assert_ptr_ne(first, NULL);
+	ck_assert(!memcmp(first->ai_addr, second->ai_addr, first->ai_addrlen));
+	free(first);
+	free(second);
+
+} END_TEST
+
+START_TEST(resolve_failure) {
+
+	// RFC 6761 guarantees that the .invalid TLD never resolves
+	ck_assert_ptr_eq(resolve("irc.invalid", "6667"), NULL);
+	ck_assert_ptr_ne(cache_find("irc.invalid", "6667"), NULL);
+	ck_assert_ptr_eq(resolve("irc.invalid", "6667"), NULL);
+
+} END_TEST
+
+static Reactor loop;
+
+static void resolve_and_stop(void *arg) {
+
+	*(struct addrinfo **) arg = resolve("localhost", "6667");
+	reactor_stop(loop);
+}
+
+START_TEST(resolve_coroutine) {
+
+	struct addrinfo *first = NULL, *second = NULL;
+
+	// Two coroutines sleep on the same lookup while the reactor runs
+	loop = reactor_init();
+	ck_assert(coro_init(loop));
+	ck_assert(coro_start(resolve_and_stop, &first));
+	ck_assert(coro_start(resolve_and_stop, &second));
+	ck_assert_int_eq(reactor_run(loop), 0);
+	if (!first || !second)
+		ck_assert_int_eq(reactor_run(loop), 0);
+
+	ck_assert_ptr_ne(first, NULL);
+	ck_assert_ptr_ne(second, NULL);
+	free(first);
+	free(second);
+	coro_cleanup();
+	reactor_destroy(loop);
+
+} END_TEST
+
+Suite *resolver_suite(void) {
+
+	Suite *suite = suite_create("resolver");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_checked_fixture(core, NULL, resolver_stop);
+	tcase_add_test(core, resolve_numeric);
+	tcase_add_test(core, resolve_cached);
+	tcase_add_test(core, resolve_failure);
+	tcase_add_test(core, resolve_coroutine);
+
+	return suite;
+}
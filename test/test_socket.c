@@ -4,11 +4,15 @@
 #include <signal.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <netinet/in.h>
 #include "test_main.h"
 #include "socket.h"
 #include "irc.h"
-
-ssize_t sock_readbyte(int sock, char *byte);
+#include "deadline.h"
+#include "coro.h"
+#include "event.h"
 
 START_TEST(socket_connect) {
 
@@ -17,6 +21,126 @@ START_TEST(socket_connect) {
 
 } END_TEST
 
+/** ::1 first, then 127.0.0.1. Free with freeaddrinfo() */
+static struct addrinfo *dual_stack_addresses(const char *port) {
+
+	struct addrinfo *v6, *v4;
+	struct addrinfo hints = {.ai_socktype = SOCK_STREAM, .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV};
+
+	ck_assert_int_eq(getaddrinfo("::1", port, &hints, &v6), 0);
+	ck_assert_int_eq(getaddrinfo(LOCALHOST, port, &hints, &v4), 0);
+	v6->ai_next = v4;
+
+	return v6;
+}
+
+static int peer_family(int sock) {
+
+	struct sockaddr_storage peer;
+
+	ck_assert_int_eq(getpeername(sock, (struct sockaddr *) &peer, &(socklen_t) {sizeof(peer)}), 0);
+	return peer.ss_family;
+}
+
+START_TEST(socket_connect_fallback) {
+
+	struct addrinfo *addr = dual_stack_addresses("12346");
+	int sock;
+
+	// Nothing listens on ::1, so the refused IPv6 attempt is followed by IPv4
+	ck_assert_int_gt(sock_listen(LOCALHOST, "12346"), 0);
+	sock = connect_any(addr);
+	ck_assert_int_gt(sock, 0);
+	ck_assert_int_eq(peer_family(sock), AF_INET);
+	ck_assert_int_eq(fcntl(sock, F_GETFL, 0) & O_NONBLOCK, 0);
+	ck_assert_int_ne(fcntl(sock, F_GETFD, 0) & FD_CLOEXEC, 0);
+
+	freeaddrinfo(addr);
+
+} END_TEST
+
+START_TEST(socket_connect_stalled) {
+
+	struct addrinfo *addr = dual_stack_addresses("12347");
+	struct sockaddr_in6 v6 = {.sin6_family = AF_INET6, .sin6_port = htons(12347), .sin6_addr = IN6ADDR_LOOPBACK_INIT};
+	struct timespec start, end;
+	int listenfd, sock;
+
+	// A full accept queue drops SYNs, the same as a dead route would
+	listenfd = socket(AF_INET6, SOCK_STREAM, 0);
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &(int) {1}, sizeof(int));
+	ck_assert_int_eq(bind(listenfd, (struct sockaddr *) &v6, sizeof(v6)), 0);
+	ck_assert_int_eq(listen(listenfd, 0), 0);
+	ck_assert_int_gt(connect_any(addr), 0);
+
+	ck_assert_int_gt(sock_listen(LOCALHOST, "12347"), 0);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	sock = connect_any(addr);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ck_assert_int_gt(sock, 0);
+	ck_assert_int_eq(peer_family(sock), AF_INET);
+
+	// IPv4 started after the attempt delay, instead of waiting for the SYN timeout
+	ck_assert_int_lt(end.tv_sec - start.tv_sec, 2);
+	freeaddrinfo(addr);
+
+} END_TEST
+
+START_TEST(socket_connect_timeout) {
+
+	struct addrinfo *addr, hints = {.ai_socktype = SOCK_STREAM, .ai_flags = AI_NUMERICHOST | AI_NUMERICSERV};
+	struct sockaddr_in6 v6 = {.sin6_family = AF_INET6, .sin6_port = htons(12348), .sin6_addr = IN6ADDR_LOOPBACK_INIT};
+	struct timespec start, end;
+	struct deadline deadline;
+	int listenfd;
+
+	listenfd = socket(AF_INET6, SOCK_STREAM, 0);
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &(int) {1}, sizeof(int));
+	ck_assert_int_eq(bind(listenfd, (struct sockaddr *) &v6, sizeof(v6)), 0);
+	ck_assert_int_eq(listen(listenfd, 0), 0);
+	ck_assert_int_eq(getaddrinfo("::1", "12348", &hints, &addr), 0);
+	ck_assert_int_gt(connect_any(addr), 0);
+
+	// The only address never answers, so the wait is bounded by the deadline
+	deadline_start(&deadline, 300);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ck_assert_int_eq(connect_any(addr), -1);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	deadline_stop();
+	ck_assert_int_lt(end.tv_sec - start.tv_sec, 2);
+	freeaddrinfo(addr);
+
+} END_TEST
+
+static Reactor loop;
+static struct addrinfo *coro_addr;
+
+static void connect_and_stop(void *arg) {
+
+	*(int *) arg = connect_any(coro_addr);
+	reactor_stop(loop);
+}
+
+START_TEST(socket_connect_coroutine) {
+
+	int sock = -1;
+
+	// The refused IPv6 attempt & the IPv4 one are awaited through the reactor
+	coro_addr = dual_stack_addresses("12349");
+	ck_assert_int_gt(sock_listen(LOCALHOST, "12349"), 0);
+	loop = reactor_init();
+	ck_assert(coro_init(loop));
+	ck_assert(coro_start(connect_and_stop, &sock));
+	ck_assert_int_eq(reactor_run(loop), 0);
+	ck_assert_int_gt(sock, 0);
+	ck_assert_int_eq(peer_family(sock), AF_INET);
+
+	coro_cleanup();
+	reactor_destroy(loop);
+	freeaddrinfo(coro_addr);
+
+} END_TEST
+
 START_TEST(socket_listen) {
 
 	ck_assert_int_gt(sock_listen(LOCALHOST, "12345"), 0);
@@ -40,6 +164,10 @@ START_TEST(socket_accept) {
 	ck_assert_int_gt(acceptfd, 0);
 	ck_assert_int_eq(fcntl(acceptfd, F_GETFL, 0) & O_NONBLOCK, 0);
 
+	// Only the descriptors an upgrade hands over explicitly survive it
+	ck_assert_int_ne(fcntl(acceptfd, F_GETFD, 0) & FD_CLOEXEC, 0);
+	ck_assert_int_ne(fcntl(listenfd, F_GETFD, 0) & FD_CLOEXEC, 0);
+
 	acceptfd = sock_accept(listenfd, NONBLOCK);
 	ck_assert_int_gt(acceptfd, 0);
 	ck_assert_int_ne(fcntl(acceptfd, F_GETFL, 0) & O_NONBLOCK, 0);
@@ -63,6 +191,52 @@ START_TEST(socket_write) {
 
 } END_TEST
 
+START_TEST(socket_writev) {
+
+	char a[] = "PRIVMSG #a :1\r\n", b[] = "PRIVMSG #a :2\r\n", c[] = "";
+	struct iovec iov[] = {{a, strlen(a)}, {c, 0}, {b, strlen(b)}};
+	ssize_t sent, received;
+
+	sent = sock_writev(mock[WR], iov, 3);
+	received = read(mock[RD], test_buffer, IRCLEN);
+	ck_assert_int_eq(sent, received);
+	test_buffer[received] = '\0';
+	ck_assert_str_eq(test_buffer, "PRIVMSG #a :1\r\nPRIVMSG #a :2\r\n");
+	for (int i = 0; i < 3; i++)
+		ck_assert_uint_eq(iov[i].iov_len, 0);
+
+	ck_assert_int_eq(sock_writev(mock[WR], iov, 3), 0);
+
+} END_TEST
+
+START_TEST(socket_writev_partial) {
+
+	char big[4096];
+	struct iovec iov[2];
+	ssize_t sent, total = 0, n;
+
+	memset(big, 'a', sizeof(big));
+	fcntl(mock[WR], F_SETFL, O_NONBLOCK);
+	fcntl(mock[RD], F_SETFL, O_NONBLOCK);
+
+	// Fill the socket buffer until a short write happens
+	do {
+		iov[0] = (struct iovec) {big, sizeof(big)};
+		iov[1] = (struct iovec) {big, sizeof(big)};
+		sent = sock_writev(mock[WR], iov, 2);
+		ck_assert_int_ne(sent, -1);
+		total += sent;
+	} while (sent == 2 * sizeof(big));
+
+	// The unsent remainder is described by iov
+	ck_assert_uint_eq(iov[0].iov_len + iov[1].iov_len, 2 * sizeof(big) - sent);
+
+	while ((n = read(mock[RD], big, sizeof(big))) > 0)
+		total -= n;
+	ck_assert_int_eq(total, 0);
+
+} END_TEST
+
 START_TEST(socket_write_non_blocking) {
 
 	const char *msg = "rofl";
@@ -113,77 +287,170 @@ START_TEST(socket_read_non_blocking) {
 
 } END_TEST
 
-START_TEST(socket_readbytes) {
+START_TEST(reader_lines) {
 
-	int i;
-	char c;
-	const char *msg = "lol\r\ntroll\r\n";
+	Reader reader;
+	struct line lines[READER_MAXLINES];
+	const char *msg = "lol\r\ntroll\r\n\r\nno_cr\nhalf";
 
+	reader = reader_init(mock[RD]);
 	sock_write(mock[WR], msg, strlen(msg));
+	ck_assert_int_eq(reader_readlines(reader, lines, READER_MAXLINES), 4);
+	ck_assert_str_eq(lines[0].buf, "lol");
+	ck_assert_uint_eq(lines[0].len, 3);
+	ck_assert_str_eq(lines[1].buf, "troll");
+	ck_assert_str_eq(lines[2].buf, "");
+	ck_assert_uint_eq(lines[2].len, 0);
+	ck_assert_str_eq(lines[3].buf, "no_cr");
+
+	sock_write(mock[WR], "\r\n", 2);
 	close(mock[WR]);
+	ck_assert_int_eq(reader_readlines(reader, lines, READER_MAXLINES), 1);
+	ck_assert_str_eq(lines[0].buf, "half");
+	ck_assert_int_eq(reader_readlines(reader, lines, READER_MAXLINES), 0);
+	reader_destroy(reader);
 
-	for (i = 0; sock_readbyte(mock[RD], &c) > 0; i++)
-		test_buffer[i] = c;
+} END_TEST
 
-	test_buffer[i] = '\0';
-	ck_assert_str_eq(msg, test_buffer);
+START_TEST(reader_max_lines) {
+
+	Reader reader;
+	struct line lines[2];
+	const char *msg = "a\r\nb\r\nc\r\n";
+
+	reader = reader_init(mock[RD]);
+	fcntl(mock[RD], F_SETFL, O_NONBLOCK);
+	sock_write(mock[WR], msg, strlen(msg));
+	ck_assert_int_eq(reader_readlines(reader, lines, 2), 2);
+	ck_assert_str_eq(lines[1].buf, "b");
+
+	// Left over line is returned without reading again
+	ck_assert_int_eq(reader_readlines(reader, lines, 2), 1);
+	ck_assert_str_eq(lines[0].buf, "c");
+	ck_assert_int_eq(reader_readlines(reader, lines, 2), -EAGAIN);
+	reader_destroy(reader);
 
 } END_TEST
 
-START_TEST(socket_readline_blocking) {
+START_TEST(reader_blocking) {
 
+	Reader reader = reader_init(mock[RD]);
+	struct line lines[READER_MAXLINES];
 	const char *msg = "lol";
 
 	sock_write(mock[WR], msg, strlen(msg));
 	alarm(1);
-	sock_readline(mock[RD], test_buffer, IRCLEN);
+	reader_readlines(reader, lines, READER_MAXLINES);
 	alarm(0);
 	ck_abort();
 
 } END_TEST
 
-START_TEST(socket_readline_blocking2) {
+START_TEST(reader_non_blocking) {
 
-	const char *msg = "lol\r\n";
+	Reader reader;
+	struct line lines[READER_MAXLINES];
+	const char *msg = "yo";
 
+	reader = reader_init(mock[RD]);
+	fcntl(mock[RD], F_SETFL, O_NONBLOCK);
 	sock_write(mock[WR], msg, strlen(msg));
-	ssize_t n = sock_readline(mock[RD], test_buffer, IRCLEN);
-	ck_assert_int_eq(n, 5);
-
-} END_TEST
-
-START_TEST(socket_readline_non_blocking) {
-
-	const char *msg = "yo\r\n";
+	ck_assert_int_eq(reader_readlines(reader, lines, READER_MAXLINES), -EAGAIN);
 
-	fcntl(mock[WR], F_SETFL, O_NONBLOCK);
+	msg = "\r\nhey\r\n";
 	sock_write(mock[WR], msg, strlen(msg));
-	ssize_t n = sock_readline(mock[RD], test_buffer, IRCLEN);
-	ck_assert_int_eq(n, 4);
+	ck_assert_int_eq(reader_readlines(reader, lines, READER_MAXLINES), 2);
+	ck_assert_str_eq(lines[0].buf, "yo");
+	ck_assert_str_eq(lines[1].buf, "hey");
+	reader_destroy(reader);
 
 } END_TEST
 
-START_TEST(socket_readline_non_blocking2) {
+START_TEST(reader_wrap_around) {
+
+	Reader reader;
+	struct line lines[READER_MAXLINES];
+	char msg[300];
+
+	memset(msg, 'x', sizeof(msg));
+	msg[297] = '\r';
+	msg[298] = '\n';
+	msg[299] = 'a';
+
+	// Keep a partial line buffered so the reader never rewinds and lines eventually cross the ring's edge
+	reader = reader_init(mock[RD]);
+	sock_write(mock[WR], "a", 1);
+	for (int i = 0; i < 3 * READER_BUFSIZE / (int) sizeof(msg); i++) {
+		sock_write(mock[WR], msg, sizeof(msg));
+		ck_assert_int_eq(reader_readlines(reader, lines, READER_MAXLINES), 1);
+		ck_assert_uint_eq(lines[0].len, 298);
+		ck_assert_int_eq(lines[0].buf[0], 'a');
+		ck_assert_int_eq(lines[0].buf[297], 'x');
+		ck_assert_int_eq(lines[0].buf[298], '\0');
+	}
+	reader_destroy(reader);
 
-	const char *msg = "yo";
-	ssize_t n;
-	size_t offset;
+} END_TEST
 
-	fcntl(mock[RD], F_SETFL, O_NONBLOCK);
-	sock_write(mock[WR], msg, strlen(msg));
-	n = sock_readline(mock[RD], test_buffer, IRCLEN);
-	ck_assert_int_eq(n, -EAGAIN);
+START_TEST(reader_long_line) {
+
+	Reader reader;
+	struct line lines[READER_MAXLINES];
+	char msg[READER_LINELEN + 102];
+
+	memset(msg, 'a', sizeof(msg));
+	msg[sizeof(msg) - 2] = '\r';
+	msg[sizeof(msg) - 1] = '\n';
+
+	// The line is cut and the rest of it is discarded
+	reader = reader_init(mock[RD]);
+	sock_write(mock[WR], msg, sizeof(msg));
+	sock_write(mock[WR], "b\r\n", 3);
+	ck_assert_int_eq(reader_readlines(reader, lines, READER_MAXLINES), 1);
+	ck_assert_uint_eq(lines[0].len, READER_LINELEN);
+	ck_assert_uint_eq(strlen(lines[0].buf), READER_LINELEN);
+	ck_assert_int_eq(reader_readlines(reader, lines, READER_MAXLINES), 1);
+	ck_assert_str_eq(lines[0].buf, "b");
+
+	// Even when its terminator arrives with a later read
+	sock_write(mock[WR], msg, READER_LINELEN + 50);
+	ck_assert_int_eq(reader_readlines(reader, lines, READER_MAXLINES), 1);
+	ck_assert_uint_eq(lines[0].len, READER_LINELEN);
+	sock_write(mock[WR], msg + READER_LINELEN + 50, sizeof(msg) - READER_LINELEN - 50);
+	sock_write(mock[WR], "c\n", 2);
+	ck_assert_int_eq(reader_readlines(reader, lines, READER_MAXLINES), 1);
+	ck_assert_str_eq(lines[0].buf, "c");
+	reader_destroy(reader);
 
-	msg = "\r\nhey\r\n";
-	sock_write(mock[WR], msg, strlen(msg));
-	offset = strlen(test_buffer);
-	n = sock_readline(mock[RD], test_buffer + offset, IRCLEN);
-	ck_assert_int_eq(n, 2);
-	ck_assert_str_eq(test_buffer, "yo\r\n");
+} END_TEST
 
-	n = sock_readline(mock[RD], test_buffer, IRCLEN);
-	ck_assert_int_eq(n, 5);
-	ck_assert_str_eq(test_buffer, "hey\r\n");
+START_TEST(reader_feed_lines) {
+
+	Reader reader;
+	struct line lines[READER_MAXLINES];
+	char msg[300];
+	size_t used;
+
+	// Nothing is read from the socket, data only comes from the feed
+	reader = reader_init(mock[RD]);
+	ck_assert_uint_eq(reader_feed(reader, "PING :a\r\nPI", 11), 11);
+	ck_assert_uint_eq(reader_getlines(reader, lines, READER_MAXLINES), 1);
+	ck_assert_str_eq(lines[0].buf, "PING :a");
+	ck_assert_uint_eq(reader_getlines(reader, lines, READER_MAXLINES), 0);
+
+	reader_feed(reader, "NG :b\n", 6);
+	ck_assert_uint_eq(reader_getlines(reader, lines, READER_MAXLINES), 1);
+	ck_assert_str_eq(lines[0].buf, "PING :b");
+
+	// Only what fits is consumed
+	memset(msg, 'x', sizeof(msg));
+	msg[sizeof(msg) - 1] = '\n';
+	for (used = 0; used < READER_BUFSIZE; used += reader_feed(reader, msg, sizeof(msg)));
+	ck_assert_uint_eq(used, READER_BUFSIZE);
+	ck_assert_uint_eq(reader_feed(reader, msg, sizeof(msg)), 0);
+	ck_assert_uint_gt(reader_getlines(reader, lines, READER_MAXLINES), 0);
+	ck_assert_uint_eq(lines[0].len, sizeof(msg) - 1);
+	reader_destroy(reader);
 
 } END_TEST
 
@@ -195,6 +462,10 @@ Suite *socket_suite(void) {
 
 	suite_add_tcase(suite, core);
 	tcase_add_test(core, socket_connect);
+	tcase_add_test(core, socket_connect_fallback);
+	tcase_add_test(core, socket_connect_stalled);
+	tcase_add_test(core, socket_connect_timeout);
+	tcase_add_test(core, socket_connect_coroutine);
 	tcase_add_test(core, socket_listen);
 	tcase_add_test(core, socket_accept);
 
@@ -202,13 +473,17 @@ Suite *socket_suite(void) {
 	tcase_add_checked_fixture(sockIO, mock_start, mock_stop);
 	tcase_add_test(sockIO, socket_write);
 	tcase_add_test(sockIO, socket_write_non_blocking);
+	tcase_add_test(sockIO, socket_writev);
+	tcase_add_test(sockIO, socket_writev_partial);
 	tcase_add_test(sockIO, socket_read);
 	tcase_add_test(sockIO, socket_read_non_blocking);
-	tcase_add_test(sockIO, socket_readbytes);
-	tcase_add_test_raise_signal(sockIO, socket_readline_blocking, SIGKILL);
-	tcase_add_test(sockIO, socket_readline_blocking2);
-	tcase_add_test(sockIO, socket_readline_non_blocking);
-	tcase_add_test(sockIO, socket_readline_non_blocking2);
+	tcase_add_test(sockIO, reader_lines);
+	tcase_add_test(sockIO, reader_max_lines);
+	tcase_add_test_raise_signal(sockIO, reader_blocking, SIGKILL);
+	tcase_add_test(sockIO, reader_non_blocking);
+	tcase_add_test(sockIO, reader_wrap_around);
+	tcase_add_test(sockIO, reader_long_line);
+	tcase_add_test(sockIO, reader_feed_lines);
 
 	return suite;
 }
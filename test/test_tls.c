@@ -0,0 +1,168 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include "test_main.h"
+#include "tls.h"
+
+#define CERT_FILE "test-files/tls-cert.pem"
+#define KEY_FILE  "test-files/tls-key.pem"
+
+static SSL_CTX *server_ctx;
+static char server_received[IRCLEN + 1];
+
+static void tls_start(void) {
+
+	signal(SIGPIPE, SIG_IGN); // Like the bot does, the peers may close while the other side still writes
+	server_ctx = SSL_CTX_new(TLS_server_method());
+	ck_assert_ptr_ne(server_ctx, NULL);
+	ck_assert_int_eq(SSL_CTX_use_certificate_file(server_ctx, CERT_FILE, SSL_FILETYPE_PEM), 1);
+	ck_assert_int_eq(SSL_CTX_use_PrivateKey_file(server_ctx, KEY_FILE, SSL_FILETYPE_PEM), 1);
+	ck_assert(tls_init(CERT_FILE));
+}
+
+static void tls_stop(void) {
+
+	tls_cleanup();
+	SSL_CTX_free(server_ctx);
+}
+
+/** Greet the client and record what it sends until it closes the connection */
+static void *tls_server(void *sock) {
+
+	int n, total = 0;
+	SSL *ssl = SSL_new(server_ctx);
+
+	SSL_set_fd(ssl, *(int *) sock);
+	if (SSL_accept(ssl) == 1) {
+		SSL_write(ssl, "PING :tls\r\n", 11);
+		while (total < IRCLEN && (n = SSL_read(ssl, server_received + total, IRCLEN - total)) > 0)
+			total += n;
+	}
+	server_received[total] = '\0';
+	SSL_free(ssl);
+	close(*(int *) sock);
+	return NULL;
+}
+
+/** Connect to a new server thread. Every connection uses a fresh socket pair */
+static Tls tls_handshake(pthread_t *tid, int *sock) {
+
+	int pair[2];
+	Tls tls;
+
+	ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+	sock[0] = pair[0];
+	sock[1] = pair[1];
+	pthread_create(tid, NULL, tls_server, &sock[1]);
+	tls = tls_connect(sock[0], "localhost", "6697");
+	ck_assert_ptr_ne(tls, NULL);
+	fcntl(sock[0], F_SETFL, O_NONBLOCK);
+	return tls;
+}
+
+/** Read the greeting, which also delivers the session tickets */
+static void read_greeting(Tls tls, int sock) {
+
+	ssize_t n;
+
+	while ((n = tls_read(tls, test_buffer, IRCLEN)) == -EAGAIN)
+		poll(&(struct pollfd) {sock, POLLIN, 0}, 1, -1);
+
+	ck_assert_int_eq(n, 11);
+	test_buffer[n] = '\0';
+	ck_assert_str_eq(test_buffer, "PING :tls\r\n");
+	ck_assert_int_eq(tls_read(tls, test_buffer, IRCLEN), -EAGAIN);
+}
+
+static void hang_up(Tls tls, pthread_t tid, int sock) {
+
+	tls_close(tls);
+	close(sock);
+	pthread_join(tid, NULL);
+}
+
+START_TEST(tls_transport) {
+
+	Tls tls;
+	pthread_t tid;
+	int sock[2];
+	char a[] = "PONG :tls\r\n", b[] = "JOIN #foss\r\n";
+	struct iovec iov[] = {{a, strlen(a)}, {b, strlen(b)}};
+
+	tls = tls_handshake(&tid, sock);
+	ck_assert(!tls_resumed(tls));
+	read_greeting(tls, sock[0]);
+
+	ck_assert_int_eq(tls_writev(tls, iov, 2), strlen(a) + strlen(b));
+	ck_assert_int_eq(iov[1].iov_len, 0);
+	hang_up(tls, tid, sock[0]);
+	ck_assert_str_eq(server_received, "PONG :tls\r\nJOIN #foss\r\n");
+
+} END_TEST
+
+START_TEST(tls_resumption) {
+
+	Tls tls;
+	pthread_t tid;
+	int sock[2];
+
+	tls = tls_handshake(&tid, sock);
+	ck_assert(!tls_resumed(tls));
+	read_greeting(tls, sock[0]);
+	hang_up(tls, tid, sock[0]);
+
+	// Reconnecting resumes the cached session
+	tls = tls_handshake(&tid, sock);
+	ck_assert(tls_resumed(tls));
+	read_greeting(tls, sock[0]);
+	hang_up(tls, tid, sock[0]);
+
+	// A new program image gets the sessions through the environment
+	tls_export_sessions();
+	ck_assert_ptr_ne(getenv(TLS_SESSION_ENV), NULL);
+	tls_cleanup();
+	ck_assert(tls_init(CERT_FILE));
+	ck_assert_ptr_eq(getenv(TLS_SESSION_ENV), NULL);
+
+	tls = tls_handshake(&tid, sock);
+	ck_assert(tls_resumed(tls));
+	read_greeting(tls, sock[0]);
+	hang_up(tls, tid, sock[0]);
+
+} END_TEST
+
+START_TEST(tls_wrong_host) {
+
+	int pair[2];
+	pthread_t tid;
+
+	// Certificate is only valid for localhost & 127.0.0.1
+	ck_assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, pair));
+	pthread_create(&tid, NULL, tls_server, &pair[1]);
+	ck_assert_ptr_eq(tls_connect(pair[0], "irc.example.org", "6697"), NULL);
+	close(pair[0]);
+	pthread_join(tid, NULL);
+
+} END_TEST
+
+Suite *tls_suite(void) {
+
+	Suite *suite = suite_create("tls");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_checked_fixture(core, tls_start, tls_stop);
+	tcase_add_test(core, tls_transport);
+	tcase_add_test(core, tls_resumption);
+	tcase_add_test(core, tls_wrong_host);
+
+	return suite;
+}
@@ -0,0 +1,85 @@
+#include <check.h>
+#include <string.h>
+#include "test_main.h"
+#include "tokenizer.h"
+
+START_TEST(tokenizer_classes) {
+
+	size_t len;
+	struct irc_tokens tok;
+	char line[TOKEN_MAXLEN + 1];
+	const char *samples[] = {
+		"@time=2011-10-19T16:40:51.620Z :bob!~b@c.d PRIVMSG #foss-teimes :hi: there :)",
+		":wolfe.freenode.net 353 fossbot = #foss-teimes :fossbot freestyl3r @ChanServ",
+		"a :b", " :", "x", ""
+	};
+	const int count = sizeof(samples) / sizeof(samples[0]);
+
+	// The last line fills every word and crosses every block boundary. Compare with a plain scan
+	for (int i = 0; i <= count; i++) {
+		if (i < count)
+			strcpy(line, samples[i]);
+		else
+			for (int j = 0; j < TOKEN_MAXLEN; j++)
+				line[j] = " :!@a"[(j * 7 + j / 3) % 5];
+
+		len = i < count ? strlen(line) : TOKEN_MAXLEN;
+		ck_assert(irc_tokenize(line, len, &tok));
+		ck_assert_uint_eq(tok.words, 0);
+		if (len)
+			token_next(&tok, tok.space, len - 1);
+
+		ck_assert_uint_eq(tok.words, (len + 63) / 64);
+		for (size_t j = 0; j < len; j++) {
+			ck_assert_int_eq(tok.space[j / 64] >> j % 64 & 1, line[j] == ' ');
+			ck_assert_int_eq(tok.user[j / 64] >> j % 64 & 1, line[j] == '!' || line[j] == '@');
+			ck_assert_int_eq(tok.trailing[j / 64] >> j % 64 & 1, j && line[j] == ':' && line[j - 1] == ' ');
+		}
+		// Nothing past the line is classified
+		if (len % 64)
+			ck_assert_int_eq(tok.space[len / 64] >> len % 64, 0);
+	}
+	ck_assert(!irc_tokenize(line, TOKEN_MAXLEN + 1, &tok));
+
+} END_TEST
+
+START_TEST(tokenizer_next) {
+
+	struct irc_tokens tok;
+	char line[TOKEN_MAXLEN];
+	const char *msg = ":bob!~b@c.d PRIVMSG #foss-teimes :hi there";
+
+	ck_assert(irc_tokenize(msg, strlen(msg), &tok));
+	ck_assert_uint_eq(token_next(&tok, tok.space, 0), 11);
+	ck_assert_uint_eq(token_next(&tok, tok.space, 11), 11);
+	ck_assert_uint_eq(token_next(&tok, tok.user, 0), 4);
+	ck_assert_uint_eq(token_next(&tok, tok.user, 5), 7);
+	ck_assert_uint_eq(token_next(&tok, tok.trailing, 0), 33);
+	ck_assert_uint_eq(token_next(&tok, tok.trailing, 34), strlen(msg));
+	ck_assert_uint_eq(token_next(&tok, tok.space, strlen(msg)), strlen(msg));
+
+	// Only the words up to the match get classified
+	memset(line, 'a', TOKEN_MAXLEN);
+	line[70]  = ' ';
+	line[300] = ' ';
+	ck_assert(irc_tokenize(line, TOKEN_MAXLEN, &tok));
+	ck_assert_uint_eq(token_next(&tok, tok.space, 0), 70);
+	ck_assert_uint_eq(tok.words, 2);
+	ck_assert_uint_eq(token_next(&tok, tok.space, 71), 300);
+	ck_assert_uint_eq(tok.words, 5);
+	ck_assert_uint_eq(token_next(&tok, tok.space, 301), TOKEN_MAXLEN);
+	ck_assert_uint_eq(tok.words, TOKEN_WORDS);
+
+} END_TEST
+
+Suite *tokenizer_suite(void) {
+
+	Suite *suite = suite_create("tokenizer");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_test(core, tokenizer_classes);
+	tcase_add_test(core, tokenizer_next);
+
+	return suite;
+}
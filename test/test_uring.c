@@ -0,0 +1,145 @@
+#include <check.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "test_main.h"
+#include "event.h"
+#include "uring.h"
+#include "queue.h"
+
+static Reactor reactor;
+static Uring uring;
+static ssize_t results[8];
+static int count;
+
+static void uring_start(void) {
+
+	mock_start();
+	fcntl(mock[RD], F_SETFL, O_NONBLOCK);
+	reactor = reactor_init();
+	uring = uring_init(reactor);
+	count = 0;
+}
+
+static void uring_stop(void) {
+
+	uring_destroy(uring);
+	reactor_destroy(reactor);
+	mock_stop();
+}
+
+static void record_handler(void *data, char *buf, ssize_t res) {
+
+	(void) data;
+
+	if (res > 0 && buf) {
+		memcpy(test_buffer, buf, res);
+		test_buffer[res] = '\0';
+	}
+	results[count++] = res;
+}
+
+START_TEST(uring_recv_multishot) {
+
+	Uring_op op;
+
+	if (!uring) // Kernel doesn't support it, nothing to test
+		return;
+
+	op = uring_recv(uring, mock[RD], record_handler, NULL);
+	ck_assert_ptr_ne(op, NULL);
+
+	// A single submission keeps receiving
+	for (int i = 0; i < 3; i++) {
+		write(mock[WR], "PING :a\r\n", 9);
+		uring_wait(uring);
+		ck_assert_int_eq(count, i + 1);
+		ck_assert_int_eq(results[i], 9);
+		ck_assert_str_eq(test_buffer, "PING :a\r\n");
+	}
+	uring_cancel(uring, op);
+	uring_wait(uring);
+	ck_assert_int_eq(count, 4);
+	ck_assert_int_eq(results[3], -ECANCELED);
+
+} END_TEST
+
+START_TEST(uring_recv_closed) {
+
+	if (!uring)
+		return;
+
+	ck_assert_ptr_ne(uring_recv(uring, mock[RD], record_handler, NULL), NULL);
+	close(mock[WR]);
+	uring_wait(uring);
+	ck_assert_int_eq(count, 1);
+	ck_assert_int_eq(results[0], 0);
+
+} END_TEST
+
+START_TEST(uring_send_linked) {
+
+	char a[] = "PRIVMSG #a :1\r\n", b[] = "PRIVMSG #a :2\r\n";
+	struct iovec iov[] = {{a, strlen(a)}, {b, strlen(b)}};
+	ssize_t n;
+
+	if (!uring)
+		return;
+
+	ck_assert(uring_sendv(uring, mock[WR], iov, 2, record_handler, NULL));
+	uring_wait(uring);
+	while (!count)
+		uring_wait(uring);
+
+	// Handler is called once for the whole chain
+	ck_assert_int_eq(count, 1);
+	ck_assert_int_eq(results[0], strlen(a) + strlen(b));
+	n = read(mock[RD], test_buffer, IRCLEN);
+	test_buffer[n] = '\0';
+	ck_assert_str_eq(test_buffer, "PRIVMSG #a :1\r\nPRIVMSG #a :2\r\n");
+
+	close(mock[RD]);
+	ck_assert(uring_sendv(uring, mock[WR], iov, 2, record_handler, NULL));
+	while (count < 2)
+		uring_wait(uring);
+	ck_assert_int_eq(results[1], -EPIPE);
+
+} END_TEST
+
+START_TEST(uring_queue) {
+
+	Mqueue mq;
+	ssize_t n;
+
+	if (!uring)
+		return;
+
+	mq = mqueue_init(reactor, mock[WR]);
+	mqueue_set_uring(mq, uring);
+	mqueue_send(mq, "line 1\r\n");
+	mqueue_send(mq, "line 2\r\n");
+	mqueue_flush(mq);
+
+	// Lines are still owned by the kernel, destroy must wait for the completion
+	mqueue_destroy(mq);
+	n = read(mock[RD], test_buffer, IRCLEN);
+	test_buffer[n] = '\0';
+	ck_assert_str_eq(test_buffer, "line 1\r\nline 2\r\n");
+
+} END_TEST
+
+Suite *uring_suite(void) {
+
+	Suite *suite = suite_create("uring");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_checked_fixture(core, uring_start, uring_stop);
+	tcase_add_test(core, uring_recv_multishot);
+	tcase_add_test(core, uring_recv_closed);
+	tcase_add_test(core, uring_send_linked);
+	tcase_add_test(core, uring_queue);
+
+	return suite;
+}
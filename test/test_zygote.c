@@ -0,0 +1,95 @@
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "test_main.h"
+#include "zygote.h"
+#include "tls.h"
+#include "common.h"
+
+/** Run argv and check what it printed & its exit status */
+static void run(char *argv[], const struct spawn_limits *limits, const char *output, int exit_status) {
+
+	char buf[64] = "";
+	int fd[2], status_fd, status;
+	ssize_t n;
+	pid_t pid;
+
+	ck_assert_int_eq(pipe(fd), 0);
+	pid = zygote_spawn(argv, -1, fd[1], limits, &status_fd);
+	close(fd[1]);
+	ck_assert_int_gt(pid, 0);
+
+	for (size_t len = 0; (n = read(fd[0], buf + len, sizeof(buf) - 1 - len)) > 0; len += n)
+		;
+	ck_assert_str_eq(buf, output);
+	close(fd[0]);
+
+	status = zygote_wait(pid, status_fd);
+	ck_assert(WIFEXITED(status));
+	ck_assert_int_eq(WEXITSTATUS(status), exit_status);
+}
+
+START_TEST(zygote_spawn_helper) {
+
+	int fd[2], status_fd, status;
+	pid_t pid;
+
+	// Exported TLS sessions stay with the bot
+	setenv(TLS_SESSION_ENV, "secret", true);
+	ck_assert(zygote_start());
+	unsetenv(TLS_SESSION_ENV);
+	run(CMD("sh", "-c", "echo ${" TLS_SESSION_ENV "-unset}"), NULL, "unset\n", 0);
+	run(CMD("echo", "rofl"), NULL, "rofl\n", 0);
+	run(CMD("sh", "-c", "exit 3"), NULL, "", 3);
+	run(CMD("sh", "-c", "ulimit -t; ulimit -v"), &(struct spawn_limits) {5, 64 << 20}, "5\n65536\n", 0);
+
+	ck_assert_int_eq(pipe(fd), 0);
+	ck_assert_int_eq(zygote_spawn(CMD("/nonexistent"), -1, fd[1], NULL, &status_fd), -1);
+
+	// The limits apply while loading the program already
+	pid = zygote_spawn(CMD("sh", "-c", "exit 0"), -1, fd[1], &(struct spawn_limits) {RLIM_INFINITY, 1 << 20}, &status_fd);
+	ck_assert(pid < 0 || WEXITSTATUS(zygote_wait(pid, status_fd)) == 127);
+
+	// Exited programs stay unreaped until the status is collected, so their group can still be signalled
+	pid = zygote_spawn(CMD("true"), -1, fd[1], NULL, &status_fd);
+	ck_assert_int_gt(pid, 0);
+	usleep(100000);
+	ck_assert_int_eq(kill(-pid, 0), 0);
+	ck_assert_int_eq(WEXITSTATUS(zygote_wait(pid, status_fd)), 0);
+
+	// The program leads a process group of its own & signals are reported too
+	pid = zygote_spawn(CMD("sleep", "5"), -1, fd[1], NULL, &status_fd);
+	ck_assert_int_gt(pid, 0);
+	ck_assert_int_eq(kill(-pid, SIGKILL), 0);
+	status = zygote_wait(pid, status_fd);
+	ck_assert(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+
+	close(fd[0]);
+	close(fd[1]);
+	zygote_stop();
+
+} END_TEST
+
+START_TEST(zygote_spawn_direct) {
+
+	// Without the helper programs are our own children
+	run(CMD("echo", "lol"), NULL, "lol\n", 0);
+	run(CMD("false"), NULL, "", 1);
+	run(CMD("sh", "-c", "ulimit -t"), &(struct spawn_limits) {5, RLIM_INFINITY}, "5\n", 0);
+
+} END_TEST
+
+Suite *zygote_suite(void) {
+
+	Suite *suite = suite_create("zygote");
+	TCase *core  = tcase_create("core");
+
+	suite_add_tcase(suite, core);
+	tcase_add_test(core, zygote_spawn_helper);
+	tcase_add_test(core, zygote_spawn_direct);
+
+	return suite;
+}